@@ -0,0 +1,181 @@
+#include <Poco/SingletonHolder.h>
+
+#include "BandwidthCalendar.h"
+
+namespace // anonymous namespace begin
+{
+    /* how often a waiting transfer checks whether it was cancelled */
+    const long SLOT_POLL_MS = 200;
+} // anonymous namespace end
+
+BandwidthCalendar::Slot::Slot(
+    bool bBackfill,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+: m_bHeld(BandwidthCalendar::Instance().AcquireSlot(bBackfill, pStop,
+    pStopParam))
+{
+}
+
+BandwidthCalendar::Slot::~Slot()
+{
+    if (m_bHeld)
+    {
+        BandwidthCalendar::Instance().ReleaseSlot();
+    }
+}
+
+bool BandwidthCalendar::Slot::IsHeld() const
+{
+    return m_bHeld;
+}
+
+BandwidthCalendar &BandwidthCalendar::Instance()
+{
+    static Poco::SingletonHolder<BandwidthCalendar> sh;
+    return *sh.get();
+}
+
+BandwidthCalendar::BandwidthCalendar()
+: m_Windows()
+, m_Default()
+, m_Current()
+, m_iRunning(0)
+, m_StopEvent(false)
+, m_ApplyRunnable(*this, &BandwidthCalendar::ApplyRoutine)
+, m_ApplyThread()
+{
+}
+
+BandwidthCalendar::~BandwidthCalendar()
+{
+    Stop();
+}
+
+void BandwidthCalendar::AddWindow(const Window &window)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Windows.push_back(window);
+}
+
+void BandwidthCalendar::SetDefault(const Window &window)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Default = window;
+}
+
+void BandwidthCalendar::Clear()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Windows.clear();
+    m_Default = Window();
+}
+
+void BandwidthCalendar::Start()
+{
+    Apply();
+    if (!m_ApplyThread.isRunning())
+    {
+        m_StopEvent.reset();
+        m_ApplyThread.start(m_ApplyRunnable);
+    }
+}
+
+void BandwidthCalendar::Stop()
+{
+    if (m_ApplyThread.isRunning())
+    {
+        m_StopEvent.set();
+        m_ApplyThread.join();
+    }
+}
+
+BandwidthCalendar::Window BandwidthCalendar::GetCurrentWindow() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_Current;
+}
+
+bool BandwidthCalendar::AcquireSlot(
+    bool bBackfill,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    while ((bBackfill && !m_Current.bBackfill) ||
+        (m_Current.iMaxTransfers > 0 &&
+        m_iRunning >= m_Current.iMaxTransfers))
+    {
+        if (pStop != NULL && pStop(pStopParam))
+        {
+            return false;
+        }
+        m_SlotFree.tryWait(m_Mutex, SLOT_POLL_MS);
+    }
+    ++m_iRunning;
+    return true;
+}
+
+void BandwidthCalendar::ReleaseSlot()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    --m_iRunning;
+    /* a backfill transfer may be first in line and still not allowed */
+    m_SlotFree.broadcast();
+}
+
+bool BandwidthCalendar::Matches(const Window &window, int iDay, int iMinute)
+{
+    if (window.iBeginMinute <= window.iEndMinute)
+    {
+        return (window.iDays & (1 << iDay)) != 0 &&
+            iMinute >= window.iBeginMinute && iMinute < window.iEndMinute;
+    }
+    /* over midnight: the evening of a listed day or the morning after */
+    int iYesterday = (iDay + 6) % 7;
+    return ((window.iDays & (1 << iDay)) != 0 &&
+        iMinute >= window.iBeginMinute) ||
+        ((window.iDays & (1 << iYesterday)) != 0 &&
+        iMinute < window.iEndMinute);
+}
+
+const BandwidthCalendar::Window &BandwidthCalendar::Lookup(
+    const Poco::LocalDateTime &now) const
+{
+    int iMinute = now.hour() * 60 + now.minute();
+    for (size_t i = 0; i < m_Windows.size(); ++i)
+    {
+        if (Matches(m_Windows[i], now.dayOfWeek(), iMinute))
+        {
+            return m_Windows[i];
+        }
+    }
+    return m_Default;
+}
+
+void BandwidthCalendar::Apply()
+{
+    Poco::Int64 iBytesPerSec = 0;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        m_Current = Lookup(Poco::LocalDateTime());
+        iBytesPerSec = m_Current.iBytesPerSec;
+        m_SlotFree.broadcast();
+    }
+    RateLimiter::Instance().SetScheduleRate(iBytesPerSec);
+}
+
+void BandwidthCalendar::ApplyRoutine()
+{
+    for (;;)
+    {
+        /* windows start and end on whole minutes */
+        Poco::LocalDateTime now;
+        long iToNextMinute = (60 - now.second()) * 1000 - now.millisecond();
+        if (m_StopEvent.tryWait(iToNextMinute + 10))
+        {
+            break;
+        }
+        Apply();
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef _BandwidthCalendar_H_
+#define _BandwidthCalendar_H_
+
+#include <vector>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Event.h>
+#include <Poco/Thread.h>
+#include <Poco/RunnableAdapter.h>
+#include <Poco/LocalDateTime.h>
+
+#include "RateLimiter.h"
+
+/* weekly plan of the bandwidth this process may use. Each window caps
+   the RateLimiter total below what SetTotalRate() allows, sets how many
+   transfers may run at once and whether backfill work is let through.
+   Once started, a thread applies the window in force at every minute
+   boundary: running transfers are slowed down or sped up by the
+   limiter, and when fewer are allowed the extra ones finish the file
+   they are on before they wait */
+class BandwidthCalendar
+{
+public:
+    enum
+    {
+        Sunday = 1 << 0,
+        Monday = 1 << 1,
+        Tuesday = 1 << 2,
+        Wednesday = 1 << 3,
+        Thursday = 1 << 4,
+        Friday = 1 << 5,
+        Saturday = 1 << 6,
+        Weekdays = Monday | Tuesday | Wednesday | Thursday | Friday,
+        Weekend = Saturday | Sunday,
+        EveryDay = Weekdays | Weekend,
+    };
+
+    struct Window
+    {
+        Window()
+        : iDays(EveryDay)
+        , iBeginMinute(0)
+        , iEndMinute(24 * 60)
+        , iBytesPerSec(0)
+        , iMaxTransfers(0)
+        , bBackfill(true){}
+
+        /* days the window starts on, local time. An end before the
+           begin runs over midnight into the next day */
+        int iDays;
+        int iBeginMinute;
+        int iEndMinute;
+        /* 0 means no limit */
+        Poco::Int64 iBytesPerSec;
+        int iMaxTransfers;
+        /* off-peak: backfill transfers may run */
+        bool bBackfill;
+    };
+
+    /* a transfer holds one from its first byte to its last. If the
+       wait was given up IsHeld() is false and nothing is released */
+    class Slot
+    {
+    public:
+        Slot(bool bBackfill, RateLimiter::StopCheck pStop = NULL,
+            const void *pStopParam = NULL);
+
+        ~Slot();
+
+        bool IsHeld() const;
+
+    private:
+        Slot(const Slot &rhs);
+
+        Slot & operator=(const Slot &rhs);
+
+    private:
+        bool m_bHeld;
+    };
+
+    static BandwidthCalendar &Instance();
+
+    /* the first window that matches wins, outside all of them the
+       default applies */
+    void AddWindow(const Window &window);
+
+    void SetDefault(const Window &window);
+
+    void Clear();
+
+    /* apply the plan now and at every boundary from now on */
+    void Start();
+
+    /* the limits in force stay as they are */
+    void Stop();
+
+    Window GetCurrentWindow() const;
+
+    /* blocks while all transfers are taken or while backfill has to
+       wait, false if pStop asked to give up */
+    bool AcquireSlot(bool bBackfill, RateLimiter::StopCheck pStop = NULL,
+        const void *pStopParam = NULL);
+
+    void ReleaseSlot();
+
+    BandwidthCalendar();
+
+    ~BandwidthCalendar();
+
+private:
+    static bool Matches(const Window &window, int iDay, int iMinute);
+
+    const Window &Lookup(const Poco::LocalDateTime &now) const;
+
+    void Apply();
+
+    void ApplyRoutine();
+
+    BandwidthCalendar(const BandwidthCalendar &rhs);
+
+    BandwidthCalendar & operator=(const BandwidthCalendar &rhs);
+
+private:
+    std::vector<Window> m_Windows;
+    Window m_Default;
+    Window m_Current;
+    int m_iRunning;
+    mutable Poco::FastMutex m_Mutex;
+    Poco::Condition m_SlotFree;
+
+    Poco::Event m_StopEvent;
+    Poco::RunnableAdapter<BandwidthCalendar> m_ApplyRunnable;
+    Poco::Thread m_ApplyThread;
+};
+
+#endif // _BandwidthCalendar_H_
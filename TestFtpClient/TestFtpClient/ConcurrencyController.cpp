@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include <Poco/File.h>
+#include <Poco/SingletonHolder.h>
+
+#include "ConcurrencyController.h"
+
+namespace // anonymous namespace begin
+{
+    /* long enough for a new session to log in and get up to speed */
+    const Poco::Timestamp::TimeDiff SAMPLE_US = 3 * 1000 * 1000;
+
+    /* changes smaller than this are taken as noise */
+    const double GROW_FACTOR = 1.05;
+    const double DROP_FACTOR = 0.7;
+
+    /* after this many flat samples one more slot is tried again */
+    const int REPROBE_SAMPLES = 10;
+
+    /* how often a waiting transfer checks whether it was cancelled */
+    const long SLOT_POLL_MS = 200;
+} // anonymous namespace end
+
+ConcurrencyController::Slot::Slot(
+    const std::string &sHost,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+: m_sHost(sHost)
+, m_bHeld(sHost.empty() || ConcurrencyController::Instance().AcquireSlot(
+    sHost, pStop, pStopParam))
+{
+}
+
+ConcurrencyController::Slot::~Slot()
+{
+    if (m_bHeld && !m_sHost.empty())
+    {
+        ConcurrencyController::Instance().ReleaseSlot(m_sHost);
+    }
+}
+
+bool ConcurrencyController::Slot::IsHeld() const
+{
+    return m_bHeld;
+}
+
+ConcurrencyController &ConcurrencyController::Instance()
+{
+    static Poco::SingletonHolder<ConcurrencyController> sh;
+    return *sh.get();
+}
+
+ConcurrencyController::ConcurrencyController()
+: m_Hosts()
+, m_iInitial(2)
+, m_iMax(16)
+, m_sStateFile()
+{
+}
+
+bool ConcurrencyController::SetStateFile(const std::string &sPath)
+{
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        m_sStateFile = sPath;
+    }
+    return Load();
+}
+
+void ConcurrencyController::SetBounds(int iInitial, int iMax)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iMax = std::max(iMax, 1);
+    m_iInitial = std::max(1, std::min(iInitial, m_iMax));
+}
+
+int ConcurrencyController::GetLimit(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return GetHost(sHost).iLimit;
+}
+
+bool ConcurrencyController::AcquireSlot(
+    const std::string &sHost,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    bool bChanged = false;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = GetHost(sHost);
+        while (host.iRunning >= host.iLimit)
+        {
+            if (pStop != NULL && pStop(pStopParam))
+            {
+                return false;
+            }
+            m_SlotFree.tryWait(m_Mutex, SLOT_POLL_MS);
+        }
+        ++host.iRunning;
+        host.iPeakRunning = std::max(host.iPeakRunning, host.iRunning);
+        bChanged = Sample(host, Poco::Timestamp());
+    }
+    if (bChanged)
+    {
+        Save();
+    }
+    return true;
+}
+
+void ConcurrencyController::ReleaseSlot(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    --GetHost(sHost).iRunning;
+    m_SlotFree.broadcast();
+}
+
+void ConcurrencyController::AddBytes(const std::string &sHost, size_t iBytes)
+{
+    bool bChanged = false;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = GetHost(sHost);
+        host.iBytes += iBytes;
+        bChanged = Sample(host, Poco::Timestamp());
+        if (bChanged)
+        {
+            m_SlotFree.broadcast();
+        }
+    }
+    if (bChanged)
+    {
+        Save();
+    }
+}
+
+bool ConcurrencyController::ReportError(
+    const std::string &sHost,
+    long iResponse,
+    bool bOverload)
+{
+    /* a missing file or a full disk says nothing about the load */
+    if (iResponse != 421 && !bOverload)
+    {
+        return false;
+    }
+    bool bChanged = false;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = GetHost(sHost);
+        int iOld = host.iLimit;
+        if (iResponse == 421)
+        {
+            /* too many sessions, the failed one still holds its slot */
+            host.iCeiling = std::max(host.iRunning - 1, 1);
+            host.iLimit = std::min(host.iLimit, host.iCeiling);
+        }
+        Decrease(host, 1, 2);
+        host.bProbing = false;
+        /* start a fresh sample, the old goodput was for more sessions */
+        host.fGoodput = 0.0;
+        host.iBytes = 0;
+        host.iPeakRunning = host.iRunning;
+        host.tSample.update();
+        bChanged = host.iLimit != iOld;
+    }
+    if (bChanged)
+    {
+        Save();
+    }
+    return bChanged;
+}
+
+ConcurrencyController::Host &ConcurrencyController::GetHost(
+    const std::string &sHost)
+{
+    std::map<std::string, Host>::iterator it = m_Hosts.find(sHost);
+    if (it == m_Hosts.end())
+    {
+        it = m_Hosts.insert(std::make_pair(sHost, Host())).first;
+        it->second.iLimit = m_iInitial;
+    }
+    return it->second;
+}
+
+bool ConcurrencyController::Sample(Host &host, const Poco::Timestamp &now)
+{
+    Poco::Timestamp::TimeDiff iElapsed = now - host.tSample;
+    if (iElapsed < SAMPLE_US)
+    {
+        return false;
+    }
+
+    int iOld = host.iLimit;
+    double fGoodput = host.iBytes * 1e6 / iElapsed;
+    bool bReverted = false;
+    /* below the limit the host was not pushed, nothing to learn */
+    if (host.iPeakRunning >= host.iLimit && fGoodput > 0.0)
+    {
+        bool bGrown = fGoodput > host.fGoodput * GROW_FACTOR;
+        if (fGoodput < host.fGoodput * DROP_FACTOR)
+        {
+            Decrease(host, 3, 4);
+            host.bProbing = false;
+        }
+        else if (!bGrown && host.bProbing)
+        {
+            --host.iLimit;
+            host.bProbing = false;
+            bReverted = true;
+        }
+        else if (bGrown || ++host.iStable >= REPROBE_SAMPLES)
+        {
+            /* a cap is tried one higher as well, the 421 may have come
+               while other clients held sessions; gone once it no longer
+               holds anything back */
+            if (!bGrown && host.iCeiling > 0 &&
+                host.iLimit >= host.iCeiling)
+            {
+                host.iCeiling = host.iCeiling + 1 >= m_iMax ?
+                    0 : host.iCeiling + 1;
+            }
+            int iMax = host.iCeiling > 0 ?
+                std::min(host.iCeiling, m_iMax) : m_iMax;
+            host.iLimit = std::min(host.iLimit + 1, iMax);
+            host.bProbing = host.iLimit != iOld;
+        }
+        if (host.iLimit != iOld)
+        {
+            host.iStable = 0;
+        }
+    }
+    /* after a failed probe the sample before it stays the reference */
+    if (host.iPeakRunning > 0 && !bReverted)
+    {
+        host.fGoodput = fGoodput;
+    }
+    host.iBytes = 0;
+    host.iPeakRunning = host.iRunning;
+    host.tSample = now;
+    return host.iLimit != iOld;
+}
+
+void ConcurrencyController::Decrease(
+    Host &host,
+    int iNumerator,
+    int iDenominator)
+{
+    host.iLimit = std::max(host.iLimit * iNumerator / iDenominator, 1);
+}
+
+bool ConcurrencyController::Load()
+{
+    Poco::FastMutex::ScopedLock lf(m_FileMutex);
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    FILE *pFile = fopen(m_sStateFile.c_str(), "r");
+    if (pFile == NULL)
+    {
+        return errno == ENOENT;
+    }
+
+    /* "host limit ceiling" per line */
+    char szHost[256];
+    int iLimit = 0;
+    int iCeiling = 0;
+    while (fscanf(pFile, "%255s %d %d", szHost, &iLimit, &iCeiling) == 3)
+    {
+        Host &host = GetHost(szHost);
+        host.iCeiling = std::max(iCeiling, 0);
+        host.iLimit = std::max(1, std::min(iLimit, m_iMax));
+    }
+    bool bResult = feof(pFile) != 0;
+    fclose(pFile);
+    return bResult;
+}
+
+void ConcurrencyController::Save()
+{
+    Poco::FastMutex::ScopedLock lf(m_FileMutex);
+    std::string sPath;
+    std::map<std::string, Host> hosts;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        sPath = m_sStateFile;
+        hosts = m_Hosts;
+    }
+    if (sPath.empty())
+    {
+        return;
+    }
+
+    /* replaced as a whole so a crash never leaves half a file */
+    std::string sTempPath = sPath + ".tmp";
+    FILE *pFile = fopen(sTempPath.c_str(), "w");
+    if (pFile == NULL)
+    {
+        perror(NULL);
+        return;
+    }
+    std::map<std::string, Host>::const_iterator it = hosts.begin();
+    for (; it != hosts.end(); ++it)
+    {
+        fprintf(pFile, "%s %d %d\n", it->first.c_str(),
+            it->second.iLimit, it->second.iCeiling);
+    }
+    if (fclose(pFile) != 0)
+    {
+        perror(NULL);
+        return;
+    }
+    try
+    {
+        Poco::File(sTempPath).renameTo(sPath);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef _ConcurrencyController_H_
+#define _ConcurrencyController_H_
+
+#include <string>
+#include <map>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+
+#include "RateLimiter.h"
+
+/* learns per server how many transfers to run at once, shared by every
+   FtpClient of the process. A transfer holds a slot of its host while
+   it runs. Every couple of seconds the goodput of a host that used all
+   its slots is compared with the sample before: while it keeps growing
+   one slot is added, a slot that brought nothing is taken back and
+   tried again later, when it falls clearly the limit is cut by a
+   quarter, and a transfer that could not connect or timed out halves
+   it. A 421 reply halves it too and caps the host below the number of
+   sessions that got it refused; a host that stays flat at its cap has
+   it raised by one like a probe. Other failures leave it alone. What
+   was learned can be kept in a file so the next run starts from there */
+class ConcurrencyController
+{
+public:
+    /* an empty host is not limited */
+    class Slot
+    {
+    public:
+        Slot(const std::string &sHost, RateLimiter::StopCheck pStop = NULL,
+            const void *pStopParam = NULL);
+
+        ~Slot();
+
+        bool IsHeld() const;
+
+    private:
+        Slot(const Slot &rhs);
+
+        Slot & operator=(const Slot &rhs);
+
+    private:
+        std::string m_sHost;
+        bool m_bHeld;
+    };
+
+    static ConcurrencyController &Instance();
+
+    /* load the learned limits and keep the file up to date from now on,
+       false if an existing file could not be read */
+    bool SetStateFile(const std::string &sPath);
+
+    /* the limit a host never seen before starts with, and the most any
+       host is allowed */
+    void SetBounds(int iInitial, int iMax);
+
+    int GetLimit(const std::string &sHost);
+
+    /* blocks while the host has no free slot, false if pStop asked to
+       give up */
+    bool AcquireSlot(const std::string &sHost,
+        RateLimiter::StopCheck pStop = NULL, const void *pStopParam = NULL);
+
+    void ReleaseSlot(const std::string &sHost);
+
+    /* bytes moved to or from the host, the goodput samples */
+    void AddBytes(const std::string &sHost, size_t iBytes);
+
+    /* a transfer to the host failed with iResponse as the last reply,
+       bOverload if it could not connect or timed out. True if the limit
+       went down so that a retry may get through */
+    bool ReportError(const std::string &sHost, long iResponse,
+        bool bOverload);
+
+    ConcurrencyController();
+
+private:
+    struct Host
+    {
+        Host()
+        : iLimit(1)
+        , iCeiling(0)
+        , iRunning(0)
+        , iPeakRunning(0)
+        , iBytes(0)
+        , tSample()
+        , fGoodput(0.0)
+        , bProbing(false)
+        , iStable(0){}
+
+        int iLimit;
+        /* learned from 421 replies and probed upward, 0 while unknown */
+        int iCeiling;
+        int iRunning;
+        /* the most transfers at once during the current sample */
+        int iPeakRunning;
+        Poco::Int64 iBytes;
+        Poco::Timestamp tSample;
+        /* bytes per second of the previous sample */
+        double fGoodput;
+        /* the limit was just raised to see whether that helps */
+        bool bProbing;
+        /* samples in a row without a change */
+        int iStable;
+    };
+
+    Host &GetHost(const std::string &sHost);
+
+    /* true if the limit changed */
+    bool Sample(Host &host, const Poco::Timestamp &now);
+
+    static void Decrease(Host &host, int iNumerator, int iDenominator);
+
+    bool Load();
+
+    void Save();
+
+    ConcurrencyController(const ConcurrencyController &rhs);
+
+    ConcurrencyController & operator=(const ConcurrencyController &rhs);
+
+private:
+    std::map<std::string, Host> m_Hosts;
+    int m_iInitial;
+    int m_iMax;
+    std::string m_sStateFile;
+    Poco::FastMutex m_Mutex;
+    Poco::Condition m_SlotFree;
+    /* only one thread writes the state file at a time */
+    Poco::FastMutex m_FileMutex;
+};
+
+#endif // _ConcurrencyController_H_
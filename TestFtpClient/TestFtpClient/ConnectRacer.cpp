@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <Poco/SingletonHolder.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "ConnectRacer.h"
+
+namespace // anonymous namespace begin
+{
+    /* how long resolved addresses are used, curl's DNS cache default */
+    const Poco::Timestamp::TimeDiff RESOLVE_US = 60 * 1000 * 1000;
+
+    /* weight of a new sample in the averaged time to the greeting */
+    const double SAMPLE_WEIGHT = 0.25;
+
+    /* how often a race looks at its stop check */
+    const Poco::Timestamp::TimeDiff STOP_POLL_US = 100 * 1000;
+
+    struct _Attempt
+    {
+        curl_socket_t iSocket;
+        size_t iEndpoint;
+        Poco::Timestamp tStart;
+        bool bConnected;
+        bool bWritable;
+        bool bReadable;
+        bool bError;
+    };
+
+    /* "host" and port of "host[:port]" or "[v6]:port" */
+    void _SplitHost(
+        const std::string &sHost,
+        unsigned short iDefaultPort,
+        std::string &sName,
+        unsigned short &iPort)
+    {
+        iPort = iDefaultPort;
+        if (!sHost.empty() && sHost[0] == '[')
+        {
+            std::string::size_type iBracket = sHost.find(']');
+            sName = sHost.substr(1, iBracket == std::string::npos ?
+                std::string::npos : iBracket - 1);
+            if (iBracket != std::string::npos &&
+                iBracket + 1 < sHost.size() && sHost[iBracket + 1] == ':')
+            {
+                iPort = (unsigned short)atoi(sHost.c_str() + iBracket + 2);
+            }
+            return;
+        }
+        std::string::size_type iColon = sHost.find(':');
+        if (iColon == std::string::npos || sHost.rfind(':') != iColon)
+        {
+            /* no port, or a bare IPv6 address */
+            sName = sHost;
+            return;
+        }
+        sName = sHost.substr(0, iColon);
+        iPort = (unsigned short)atoi(sHost.c_str() + iColon + 1);
+    }
+
+    void _CloseSocket(curl_socket_t iSocket)
+    {
+#if defined(_WIN32)
+        closesocket(iSocket);
+#else
+        close(iSocket);
+#endif
+    }
+
+    /* a non-blocking connect under way, false if it failed at once */
+    bool _StartConnect(
+        const struct sockaddr *pAddr,
+        int iLength,
+        curl_socket_t &iSocket)
+    {
+        iSocket = socket(pAddr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+        if (iSocket == CURL_SOCKET_BAD)
+        {
+            return false;
+        }
+#if defined(_WIN32)
+        u_long iOn = 1;
+        bool bStarted = ioctlsocket(iSocket, FIONBIO, &iOn) == 0 &&
+            (connect(iSocket, pAddr, iLength) == 0 ||
+            WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+        int iFlags = fcntl(iSocket, F_GETFL, 0);
+        bool bStarted = iFlags != -1 &&
+            fcntl(iSocket, F_SETFL, iFlags | O_NONBLOCK) == 0 &&
+            (connect(iSocket, pAddr, (socklen_t)iLength) == 0 ||
+            errno == EINPROGRESS);
+#endif
+        if (!bStarted)
+        {
+            _CloseSocket(iSocket);
+            iSocket = CURL_SOCKET_BAD;
+        }
+        return bStarted;
+    }
+
+    /* connecting sockets wait to be writable, connected ones for the
+       greeting; false on a failure of the wait itself */
+    bool _WaitAttempts(std::vector<_Attempt> &vectAttempts, long iWaitMs)
+    {
+#if defined(_WIN32)
+        /* select reports a refused connect, WSAPoll does not */
+        fd_set readSet;
+        fd_set writeSet;
+        fd_set errorSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_ZERO(&errorSet);
+        for (size_t i = 0; i < vectAttempts.size(); ++i)
+        {
+            _Attempt &attempt = vectAttempts[i];
+            if (attempt.bConnected)
+            {
+                FD_SET(attempt.iSocket, &readSet);
+            }
+            else
+            {
+                FD_SET(attempt.iSocket, &writeSet);
+                FD_SET(attempt.iSocket, &errorSet);
+            }
+        }
+        struct timeval timeout;
+        timeout.tv_sec = iWaitMs / 1000;
+        timeout.tv_usec = (iWaitMs % 1000) * 1000;
+        if (select(0, &readSet, &writeSet, &errorSet, &timeout) < 0)
+        {
+            fprintf(stderr, "select failed: %d\n", WSAGetLastError());
+            return false;
+        }
+        for (size_t i = 0; i < vectAttempts.size(); ++i)
+        {
+            _Attempt &attempt = vectAttempts[i];
+            attempt.bReadable = FD_ISSET(attempt.iSocket, &readSet) != 0;
+            attempt.bWritable = FD_ISSET(attempt.iSocket, &writeSet) != 0;
+            attempt.bError = FD_ISSET(attempt.iSocket, &errorSet) != 0;
+        }
+#else
+        /* select cannot take descriptors above FD_SETSIZE */
+        std::vector<struct pollfd> vectFds(vectAttempts.size());
+        for (size_t i = 0; i < vectAttempts.size(); ++i)
+        {
+            vectFds[i].fd = vectAttempts[i].iSocket;
+            vectFds[i].events =
+                vectAttempts[i].bConnected ? POLLIN : POLLOUT;
+            vectFds[i].revents = 0;
+        }
+        if (poll(&vectFds[0], (nfds_t)vectFds.size(), (int)iWaitMs) < 0 &&
+            errno != EINTR)
+        {
+            perror("poll");
+            return false;
+        }
+        for (size_t i = 0; i < vectAttempts.size(); ++i)
+        {
+            _Attempt &attempt = vectAttempts[i];
+            attempt.bReadable = (vectFds[i].revents & POLLIN) != 0;
+            attempt.bWritable = (vectFds[i].revents & POLLOUT) != 0;
+            attempt.bError = (vectFds[i].revents &
+                (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        }
+#endif
+        return true;
+    }
+
+    /* true once connected and greeted, bFailed on a refused connect,
+       a closed connection or a greeting that is not 2xx */
+    bool _CheckAttempt(_Attempt &attempt, bool &bFailed)
+    {
+        bFailed = false;
+        if (!attempt.bConnected)
+        {
+            if (!attempt.bWritable && !attempt.bError)
+            {
+                return false;
+            }
+            int iError = 0;
+#if defined(_WIN32)
+            int iLength = sizeof(iError);
+#else
+            socklen_t iLength = sizeof(iError);
+#endif
+            if (getsockopt(attempt.iSocket, SOL_SOCKET, SO_ERROR,
+                (char *)&iError, &iLength) != 0 || iError != 0)
+            {
+                bFailed = true;
+                return false;
+            }
+            /* the greeting may already be there */
+            attempt.bConnected = true;
+            attempt.bReadable = true;
+        }
+        if (!attempt.bReadable)
+        {
+            return false;
+        }
+        /* only peeked, curl reads it again */
+        char cReply = 0;
+        int iRead = (int)recv(attempt.iSocket, &cReply, 1, MSG_PEEK);
+        if (iRead == 1)
+        {
+            bFailed = cReply != '2';
+            return !bFailed;
+        }
+#if defined(_WIN32)
+        bFailed = iRead == 0 || WSAGetLastError() != WSAEWOULDBLOCK;
+#else
+        bFailed = iRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+#endif
+        return false;
+    }
+} // anonymous namespace end
+
+ConnectRacer &ConnectRacer::Instance()
+{
+    static Poco::SingletonHolder<ConnectRacer> sh;
+    return *sh.get();
+}
+
+ConnectRacer::ConnectRacer()
+: m_Replicas()
+, m_Candidates()
+, m_Stats()
+, m_iStaggerMs(250)
+, m_iTimeoutMs(5000)
+{
+}
+
+void ConnectRacer::SetReplicas(
+    const std::string &sHost,
+    const std::vector<std::string> &vectReplicas)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Replicas[sHost] = vectReplicas;
+    m_Candidates.erase(sHost);
+}
+
+void ConnectRacer::GetReplicas(
+    const std::string &sHost,
+    std::vector<std::string> &vectReplicas)
+{
+    vectReplicas.clear();
+    std::string sName;
+    unsigned short iPort = 0;
+    _SplitHost(sHost, 0, sName, iPort);
+
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, std::vector<std::string> >::const_iterator it =
+        m_Replicas.find(sHost);
+    if (it == m_Replicas.end())
+    {
+        return;
+    }
+    for (size_t i = 0; i < it->second.size(); ++i)
+    {
+        std::string sReplica = it->second[i];
+        unsigned short iReplicaPort = 0;
+        _SplitHost(sReplica, 0, sName, iReplicaPort);
+        if (iReplicaPort == 0 && iPort != 0)
+        {
+            char szPort[8];
+            sprintf(szPort, "%u", (unsigned)iPort);
+            if (sName.find(':') != std::string::npos && sReplica[0] != '[')
+            {
+                sReplica = "[" + sReplica + "]";
+            }
+            sReplica += std::string(":") + szPort;
+        }
+        vectReplicas.push_back(sReplica);
+    }
+}
+
+void ConnectRacer::SetStaggerDelay(long iMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iStaggerMs = std::max(iMs, 0L);
+}
+
+void ConnectRacer::SetTimeout(long iMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iTimeoutMs = std::max(iMs, 1L);
+}
+
+curl_socket_t ConnectRacer::Connect(
+    const std::string &sHost,
+    unsigned short iPort,
+    bool &bRaced,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    std::vector<Endpoint> vectEndpoints;
+    GetEndpoints(sHost, iPort, vectEndpoints);
+    bRaced = vectEndpoints.size() > 1;
+    if (!bRaced)
+    {
+        return CURL_SOCKET_BAD;
+    }
+    Poco::Timestamp::TimeDiff iStagger = 0;
+    Poco::Timestamp::TimeDiff iTimeout = 0;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        iStagger = (Poco::Timestamp::TimeDiff)m_iStaggerMs * 1000;
+        iTimeout = (Poco::Timestamp::TimeDiff)m_iTimeoutMs * 1000;
+    }
+
+    std::vector<_Attempt> vectAttempts;
+    size_t iNext = 0;
+    Poco::Timestamp tDeadline;
+    tDeadline += iTimeout;
+    Poco::Timestamp tNextStart;
+    curl_socket_t iWinner = CURL_SOCKET_BAD;
+    bool bStopped = false;
+    for (;;)
+    {
+        Poco::Timestamp now;
+        if (iNext < vectEndpoints.size() &&
+            (now >= tNextStart || vectAttempts.empty()))
+        {
+            const Endpoint &endpoint = vectEndpoints[iNext];
+            _Attempt attempt;
+            attempt.iEndpoint = iNext++;
+            attempt.bConnected = false;
+            attempt.bWritable = false;
+            attempt.bReadable = false;
+            attempt.bError = false;
+            if (_StartConnect((const struct sockaddr *)&endpoint.addr,
+                endpoint.iLength, attempt.iSocket))
+            {
+                vectAttempts.push_back(attempt);
+                tNextStart = now + iStagger;
+            }
+            else
+            {
+                /* refused at once, e.g. on the local host */
+                ReportFailure(endpoint);
+            }
+            continue;
+        }
+        bStopped = pStop != NULL && pStop(pStopParam);
+        if (vectAttempts.empty() || now >= tDeadline || bStopped)
+        {
+            break;
+        }
+
+        Poco::Timestamp::TimeDiff iWait = tDeadline - now;
+        if (iNext < vectEndpoints.size())
+        {
+            iWait = std::min(iWait, tNextStart - now);
+        }
+        if (pStop != NULL)
+        {
+            iWait = std::min(iWait, STOP_POLL_US);
+        }
+        if (!_WaitAttempts(vectAttempts, (long)((iWait + 999) / 1000)))
+        {
+            break;
+        }
+        now.update();
+        std::vector<_Attempt>::iterator it = vectAttempts.begin();
+        while (it != vectAttempts.end())
+        {
+            bool bFailed = false;
+            if (_CheckAttempt(*it, bFailed))
+            {
+                ReportWin(vectEndpoints[it->iEndpoint],
+                    std::max((now - it->tStart) / 1000.0, 0.001));
+                iWinner = it->iSocket;
+                vectAttempts.erase(it);
+                break;
+            }
+            if (bFailed)
+            {
+                /* the next address does not wait for the delay */
+                ReportFailure(vectEndpoints[it->iEndpoint]);
+                _CloseSocket(it->iSocket);
+                it = vectAttempts.erase(it);
+                tNextStart = now;
+                continue;
+            }
+            ++it;
+        }
+        if (iWinner != CURL_SOCKET_BAD)
+        {
+            break;
+        }
+    }
+
+    /* the slower ones are not failures, they are only dropped */
+    for (size_t i = 0; i < vectAttempts.size(); ++i)
+    {
+        _CloseSocket(vectAttempts[i].iSocket);
+    }
+    if (iWinner == CURL_SOCKET_BAD && !bStopped)
+    {
+        fprintf(stderr, "none of the %u addresses of %s answered\n",
+            (unsigned)vectEndpoints.size(), sHost.c_str());
+    }
+    return iWinner;
+}
+
+bool ConnectRacer::IsRaced(const std::string &sHost, unsigned short iPort)
+{
+    std::vector<Endpoint> vectEndpoints;
+    GetEndpoints(sHost, iPort, vectEndpoints);
+    return vectEndpoints.size() > 1;
+}
+
+void ConnectRacer::GetAddresses(
+    const std::string &sHost,
+    std::vector<Address> &vectAddresses)
+{
+    vectAddresses.clear();
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Candidates>::iterator it = m_Candidates.find(sHost);
+    if (it == m_Candidates.end())
+    {
+        return;
+    }
+    std::vector<Endpoint> vectEndpoints = it->second.vectEndpoints;
+    SortLocked(vectEndpoints);
+    for (size_t i = 0; i < vectEndpoints.size(); ++i)
+    {
+        Address address;
+        address.sAddress = vectEndpoints[i].sAddress;
+        std::map<std::string, Stats>::const_iterator itStats =
+            m_Stats.find(address.sAddress);
+        if (itStats != m_Stats.end())
+        {
+            address.fConnectMs = itStats->second.fConnectMs;
+            address.iWins = itStats->second.iWins;
+            address.iFailures = itStats->second.iFailures;
+        }
+        vectAddresses.push_back(address);
+    }
+}
+
+void ConnectRacer::Resolve(
+    const std::string &sHost,
+    unsigned short iPort,
+    std::vector<Endpoint> &vectEndpoints)
+{
+    std::string sName;
+    _SplitHost(sHost, iPort, sName, iPort);
+    char szPort[8];
+    sprintf(szPort, "%u", (unsigned)iPort);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *pResult = NULL;
+    int iError = getaddrinfo(sName.c_str(), szPort, &hints, &pResult);
+    if (iError != 0)
+    {
+        fprintf(stderr, "%s: %s\n", sName.c_str(), gai_strerror(iError));
+        return;
+    }
+    for (struct addrinfo *p = pResult; p != NULL; p = p->ai_next)
+    {
+        char szHost[64];
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage) ||
+            getnameinfo(p->ai_addr, (socklen_t)p->ai_addrlen, szHost,
+            sizeof(szHost), NULL, 0, NI_NUMERICHOST) != 0)
+        {
+            continue;
+        }
+        Endpoint endpoint;
+        memcpy(&endpoint.addr, p->ai_addr, p->ai_addrlen);
+        endpoint.iLength = (int)p->ai_addrlen;
+        endpoint.sAddress = (p->ai_family == AF_INET6) ?
+            std::string("[") + szHost + "]:" + szPort :
+            std::string(szHost) + ":" + szPort;
+        /* a replica may resolve to an address seen before */
+        bool bSeen = false;
+        for (size_t i = 0; i < vectEndpoints.size() && !bSeen; ++i)
+        {
+            bSeen = vectEndpoints[i].sAddress == endpoint.sAddress;
+        }
+        if (!bSeen)
+        {
+            vectEndpoints.push_back(endpoint);
+        }
+    }
+    freeaddrinfo(pResult);
+}
+
+void ConnectRacer::GetEndpoints(
+    const std::string &sHost,
+    unsigned short iPort,
+    std::vector<Endpoint> &vectEndpoints)
+{
+    std::vector<std::string> vectReplicas;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        std::map<std::string, Candidates>::const_iterator it =
+            m_Candidates.find(sHost);
+        if (it != m_Candidates.end() &&
+            !it->second.tResolved.isElapsed(RESOLVE_US))
+        {
+            vectEndpoints = it->second.vectEndpoints;
+            SortLocked(vectEndpoints);
+            return;
+        }
+        std::map<std::string, std::vector<std::string> >::const_iterator
+            itReplicas = m_Replicas.find(sHost);
+        if (itReplicas != m_Replicas.end())
+        {
+            vectReplicas = itReplicas->second;
+        }
+    }
+
+    /* not under the lock, a slow resolver would hold up every race */
+    std::vector<Endpoint> vectResolved;
+    Resolve(sHost, iPort, vectResolved);
+    for (size_t i = 0; i < vectReplicas.size(); ++i)
+    {
+        Resolve(vectReplicas[i], iPort, vectResolved);
+    }
+
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Candidates &candidates = m_Candidates[sHost];
+    candidates.tResolved.update();
+    candidates.vectEndpoints = vectResolved;
+    vectEndpoints.swap(vectResolved);
+    SortLocked(vectEndpoints);
+}
+
+void ConnectRacer::SortLocked(std::vector<Endpoint> &vectEndpoints) const
+{
+    /* (group, time to the greeting), the index keeps the resolver
+       order among equals */
+    std::vector<std::pair<std::pair<int, double>, size_t> > vectKeys;
+    for (size_t i = 0; i < vectEndpoints.size(); ++i)
+    {
+        std::pair<int, double> key(1, 0.0);
+        std::map<std::string, Stats>::const_iterator it =
+            m_Stats.find(vectEndpoints[i].sAddress);
+        if (it != m_Stats.end())
+        {
+            if (it->second.bFailed)
+            {
+                key.first = 2;
+            }
+            else if (it->second.fConnectMs > 0.0)
+            {
+                key = std::make_pair(0, it->second.fConnectMs);
+            }
+        }
+        vectKeys.push_back(std::make_pair(key, i));
+    }
+    std::sort(vectKeys.begin(), vectKeys.end());
+    std::vector<Endpoint> vectSorted;
+    vectSorted.reserve(vectEndpoints.size());
+    for (size_t i = 0; i < vectKeys.size(); ++i)
+    {
+        vectSorted.push_back(vectEndpoints[vectKeys[i].second]);
+    }
+    vectEndpoints.swap(vectSorted);
+}
+
+void ConnectRacer::ReportWin(const Endpoint &endpoint, double fConnectMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Stats &stats = m_Stats[endpoint.sAddress];
+    stats.fConnectMs = (stats.fConnectMs > 0.0) ?
+        stats.fConnectMs + SAMPLE_WEIGHT * (fConnectMs - stats.fConnectMs) :
+        fConnectMs;
+    ++stats.iWins;
+    stats.bFailed = false;
+}
+
+void ConnectRacer::ReportFailure(const Endpoint &endpoint)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Stats &stats = m_Stats[endpoint.sAddress];
+    ++stats.iFailures;
+    stats.bFailed = true;
+}
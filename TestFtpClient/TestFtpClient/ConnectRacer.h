@@ -0,0 +1,140 @@
+#ifndef _ConnectRacer_H_
+#define _ConnectRacer_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <curl/curl.h>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
+
+#include "RateLimiter.h"
+
+/* control connections to servers with more than one address, for every
+   FtpClient of the process. The addresses the host name resolves to and
+   the replicas set for it are raced in the style of Happy Eyeballs: the
+   address that answered fastest so far is tried first, the next one
+   joins after a short delay or as soon as an attempt fails, and the
+   first to send its greeting wins while the others are closed. curl
+   gets the winner through the open socket callback and logs in on it,
+   but still takes the address it resolved itself for the server, so a
+   raced connection has to ask for the data address in a PASV reply.
+   The time to the greeting is averaged per address */
+class ConnectRacer
+{
+public:
+    struct Address
+    {
+        Address()
+        : sAddress()
+        , fConnectMs(0.0)
+        , iWins(0)
+        , iFailures(0){}
+
+        /* "ip:port", "[ip]:port" for IPv6 */
+        std::string sAddress;
+        /* 0 while unknown */
+        double fConnectMs;
+        Poco::UInt64 iWins;
+        Poco::UInt64 iFailures;
+    };
+
+    static ConnectRacer &Instance();
+
+    /* servers with the same files and logins as sHost ("host[:port]" as
+       in the URL), each "host[:port]" with the port of sHost by default */
+    void SetReplicas(const std::string &sHost,
+        const std::vector<std::string> &vectReplicas);
+
+    /* the replicas of sHost, each with the port of sHost if it had none,
+       so that they can take its place in a URL */
+    void GetReplicas(const std::string &sHost,
+        std::vector<std::string> &vectReplicas);
+
+    /* before the next address joins the race, 250 ms by default */
+    void SetStaggerDelay(long iMs);
+
+    /* for the whole race, 5 s by default as the connect timeout */
+    void SetTimeout(long iMs);
+
+    /* a connected socket to the address of sHost that greeted first,
+       CURL_SOCKET_BAD if none did or pStop asked to give up. bRaced is
+       false when there is only one address, curl connects to it by
+       itself then */
+    curl_socket_t Connect(const std::string &sHost, unsigned short iPort,
+        bool &bRaced, RateLimiter::StopCheck pStop = NULL,
+        const void *pStopParam = NULL);
+
+    /* whether Connect() races for sHost, it has more than one address */
+    bool IsRaced(const std::string &sHost, unsigned short iPort);
+
+    /* the addresses of sHost in the order they are tried */
+    void GetAddresses(const std::string &sHost,
+        std::vector<Address> &vectAddresses);
+
+    ConnectRacer();
+
+private:
+    struct Endpoint
+    {
+        struct sockaddr_storage addr;
+        int iLength;
+        std::string sAddress;
+    };
+
+    /* the addresses of a host and its replicas, resolved again after a
+       while as curl does */
+    struct Candidates
+    {
+        Candidates()
+        : tResolved(0)
+        , vectEndpoints(){}
+
+        Poco::Timestamp tResolved;
+        std::vector<Endpoint> vectEndpoints;
+    };
+
+    struct Stats
+    {
+        Stats()
+        : fConnectMs(0.0)
+        , iWins(0)
+        , iFailures(0)
+        , bFailed(false){}
+
+        double fConnectMs;
+        Poco::UInt64 iWins;
+        Poco::UInt64 iFailures;
+        /* the last attempt failed, it goes to the back */
+        bool bFailed;
+    };
+
+    static void Resolve(const std::string &sHost, unsigned short iPort,
+        std::vector<Endpoint> &vectEndpoints);
+
+    /* resolves when the cached addresses are too old */
+    void GetEndpoints(const std::string &sHost, unsigned short iPort,
+        std::vector<Endpoint> &vectEndpoints);
+
+    /* fastest first, then the unknown ones as resolved, failed last */
+    void SortLocked(std::vector<Endpoint> &vectEndpoints) const;
+
+    void ReportWin(const Endpoint &endpoint, double fConnectMs);
+
+    void ReportFailure(const Endpoint &endpoint);
+
+    ConnectRacer(const ConnectRacer &rhs);
+
+    ConnectRacer & operator=(const ConnectRacer &rhs);
+
+private:
+    std::map<std::string, std::vector<std::string> > m_Replicas;
+    std::map<std::string, Candidates> m_Candidates;
+    std::map<std::string, Stats> m_Stats;
+    long m_iStaggerMs;
+    long m_iTimeoutMs;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _ConnectRacer_H_
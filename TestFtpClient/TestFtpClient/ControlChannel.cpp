@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <Poco/Timestamp.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+#include "ControlChannel.h"
+
+namespace // anonymous namespace begin
+{
+    /* "123 " or "123-" starting a reply line, the code of it or 0 */
+    int _GetReplyCode(const std::string &sLine, bool &bMore)
+    {
+        if (sLine.size() < 3 || !isdigit((unsigned char)sLine[0]) ||
+            !isdigit((unsigned char)sLine[1]) ||
+            !isdigit((unsigned char)sLine[2]))
+        {
+            return 0;
+        }
+        bMore = sLine.size() > 3 && sLine[3] == '-';
+        return atoi(sLine.substr(0, 3).c_str());
+    }
+
+    long _GetLeftMs(const Poco::Timestamp &tStart, long iTimeoutMs)
+    {
+        return iTimeoutMs - (long)(tStart.elapsed() / 1000);
+    }
+} // anonymous namespace end
+
+ControlChannel::ControlChannel()
+: m_pCurl(NULL)
+, m_sReceived()
+, m_bBroken(false)
+{
+}
+
+ControlChannel::~ControlChannel()
+{
+    Close();
+}
+
+bool ControlChannel::Open(
+    const std::string &sUrl,
+    const std::string &sUserPwd,
+    long iTimeout)
+{
+    Close();
+    m_pCurl = curl_easy_init();
+    if (m_pCurl == NULL)
+    {
+        fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+        return false;
+    }
+    curl_easy_setopt(m_pCurl, CURLOPT_URL, sUrl.c_str());
+    curl_easy_setopt(m_pCurl, CURLOPT_USERPWD, sUserPwd.c_str());
+    /* log in and stop there, before the CWD and the transfer */
+    curl_easy_setopt(m_pCurl, CURLOPT_CONNECT_ONLY, 1L);
+    curl_easy_setopt(m_pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(m_pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT, iTimeout);
+
+    CURLcode ret = curl_easy_perform(m_pCurl);
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "%s: %s\n", sUrl.c_str(), curl_easy_strerror(ret));
+        Close();
+        return false;
+    }
+    m_bBroken = false;
+    return true;
+}
+
+int ControlChannel::Command(
+    const std::string &sCommand,
+    std::string &sReply,
+    long iTimeoutMs)
+{
+    sReply.clear();
+    if (m_pCurl == NULL || m_bBroken)
+    {
+        return 0;
+    }
+    std::string sLine = sCommand + "\r\n";
+    size_t iSent = 0;
+    Poco::Timestamp tStart;
+    while (iSent < sLine.size())
+    {
+        size_t iCount = 0;
+        CURLcode ret = curl_easy_send(m_pCurl, sLine.data() + iSent,
+            sLine.size() - iSent, &iCount);
+        if (ret == CURLE_AGAIN)
+        {
+            long iLeftMs = _GetLeftMs(tStart, iTimeoutMs);
+            if (iLeftMs <= 0 || !WaitSocket(false, iLeftMs))
+            {
+                m_bBroken = true;
+                return 0;
+            }
+            continue;
+        }
+        if (ret != CURLE_OK)
+        {
+            fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+            m_bBroken = true;
+            return 0;
+        }
+        iSent += iCount;
+    }
+    int iCode = ReadReply(sReply, _GetLeftMs(tStart, iTimeoutMs));
+    if (iCode == 0)
+    {
+        m_bBroken = true;
+    }
+    return iCode;
+}
+
+int ControlChannel::ReadReply(std::string &sReply, long iTimeoutMs)
+{
+    Poco::Timestamp tStart;
+    for (;;)
+    {
+        int iCode = TakeReply(sReply);
+        if (iCode != 0 || m_pCurl == NULL || m_bBroken)
+        {
+            return iCode;
+        }
+        char szBuffer[1024];
+        size_t iRead = 0;
+        CURLcode ret = curl_easy_recv(m_pCurl, szBuffer, sizeof(szBuffer),
+            &iRead);
+        if (ret == CURLE_OK && iRead > 0)
+        {
+            m_sReceived.append(szBuffer, iRead);
+            continue;
+        }
+        if (ret != CURLE_AGAIN)
+        {
+            /* nothing read without an error: the server closed it */
+            fprintf(stderr, "%s\n", ret == CURLE_OK ?
+                "control connection closed" : curl_easy_strerror(ret));
+            m_bBroken = true;
+            return 0;
+        }
+        long iLeftMs = _GetLeftMs(tStart, iTimeoutMs);
+        if (iLeftMs <= 0)
+        {
+            return 0;
+        }
+        WaitSocket(true, iLeftMs);
+    }
+}
+
+bool ControlChannel::IsBroken() const
+{
+    return m_bBroken;
+}
+
+std::string ControlChannel::GetPeerIp()
+{
+    char *pIp = NULL;
+    if (m_pCurl == NULL ||
+        curl_easy_getinfo(m_pCurl, CURLINFO_PRIMARY_IP, &pIp) != CURLE_OK ||
+        pIp == NULL)
+    {
+        return "";
+    }
+    return pIp;
+}
+
+void ControlChannel::Close()
+{
+    if (m_pCurl != NULL)
+    {
+        curl_easy_cleanup(m_pCurl);
+        m_pCurl = NULL;
+    }
+    m_sReceived.clear();
+    m_bBroken = false;
+}
+
+int ControlChannel::TakeReply(std::string &sReply)
+{
+    /* a multi-line reply ends with "123 " after lines of "123-" */
+    std::string::size_type iBegin = 0;
+    int iFirst = 0;
+    for (;;)
+    {
+        std::string::size_type iEnd = m_sReceived.find('\n', iBegin);
+        if (iEnd == std::string::npos)
+        {
+            return 0;
+        }
+        std::string sLine = m_sReceived.substr(iBegin, iEnd - iBegin);
+        if (!sLine.empty() && sLine[sLine.size() - 1] == '\r')
+        {
+            sLine.erase(sLine.size() - 1);
+        }
+        bool bMore = false;
+        int iCode = _GetReplyCode(sLine, bMore);
+        iBegin = iEnd + 1;
+        if (iFirst == 0)
+        {
+            iFirst = iCode;
+            if (iFirst == 0)
+            {
+                /* not a reply, dropped */
+                m_sReceived.erase(0, iBegin);
+                iBegin = 0;
+                continue;
+            }
+        }
+        if (iCode == iFirst && !bMore)
+        {
+            sReply = m_sReceived.substr(0, iEnd);
+            if (!sReply.empty() && sReply[sReply.size() - 1] == '\r')
+            {
+                sReply.erase(sReply.size() - 1);
+            }
+            m_sReceived.erase(0, iBegin);
+            return iFirst;
+        }
+    }
+}
+
+bool ControlChannel::WaitSocket(bool bRead, long iTimeoutMs)
+{
+    long iSocket = -1;
+    if (curl_easy_getinfo(m_pCurl, CURLINFO_LASTSOCKET, &iSocket) !=
+        CURLE_OK || iSocket == -1)
+    {
+        m_bBroken = true;
+        return false;
+    }
+#if defined(_WIN32)
+    fd_set socketSet;
+    FD_ZERO(&socketSet);
+    FD_SET((curl_socket_t)iSocket, &socketSet);
+    struct timeval timeout;
+    timeout.tv_sec = iTimeoutMs / 1000;
+    timeout.tv_usec = (iTimeoutMs % 1000) * 1000;
+    return select(0, bRead ? &socketSet : NULL, bRead ? NULL : &socketSet,
+        NULL, &timeout) > 0;
+#else
+    struct pollfd pollFd;
+    pollFd.fd = (int)iSocket;
+    pollFd.events = bRead ? POLLIN : POLLOUT;
+    pollFd.revents = 0;
+    return poll(&pollFd, 1, (int)iTimeoutMs) > 0;
+#endif
+}
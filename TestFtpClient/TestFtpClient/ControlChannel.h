@@ -0,0 +1,61 @@
+#ifndef _ControlChannel_H_
+#define _ControlChannel_H_
+
+#include <string>
+#include <curl/curl.h>
+
+/* a control connection for commands curl has no option for, such as the
+   two halves of a server to server copy. curl connects and logs in
+   (CURLOPT_CONNECT_ONLY), so the login, proxies and TLS work as they do
+   for transfers; the commands and replies then go over it as they are */
+class ControlChannel
+{
+public:
+    ControlChannel();
+
+    ~ControlChannel();
+
+    /* connect and log in to the server of sUrl, iTimeout seconds for the
+       connect and for each reply of the login */
+    bool Open(const std::string &sUrl, const std::string &sUserPwd,
+        long iTimeout);
+
+    /* send sCommand and wait for its reply; the reply code, 0 if none
+       came within iTimeoutMs or the connection failed. Either way the
+       channel is broken then, a late reply would pass for the one to
+       the next command */
+    int Command(const std::string &sCommand, std::string &sReply,
+        long iTimeoutMs);
+
+    /* the next reply, e.g. the one at the end of a transfer. 0 if there
+       was none within iTimeoutMs, see IsBroken */
+    int ReadReply(std::string &sReply, long iTimeoutMs);
+
+    /* the connection failed, the server closed it or a command got no
+       reply in time */
+    bool IsBroken() const;
+
+    /* the address curl connected to */
+    std::string GetPeerIp();
+
+    /* QUIT, and the connection is closed */
+    void Close();
+
+private:
+    /* a whole reply at the front of m_sReceived, its code or 0 */
+    int TakeReply(std::string &sReply);
+
+    bool WaitSocket(bool bRead, long iTimeoutMs);
+
+    ControlChannel(const ControlChannel &rhs);
+
+    ControlChannel & operator=(const ControlChannel &rhs);
+
+private:
+    CURL *m_pCurl;
+    /* what came in and is not a whole reply yet */
+    std::string m_sReceived;
+    bool m_bBroken;
+};
+
+#endif // _ControlChannel_H_
@@ -0,0 +1,147 @@
+#include <Poco/SingletonHolder.h>
+
+#include "DataModeCache.h"
+
+DataModeCache &DataModeCache::Instance()
+{
+    static Poco::SingletonHolder<DataModeCache> sh;
+    return *sh.get();
+}
+
+const char *DataModeCache::GetName(Mode eMode)
+{
+    switch (eMode)
+    {
+    case Epsv:
+        return "EPSV";
+    case Pasv:
+        return "PASV";
+    case Port:
+        return "PORT";
+    default:
+        return "auto";
+    }
+}
+
+DataModeCache::Mode DataModeCache::GetNextMode(Mode eMode)
+{
+    switch (eMode)
+    {
+    case Auto:
+        return Epsv;
+    case Epsv:
+        return Pasv;
+    case Pasv:
+        return Port;
+    default:
+        return Auto;
+    }
+}
+
+DataModeCache::DataModeCache()
+: m_Hosts()
+, m_eDefault(Auto)
+{
+}
+
+void DataModeCache::SetMode(const std::string &sHost, Mode eMode)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    host.eConfigured = eMode;
+    host.eProbed = Auto;
+}
+
+void DataModeCache::SetDefaultMode(Mode eMode)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_eDefault = eMode;
+}
+
+DataModeCache::Mode DataModeCache::GetMode(
+    const std::string &sHost,
+    bool &bFixed)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    if (it != m_Hosts.end() && it->second.eConfigured != Auto)
+    {
+        bFixed = true;
+        return it->second.eConfigured;
+    }
+    if (it != m_Hosts.end() && it->second.eProbed != Auto)
+    {
+        bFixed = false;
+        return it->second.eProbed;
+    }
+    bFixed = m_eDefault != Auto;
+    return m_eDefault;
+}
+
+void DataModeCache::ReportSuccess(
+    const std::string &sHost,
+    Mode eMode,
+    double fFirstByteMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    Stats &stats = host.stats[eMode];
+    if (stats.iSuccesses == 0 || fFirstByteMs < stats.fMinMs)
+    {
+        stats.fMinMs = fFirstByteMs;
+    }
+    if (fFirstByteMs > stats.fMaxMs)
+    {
+        stats.fMaxMs = fFirstByteMs;
+    }
+    stats.fTotalMs += fFirstByteMs;
+    ++stats.iSuccesses;
+    if (host.eConfigured == Auto)
+    {
+        host.eProbed = eMode;
+    }
+}
+
+void DataModeCache::ReportFailure(const std::string &sHost, Mode eMode)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    ++host.stats[eMode].iFailures;
+    if (host.eProbed == eMode)
+    {
+        host.eProbed = Auto;
+    }
+}
+
+DataModeCache::Stats DataModeCache::GetStats(
+    const std::string &sHost,
+    Mode eMode)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    if (it == m_Hosts.end())
+    {
+        return Stats();
+    }
+    return it->second.stats[eMode];
+}
+
+void DataModeCache::Clear()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::iterator it = m_Hosts.begin();
+    while (it != m_Hosts.end())
+    {
+        if (it->second.eConfigured == Auto)
+        {
+            m_Hosts.erase(it++);
+            continue;
+        }
+        it->second.eProbed = Auto;
+        for (int i = 0; i < ModeCount; ++i)
+        {
+            it->second.stats[i] = Stats();
+        }
+        ++it;
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef _DataModeCache_H_
+#define _DataModeCache_H_
+
+#include <string>
+#include <map>
+#include <Poco/Mutex.h>
+
+/* how each server gets its data connections, shared by every FtpClient
+   of the process. A host can be set to one mode, otherwise it is probed:
+   EPSV first, then PASV, then PORT/EPRT, and the first mode that carried
+   data is kept for the host so later transfers start with it. A kept
+   mode that fails is dropped and the probe goes on from the next one.
+   Every attempt is counted per host and mode, successful ones with the
+   time from the control connection being up to the first data byte */
+class DataModeCache
+{
+public:
+    enum Mode
+    {
+        Auto,
+        Epsv,
+        Pasv,
+        Port,
+        ModeCount,
+    };
+
+    struct Stats
+    {
+        Stats()
+        : iSuccesses(0)
+        , iFailures(0)
+        , fTotalMs(0.0)
+        , fMinMs(0.0)
+        , fMaxMs(0.0){}
+
+        int iSuccesses;
+        int iFailures;
+        /* first byte latency of the successful attempts */
+        double fTotalMs;
+        double fMinMs;
+        double fMaxMs;
+    };
+
+    static DataModeCache &Instance();
+
+    static const char *GetName(Mode eMode);
+
+    /* the mode probed after eMode, Auto when there is none left */
+    static Mode GetNextMode(Mode eMode);
+
+    /* sHost as in the URL, with the port if it has one. Auto lets the
+       host be probed again */
+    void SetMode(const std::string &sHost, Mode eMode);
+
+    /* for hosts without a mode of their own, Auto by default */
+    void SetDefaultMode(Mode eMode);
+
+    /* the mode to start with, Auto if it has to be probed. bFixed is
+       set when the mode was configured and must not be left */
+    Mode GetMode(const std::string &sHost, bool &bFixed);
+
+    void ReportSuccess(const std::string &sHost, Mode eMode,
+        double fFirstByteMs);
+
+    void ReportFailure(const std::string &sHost, Mode eMode);
+
+    Stats GetStats(const std::string &sHost, Mode eMode);
+
+    /* forget the probed modes and the statistics */
+    void Clear();
+
+    DataModeCache();
+
+private:
+    struct Host
+    {
+        Host()
+        : eConfigured(Auto)
+        , eProbed(Auto){}
+
+        Mode eConfigured;
+        Mode eProbed;
+        Stats stats[ModeCount];
+    };
+
+    DataModeCache(const DataModeCache &rhs);
+
+    DataModeCache & operator=(const DataModeCache &rhs);
+
+private:
+    std::map<std::string, Host> m_Hosts;
+    Mode m_eDefault;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _DataModeCache_H_
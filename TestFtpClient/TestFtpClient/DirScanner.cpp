@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <string.h>
+#include <Poco/Thread.h>
+#include <Poco/RunnableAdapter.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "DirScanner.h"
+
+namespace // anonymous namespace begin
+{
+    inline bool _IsDots(const char *pName)
+    {
+        return pName[0] == '.' &&
+            (pName[1] == '\0' || (pName[1] == '.' && pName[2] == '\0'));
+    }
+
+#if !defined(_WIN32)
+    /* follows links like Poco::File::isFile() */
+    bool _StatAt(
+        int iDirFd,
+        const char *pName,
+        unsigned int &iMode,
+        Poco::Int64 &iSize,
+        Poco::Timestamp::TimeVal &tModify)
+    {
+#if defined(STATX_SIZE)
+        struct statx st;
+        if (statx(iDirFd, pName, AT_STATX_DONT_SYNC,
+            STATX_TYPE | STATX_SIZE | STATX_MTIME, &st) != 0) return false;
+        iMode = st.stx_mode;
+        iSize = (Poco::Int64)st.stx_size;
+        tModify = (Poco::Timestamp::TimeVal)st.stx_mtime.tv_sec * 1000000 +
+            st.stx_mtime.tv_nsec / 1000;
+#else
+        struct stat st;
+        if (fstatat(iDirFd, pName, &st, 0) != 0) return false;
+        iMode = st.st_mode;
+        iSize = (Poco::Int64)st.st_size;
+        tModify = (Poco::Timestamp::TimeVal)st.st_mtime * 1000000;
+#endif
+        return true;
+    }
+#endif
+
+#if defined(__linux__)
+    /* the kernel's record, glibc does not export it */
+    struct _LinuxDirent64
+    {
+        Poco::UInt64 d_ino;
+        Poco::Int64 d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+#endif
+} // anonymous namespace end
+
+DirScanner::DirScanner(
+    const FileFilter &filter,
+    DirScanHandler &handler,
+    bool bNeedStat/* = true*/)
+: m_Filter(filter)
+, m_Handler(handler)
+, m_bNeedStat(bNeedStat || filter.NeedsAttributes())
+, m_bRecursive(false)
+, m_sRoot()
+, m_vectPending()
+, m_iBusy(0)
+, m_bStop(false)
+, m_bFailed(false)
+, m_iFileCount(0)
+, m_iDirCount(0)
+{
+}
+
+bool DirScanner::Scan(
+    const std::string &sRoot,
+    bool bRecursive/* = false*/,
+    int iThreads/* = 1*/)
+{
+    m_sRoot = sRoot;
+    if (!m_sRoot.empty() &&
+        m_sRoot[m_sRoot.size() - 1] != '/' &&
+        m_sRoot[m_sRoot.size() - 1] != '\\')
+    {
+        m_sRoot += '/';
+    }
+    m_bRecursive = bRecursive;
+    m_vectPending.assign(1, std::string());
+    m_iBusy = 0;
+    m_bStop = false;
+    m_bFailed = false;
+    m_iFileCount = 0;
+    m_iDirCount = 0;
+
+    if (!bRecursive || iThreads < 2)
+    {
+        WorkLoop();
+        return !m_bFailed;
+    }
+
+    /* the calling thread is one of the workers */
+    Poco::RunnableAdapter<DirScanner> runnable(*this, &DirScanner::WorkLoop);
+    std::vector<Poco::Thread *> vectThreads;
+    for (int i = 1; i < iThreads; ++i)
+    {
+        vectThreads.push_back(new Poco::Thread());
+        vectThreads.back()->start(runnable);
+    }
+    WorkLoop();
+    for (size_t i = 0; i < vectThreads.size(); ++i)
+    {
+        vectThreads[i]->join();
+        delete vectThreads[i];
+    }
+    return !m_bFailed;
+}
+
+void DirScanner::Stop()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bStop = true;
+    m_WorkReady.broadcast();
+}
+
+bool DirScanner::IsStopped()
+{
+    if (!m_bStop && m_Handler.IsStopped()) m_bStop = true;
+    return m_bStop;
+}
+
+Poco::UInt64 DirScanner::GetFileCount() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_iFileCount;
+}
+
+Poco::UInt64 DirScanner::GetDirCount() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_iDirCount;
+}
+
+void DirScanner::WorkLoop()
+{
+    std::vector<std::string> vectSubDirs;
+    std::string sRelDir;
+
+    m_Mutex.lock();
+    for (;;)
+    {
+        /* idle workers wait while a busy one may still add directories */
+        while (m_vectPending.empty() && m_iBusy > 0 && !m_bStop)
+        {
+            m_WorkReady.wait(m_Mutex);
+        }
+        if (m_vectPending.empty() || IsStopped()) break;
+
+        sRelDir.swap(m_vectPending.back());
+        m_vectPending.pop_back();
+        ++m_iBusy;
+        m_Mutex.unlock();
+
+        vectSubDirs.clear();
+        Poco::UInt64 iFiles = 0;
+        bool bOpened = false;
+        try
+        {
+            bOpened = ScanOne(sRelDir, vectSubDirs, iFiles);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+        }
+
+        m_Mutex.lock();
+        --m_iBusy;
+        m_iFileCount += iFiles;
+        ++m_iDirCount;
+        /* an unreadable subdirectory is skipped, only the root fails */
+        if (!bOpened && sRelDir.empty())
+        {
+            m_bFailed = true;
+        }
+        m_vectPending.insert(m_vectPending.end(),
+            vectSubDirs.begin(), vectSubDirs.end());
+        m_WorkReady.broadcast();
+    }
+    m_WorkReady.broadcast();
+    m_Mutex.unlock();
+}
+
+#if defined(_WIN32)
+
+bool DirScanner::ScanOne(
+    const std::string &sRelDir,
+    std::vector<std::string> &vectSubDirs,
+    Poco::UInt64 &iFiles)
+{
+    /* basic info skips the 8.3 name, large fetch batches the entries */
+    std::string sPattern = m_sRoot + sRelDir + "*";
+    WIN32_FIND_DATAA data;
+    HANDLE hFind = FindFirstFileExA(sPattern.c_str(), FindExInfoBasic,
+        &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "FindFirstFileEx %s failed: %lu\n",
+            sPattern.c_str(), GetLastError());
+        return false;
+    }
+
+    bool bContinue = true;
+    do
+    {
+        const char *pName = data.cFileName;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            /* junctions are not followed, they may loop */
+            if (m_bRecursive && !_IsDots(pName) &&
+                !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            {
+                vectSubDirs.push_back(sRelDir + pName + '/');
+            }
+            continue;
+        }
+
+        size_t iNameLen = strlen(pName);
+        if (!m_Filter.MatchName(pName, iNameLen)) continue;
+
+        /* the find data already carries size and time, no stat needed */
+        Poco::Int64 iSize = ((Poco::Int64)data.nFileSizeHigh << 32) |
+            data.nFileSizeLow;
+        Poco::Timestamp::TimeVal tModify = Poco::Timestamp::fromFileTimeNP(
+            data.ftLastWriteTime.dwLowDateTime,
+            data.ftLastWriteTime.dwHighDateTime).epochMicroseconds();
+        if (m_Filter.NeedsAttributes() &&
+            !m_Filter.MatchAttributes(iSize, tModify)) continue;
+
+        ++iFiles;
+        if (!m_Handler.OnDirEntry(sRelDir, pName, iNameLen, iSize, tModify))
+        {
+            m_bStop = true;
+            bContinue = false;
+        }
+    } while (bContinue && !IsStopped() && FindNextFileA(hFind, &data));
+
+    FindClose(hFind);
+    return true;
+}
+
+#else
+
+bool DirScanner::ScanOne(
+    const std::string &sRelDir,
+    std::vector<std::string> &vectSubDirs,
+    Poco::UInt64 &iFiles)
+{
+    std::string sPath = m_sRoot + sRelDir;
+    int iDirFd = open(sPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (iDirFd < 0)
+    {
+        perror(sPath.c_str());
+        return false;
+    }
+
+#if defined(__linux__)
+    /* one call hands back a few hundred entries */
+    Poco::UInt64 buffer[4096];
+    bool bContinue = true;
+    while (bContinue && !IsStopped())
+    {
+        long iRead = syscall(SYS_getdents64, iDirFd, buffer, sizeof(buffer));
+        if (iRead < 0)
+        {
+            perror(sPath.c_str());
+            break;
+        }
+        if (iRead == 0) break;
+
+        const char *pData = reinterpret_cast<const char *>(buffer);
+        for (long iPos = 0; iPos < iRead && bContinue && !IsStopped(); )
+        {
+            const _LinuxDirent64 *pEntry =
+                reinterpret_cast<const _LinuxDirent64 *>(pData + iPos);
+            iPos += pEntry->d_reclen;
+            bContinue = ScanEntry(iDirFd, sRelDir, pEntry->d_name,
+                pEntry->d_type, vectSubDirs, iFiles);
+        }
+    }
+    close(iDirFd);
+#else
+    DIR *pDir = fdopendir(iDirFd);
+    if (pDir == NULL)
+    {
+        perror(sPath.c_str());
+        close(iDirFd);
+        return false;
+    }
+    struct dirent *pEntry = NULL;
+    while (!IsStopped() && (pEntry = readdir(pDir)) != NULL)
+    {
+        if (!ScanEntry(iDirFd, sRelDir, pEntry->d_name,
+            pEntry->d_type, vectSubDirs, iFiles)) break;
+    }
+    closedir(pDir);
+#endif
+    return true;
+}
+
+bool DirScanner::ScanEntry(
+    int iDirFd,
+    const std::string &sRelDir,
+    const char *pName,
+    unsigned char iType,
+    std::vector<std::string> &vectSubDirs,
+    Poco::UInt64 &iFiles)
+{
+    if (_IsDots(pName)) return true;
+
+    if (iType == DT_DIR)
+    {
+        if (m_bRecursive) vectSubDirs.push_back(sRelDir + pName + '/');
+        return true;
+    }
+    if (iType != DT_REG && iType != DT_LNK && iType != DT_UNKNOWN)
+    {
+        return true;
+    }
+
+    /* the name is free, test it before paying for a stat; an unknown
+       type in a recursive scan may be a directory and is stat'ed first */
+    size_t iNameLen = strlen(pName);
+    bool bNameChecked = false;
+    if (iType != DT_UNKNOWN || !m_bRecursive)
+    {
+        if (!m_Filter.MatchName(pName, iNameLen)) return true;
+        bNameChecked = true;
+    }
+
+    Poco::Int64 iSize = -1;
+    Poco::Timestamp::TimeVal tModify = 0;
+    if (iType != DT_REG || m_bNeedStat)
+    {
+        unsigned int iMode = 0;
+        /* gone since it was listed */
+        if (!_StatAt(iDirFd, pName, iMode, iSize, tModify)) return true;
+        if (S_ISDIR(iMode))
+        {
+            if (m_bRecursive && iType == DT_UNKNOWN)
+            {
+                vectSubDirs.push_back(sRelDir + pName + '/');
+            }
+            return true;
+        }
+        if (!S_ISREG(iMode)) return true;
+    }
+
+    if (!bNameChecked && !m_Filter.MatchName(pName, iNameLen)) return true;
+    if (m_Filter.NeedsAttributes() &&
+        !m_Filter.MatchAttributes(iSize, tModify)) return true;
+
+    ++iFiles;
+    if (!m_Handler.OnDirEntry(sRelDir, pName, iNameLen, iSize, tModify))
+    {
+        m_bStop = true;
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _DirScanner_H_
+#define _DirScanner_H_
+
+#include <string>
+#include <vector>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+
+#include "FileFilter.h"
+
+/* receives the regular files accepted by the filter; sRelDir is the
+   directory below the root with a trailing '/', "" for the root itself.
+   With more than one thread this is called concurrently. Return false
+   to stop the scan */
+class DirScanHandler
+{
+public:
+    virtual ~DirScanHandler(){}
+
+    virtual bool OnDirEntry(
+        const std::string &sRelDir,
+        const char *pName,
+        size_t iNameLen,
+        Poco::Int64 iSize,
+        Poco::Timestamp::TimeVal tModify) = 0;
+
+    /* polled between entries, true stops the scan like Stop() */
+    virtual bool IsStopped(){ return false; }
+};
+
+/* directory walk that reads the entry type straight from the directory
+   (getdents64 on Linux, FindFirstFileEx on Windows), matches the bare
+   name before anything else and stats only the files that pass */
+class DirScanner
+{
+public:
+    /* bNeedStat = false reports iSize -1 / tModify 0 unless the filter
+       itself has size or time limits */
+    DirScanner(
+        const FileFilter &filter,
+        DirScanHandler &handler,
+        bool bNeedStat = true);
+
+    /* subdirectories are spread over iThreads workers when bRecursive */
+    bool Scan(
+        const std::string &sRoot,
+        bool bRecursive = false,
+        int iThreads = 1);
+
+    /* may be called from any thread, Scan() returns soon after */
+    void Stop();
+
+    Poco::UInt64 GetFileCount() const;
+
+    Poco::UInt64 GetDirCount() const;
+
+private:
+    void WorkLoop();
+
+    /* Stop() was called or the handler asks to stop */
+    bool IsStopped();
+
+    /* false if the directory could not be opened */
+    bool ScanOne(const std::string &sRelDir,
+        std::vector<std::string> &vectSubDirs,
+        Poco::UInt64 &iFiles);
+
+#if !defined(_WIN32)
+    /* false once the handler asked to stop */
+    bool ScanEntry(int iDirFd, const std::string &sRelDir,
+        const char *pName, unsigned char iType,
+        std::vector<std::string> &vectSubDirs,
+        Poco::UInt64 &iFiles);
+#endif
+
+    DirScanner(const DirScanner &rhs);
+
+    DirScanner & operator=(const DirScanner &rhs);
+
+private:
+    const FileFilter &m_Filter;
+    DirScanHandler &m_Handler;
+    bool m_bNeedStat;
+    bool m_bRecursive;
+    std::string m_sRoot;
+
+    /* directories still to read and how many workers are busy */
+    std::vector<std::string> m_vectPending;
+    int m_iBusy;
+    volatile bool m_bStop;
+    bool m_bFailed;
+    Poco::UInt64 m_iFileCount;
+    Poco::UInt64 m_iDirCount;
+    mutable Poco::FastMutex m_Mutex;
+    Poco::Condition m_WorkReady;
+};
+
+#endif // _DirScanner_H_
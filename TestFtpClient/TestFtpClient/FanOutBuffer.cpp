@@ -0,0 +1,268 @@
+#include <string.h>
+#include <algorithm>
+#include <Poco/ScopedUnlock.h>
+
+#include "FanOutBuffer.h"
+
+namespace // anonymous namespace begin
+{
+    /* how long a full window waits for the readers at its start */
+    const Poco::Timestamp::TimeDiff DETACH_WAIT_US = 1000 * 1000;
+    const long FREED_POLL_MS = 50;
+    const long LOADED_POLL_MS = 50;
+
+    int _SeekFile(FILE *pFileHandle, Poco::Int64 iOffset)
+    {
+#if defined(_MSC_VER)
+        return _fseeki64(pFileHandle, iOffset, SEEK_SET);
+#else
+        return fseeko(pFileHandle, (off_t)iOffset, SEEK_SET);
+#endif
+    }
+} // anonymous namespace end
+
+FanOutBuffer::FanOutBuffer(
+    const std::string &sPath,
+    int iReaders,
+    size_t iBlockSize/* = 256 * 1024*/,
+    size_t iMaxBlocks/* = 64*/)
+: m_sPath(sPath)
+, m_iBlockSize(std::max(iBlockSize, (size_t)1))
+, m_iMaxBlocks(std::max(iMaxBlocks, (size_t)1))
+, m_pFileHandle(NULL)
+, m_Blocks()
+, m_iFirstBlock(0)
+, m_bEof(false)
+, m_bError(false)
+, m_bLoading(false)
+, m_bFull(false)
+, m_tFull()
+, m_vectReaders(std::max(iReaders, 0))
+{
+}
+
+FanOutBuffer::~FanOutBuffer()
+{
+    for (size_t i = 0; i < m_vectReaders.size(); ++i)
+    {
+        if (m_vectReaders[i].pFileHandle != NULL)
+        {
+            fclose(m_vectReaders[i].pFileHandle);
+        }
+    }
+    if (m_pFileHandle != NULL)
+    {
+        fclose(m_pFileHandle);
+    }
+}
+
+bool FanOutBuffer::Open()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    if (m_pFileHandle == NULL)
+    {
+        m_pFileHandle = fopen(m_sPath.c_str(), "rb");
+        if (m_pFileHandle == NULL)
+        {
+            perror(NULL);
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t FanOutBuffer::Read(int iReader, void *pData, size_t iSize)
+{
+    FILE *pFileHandle = NULL;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Reader &reader = m_vectReaders[iReader];
+        if (reader.bDone)
+        {
+            return 0;
+        }
+        while (!reader.bDetached)
+        {
+            Poco::Int64 iBlock = reader.iPos / (Poco::Int64)m_iBlockSize;
+            if (iBlock < m_iFirstBlock + (Poco::Int64)m_Blocks.size())
+            {
+                const std::vector<char> &block =
+                    m_Blocks[(size_t)(iBlock - m_iFirstBlock)];
+                size_t iOffset = (size_t)(reader.iPos % m_iBlockSize);
+                size_t iCopy = iOffset < block.size() ?
+                    std::min(iSize, block.size() - iOffset) : 0;
+                if (iCopy > 0)
+                {
+                    memcpy(pData, &block[iOffset], iCopy);
+                    reader.iPos += iCopy;
+                    TrimLocked();
+                }
+                return iCopy;
+            }
+            if (m_bEof || m_bError)
+            {
+                return m_bError ? (size_t)-1 : 0;
+            }
+            if (m_Blocks.size() >= m_iMaxBlocks)
+            {
+                Poco::Timestamp now;
+                if (!m_bFull)
+                {
+                    m_bFull = true;
+                    m_tFull = now;
+                }
+                if (now - m_tFull < DETACH_WAIT_US)
+                {
+                    m_Freed.tryWait(m_Mutex, FREED_POLL_MS);
+                    continue;
+                }
+                /* still full, whoever keeps its first block falls back
+                   to the disk */
+                for (size_t i = 0; i < m_vectReaders.size(); ++i)
+                {
+                    Reader &other = m_vectReaders[i];
+                    if (!other.bDone && !other.bDetached &&
+                        other.iPos / (Poco::Int64)m_iBlockSize ==
+                        m_iFirstBlock)
+                    {
+                        DetachLocked(other);
+                    }
+                }
+                TrimLocked();
+            }
+            else if (m_bLoading)
+            {
+                /* another reader is at the disk for this block */
+                m_Loaded.tryWait(m_Mutex, LOADED_POLL_MS);
+            }
+            else
+            {
+                LoadLocked();
+            }
+        }
+        pFileHandle = reader.pFileHandle;
+    }
+
+    /* detached, its own handle is only used by its own thread */
+    if (pFileHandle == NULL)
+    {
+        return (size_t)-1;
+    }
+    size_t iRead = fread(pData, 1, iSize, pFileHandle);
+    if (iRead < iSize && ferror(pFileHandle))
+    {
+        return (size_t)-1;
+    }
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_vectReaders[iReader].iPos += iRead;
+    return iRead;
+}
+
+void FanOutBuffer::Seek(int iReader, Poco::Int64 iPos)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Reader &reader = m_vectReaders[iReader];
+    reader.iPos = iPos;
+    if (!reader.bDetached &&
+        iPos / (Poco::Int64)m_iBlockSize < m_iFirstBlock)
+    {
+        DetachLocked(reader);
+    }
+    else if (reader.bDetached && reader.pFileHandle != NULL)
+    {
+        _SeekFile(reader.pFileHandle, iPos);
+        clearerr(reader.pFileHandle);
+    }
+    TrimLocked();
+}
+
+void FanOutBuffer::Done(int iReader)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Reader &reader = m_vectReaders[iReader];
+    reader.bDone = true;
+    if (reader.pFileHandle != NULL)
+    {
+        fclose(reader.pFileHandle);
+        reader.pFileHandle = NULL;
+    }
+    TrimLocked();
+}
+
+bool FanOutBuffer::IsDetached(int iReader)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectReaders[iReader].bDetached;
+}
+
+bool FanOutBuffer::LoadLocked()
+{
+    if (m_pFileHandle == NULL)
+    {
+        m_bError = true;
+        return false;
+    }
+    m_bLoading = true;
+    std::vector<char> block(m_iBlockSize);
+    size_t iRead = 0;
+    bool bError = false;
+    {
+        Poco::ScopedUnlock<Poco::FastMutex> u(m_Mutex);
+        iRead = fread(&block[0], 1, m_iBlockSize, m_pFileHandle);
+        bError = iRead < m_iBlockSize && ferror(m_pFileHandle) != 0;
+    }
+    m_bLoading = false;
+    m_Loaded.broadcast();
+    if (iRead < m_iBlockSize)
+    {
+        m_bError = bError;
+        m_bEof = true;
+    }
+    if (iRead == 0)
+    {
+        return false;
+    }
+    block.resize(iRead);
+    m_Blocks.push_back(std::vector<char>());
+    m_Blocks.back().swap(block);
+    return true;
+}
+
+void FanOutBuffer::TrimLocked()
+{
+    /* the blocks loaded so far if nobody reads from memory any more */
+    Poco::Int64 iKeep = m_iFirstBlock + (Poco::Int64)m_Blocks.size();
+    for (size_t i = 0; i < m_vectReaders.size(); ++i)
+    {
+        const Reader &reader = m_vectReaders[i];
+        if (!reader.bDone && !reader.bDetached)
+        {
+            iKeep = std::min(iKeep,
+                reader.iPos / (Poco::Int64)m_iBlockSize);
+        }
+    }
+    bool bFreed = false;
+    while (m_iFirstBlock < iKeep && !m_Blocks.empty())
+    {
+        m_Blocks.pop_front();
+        ++m_iFirstBlock;
+        bFreed = true;
+    }
+    if (bFreed)
+    {
+        m_bFull = m_bFull && m_Blocks.size() > m_iMaxBlocks * 3 / 4;
+        m_Freed.broadcast();
+    }
+}
+
+void FanOutBuffer::DetachLocked(Reader &reader)
+{
+    reader.bDetached = true;
+    reader.pFileHandle = fopen(m_sPath.c_str(), "rb");
+    if (reader.pFileHandle == NULL)
+    {
+        perror(NULL);
+        return;
+    }
+    _SeekFile(reader.pFileHandle, reader.iPos);
+}
@@ -0,0 +1,93 @@
+#ifndef _FanOutBuffer_H_
+#define _FanOutBuffer_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+
+/* one local file read from disk once for several uploads of it. Blocks
+   stay in memory until every reader got them, up to iMaxBlocks. When a
+   reader ahead needs a new block and the window stays full for a
+   second, the readers still at its first block are detached and go on
+   reading the file by themselves, so a slow server neither holds back
+   the others nor makes the buffer grow */
+class FanOutBuffer
+{
+public:
+    FanOutBuffer(const std::string &sPath, int iReaders,
+        size_t iBlockSize = 256 * 1024, size_t iMaxBlocks = 64);
+
+    ~FanOutBuffer();
+
+    /* false if the file cannot be read */
+    bool Open();
+
+    /* the next bytes of the file for iReader, 0 at the end of the file,
+       (size_t)-1 if reading failed */
+    size_t Read(int iReader, void *pData, size_t iSize);
+
+    /* back to iPos for another attempt, a block no longer held means
+       reading by itself from then on */
+    void Seek(int iReader, Poco::Int64 iPos);
+
+    /* no more reads from iReader, the blocks it held are released */
+    void Done(int iReader);
+
+    bool IsDetached(int iReader);
+
+private:
+    struct Reader
+    {
+        Reader()
+        : iPos(0)
+        , pFileHandle(NULL)
+        , bDetached(false)
+        , bDone(false){}
+
+        Poco::Int64 iPos;
+        /* its own, once detached */
+        FILE *pFileHandle;
+        bool bDetached;
+        bool bDone;
+    };
+
+    /* the next block from disk, false at the end or on an error. Called
+       locked, the lock is let go during the read so the readers of the
+       blocks in memory go on; one load at a time */
+    bool LoadLocked();
+
+    /* drop the blocks every attached reader is past */
+    void TrimLocked();
+
+    void DetachLocked(Reader &reader);
+
+    FanOutBuffer(const FanOutBuffer &rhs);
+
+    FanOutBuffer & operator=(const FanOutBuffer &rhs);
+
+private:
+    std::string m_sPath;
+    size_t m_iBlockSize;
+    size_t m_iMaxBlocks;
+    FILE *m_pFileHandle;
+    std::deque<std::vector<char> > m_Blocks;
+    /* the block number of m_Blocks.front() */
+    Poco::Int64 m_iFirstBlock;
+    bool m_bEof;
+    bool m_bError;
+    bool m_bLoading;
+    /* since when the window is full, until it is a quarter empty */
+    bool m_bFull;
+    Poco::Timestamp m_tFull;
+    std::vector<Reader> m_vectReaders;
+    Poco::FastMutex m_Mutex;
+    Poco::Condition m_Freed;
+    Poco::Condition m_Loaded;
+};
+
+#endif // _FanOutBuffer_H_
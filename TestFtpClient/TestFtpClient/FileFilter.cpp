@@ -0,0 +1,361 @@
+#include <string.h>
+
+#include "FileFilter.h"
+
+namespace // anonymous namespace begin
+{
+    inline char _Fold(char c, bool bCaseSensitive)
+    {
+        if (!bCaseSensitive && c >= 'A' && c <= 'Z')
+        {
+            return (char)(c + ('a' - 'A'));
+        }
+        return c;
+    }
+
+    std::string _FoldString(const std::string &sValue, bool bCaseSensitive)
+    {
+        std::string sResult(sValue);
+        for (size_t i = 0; i < sResult.size(); ++i)
+        {
+            sResult[i] = _Fold(sResult[i], bCaseSensitive);
+        }
+        return sResult;
+    }
+
+    bool _EqualsFolded(
+        const char *pName,
+        const std::string &sFolded,
+        bool bCaseSensitive)
+    {
+        for (size_t i = 0; i < sFolded.size(); ++i)
+        {
+            if (_Fold(pName[i], bCaseSensitive) != sFolded[i]) return false;
+        }
+        return true;
+    }
+
+    /* FNV-1a over the folded bytes */
+    size_t _HashFolded(const char *pData, size_t iLen, bool bCaseSensitive)
+    {
+        unsigned int iHash = 2166136261u;
+        for (size_t i = 0; i < iLen; ++i)
+        {
+            iHash ^= (unsigned char)_Fold(pData[i], bCaseSensitive);
+            iHash *= 16777619u;
+        }
+        return iHash;
+    }
+
+    /* match one pattern element at p against c, p advances past it */
+    bool _MatchOne(
+        const char *&p,
+        const char *pEnd,
+        char c,
+        bool bCaseSensitive)
+    {
+        if (*p == '?')
+        {
+            ++p;
+            return true;
+        }
+        if (*p == '[')
+        {
+            const char *pClose = p + 1;
+            if (pClose != pEnd && (*pClose == '!' || *pClose == '^')) ++pClose;
+            if (pClose != pEnd && *pClose == ']') ++pClose;
+            while (pClose != pEnd && *pClose != ']') ++pClose;
+            if (pClose != pEnd)
+            {
+                const char *q = p + 1;
+                bool bNegate = (*q == '!' || *q == '^');
+                if (bNegate) ++q;
+                bool bFound = false;
+                char cFolded = _Fold(c, bCaseSensitive);
+                while (q != pClose)
+                {
+                    if (q + 2 < pClose && q[1] == '-')
+                    {
+                        bFound = bFound || (cFolded >= q[0] && cFolded <= q[2]);
+                        q += 3;
+                    }
+                    else
+                    {
+                        bFound = bFound || (cFolded == *q);
+                        ++q;
+                    }
+                }
+                p = pClose + 1;
+                return bFound != bNegate;
+            }
+            /* unterminated set, take '[' literally */
+        }
+        return *p++ == _Fold(c, bCaseSensitive);
+    }
+
+    bool _MatchGlobGeneral(
+        const char *p,
+        const char *pEnd,
+        const char *s,
+        const char *sEnd,
+        bool bCaseSensitive)
+    {
+        const char *pStar = NULL;
+        const char *sStar = NULL;
+        while (s != sEnd)
+        {
+            if (p != pEnd && *p == '*')
+            {
+                pStar = ++p;
+                sStar = s;
+                continue;
+            }
+            const char *pNext = p;
+            if (p != pEnd && _MatchOne(pNext, pEnd, *s, bCaseSensitive))
+            {
+                p = pNext;
+                ++s;
+                continue;
+            }
+            if (pStar != NULL)
+            {
+                /* let the last star swallow one more character */
+                p = pStar;
+                s = ++sStar;
+                continue;
+            }
+            return false;
+        }
+        while (p != pEnd && *p == '*') ++p;
+        return p == pEnd;
+    }
+} // anonymous namespace end
+
+FileFilter::FileFilter()
+: m_vectRules()
+, m_bHasInclude(false)
+, m_iMinSize(0)
+, m_iMaxSize(-1)
+, m_tFrom(Poco::Timestamp::TIMEVAL_MIN)
+, m_tTo(Poco::Timestamp::TIMEVAL_MAX)
+{
+}
+
+void FileFilter::AddGlob(
+    const std::string &sPattern,
+    bool bInclude/* = true*/,
+    bool bCaseSensitive/* = false*/)
+{
+    Rule rule;
+    rule.eKind = GlobRule;
+    rule.bInclude = bInclude;
+    rule.bCaseSensitive = bCaseSensitive;
+    rule.sPattern = _FoldString(sPattern, bCaseSensitive);
+
+    /* the common shapes reduce to a plain compare */
+    std::string::size_type iWild = rule.sPattern.find_first_of("*?[");
+    std::string::size_type iLastWild = rule.sPattern.find_last_of("*?[");
+    if (rule.sPattern == "*")
+    {
+        rule.eGlob = GlobAny;
+    }
+    else if (iWild == std::string::npos)
+    {
+        rule.eGlob = GlobLiteral;
+    }
+    else if (iWild == rule.sPattern.size() - 1 && rule.sPattern[iWild] == '*')
+    {
+        rule.eGlob = GlobPrefix;
+        rule.sPattern.erase(iWild);
+    }
+    else if (iWild == 0 && iLastWild == 0 && rule.sPattern[0] == '*')
+    {
+        rule.eGlob = GlobSuffix;
+        rule.sPattern.erase(0, 1);
+    }
+    else
+    {
+        rule.eGlob = GlobGeneral;
+    }
+
+    m_vectRules.push_back(rule);
+    m_bHasInclude = m_bHasInclude || bInclude;
+}
+
+void FileFilter::AddRegex(
+    const std::string &sPattern,
+    bool bInclude/* = true*/,
+    bool bCaseSensitive/* = true*/)
+{
+    Rule rule;
+    rule.eKind = RegexRule;
+    rule.bInclude = bInclude;
+    rule.bCaseSensitive = bCaseSensitive;
+    rule.eGlob = GlobGeneral;
+    rule.sPattern = sPattern;
+    rule.pRegex = new Poco::RegularExpression(sPattern,
+        bCaseSensitive ? 0 : Poco::RegularExpression::RE_CASELESS);
+
+    m_vectRules.push_back(rule);
+    m_bHasInclude = m_bHasInclude || bInclude;
+}
+
+void FileFilter::AddExtensions(
+    const std::vector<std::string> &vectExt,
+    bool bInclude/* = true*/,
+    bool bCaseSensitive/* = false*/)
+{
+    Rule rule;
+    rule.eKind = ExtensionRule;
+    rule.bInclude = bInclude;
+    rule.bCaseSensitive = bCaseSensitive;
+    rule.eGlob = GlobGeneral;
+
+    size_t iSlots = 8;
+    while (iSlots < vectExt.size() * 2) iSlots *= 2;
+    rule.vectSlots.resize(iSlots);
+    rule.vectSlotUsed.resize(iSlots, 0);
+    for (size_t i = 0; i < vectExt.size(); ++i)
+    {
+        std::string sExt = _FoldString(vectExt[i], bCaseSensitive);
+        size_t iSlot = _HashFolded(sExt.data(), sExt.size(), true)
+            & (iSlots - 1);
+        while (rule.vectSlotUsed[iSlot] && rule.vectSlots[iSlot] != sExt)
+        {
+            iSlot = (iSlot + 1) & (iSlots - 1);
+        }
+        rule.vectSlots[iSlot] = sExt;
+        rule.vectSlotUsed[iSlot] = 1;
+    }
+
+    m_vectRules.push_back(rule);
+    m_bHasInclude = m_bHasInclude || bInclude;
+}
+
+void FileFilter::SetSizeRange(
+    Poco::Int64 iMinSize,
+    Poco::Int64 iMaxSize/* = -1*/)
+{
+    m_iMinSize = iMinSize;
+    m_iMaxSize = iMaxSize;
+}
+
+void FileFilter::SetModifiedRange(
+    const Poco::Timestamp &tFrom,
+    const Poco::Timestamp &tTo/* = Poco::Timestamp::TIMEVAL_MAX*/)
+{
+    m_tFrom = tFrom.epochMicroseconds();
+    m_tTo = tTo.epochMicroseconds();
+}
+
+bool FileFilter::NeedsAttributes() const
+{
+    return m_iMinSize > 0 || m_iMaxSize >= 0 ||
+        m_tFrom != Poco::Timestamp::TIMEVAL_MIN ||
+        m_tTo != Poco::Timestamp::TIMEVAL_MAX;
+}
+
+bool FileFilter::MatchName(const char *pName, size_t iNameLen) const
+{
+    for (size_t i = 0; i < m_vectRules.size(); ++i)
+    {
+        if (MatchRule(m_vectRules[i], pName, iNameLen))
+        {
+            return m_vectRules[i].bInclude;
+        }
+    }
+    return !m_bHasInclude;
+}
+
+bool FileFilter::MatchName(const std::string &sName) const
+{
+    return MatchName(sName.data(), sName.size());
+}
+
+bool FileFilter::MatchAttributes(
+    Poco::Int64 iSize,
+    Poco::Timestamp::TimeVal tModify) const
+{
+    return iSize >= m_iMinSize &&
+        (m_iMaxSize < 0 || iSize <= m_iMaxSize) &&
+        tModify >= m_tFrom && tModify <= m_tTo;
+}
+
+FileFilter FileFilter::FromExtensions(
+    const std::vector<std::string> &vectMatch,
+    bool bMatch)
+{
+    FileFilter filter;
+    filter.AddExtensions(vectMatch, bMatch, true);
+    return filter;
+}
+
+bool FileFilter::MatchRule(
+    const Rule &rule,
+    const char *pName,
+    size_t iNameLen) const
+{
+    switch (rule.eKind)
+    {
+    case GlobRule:
+        return MatchGlob(rule, pName, iNameLen);
+    case RegexRule:
+        return rule.pRegex->match(std::string(pName, iNameLen));
+    case ExtensionRule:
+        return MatchExtension(rule, pName, iNameLen);
+    default:
+        return false;
+    }
+}
+
+bool FileFilter::MatchGlob(
+    const Rule &rule,
+    const char *pName,
+    size_t iNameLen)
+{
+    const std::string &sPattern = rule.sPattern;
+    switch (rule.eGlob)
+    {
+    case GlobAny:
+        return true;
+    case GlobLiteral:
+        return iNameLen == sPattern.size() &&
+            _EqualsFolded(pName, sPattern, rule.bCaseSensitive);
+    case GlobPrefix:
+        return iNameLen >= sPattern.size() &&
+            _EqualsFolded(pName, sPattern, rule.bCaseSensitive);
+    case GlobSuffix:
+        return iNameLen >= sPattern.size() &&
+            _EqualsFolded(pName + iNameLen - sPattern.size(), sPattern,
+                rule.bCaseSensitive);
+    default:
+        return _MatchGlobGeneral(sPattern.data(),
+            sPattern.data() + sPattern.size(),
+            pName, pName + iNameLen, rule.bCaseSensitive);
+    }
+}
+
+bool FileFilter::MatchExtension(
+    const Rule &rule,
+    const char *pName,
+    size_t iNameLen)
+{
+    /* same split as Poco::Path::getExtension, after the last dot */
+    const char *pExt = pName + iNameLen;
+    while (pExt != pName && pExt[-1] != '.') --pExt;
+    size_t iExtLen = (pExt == pName) ? 0 : pName + iNameLen - pExt;
+
+    size_t iMask = rule.vectSlots.size() - 1;
+    size_t iSlot = _HashFolded(pExt, iExtLen, rule.bCaseSensitive) & iMask;
+    while (rule.vectSlotUsed[iSlot])
+    {
+        const std::string &sExt = rule.vectSlots[iSlot];
+        if (sExt.size() == iExtLen &&
+            _EqualsFolded(pExt, sExt, rule.bCaseSensitive))
+        {
+            return true;
+        }
+        iSlot = (iSlot + 1) & iMask;
+    }
+    return false;
+}
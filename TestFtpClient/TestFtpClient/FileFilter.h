@@ -0,0 +1,108 @@
+#ifndef _FileFilter_H_
+#define _FileFilter_H_
+
+#include <string>
+#include <vector>
+#include <Poco/SharedPtr.h>
+#include <Poco/Timestamp.h>
+#include <Poco/RegularExpression.h>
+
+/* file selection compiled once, evaluated on bare names and attributes;
+   include/exclude rules are tried in the order added and the first match
+   decides, a name no rule matches is taken only if there is no include
+   rule at all */
+class FileFilter
+{
+public:
+    FileFilter();
+
+    /* * and ? wildcards plus [abc] / [a-z] sets over the file name */
+    void AddGlob(
+        const std::string &sPattern,
+        bool bInclude = true,
+        bool bCaseSensitive = false);
+
+    /* the expression has to match the whole file name */
+    void AddRegex(
+        const std::string &sPattern,
+        bool bInclude = true,
+        bool bCaseSensitive = true);
+
+    /* extensions without the dot, "" stands for names without one */
+    void AddExtensions(
+        const std::vector<std::string> &vectExt,
+        bool bInclude = true,
+        bool bCaseSensitive = false);
+
+    /* iMaxSize < 0 means no upper bound */
+    void SetSizeRange(Poco::Int64 iMinSize, Poco::Int64 iMaxSize = -1);
+
+    void SetModifiedRange(
+        const Poco::Timestamp &tFrom,
+        const Poco::Timestamp &tTo = Poco::Timestamp::TIMEVAL_MAX);
+
+    /* the size / time limits need a stat of every candidate */
+    bool NeedsAttributes() const;
+
+    bool MatchName(const char *pName, size_t iNameLen) const;
+
+    bool MatchName(const std::string &sName) const;
+
+    bool MatchAttributes(
+        Poco::Int64 iSize,
+        Poco::Timestamp::TimeVal tModify) const;
+
+    /* the old vectMatch / bMatch extension rule, compared case-sensitive */
+    static FileFilter FromExtensions(
+        const std::vector<std::string> &vectMatch,
+        bool bMatch);
+
+private:
+    enum RuleKind
+    {
+        GlobRule,
+        RegexRule,
+        ExtensionRule,
+    };
+
+    enum GlobKind
+    {
+        GlobAny,
+        GlobLiteral,
+        GlobPrefix,
+        GlobSuffix,
+        GlobGeneral,
+    };
+
+    struct Rule
+    {
+        RuleKind eKind;
+        bool bInclude;
+        bool bCaseSensitive;
+        GlobKind eGlob;
+        std::string sPattern;
+        Poco::SharedPtr<Poco::RegularExpression> pRegex;
+        /* open addressing table of extensions, vectSlotUsed marks taken slots */
+        std::vector<std::string> vectSlots;
+        std::vector<char> vectSlotUsed;
+    };
+
+    bool MatchRule(const Rule &rule, const char *pName,
+        size_t iNameLen) const;
+
+    static bool MatchGlob(const Rule &rule, const char *pName,
+        size_t iNameLen);
+
+    static bool MatchExtension(const Rule &rule, const char *pName,
+        size_t iNameLen);
+
+private:
+    std::vector<Rule> m_vectRules;
+    bool m_bHasInclude;
+    Poco::Int64 m_iMinSize;
+    Poco::Int64 m_iMaxSize;
+    Poco::Timestamp::TimeVal m_tFrom;
+    Poco::Timestamp::TimeVal m_tTo;
+};
+
+#endif // _FileFilter_H_
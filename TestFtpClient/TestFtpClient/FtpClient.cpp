@@ -1,11 +1,69 @@
 #include <Poco/Path.h>
 #include <Poco/File.h>
-#include <Poco/DirectoryIterator.h>
+#include <Poco/Delegate.h>
+#include <Poco/Timespan.h>
+#include <Poco/ExpireLRUCache.h>
+#include <Poco/SingletonHolder.h>
+#include <Poco/URI.h>
+#include <algorithm>
+#include <set>
 
 #include "FtpClient.h"
+#include "DirScanner.h"
+#include "DataModeCache.h"
+#include "SocketTuner.h"
+#include "SessionPool.h"
+#include "PortManager.h"
+#include "HostHealth.h"
+#include "ConnectRacer.h"
+#include "RangeScheduler.h"
+#include "FanOutBuffer.h"
+#include "ControlChannel.h"
+#include "RelayBuffer.h"
+#include "UrlUtil.h"
 
 namespace // anonymous namespace begin
 {
+    int _SeekFile(FILE *pFileHandle, Poco::Int64 iOffset)
+    {
+#if defined(_MSC_VER)
+        return _fseeki64(pFileHandle, iOffset, SEEK_SET);
+#else
+        return fseeko(pFileHandle, (off_t)iOffset, SEEK_SET);
+#endif
+    }
+
+    Poco::Int64 _TellFile(FILE *pFileHandle)
+    {
+#if defined(_MSC_VER)
+        return _ftelli64(pFileHandle);
+#else
+        return (Poco::Int64)ftello(pFileHandle);
+#endif
+    }
+
+    bool _IsStopped(const void *pParam)
+    {
+        const FtpParam *pFtpParam = (const FtpParam *)pParam;
+        return pFtpParam->bCancel || pFtpParam->bYield ||
+            (pFtpParam->pTotal != NULL && pFtpParam->pTotal->bCancel);
+    }
+
+    /* the path of an ftp url as the commands take it: relative to the
+       login directory as curl has it, "%2F" first for an absolute one */
+    std::string _GetUrlPath(const std::string &sUrl)
+    {
+        std::string::size_type iBegin = sUrl.find("://");
+        iBegin = (iBegin == std::string::npos) ? 0 : iBegin + 3;
+        iBegin = sUrl.find('/', iBegin);
+        std::string sPath;
+        if (iBegin != std::string::npos)
+        {
+            Poco::URI::decode(sUrl.substr(iBegin + 1), sPath);
+        }
+        return sPath;
+    }
+
     /* read data to upload */
     size_t _ReadData(
         void *pData,
@@ -21,10 +79,36 @@ namespace // anonymous namespace begin
             return CURL_READFUNC_ABORT;
         }
 
-        size_t iRead = fread(pData, size, nmemb, pFileHandle) * size;
+        size_t iWant = size * nmemb;
+        if (pFtpParam->iReadRemain >= 0 &&
+            (Poco::Int64)iWant > pFtpParam->iReadRemain)
+        {
+            iWant = (size_t)pFtpParam->iReadRemain;
+        }
+        size_t iRead = fread(pData, 1, iWant, pFileHandle);
+        if (!RateLimiter::Instance().Acquire(pFtpParam->iRateJob,
+            pFtpParam->sHost, RateLimiter::Upload, iRead,
+            _IsStopped, pFtpParam))
+        {
+            return CURL_READFUNC_ABORT;
+        }
+        if (pFtpParam->bAdaptive)
+        {
+            ConcurrencyController::Instance().AddBytes(pFtpParam->sHost,
+                iRead);
+        }
         {
             Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
             pFtpParam->iCurSize += iRead;
+            if (pFtpParam->iReadRemain >= 0)
+            {
+                pFtpParam->iReadRemain -= iRead;
+            }
+        }
+        if (pFtpParam->pTotal != NULL)
+        {
+            Poco::FastMutex::ScopedLock l(pFtpParam->pTotal->theMutex);
+            pFtpParam->pTotal->iCurSize += iRead;
         }
 
         (pFtpParam->pClient->*(pFtpParam->pFunc))(pParam);
@@ -47,10 +131,17 @@ namespace // anonymous namespace begin
             return CURL_READFUNC_ABORT;
         }
 
+        /* a short count makes curl abort the transfer */
+        if (!RateLimiter::Instance().Acquire(pFtpParam->iRateJob,
+            pFtpParam->sHost, RateLimiter::Download, size * nmemb,
+            _IsStopped, pFtpParam))
+        {
+            return 0;
+        }
         size_t iWrite = fwrite(pData, size, nmemb, pFileHandle) * size;
         {
             Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
-            pFtpParam->iCurSize = ftell(pFileHandle);
+            pFtpParam->iCurSize = _TellFile(pFileHandle);
         }
 
         (pFtpParam->pClient->*(pFtpParam->pFunc))(pParam);
@@ -72,7 +163,8 @@ namespace // anonymous namespace begin
     bool _GetUrlFileSize(
         double &fileSize,
         const std::string &sUrl,
-        const std::string &sUserPwd)
+        const std::string &sUserPwd,
+        long *pFileTime = NULL)
     {
         CURL *pCurl = curl_easy_init();
         if (pCurl)
@@ -82,12 +174,23 @@ namespace // anonymous namespace begin
             curl_easy_setopt(pCurl, CURLOPT_NOBODY, 1L);
             curl_easy_setopt(pCurl, CURLOPT_HEADERFUNCTION, _ThrowAway);
             curl_easy_setopt(pCurl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+            if (pFileTime != NULL)
+            {
+                /* MDTM, -1 if the server does not tell */
+                curl_easy_setopt(pCurl, CURLOPT_FILETIME, 1L);
+            }
 
             CURLcode res = curl_easy_perform(pCurl);
             if (CURLE_OK == res)
             {
                 res = curl_easy_getinfo(pCurl,
                     CURLINFO_CONTENT_LENGTH_DOWNLOAD, &fileSize);
+                if (CURLE_OK == res && pFileTime != NULL)
+                {
+                    res = curl_easy_getinfo(pCurl, CURLINFO_FILETIME,
+                        pFileTime);
+                }
 
                 curl_easy_cleanup(pCurl);
                 return (CURLE_OK == res) && (fileSize > 0.0);
@@ -113,501 +216,3168 @@ namespace // anonymous namespace begin
         (void)ultotal;
         (void)ulnow;
         FtpParam *pFtpParam = (FtpParam *)pParam;
-        if (pFtpParam && pFtpParam->bCancel)
+        if (pFtpParam && _IsStopped(pFtpParam))
         {
             return -1;
         }
         return 0;
     }
 
-    bool _GetUploadTasksWithoutFilter(
-        const std::string &sLocalDirectory,
-        const std::string &sRemoteDirectory,
-        std::deque<std::pair<std::string, std::string> > & uploadTasks,
-        long &iTotalSize)
+    /* feed listing data to the parser as it arrives */
+    size_t _ParseData(
+        void *pData,
+        size_t size,
+        size_t nmemb,
+        void *pParam)
     {
-        iTotalSize = 0;
-        std::string sUrlDirectory = sRemoteDirectory;
-//         if (sRemoteDirectory.back() != '/')
-//         {
-//             sUrlDirectory += "/";
-//         }
-        Poco::DirectoryIterator it(sLocalDirectory), end;
-        while (it != end)
-        {
-            if (it->isFile())
-            {
-                std::string sRemotePath = sUrlDirectory +
-                    Poco::Path(it->path()).getFileName();
-                uploadTasks.push_back(std::make_pair(sRemotePath,
-                    it->path()));
-                iTotalSize += (long)it->getSize();
-            }
-            ++it;
-        }
-
-        return !uploadTasks.empty();
+        FtpListParser *pParser = (FtpListParser *)pParam;
+        pParser->Feed((const char *)pData, size * nmemb);
+        return size * nmemb;
     }
 
-    bool _GetUploadTasksWithFilter(
-        const std::string &sLocalDirectory,
-        const std::string &sRemoteDirectory,
-        std::deque<std::pair<std::string, std::string> > & uploadTasks,
-        long &iTotalSize,
-        const std::vector<std::string> &vectMatch,
-        bool bMatch)
+    class ListCollector : public FtpListHandler
     {
-        iTotalSize = 0;
-        std::string sUrlDirectory = sRemoteDirectory;
-//         if (sRemoteDirectory.back() != '/')
-//         {
-//             sUrlDirectory += "/";
-//         }
-        Poco::DirectoryIterator it(sLocalDirectory), end;
-        while (it != end)
+    public:
+        explicit ListCollector(std::vector<FtpFileInfo> &vectEntries)
+        : m_vectEntries(vectEntries){}
+
+        void OnListEntry(const FtpListEntry &entry)
         {
-            if (!it->isFile())
-            {
-                ++it;
-                continue;
-            }
-            std::string sExt = Poco::Path(it->path()).getExtension();
-            if (bMatch)
-            {
-                for (int i = 0; i < vectMatch.size(); ++i)
-                {
-                    if (sExt == vectMatch[i])
-                    {
-                        std::string sRemotePath = sUrlDirectory +
-                            Poco::Path(it->path()).getFileName();
-                        uploadTasks.push_back(std::make_pair(sRemotePath,
-                            it->path()));
-                        iTotalSize += (long)it->getSize();
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                bool bNotHas = true;
-                for (int i = 0; i < vectMatch.size(); ++i)
-                {
-                    if (sExt == vectMatch[i])
-                    {
-                        bNotHas = false;
-                        break;
-                    }
-                }
-                if (bNotHas)
-                {
-                    std::string sRemotePath = sUrlDirectory +
-                        Poco::Path(it->path()).getFileName();
-                    uploadTasks.push_back(std::make_pair(sRemotePath,
-                        it->path()));
-                    iTotalSize += (long)it->getSize();
-                }
-            }
-            ++it;
+            m_vectEntries.push_back(FtpFileInfo());
+            FtpFileInfo &fileInfo = m_vectEntries.back();
+            fileInfo.sName.assign(entry.pName, entry.iNameLen);
+            fileInfo.eType = entry.eType;
+            fileInfo.iSize = entry.iSize;
+            fileInfo.tModify = entry.tModify;
         }
 
-        return !uploadTasks.empty();
-    }
-
-    void _GetProcessInfoWithLock(
-        FtpParam *pFtpParam,
-        std::string &sFileName,
-        long &iCurSize,
-        long &iTotalSize)
-    {
+        void OnListRestart()
         {
-            Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
-            sFileName = pFtpParam->sFileName;
-            iCurSize = pFtpParam->iCurSize;
-            iTotalSize = pFtpParam->iTotalSize;
+            m_vectEntries.clear();
         }
-        return;
-    }
-} // anonymous namespace end
-
-FtpClient::FtpClient(const std::string &sUserPwd/* = "admin:123456"*/)
-: Poco::Runnable()
-, Poco::Thread()
-, m_CallbackMutex()
-, m_sLocalPath()
-, m_sRemotePath()
-, m_sUserPwd(sUserPwd)
-, m_eCurOptMode(Unknown)
-, m_bOptResult(false)
-, m_bRoutineStart(false)
-{
-}
-
-FtpClient::~FtpClient()
-{
-    Cancel();
-    AwaitResult();
-}
 
-void FtpClient::SetUserPwd(const std::string &sUserPwd)
-{
-    m_sUserPwd = sUserPwd;
-}
+    private:
+        ListCollector & operator=(const ListCollector &rhs);
 
-const std::string FtpClient::GetUserPwd() const
-{
-    return m_sUserPwd;
-}
+        std::vector<FtpFileInfo> &m_vectEntries;
+    };
 
-bool FtpClient::RegisterObserver(ProgressObserver *observer)
-{
-    Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
-    if (std::find(m_Observers.begin(), m_Observers.end(), observer)
-        == m_Observers.end())
+    /* directory listings shared by all clients of this process */
+    class ListCache
+    : public Poco::ExpireLRUCache<std::string, std::vector<FtpFileInfo> >
     {
-        m_Observers.push_back(observer);
-        return true;
-    }
-    return false;
-}
+    public:
+        ListCache()
+        : Poco::ExpireLRUCache<std::string, std::vector<FtpFileInfo> >(
+            1024, 30000){}
+    };
 
-bool FtpClient::UnRegisterObserver(ProgressObserver *observer)
-{
-    Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
-    std::vector<ProgressObserver *>::iterator it =
-        std::find(m_Observers.begin(), m_Observers.end(), observer);
-    if (it != m_Observers.end())
+    ListCache &_GetListCache()
     {
-        m_Observers.erase(it);
-        return true;
+        static Poco::SingletonHolder<ListCache> sh;
+        return *sh.get();
     }
-    return false;
-}
 
-bool FtpClient::UploadFileSync(
-    const std::string &sRemotePath,
-    const std::string &sLocalPath,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (UploadFileAsync(sRemotePath, sLocalPath, sUserPwd))
+    /* servers that rejected MLSD, listed with LIST from then on by all
+       clients of this process */
+    class ListOnlyHosts
     {
-        return AwaitResult();
-    }
-    return false;
-}
+    public:
+        static ListOnlyHosts &Instance()
+        {
+            static Poco::SingletonHolder<ListOnlyHosts> sh;
+            return *sh.get();
+        }
 
-bool FtpClient::UploadFileAsync(
-    const std::string &sRemotePath,
-    const std::string &sLocalPath,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (SetStartState(sUserPwd, Upload))
-    {
-        if (!Poco::File(sLocalPath).exists() ||
-            !Poco::File(sLocalPath).isFile()) return false;
+        bool Contains(const std::string &sHost)
+        {
+            Poco::FastMutex::ScopedLock l(m_Mutex);
+            return m_Hosts.find(sHost) != m_Hosts.end();
+        }
 
-        m_UploadTasks.push_back(std::make_pair(sRemotePath, sLocalPath));
+        void Add(const std::string &sHost)
         {
-            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-            m_FtpParam.iTotalSize =
-                (long)Poco::File(sLocalPath).getSize();
+            Poco::FastMutex::ScopedLock l(m_Mutex);
+            m_Hosts.insert(sHost);
         }
-        Poco::Thread::start(*this);
-        return true;
-    }
-    fprintf(stderr, "Routine is Running\n");
-    return false;
-}
 
-bool FtpClient::UploadDirAllFilesAsync(
-    const std::string &sRemoteDirectory,
-    const std::string &sLocalDirectory,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (!Poco::File(sLocalDirectory).exists() ||
-        !Poco::Path(sLocalDirectory).isDirectory()) return false;
+    private:
+        std::set<std::string> m_Hosts;
+        Poco::FastMutex m_Mutex;
+    };
 
-    if (SetStartState(sUserPwd, Upload))
+    std::string _GetListCacheKey(
+        const std::string &sUserPwd,
+        const std::string &sUrlDirectory)
+    {
+        return sUserPwd.substr(0, sUserPwd.find(':')) + "@" + sUrlDirectory;
+    }
+
+    std::string _GetUrlDirectory(const std::string &sRemoteDirectory)
     {
+        if (!sRemoteDirectory.empty() &&
+            sRemoteDirectory[sRemoteDirectory.size() - 1] == '/')
         {
-            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-            _GetUploadTasksWithoutFilter(sLocalDirectory,
-                sRemoteDirectory, m_UploadTasks, m_FtpParam.iTotalSize);
+            return sRemoteDirectory;
         }
-        Poco::Thread::start(*this);
-        return true;
+        return sRemoteDirectory + "/";
     }
-    fprintf(stderr, "Routine is Running\n");
-    return false;
-}
-
-bool FtpClient::UploadDirMatchedFilesAsync(
-    const std::string &sRemoteDirectory,
-    const std::string &sLocalDirectory,
-    const std::vector<std::string> &vectMatch,
-    bool bMatch/* = true*/,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (!Poco::File(sLocalDirectory).exists() ||
-        !Poco::Path(sLocalDirectory).isDirectory()) return false;
 
-    if (SetStartState(sUserPwd, Upload))
+    /* drop cached listings of every directory above sRemotePath */
+    void _InvalidateListCache(
+        const std::string &sUserPwd,
+        const std::string &sRemotePath)
     {
+        std::string::size_type iRoot = sRemotePath.find("://");
+        iRoot = (iRoot == std::string::npos) ?
+            0 : sRemotePath.find('/', iRoot + 3);
+        if (iRoot == std::string::npos) return;
+
+        std::string::size_type iPos = sRemotePath.size();
+        while (iPos > iRoot)
         {
-            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-            _GetUploadTasksWithFilter(sLocalDirectory, sRemoteDirectory,
-                m_UploadTasks, m_FtpParam.iTotalSize, vectMatch, bMatch);
+            iPos = sRemotePath.rfind('/', iPos - 1);
+            if (iPos == std::string::npos || iPos < iRoot) break;
+            _GetListCache().remove(_GetListCacheKey(sUserPwd,
+                sRemotePath.substr(0, iPos + 1)));
         }
-        Poco::Thread::start(*this);
-        return true;
     }
-    fprintf(stderr, "Routine is Running\n");
-    return false;
-}
 
-bool FtpClient::DownloadFileSync(
-    const std::string &sRemotePath,
-    const std::string &sLocalPath,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (DownloadFileAsync(sRemotePath, sLocalPath, sUserPwd))
+    bool _LessByName(const FtpFileInfo &lhs, const FtpFileInfo &rhs)
     {
-        return AwaitResult();
+        return lhs.sName < rhs.sName;
     }
-    return false;
-}
 
-bool FtpClient::DownloadFileAsync(
-    const std::string &sRemotePath,
-    const std::string &sLocalPath,
-    const std::string &sUserPwd/* = ""*/)
-{
-    if (SetStartState(sUserPwd, Download))
+    /* bRaced: curl connects data to the address it resolved, which may
+       not be the server ConnectRacer picked; a PASV reply names it */
+    void _ApplyDataMode(CURL *pCurl, DataModeCache::Mode eMode, bool bRaced)
     {
-        m_sRemotePath = sRemotePath;
-        m_sLocalPath = sLocalPath;
-        Poco::Thread::start(*this);
-        return true;
+        switch (eMode)
+        {
+        case DataModeCache::Pasv:
+            curl_easy_setopt(pCurl, CURLOPT_FTPPORT, (char *)NULL);
+            curl_easy_setopt(pCurl, CURLOPT_FTP_USE_EPSV, 0L);
+            break;
+        case DataModeCache::Port:
+            /* EPRT, PORT if the server does not know it */
+            curl_easy_setopt(pCurl, CURLOPT_FTPPORT,
+                PortManager::Instance().GetPortSpec().c_str());
+            curl_easy_setopt(pCurl, CURLOPT_FTP_USE_EPRT, 1L);
+            /* a firewall that drops the connect back fails late */
+            curl_easy_setopt(pCurl, CURLOPT_ACCEPTTIMEOUT_MS, 5000L);
+            break;
+        default:
+            /* a server that refuses EPSV gets PASV from curl itself */
+            curl_easy_setopt(pCurl, CURLOPT_FTPPORT, (char *)NULL);
+            curl_easy_setopt(pCurl, CURLOPT_FTP_USE_EPSV, bRaced ? 0L : 1L);
+            break;
+        }
     }
-    fprintf(stderr, "Routine is Running\n");
-    return false;
-}
 
-bool FtpClient::AwaitResult()
-{
-    try
+    /* errors a different data connection mode may get around; a timeout
+       only while connecting to the passive port, one after the data
+       connection was up is a stall of the transfer itself */
+    bool _IsDataModeError(CURLcode ret, long iResponse)
     {
-        while (m_bRoutineStart.Load() ||
-               Poco::Thread::isRunning())
+        switch (ret)
         {
-            Poco::Thread::yield();
+        case CURLE_OPERATION_TIMEDOUT:
+            return iResponse == 227 || iResponse == 229;
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_FTP_WEIRD_PASV_REPLY:
+        case CURLE_FTP_WEIRD_227_FORMAT:
+        case CURLE_FTP_CANT_GET_HOST:
+        case CURLE_FTP_PORT_FAILED:
+        case CURLE_FTP_ACCEPT_FAILED:
+        case CURLE_FTP_ACCEPT_TIMEOUT:
+            return true;
+        default:
+            return false;
         }
     }
-    catch (const std::exception &e)
+
+    /* the server could not be reached or refused the login; a reused
+       session that went stale is not held against it */
+    bool _IsHostDown(CURLcode ret, long iResponse, long iConnects)
     {
-        fprintf(stderr, "%s\n", e.what());
-        return false;
+        if (iResponse != 0)
+        {
+            return ret == CURLE_LOGIN_DENIED;
+        }
+        switch (ret)
+        {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+            return true;
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_FTP_WEIRD_SERVER_REPLY:
+            return iConnects > 0;
+        default:
+            return false;
+        }
     }
-    return !m_FtpParam.bCancel && m_bOptResult;
-}
 
-bool FtpClient::Cancel()
-{
-    if (m_bRoutineStart.Load())
+    /* the server went away or stalled in the middle of a download,
+       another one with the file can go on from where it stopped */
+    bool _IsFailover(CURLcode ret)
     {
-        m_FtpParam.bCancel = true;
-        return true;
+        switch (ret)
+        {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_FTP_ACCEPT_TIMEOUT:
+            return true;
+        default:
+            return false;
+        }
     }
 
-    return false;
-}
-
-bool FtpClient::SetStartState(
-    const std::string &sUserPwd,
-    OptMode eCurOptMode)
-{
-    bool bExpcted = false;
-    if (m_bRoutineStart.CompareExchange(bExpcted, true))
+    /* a replica may take over only if its copy is the same file, by
+       size and, when both servers tell it, modification time */
+    bool _IsSameFile(
+        const std::string &sUrl,
+        const std::string &sUserPwd,
+        double fileSize,
+        long iFileTime)
     {
-        if (!sUserPwd.empty())
+        if (HostHealth::Instance().GetState(UrlUtil::GetHost(sUrl)) ==
+            HostHealth::Open)
         {
-            m_sUserPwd = sUserPwd;
+            return false;
         }
-        m_eCurOptMode = eCurOptMode;
-
+        double fReplicaSize = 0.0;
+        long iReplicaTime = -1;
+        if (!_GetUrlFileSize(fReplicaSize, sUrl, sUserPwd, &iReplicaTime))
         {
-            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-            m_FtpParam.bCancel = false;
-            m_FtpParam.iCurSize = 0;
-            m_FtpParam.iTotalSize = 0;
+            return false;
+        }
+        if (fReplicaSize != fileSize ||
+            (iFileTime != -1 && iReplicaTime != -1 &&
+            iReplicaTime != iFileTime))
+        {
+            fprintf(stderr, "%s differs, not used\n", sUrl.c_str());
+            return false;
         }
-
         return true;
     }
+
+    /* puts the source of a transfer back before another attempt */
+    typedef void (*RewindFunc)(void *pParam);
+
+    /* curl_easy_perform with the socket policy and in the data
+       connection mode of sHost. While the mode is not fixed, an attempt
+       that reached the server but moved no data is repeated in the next
+       mode, the one that works is kept. Nothing is tried while the
+       circuit of sHost is open. pHostDown tells whether the failure was
+       taken as the server being down; pParam, if any, can stop a race
+       for the control connection */
+    CURLcode _PerformTransfer(
+        CURL *pCurl,
+        const std::string &sHost,
+        const FtpParam *pParam,
+        RewindFunc pRewind = NULL,
+        void *pRewindParam = NULL,
+        bool *pHostDown = NULL)
+    {
+        if (pHostDown != NULL)
+        {
+            *pHostDown = false;
+        }
+        DataModeCache &cache = DataModeCache::Instance();
+        bool bFixed = false;
+        DataModeCache::Mode eMode = cache.GetMode(sHost, bFixed);
+        if (eMode == DataModeCache::Auto)
+        {
+            eMode = DataModeCache::GetNextMode(eMode);
+        }
+        HostHealth &health = HostHealth::Instance();
+        if (!health.Allow(sHost))
+        {
+            fprintf(stderr, "%s is down, circuit open\n", sHost.c_str());
+            if (pHostDown != NULL)
+            {
+                *pHostDown = true;
+            }
+            return CURLE_COULDNT_CONNECT;
+        }
+        SocketTuner &tuner = SocketTuner::Instance();
+        SocketTuner::Context socketContext(sHost);
+        if (pParam != NULL)
+        {
+            socketContext.pStop = _IsStopped;
+            socketContext.pStopParam = pParam;
+        }
+        for (;;)
+        {
+            tuner.Prepare(pCurl, socketContext);
+            _ApplyDataMode(pCurl, eMode, socketContext.bRaced);
+            CURLcode ret = curl_easy_perform(pCurl);
+            tuner.ReportConnect(pCurl, sHost);
+            PortManager::Instance().AddConnection(
+                eMode == DataModeCache::Port);
+
+            /* without a reply the control connection itself failed */
+            long iResponse = 0;
+            long iConnects = 0;
+            curl_easy_getinfo(pCurl, CURLINFO_RESPONSE_CODE, &iResponse);
+            curl_easy_getinfo(pCurl, CURLINFO_NUM_CONNECTS, &iConnects);
+            bool bHostDown = _IsHostDown(ret, iResponse, iConnects);
+            if (pHostDown != NULL)
+            {
+                *pHostDown = bHostDown;
+            }
+            if (bHostDown)
+            {
+                health.ReportFailure(sHost);
+            }
+            else if (iResponse != 0)
+            {
+                health.ReportSuccess(sHost);
+            }
+            else
+            {
+                health.ReportAborted(sHost);
+            }
+
+            if (ret == CURLE_OK)
+            {
+                double fConnect = 0.0;
+                double fFirstByte = 0.0;
+                curl_easy_getinfo(pCurl, CURLINFO_CONNECT_TIME, &fConnect);
+                curl_easy_getinfo(pCurl, CURLINFO_STARTTRANSFER_TIME,
+                    &fFirstByte);
+                cache.ReportSuccess(sHost, eMode,
+                    std::max(fFirstByte - fConnect, 0.0) * 1000.0);
+                return ret;
+            }
+
+            double fUp = 0.0;
+            double fDown = 0.0;
+            curl_easy_getinfo(pCurl, CURLINFO_SIZE_UPLOAD, &fUp);
+            curl_easy_getinfo(pCurl, CURLINFO_SIZE_DOWNLOAD, &fDown);
+            if (!_IsDataModeError(ret, iResponse) || iResponse == 0 ||
+                fUp > 0.0 || fDown > 0.0)
+            {
+                return ret;
+            }
+            cache.ReportFailure(sHost, eMode);
+            DataModeCache::Mode eNext = bFixed ?
+                DataModeCache::Auto : DataModeCache::GetNextMode(eMode);
+            if (eNext == DataModeCache::Auto)
+            {
+                return ret;
+            }
+            fprintf(stderr, "%s in %s mode, trying %s\n",
+                curl_easy_strerror(ret), DataModeCache::GetName(eMode),
+                DataModeCache::GetName(eNext));
+            if (pRewind != NULL)
+            {
+                pRewind(pRewindParam);
+            }
+            eMode = eNext;
+        }
+    }
+
+    /* fetches the ranges one server gets of a multi-source download,
+       each written where it belongs in the shared local file */
+    class RangeWorker : public Poco::Runnable
+    {
+    public:
+        RangeWorker(
+            RangeScheduler &scheduler,
+            int iSource,
+            const std::string &sUrl,
+            const std::string &sUserPwd,
+            const std::string &sLocalPath,
+            FtpParam &totalParam)
+        : m_Scheduler(scheduler)
+        , m_iSource(iSource)
+        , m_sUrl(sUrl)
+        , m_sUserPwd(sUserPwd)
+        , m_sLocalPath(sLocalPath)
+        , m_FtpParam()
+        , m_bWriteFailed(false)
+        {
+            m_FtpParam.pClient = totalParam.pClient;
+            m_FtpParam.pFunc = totalParam.pFunc;
+            m_FtpParam.pTotal = &totalParam;
+            m_FtpParam.sFileName = totalParam.sFileName;
+            m_FtpParam.sHost = UrlUtil::GetHost(sUrl);
+            m_FtpParam.iRateJob = totalParam.iRateJob;
+        }
+
+        void run()
+        {
+            FILE *pFileHandle = fopen(m_sLocalPath.c_str(), "r+b");
+            if (pFileHandle == NULL)
+            {
+                perror(NULL);
+                m_bWriteFailed = true;
+                m_Scheduler.Fail(m_iSource);
+                return;
+            }
+            m_FtpParam.pFileHandle = pFileHandle;
+
+            SessionPool &pool = SessionPool::Instance();
+            CURL *pCurl = pool.Checkout(m_sUrl, m_sUserPwd);
+            curl_easy_setopt(pCurl, CURLOPT_URL, m_sUrl.c_str());
+            curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+            curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10L);
+            curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, WriteRange);
+            curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, this);
+            curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, Progress);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, this);
+
+            bool bReusable = true;
+            Poco::Int64 iBegin = 0;
+            Poco::Int64 iEnd = 0;
+            while (m_Scheduler.Next(m_iSource, iBegin, iEnd, _IsStopped,
+                &m_FtpParam))
+            {
+                char szRange[48];
+                sprintf(szRange, "%lld-%lld", (long long)iBegin,
+                    (long long)iEnd - 1);
+                curl_easy_setopt(pCurl, CURLOPT_RANGE, szRange);
+                _SeekFile(pFileHandle, iBegin);
+                CURLcode ret = _PerformTransfer(pCurl, m_FtpParam.sHost,
+                    &m_FtpParam);
+                /* a write error without a disk error: another source
+                   took over the rest of the range; stopped by Progress:
+                   it did so after this one stalled */
+                if (ret == CURLE_OK ||
+                    (ret == CURLE_WRITE_ERROR && !m_bWriteFailed) ||
+                    (ret == CURLE_ABORTED_BY_CALLBACK &&
+                    m_Scheduler.IsStalled(m_iSource)))
+                {
+                    continue;
+                }
+                fprintf(stderr, "%s from %s, its range goes to the others\n",
+                    curl_easy_strerror(ret), m_FtpParam.sHost.c_str());
+                bReusable = false;
+                m_Scheduler.Fail(m_iSource);
+                break;
+            }
+            pool.Checkin(pCurl, m_sUrl, m_sUserPwd, bReusable);
+            fclose(pFileHandle);
+        }
+
+        bool IsWriteFailed() const
+        {
+            return m_bWriteFailed;
+        }
+
+    private:
+        /* a stalled transfer gets no writes, this stops it once the
+           others took over */
+        static int Progress(
+            void *pParam,
+            double dltotal,
+            double dlnow,
+            double ultotal,
+            double ulnow)
+        {
+            RangeWorker *pWorker = (RangeWorker *)pParam;
+            if (pWorker->m_Scheduler.IsStalled(pWorker->m_iSource))
+            {
+                return -1;
+            }
+            return _Progress(&pWorker->m_FtpParam, dltotal, dlnow, ultotal,
+                ulnow);
+        }
+
+        static size_t WriteRange(
+            void *pData,
+            size_t size,
+            size_t nmemb,
+            void *pParam)
+        {
+            RangeWorker *pWorker = (RangeWorker *)pParam;
+            FtpParam &ftpParam = pWorker->m_FtpParam;
+            size_t iCount = size * nmemb;
+            if (!RateLimiter::Instance().Acquire(ftpParam.iRateJob,
+                ftpParam.sHost, RateLimiter::Download, iCount,
+                _IsStopped, &ftpParam))
+            {
+                return 0;
+            }
+            /* a short count stops the transfer where the range now ends */
+            size_t iKeep = pWorker->m_Scheduler.Claim(pWorker->m_iSource,
+                iCount);
+            if (fwrite(pData, 1, iKeep, ftpParam.pFileHandle) != iKeep)
+            {
+                pWorker->m_bWriteFailed = true;
+                return 0;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                ftpParam.iCurSize += (Poco::Int64)iKeep;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+                ftpParam.pTotal->iCurSize += (Poco::Int64)iKeep;
+            }
+
+            (ftpParam.pClient->*(ftpParam.pFunc))(&ftpParam);
+
+            return iKeep;
+        }
+
+        RangeWorker(const RangeWorker &rhs);
+
+        RangeWorker & operator=(const RangeWorker &rhs);
+
+    private:
+        RangeScheduler &m_Scheduler;
+        int m_iSource;
+        std::string m_sUrl;
+        std::string m_sUserPwd;
+        std::string m_sLocalPath;
+        FtpParam m_FtpParam;
+        volatile bool m_bWriteFailed;
+    };
+
+    /* uploads the shared file of a fan-out upload to one server */
+    class FanOutWorker : public Poco::Runnable
+    {
+    public:
+        FanOutWorker(
+            FanOutBuffer &buffer,
+            int iReader,
+            FanOutResult &result,
+            const std::string &sUserPwd,
+            Poco::Int64 iSize,
+            int iTimeout,
+            FtpParam &totalParam)
+        : m_Buffer(buffer)
+        , m_iReader(iReader)
+        , m_Result(result)
+        , m_sUserPwd(sUserPwd)
+        , m_iSize(iSize)
+        , m_iTimeout(iTimeout)
+        , m_FtpParam()
+        {
+            m_FtpParam.pClient = totalParam.pClient;
+            m_FtpParam.pFunc = totalParam.pFunc;
+            m_FtpParam.pTotal = &totalParam;
+            m_FtpParam.sFileName = totalParam.sFileName;
+            m_FtpParam.sHost = UrlUtil::GetHost(result.sRemotePath);
+            m_FtpParam.iRateJob = totalParam.iRateJob;
+        }
+
+        void run()
+        {
+            const std::string &sUrl = m_Result.sRemotePath;
+            SessionPool &pool = SessionPool::Instance();
+            CURL *pCurl = pool.Checkout(sUrl, m_sUserPwd);
+            curl_easy_setopt(pCurl, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(pCurl, CURLOPT_URL, sUrl.c_str());
+            curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+            if (m_iTimeout)
+            {
+                curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT,
+                    (long)m_iTimeout);
+            }
+            curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10L);
+            curl_easy_setopt(pCurl, CURLOPT_READFUNCTION, ReadShared);
+            curl_easy_setopt(pCurl, CURLOPT_READDATA, this);
+            curl_easy_setopt(pCurl, CURLOPT_INFILESIZE_LARGE,
+                (curl_off_t)m_iSize);
+            curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &m_FtpParam);
+            curl_easy_setopt(pCurl, CURLOPT_FTP_CREATE_MISSING_DIRS, 1L);
+
+            CURLcode ret = _PerformTransfer(pCurl, m_FtpParam.sHost,
+                &m_FtpParam, Rewind, this);
+            m_Buffer.Done(m_iReader);
+            m_Result.bResult = (ret == CURLE_OK);
+            if (ret != CURLE_OK)
+            {
+                m_Result.sError = curl_easy_strerror(ret);
+                fprintf(stderr, "%s: %s\n", sUrl.c_str(),
+                    m_Result.sError.c_str());
+            }
+            {
+                Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+                m_Result.iSent = m_FtpParam.iCurSize;
+            }
+            m_Result.bDetached = m_Buffer.IsDetached(m_iReader);
+            pool.Checkin(pCurl, sUrl, m_sUserPwd);
+        }
+
+    private:
+        static size_t ReadShared(
+            void *pData,
+            size_t size,
+            size_t nmemb,
+            void *pParam)
+        {
+            FanOutWorker *pWorker = (FanOutWorker *)pParam;
+            FtpParam &ftpParam = pWorker->m_FtpParam;
+            size_t iRead = pWorker->m_Buffer.Read(pWorker->m_iReader, pData,
+                size * nmemb);
+            if (iRead == (size_t)-1 ||
+                !RateLimiter::Instance().Acquire(ftpParam.iRateJob,
+                ftpParam.sHost, RateLimiter::Upload, iRead,
+                _IsStopped, &ftpParam))
+            {
+                return CURL_READFUNC_ABORT;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                ftpParam.iCurSize += (Poco::Int64)iRead;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+                ftpParam.pTotal->iCurSize += (Poco::Int64)iRead;
+            }
+
+            (ftpParam.pClient->*(ftpParam.pFunc))(&ftpParam);
+
+            return iRead;
+        }
+
+        /* another data connection mode starts over from the beginning */
+        static void Rewind(void *pParam)
+        {
+            FanOutWorker *pWorker = (FanOutWorker *)pParam;
+            FtpParam &ftpParam = pWorker->m_FtpParam;
+            pWorker->m_Buffer.Seek(pWorker->m_iReader, 0);
+            Poco::Int64 iResent = 0;
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                iResent = ftpParam.iCurSize;
+                ftpParam.iCurSize = 0;
+            }
+            Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+            ftpParam.pTotal->iCurSize -= iResent;
+        }
+
+        FanOutWorker(const FanOutWorker &rhs);
+
+        FanOutWorker & operator=(const FanOutWorker &rhs);
+
+    private:
+        FanOutBuffer &m_Buffer;
+        int m_iReader;
+        FanOutResult &m_Result;
+        std::string m_sUserPwd;
+        Poco::Int64 m_iSize;
+        int m_iTimeout;
+        FtpParam m_FtpParam;
+    };
+
+    /* uploads what the other side of a relayed copy downloads */
+    class RelayUploader : public Poco::Runnable
+    {
+    public:
+        RelayUploader(
+            RelayBuffer &buffer,
+            const std::string &sUrl,
+            const std::string &sUserPwd,
+            Poco::Int64 iSize,
+            int iTimeout,
+            FtpParam &totalParam)
+        : m_Buffer(buffer)
+        , m_sUrl(sUrl)
+        , m_sUserPwd(sUserPwd)
+        , m_iSize(iSize)
+        , m_iTimeout(iTimeout)
+        , m_FtpParam()
+        , m_bResult(false)
+        {
+            m_FtpParam.pClient = totalParam.pClient;
+            m_FtpParam.pFunc = totalParam.pFunc;
+            m_FtpParam.pTotal = &totalParam;
+            m_FtpParam.sFileName = totalParam.sFileName;
+            m_FtpParam.sHost = UrlUtil::GetHost(sUrl);
+            m_FtpParam.iRateJob = totalParam.iRateJob;
+        }
+
+        void run()
+        {
+            SessionPool &pool = SessionPool::Instance();
+            CURL *pCurl = pool.Checkout(m_sUrl, m_sUserPwd);
+            curl_easy_setopt(pCurl, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(pCurl, CURLOPT_URL, m_sUrl.c_str());
+            curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+            if (m_iTimeout)
+            {
+                curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT,
+                    (long)m_iTimeout);
+            }
+            curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10L);
+            curl_easy_setopt(pCurl, CURLOPT_READFUNCTION, ReadRelay);
+            curl_easy_setopt(pCurl, CURLOPT_READDATA, this);
+            if (m_iSize >= 0)
+            {
+                curl_easy_setopt(pCurl, CURLOPT_INFILESIZE_LARGE,
+                    (curl_off_t)m_iSize);
+            }
+            curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
+            curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &m_FtpParam);
+            curl_easy_setopt(pCurl, CURLOPT_FTP_CREATE_MISSING_DIRS, 1L);
+
+            CURLcode ret = _PerformTransfer(pCurl, m_FtpParam.sHost,
+                &m_FtpParam, Rewind, this);
+            m_bResult = (ret == CURLE_OK);
+            if (ret != CURLE_OK)
+            {
+                fprintf(stderr, "%s: %s\n", m_sUrl.c_str(),
+                    curl_easy_strerror(ret));
+                /* the download stops at its next write */
+                m_Buffer.Abort();
+            }
+            pool.Checkin(pCurl, m_sUrl, m_sUserPwd);
+        }
+
+        bool GetResult() const
+        {
+            return m_bResult;
+        }
+
+    private:
+        static size_t ReadRelay(
+            void *pData,
+            size_t size,
+            size_t nmemb,
+            void *pParam)
+        {
+            RelayUploader *pWorker = (RelayUploader *)pParam;
+            FtpParam &ftpParam = pWorker->m_FtpParam;
+            size_t iRead = pWorker->m_Buffer.Read(pData, size * nmemb,
+                _IsStopped, &ftpParam);
+            if (iRead == (size_t)-1 ||
+                !RateLimiter::Instance().Acquire(ftpParam.iRateJob,
+                ftpParam.sHost, RateLimiter::Upload, iRead,
+                _IsStopped, &ftpParam))
+            {
+                return CURL_READFUNC_ABORT;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                ftpParam.iCurSize += (Poco::Int64)iRead;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+                ftpParam.pTotal->iCurSize += (Poco::Int64)iRead;
+            }
+
+            (ftpParam.pClient->*(ftpParam.pFunc))(&ftpParam);
+
+            return iRead;
+        }
+
+        /* what was sent on is gone, only an attempt that got nothing
+           from the buffer can start over */
+        static void Rewind(void *pParam)
+        {
+            RelayUploader *pWorker = (RelayUploader *)pParam;
+            if (pWorker->m_Buffer.GetRead() > 0)
+            {
+                pWorker->m_Buffer.Abort();
+            }
+        }
+
+        RelayUploader(const RelayUploader &rhs);
+
+        RelayUploader & operator=(const RelayUploader &rhs);
+
+    private:
+        RelayBuffer &m_Buffer;
+        std::string m_sUrl;
+        std::string m_sUserPwd;
+        Poco::Int64 m_iSize;
+        int m_iTimeout;
+        FtpParam m_FtpParam;
+        volatile bool m_bResult;
+    };
+
+    struct _RelayWrite
+    {
+        RelayBuffer *pBuffer;
+        FtpParam *pFtpParam;
+    };
+
+    /* the download side of a relayed copy, waits while the upload is
+       behind by the whole buffer */
+    size_t _WriteRelay(
+        void *pData,
+        size_t size,
+        size_t nmemb,
+        void *pParam)
+    {
+        _RelayWrite *pRelay = (_RelayWrite *)pParam;
+        FtpParam *pFtpParam = pRelay->pFtpParam;
+        size_t iCount = size * nmemb;
+        if (!RateLimiter::Instance().Acquire(pFtpParam->iRateJob,
+            pFtpParam->sHost, RateLimiter::Download, iCount,
+            _IsStopped, pFtpParam) ||
+            !pRelay->pBuffer->Write(pData, iCount, _IsStopped, pFtpParam))
+        {
+            return 0;
+        }
+        return iCount;
+    }
+
+    /* a control connection to the server of sUrl, unless its circuit is
+       open */
+    bool _OpenChannel(
+        ControlChannel &channel,
+        const std::string &sUrl,
+        const std::string &sUserPwd,
+        int iTimeout)
+    {
+        std::string sHost = UrlUtil::GetHost(sUrl);
+        HostHealth &health = HostHealth::Instance();
+        if (!health.Allow(sHost))
+        {
+            fprintf(stderr, "%s is down, circuit open\n", sHost.c_str());
+            return false;
+        }
+        if (!channel.Open(sUrl, sUserPwd, iTimeout))
+        {
+            health.ReportFailure(sHost);
+            return false;
+        }
+        health.ReportSuccess(sHost);
+        return true;
+    }
+
+    /* SIZE of sPath, -1 if the server does not tell */
+    Poco::Int64 _GetChannelSize(
+        ControlChannel &channel,
+        const std::string &sPath,
+        long iTimeoutMs)
+    {
+        std::string sReply;
+        long long iSize = -1;
+        if (channel.Command("SIZE " + sPath, sReply, iTimeoutMs) != 213 ||
+            sscanf(sReply.c_str() + 3, "%lld", &iSize) != 1)
+        {
+            return -1;
+        }
+        return (Poco::Int64)iSize;
+    }
+
+    /* where the source of a server to server copy listens, as the
+       argument of PORT (bExtended false) or EPRT for the target. PASV
+       first, which most servers allow it for, then EPSV for those on
+       IPv6 only; empty if the source takes neither */
+    std::string _GetFxpPort(
+        ControlChannel &source,
+        long iTimeoutMs,
+        bool &bExtended)
+    {
+        std::string sReply;
+        int iCode = source.Command("PASV", sReply, iTimeoutMs);
+        std::string::size_type iDigits = sReply.find_first_of("0123456789",
+            4);
+        int h1, h2, h3, h4, p1, p2;
+        if (iCode == 227 && iDigits != std::string::npos &&
+            sscanf(sReply.c_str() + iDigits, "%d,%d,%d,%d,%d,%d",
+            &h1, &h2, &h3, &h4, &p1, &p2) == 6)
+        {
+            bExtended = false;
+            char szPort[64];
+            sprintf(szPort, "%d,%d,%d,%d,%d,%d", h1, h2, h3, h4, p1, p2);
+            std::string sIp = source.GetPeerIp();
+            if (h1 == 0 && h2 == 0 && h3 == 0 && h4 == 0 &&
+                sIp.find(':') == std::string::npos)
+            {
+                /* a server that does not know its own address */
+                std::replace(sIp.begin(), sIp.end(), '.', ',');
+                sprintf(szPort, "%s,%d,%d", sIp.c_str(), p1, p2);
+            }
+            return szPort;
+        }
+        iCode = source.Command("EPSV", sReply, iTimeoutMs);
+        std::string::size_type iPort = sReply.find("(|||");
+        std::string sIp = source.GetPeerIp();
+        if (iCode != 229 || iPort == std::string::npos || sIp.empty())
+        {
+            return "";
+        }
+        bExtended = true;
+        char szPort[96];
+        sprintf(szPort, "|%d|%s|%d|",
+            sIp.find(':') == std::string::npos ? 1 : 2, sIp.c_str(),
+            atoi(sReply.c_str() + iPort + 4));
+        return szPort;
+    }
+
+    struct _UploadRewind
+    {
+        FtpParam *pFtpParam;
+        Poco::Int64 iOffset;
+        Poco::Int64 iLength;
+        Poco::Int64 iStartSize;
+    };
+
+    /* back to iOffset, what was counted as sent is taken back */
+    void _RewindUpload(void *pParam)
+    {
+        _UploadRewind *pRewind = (_UploadRewind *)pParam;
+        FtpParam &ftpParam = *pRewind->pFtpParam;
+        _SeekFile(ftpParam.pFileHandle, pRewind->iOffset);
+        clearerr(ftpParam.pFileHandle);
+        Poco::Int64 iResent = 0;
+        {
+            Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+            iResent = ftpParam.iCurSize - pRewind->iStartSize;
+            ftpParam.iCurSize = pRewind->iStartSize;
+            ftpParam.iReadRemain = pRewind->iLength;
+        }
+        if (ftpParam.pTotal != NULL)
+        {
+            Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+            ftpParam.pTotal->iCurSize -= iResent;
+        }
+    }
+
+    CURLcode _GetListing(
+        FtpListHandler &handler,
+        const std::string &sUrlDirectory,
+        const std::string &sUserPwd,
+        bool bMlsd)
+    {
+        FtpListParser parser(handler, bMlsd);
+        SessionPool &pool = SessionPool::Instance();
+        CURL *pCurl = pool.Checkout(sUrlDirectory, sUserPwd);
+        if (NULL == pCurl)
+        {
+            fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+            return CURLE_FAILED_INIT;
+        }
+        curl_easy_setopt(pCurl, CURLOPT_URL, sUrlDirectory.c_str());
+        curl_easy_setopt(pCurl, CURLOPT_USERPWD, sUserPwd.c_str());
+        if (bMlsd)
+        {
+            curl_easy_setopt(pCurl, CURLOPT_CUSTOMREQUEST, "MLSD");
+        }
+        curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+        curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1);
+        curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10);
+        curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, _ParseData);
+        curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &parser);
+
+        CURLcode ret = _PerformTransfer(pCurl,
+            UrlUtil::GetHost(sUrlDirectory), NULL);
+        if (ret == CURLE_OK)
+        {
+            parser.Finish();
+        }
+        pool.Checkin(pCurl, sUrlDirectory, sUserPwd);
+        return ret;
+    }
+
+    /* records scanned files in the store and queues their ids */
+    class QueueScanHandler : public DirScanHandler
+    {
+    public:
+        QueueScanHandler(
+            TaskStore &taskStore,
+            UploadTaskQueue &queue,
+            FtpParam &ftpParam)
+        : m_TaskStore(taskStore)
+        , m_Queue(queue)
+        , m_FtpParam(ftpParam)
+        {
+        }
+
+        bool OnDirEntry(
+            const std::string &sRelDir,
+            const char *pName,
+            size_t iNameLen,
+            Poco::Int64 iSize,
+            Poco::Timestamp::TimeVal /*tModify*/)
+        {
+            TaskStore::TaskId iTask =
+                m_TaskStore.Add(sRelDir, pName, iNameLen, iSize);
+            {
+                Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+                m_FtpParam.iTotalSize += (Poco::Int64)iSize;
+            }
+            return m_Queue.Push(iTask);
+        }
+
+        /* Cancel() also ends a walk that finds nothing to queue */
+        bool IsStopped()
+        {
+            return m_FtpParam.bCancel;
+        }
+
+    private:
+        TaskStore &m_TaskStore;
+        UploadTaskQueue &m_Queue;
+        FtpParam &m_FtpParam;
+    };
+
+    /* collects the full paths of the files a flat scan finds */
+    class PathScanHandler : public DirScanHandler
+    {
+    public:
+        PathScanHandler(
+            const std::string &sRoot,
+            std::vector<std::string> &vectPaths)
+        : m_Root(Poco::Path::forDirectory(sRoot))
+        , m_vectPaths(vectPaths)
+        {
+        }
+
+        /* the root only, the way DirectoryWatcher names its files */
+        bool OnDirEntry(
+            const std::string &/*sRelDir*/,
+            const char *pName,
+            size_t iNameLen,
+            Poco::Int64 /*iSize*/,
+            Poco::Timestamp::TimeVal /*tModify*/)
+        {
+            Poco::Path path(m_Root);
+            path.setFileName(std::string(pName, iNameLen));
+            m_vectPaths.push_back(path.toString());
+            return true;
+        }
+
+    private:
+        PathScanHandler & operator=(const PathScanHandler &rhs);
+
+        Poco::Path m_Root;
+        std::vector<std::string> &m_vectPaths;
+    };
+
+    /* a pooled session that follows the server of the current task; it
+       goes back to the pool when the next task is for another server
+       and at the end */
+    class TaskSession
+    {
+    public:
+        TaskSession(const std::string &sUserPwd)
+        : m_sUserPwd(sUserPwd)
+        , m_sUrl()
+        , m_pCurl(NULL)
+        {
+        }
+
+        ~TaskSession()
+        {
+            Release();
+        }
+
+        CURL *Get(const std::string &sUrl)
+        {
+            if (m_pCurl != NULL &&
+                UrlUtil::GetRootUrl(sUrl) == UrlUtil::GetRootUrl(m_sUrl))
+            {
+                return m_pCurl;
+            }
+            Release();
+            m_pCurl = SessionPool::Instance().Checkout(sUrl, m_sUserPwd);
+            m_sUrl = sUrl;
+            return m_pCurl;
+        }
+
+    private:
+        void Release()
+        {
+            if (m_pCurl != NULL)
+            {
+                SessionPool::Instance().Checkin(m_pCurl, m_sUrl, m_sUserPwd);
+                m_pCurl = NULL;
+            }
+        }
+
+        TaskSession(const TaskSession &rhs);
+
+        TaskSession & operator=(const TaskSession &rhs);
+
+    private:
+        std::string m_sUserPwd;
+        std::string m_sUrl;
+        CURL *m_pCurl;
+    };
+
+    /* empty vectMatch takes everything, otherwise the upload rule */
+    FileFilter _MakeFilter(
+        const std::vector<std::string> &vectMatch,
+        bool bMatch)
+    {
+        if (vectMatch.empty()) return FileFilter();
+        return FileFilter::FromExtensions(vectMatch, bMatch);
+    }
+
+    struct WildcardParam
+    {
+        FtpParam *pFtpParam;
+        std::string sLocalDirectory;
+        const FileFilter *pFilter;
+        bool bFailed;
+    };
+
+    /* a name from a listing that stays in the directory it is saved to:
+       not "." or "..", no separator of either system */
+    bool _IsPlainName(const std::string &sName)
+    {
+        return !sName.empty() && sName != "." && sName != ".." &&
+            sName.find_first_of("/\\") == std::string::npos;
+    }
+
+    /* open the local file for each remote file curl is about to get */
+    long _BeginChunk(
+        const void *pTransfer,
+        void *pParam,
+        int iRemains)
+    {
+        (void)iRemains;
+        const struct curl_fileinfo *pFileInfo =
+            (const struct curl_fileinfo *)pTransfer;
+        WildcardParam *pWildcard = (WildcardParam *)pParam;
+        FtpParam *pFtpParam = pWildcard->pFtpParam;
+
+        const FileFilter &filter = *pWildcard->pFilter;
+        if (pFileInfo->filename == NULL ||
+            !_IsPlainName(pFileInfo->filename) ||
+            pFileInfo->filetype != CURLFILETYPE_FILE ||
+            !filter.MatchName(pFileInfo->filename) ||
+            !filter.MatchAttributes((Poco::Int64)pFileInfo->size,
+                (Poco::Timestamp::TimeVal)pFileInfo->time * 1000000))
+        {
+            return CURL_CHUNK_BGN_FUNC_SKIP;
+        }
+
+        std::string sLocalPath = Poco::Path(pWildcard->sLocalDirectory)
+            .makeDirectory().setFileName(pFileInfo->filename).toString();
+        FILE *pFileHandle = fopen(sLocalPath.c_str(), "wb");
+        if (pFileHandle == NULL)
+        {
+            perror(NULL);
+            pWildcard->bFailed = true;
+            return CURL_CHUNK_BGN_FUNC_FAIL;
+        }
+
+        {
+            Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
+            pFtpParam->sFileName = pFileInfo->filename;
+            pFtpParam->iCurSize = 0;
+            pFtpParam->iTotalSize = (Poco::Int64)pFileInfo->size;
+            pFtpParam->pFileHandle = pFileHandle;
+        }
+        return CURL_CHUNK_BGN_FUNC_OK;
+    }
+
+    long _EndChunk(void *pParam)
+    {
+        WildcardParam *pWildcard = (WildcardParam *)pParam;
+        FtpParam *pFtpParam = pWildcard->pFtpParam;
+
+        FILE *pFileHandle = NULL;
+        {
+            Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
+            pFileHandle = pFtpParam->pFileHandle;
+            pFtpParam->pFileHandle = NULL;
+        }
+        if (pFileHandle != NULL && fclose(pFileHandle) != 0)
+        {
+            pWildcard->bFailed = true;
+        }
+        return CURL_CHUNK_END_FUNC_OK;
+    }
+
+    void _GetProcessInfoWithLock(
+        FtpParam *pFtpParam,
+        std::string &sFileName,
+        Poco::Int64 &iCurSize,
+        Poco::Int64 &iTotalSize)
+    {
+        {
+            Poco::FastMutex::ScopedLock l(pFtpParam->theMutex);
+            sFileName = pFtpParam->sFileName;
+            iCurSize = pFtpParam->iCurSize;
+            iTotalSize = pFtpParam->iTotalSize;
+        }
+        /* a parallel transfer reports its file against the batch */
+        if (pFtpParam->pTotal != NULL)
+        {
+            Poco::FastMutex::ScopedLock l(pFtpParam->pTotal->theMutex);
+            iCurSize = pFtpParam->pTotal->iCurSize;
+            iTotalSize = pFtpParam->pTotal->iTotalSize;
+        }
+        return;
+    }
+} // anonymous namespace end
+
+FtpClient::FtpClient(const std::string &sUserPwd/* = "admin:123456"*/)
+: Poco::Runnable()
+, Poco::Thread()
+, m_TaskStore()
+, m_TaskQueue(m_TaskStore)
+, m_CallbackMutex()
+, m_sLocalPath()
+, m_sRemotePath()
+, m_sTargetPath()
+, m_sUserPwd(sUserPwd)
+, m_sTargetUserPwd()
+, m_Filter()
+, m_iStableMs(500)
+, m_iIntervalMs(1000)
+, m_iIdleMs(10000)
+, m_eCurOptMode(Unknown)
+, m_bOptResult(false)
+, m_bRecursive(false)
+, m_bScanFailed(false)
+, m_bWorkerFailed(false)
+, m_iMaxConcurrency(1)
+, m_eSchedulePolicy(UploadTaskQueue::Fifo)
+, m_iRateJob(RateLimiter::Instance().RegisterJob())
+, m_bBackfill(false)
+, m_bAdaptive(false)
+, m_bParkOnOutage(false)
+, m_iDownloadSources(1)
+, m_vectFanOut()
+, m_bCopyRelayed(false)
+, m_HostCaps()
+, m_pSession(NULL)
+, m_ScanRunnable(*this, &FtpClient::ScanDirectory)
+, m_WorkerRunnable(*this, &FtpClient::UploadWorker)
+, m_ScanThread()
+, m_bRoutineStart(false)
+{
+    m_TaskQueue.SetHostLimits(this);
+}
+
+FtpClient::~FtpClient()
+{
+    Cancel();
+    AwaitResult();
+    RateLimiter::Instance().UnregisterJob(m_iRateJob);
+}
+
+void FtpClient::SetUserPwd(const std::string &sUserPwd)
+{
+    m_sUserPwd = sUserPwd;
+}
+
+const std::string FtpClient::GetUserPwd() const
+{
+    return m_sUserPwd;
+}
+
+bool FtpClient::RegisterObserver(ProgressObserver *observer)
+{
+    Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
+    if (std::find(m_Observers.begin(), m_Observers.end(), observer)
+        == m_Observers.end())
+    {
+        m_Observers.push_back(observer);
+        return true;
+    }
+    return false;
+}
+
+bool FtpClient::UnRegisterObserver(ProgressObserver *observer)
+{
+    Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
+    std::vector<ProgressObserver *>::iterator it =
+        std::find(m_Observers.begin(), m_Observers.end(), observer);
+    if (it != m_Observers.end())
+    {
+        m_Observers.erase(it);
+        return true;
+    }
+    return false;
+}
+
+bool FtpClient::UploadFileSync(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (UploadFileAsync(sRemotePath, sLocalPath, sUserPwd))
+    {
+        return AwaitResult();
+    }
+    return false;
+}
+
+bool FtpClient::UploadFileAsync(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (!Poco::File(sLocalPath).exists() ||
+        !Poco::File(sLocalPath).isFile()) return false;
+
+    if (SetStartState(sUserPwd, Upload))
+    {
+        Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+        {
+            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+            m_FtpParam.iTotalSize = (Poco::Int64)iSize;
+        }
+        m_TaskQueue.Push(m_TaskStore.AddFile(sRemotePath, sLocalPath, iSize,
+            m_TaskStore.InternHost(UrlUtil::GetHost(sRemotePath))));
+        m_TaskQueue.Finish();
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::SubmitUploadFile(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iPriority,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (!Poco::File(sLocalPath).exists() ||
+        !Poco::File(sLocalPath).isFile()) return false;
+
+    Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+    if (SetStartState(sUserPwd, Upload))
+    {
+        {
+            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+            m_FtpParam.iTotalSize = (Poco::Int64)iSize;
+        }
+        TaskStore::TaskId iTask = m_TaskStore.AddFile(sRemotePath,
+            sLocalPath, iSize,
+            m_TaskStore.InternHost(UrlUtil::GetHost(sRemotePath)));
+        m_TaskStore.SetPriority(iTask, iPriority);
+        m_TaskQueue.Push(iTask);
+        m_TaskQueue.Finish();
+        Poco::Thread::start(*this);
+        return true;
+    }
+
+    /* join the running upload; the queue refuses once its transfers
+       have run dry and are on their way out. The lock keeps a new
+       routine from starting in between */
+    TaskStore::HostId iHost = m_TaskStore.InternHost(
+        UrlUtil::GetHost(sRemotePath));
+    bool bJoined = false;
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        if (m_eCurOptMode == Upload)
+        {
+            TaskStore::TaskId iTask = m_TaskStore.AddFile(sRemotePath,
+                sLocalPath, iSize, iHost);
+            m_TaskStore.SetPriority(iTask, iPriority);
+            bJoined = m_TaskQueue.Push(iTask, false);
+            if (bJoined)
+            {
+                m_FtpParam.iTotalSize += (Poco::Int64)iSize;
+            }
+        }
+    }
+    if (bJoined)
+    {
+        PreemptFor(iPriority, iHost);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::UploadDirAllFilesAsync(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const std::string &sUserPwd/* = ""*/)
+{
+    return UploadDirFilteredFilesAsync(sRemoteDirectory, sLocalDirectory,
+        FileFilter(), sUserPwd);
+}
+
+bool FtpClient::UploadDirMatchedFilesAsync(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const std::vector<std::string> &vectMatch,
+    bool bMatch/* = true*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    return UploadDirFilteredFilesAsync(sRemoteDirectory, sLocalDirectory,
+        FileFilter::FromExtensions(vectMatch, bMatch), sUserPwd);
+}
+
+bool FtpClient::UploadDirFilteredFilesAsync(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const FileFilter &filter,
+    const std::string &sUserPwd/* = ""*/)
+{
+    return StartDirUpload(sRemoteDirectory, sLocalDirectory, filter,
+        false, sUserPwd);
+}
+
+bool FtpClient::UploadDirTreeAsync(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const FileFilter &filter/* = FileFilter()*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    return StartDirUpload(sRemoteDirectory, sLocalDirectory, filter,
+        true, sUserPwd);
+}
+
+bool FtpClient::StartDirUpload(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const FileFilter &filter,
+    bool bRecursive,
+    const std::string &sUserPwd)
+{
+    if (!Poco::File(sLocalDirectory).exists() ||
+        !Poco::Path(sLocalDirectory).isDirectory()) return false;
+
+    if (SetStartState(sUserPwd, Upload))
+    {
+        /* the scan feeds the queue while the first files are sent */
+        m_sRemotePath = sRemoteDirectory;
+        m_TaskStore.InternHost(UrlUtil::GetHost(m_sRemotePath));
+        m_sLocalPath = sLocalDirectory;
+        if (!m_sLocalPath.empty() &&
+            m_sLocalPath[m_sLocalPath.size() - 1] != '/' &&
+            m_sLocalPath[m_sLocalPath.size() - 1] != '\\')
+        {
+            m_sLocalPath += '/';
+        }
+        m_Filter = filter;
+        m_bRecursive = bRecursive;
+        m_ScanThread.start(m_ScanRunnable);
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::WatchDirUploadAsync(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory,
+    const std::vector<std::string> &vectMatch/* = std::vector<std::string>()*/,
+    bool bMatch/* = true*/,
+    int iStableMs/* = 500*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (!Poco::File(sLocalDirectory).exists() ||
+        !Poco::File(sLocalDirectory).isDirectory()) return false;
+
+    if (SetStartState(sUserPwd, WatchUpload))
+    {
+        m_sRemotePath = sRemoteDirectory;
+        m_TaskStore.InternHost(UrlUtil::GetHost(m_sRemotePath));
+        m_sLocalPath = sLocalDirectory;
+        m_Filter = _MakeFilter(vectMatch, bMatch);
+        m_iStableMs = iStableMs;
+        {
+            Poco::FastMutex::ScopedLock l(m_PendingMutex);
+            m_PendingFiles.clear();
+        }
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::UploadGrowingFileAsync(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iIntervalMs/* = 1000*/,
+    int iIdleMs/* = 10000*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (!Poco::File(sLocalPath).exists() ||
+        !Poco::File(sLocalPath).isFile()) return false;
+
+    if (SetStartState(sUserPwd, TailUpload))
+    {
+        m_sRemotePath = sRemotePath;
+        m_sLocalPath = sLocalPath;
+        m_iIntervalMs = iIntervalMs;
+        m_iIdleMs = iIdleMs;
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::UploadFanOutSync(
+    const std::vector<std::string> &vectRemotePaths,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (UploadFanOutAsync(vectRemotePaths, sLocalPath, sUserPwd))
+    {
+        return AwaitResult();
+    }
+    return false;
+}
+
+bool FtpClient::UploadFanOutAsync(
+    const std::vector<std::string> &vectRemotePaths,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (vectRemotePaths.empty() || !Poco::File(sLocalPath).exists() ||
+        !Poco::File(sLocalPath).isFile()) return false;
+
+    if (SetStartState(sUserPwd, FanOutUpload))
+    {
+        m_sRemotePath = vectRemotePaths[0];
+        m_sLocalPath = sLocalPath;
+        m_vectFanOut.assign(vectRemotePaths.size(), FanOutResult());
+        for (size_t i = 0; i < vectRemotePaths.size(); ++i)
+        {
+            m_vectFanOut[i].sRemotePath = vectRemotePaths[i];
+        }
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+void FtpClient::GetFanOutResults(std::vector<FanOutResult> &vectResults)
+{
+    vectResults = m_vectFanOut;
+}
+
+bool FtpClient::CopyRemoteFileSync(
+    const std::string &sSourcePath,
+    const std::string &sTargetPath,
+    const std::string &sUserPwd/* = ""*/,
+    const std::string &sTargetUserPwd/* = ""*/)
+{
+    if (CopyRemoteFileAsync(sSourcePath, sTargetPath, sUserPwd,
+        sTargetUserPwd))
+    {
+        return AwaitResult();
+    }
+    return false;
+}
+
+bool FtpClient::CopyRemoteFileAsync(
+    const std::string &sSourcePath,
+    const std::string &sTargetPath,
+    const std::string &sUserPwd/* = ""*/,
+    const std::string &sTargetUserPwd/* = ""*/)
+{
+    if (sSourcePath.empty() || sTargetPath.empty()) return false;
+
+    if (SetStartState(sUserPwd, RemoteCopy))
+    {
+        m_sRemotePath = sSourcePath;
+        m_sTargetPath = sTargetPath;
+        m_sTargetUserPwd = sTargetUserPwd.empty() ?
+            m_sUserPwd : sTargetUserPwd;
+        m_bCopyRelayed = false;
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::IsCopyRelayed() const
+{
+    return m_bCopyRelayed;
+}
+
+bool FtpClient::DownloadFileSync(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (DownloadFileAsync(sRemotePath, sLocalPath, sUserPwd))
+    {
+        return AwaitResult();
+    }
+    return false;
+}
+
+bool FtpClient::DownloadFileAsync(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (SetStartState(sUserPwd, Download))
+    {
+        m_sRemotePath = sRemotePath;
+        m_sLocalPath = sLocalPath;
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::DownloadMatchedFilesAsync(
+    const std::string &sRemotePattern,
+    const std::string &sLocalDirectory,
+    const std::vector<std::string> &vectMatch/* = std::vector<std::string>()*/,
+    bool bMatch/* = true*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    if (SetStartState(sUserPwd, DownloadMatched))
+    {
+        m_sRemotePath = sRemotePattern;
+        m_sLocalPath = sLocalDirectory;
+        m_Filter = _MakeFilter(vectMatch, bMatch);
+        Poco::Thread::start(*this);
+        return true;
+    }
+    fprintf(stderr, "Routine is Running\n");
+    return false;
+}
+
+bool FtpClient::ListDirectory(
+    const std::string &sRemoteDirectory,
+    std::vector<FtpFileInfo> &vectEntries,
+    bool bUseCache/* = true*/,
+    const std::string &sUserPwd/* = ""*/)
+{
+    const std::string &sAuth = sUserPwd.empty() ? m_sUserPwd : sUserPwd;
+    std::string sUrlDirectory = _GetUrlDirectory(sRemoteDirectory);
+    std::string sKey = _GetListCacheKey(sAuth, sUrlDirectory);
+    if (bUseCache)
+    {
+        Poco::SharedPtr<std::vector<FtpFileInfo> > pEntries =
+            _GetListCache().get(sKey);
+        if (!pEntries.isNull())
+        {
+            vectEntries = *pEntries;
+            return true;
+        }
+    }
+
+    std::vector<FtpFileInfo> vectResult;
+    ListCollector collector(vectResult);
+    if (!ListDirectoryImpl(sUrlDirectory, sAuth, collector))
+    {
+        return false;
+    }
+    std::sort(vectResult.begin(), vectResult.end(), _LessByName);
+    _GetListCache().add(sKey, vectResult);
+    vectEntries.swap(vectResult);
+    return true;
+}
+
+bool FtpClient::ListDirectory(
+    const std::string &sRemoteDirectory,
+    FtpListHandler &handler,
+    const std::string &sUserPwd/* = ""*/)
+{
+    const std::string &sAuth = sUserPwd.empty() ? m_sUserPwd : sUserPwd;
+    return ListDirectoryImpl(_GetUrlDirectory(sRemoteDirectory),
+        sAuth, handler);
+}
+
+bool FtpClient::GetRemoteFileInfo(
+    const std::string &sRemotePath,
+    FtpFileInfo &fileInfo,
+    const std::string &sUserPwd/* = ""*/)
+{
+    std::string::size_type iPos = sRemotePath.rfind('/');
+    if (iPos == std::string::npos || iPos + 1 >= sRemotePath.size())
+    {
+        return false;
+    }
+
+    std::vector<FtpFileInfo> vectEntries;
+    if (!ListDirectory(sRemotePath.substr(0, iPos + 1),
+        vectEntries, true, sUserPwd))
+    {
+        return false;
+    }
+
+    FtpFileInfo key;
+    key.sName = sRemotePath.substr(iPos + 1);
+    std::vector<FtpFileInfo>::const_iterator it = std::lower_bound(
+        vectEntries.begin(), vectEntries.end(), key, _LessByName);
+    if (it != vectEntries.end() && it->sName == key.sName)
+    {
+        fileInfo = *it;
+        return true;
+    }
+    return false;
+}
+
+bool FtpClient::DeleteRemoteFile(
+    const std::string &sRemotePath,
+    const std::string &sUserPwd/* = ""*/)
+{
+    const std::string &sAuth = sUserPwd.empty() ? m_sUserPwd : sUserPwd;
+    std::string::size_type iPos = sRemotePath.rfind('/');
+    if (iPos == std::string::npos || iPos + 1 >= sRemotePath.size())
+    {
+        return false;
+    }
+
+    std::string sUrlDirectory = sRemotePath.substr(0, iPos + 1);
+    SessionPool &pool = SessionPool::Instance();
+    CURL *pCurl = pool.Checkout(sUrlDirectory, sAuth);
+    if (NULL == pCurl)
+    {
+        fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+        return false;
+    }
+    std::string sCommand = "DELE " + sRemotePath.substr(iPos + 1);
+    struct curl_slist *pCommands = curl_slist_append(NULL, sCommand.c_str());
+
+    curl_easy_setopt(pCurl, CURLOPT_URL, sUrlDirectory.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_USERPWD, sAuth.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_QUOTE, pCommands);
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+
+    CURLcode ret = curl_easy_perform(pCurl);
+    _InvalidateListCache(sAuth, sRemotePath);
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+    }
+    pool.Checkin(pCurl, sUrlDirectory, sAuth);
+    curl_slist_free_all(pCommands);
+    return ret == CURLE_OK;
+}
+
+void FtpClient::ClearListCache()
+{
+    _GetListCache().clear();
+}
+
+void FtpClient::SetMaxConcurrency(int iMaxConcurrency)
+{
+    m_iMaxConcurrency = std::max(iMaxConcurrency, 1);
+}
+
+void FtpClient::SetSchedulePolicy(UploadTaskQueue::Policy ePolicy)
+{
+    m_eSchedulePolicy = ePolicy;
+}
+
+void FtpClient::SetRateWeight(int iWeight)
+{
+    RateLimiter::Instance().SetJobWeight(m_iRateJob, iWeight);
+}
+
+void FtpClient::SetBackfill(bool bBackfill)
+{
+    m_bBackfill = bBackfill;
+}
+
+void FtpClient::SetAdaptiveConcurrency(bool bAdaptive)
+{
+    m_bAdaptive = bAdaptive;
+}
+
+void FtpClient::SetParkOnOutage(bool bPark)
+{
+    m_bParkOnOutage = bPark;
+}
+
+void FtpClient::SetDownloadSources(int iSources)
+{
+    m_iDownloadSources = std::max(iSources, 1);
+}
+
+void FtpClient::SetHostMaxConcurrency(const std::string &sHost, int iMax)
+{
+    Poco::FastMutex::ScopedLock l(m_HostCapMutex);
+    m_HostCaps[sHost] = std::max(iMax, 0);
+}
+
+void FtpClient::GetHostLoads(
+    std::vector<UploadTaskQueue::HostLoad> &vectLoads)
+{
+    m_TaskQueue.GetHostLoads(vectLoads);
+}
+
+bool FtpClient::AwaitResult()
+{
+    try
+    {
+        while (m_bRoutineStart.Load() ||
+               Poco::Thread::isRunning())
+        {
+            Poco::Thread::yield();
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return false;
+    }
+    return !m_FtpParam.bCancel && m_bOptResult;
+}
+
+bool FtpClient::Cancel()
+{
+    if (m_bRoutineStart.Load())
+    {
+        m_FtpParam.bCancel = true;
+        m_WakeEvent.set();
+        m_TaskQueue.Abort();
+        return true;
+    }
+
+    return false;
+}
+
+bool FtpClient::SetStartState(
+    const std::string &sUserPwd,
+    OptMode eCurOptMode)
+{
+    bool bExpcted = false;
+    if (m_bRoutineStart.CompareExchange(bExpcted, true))
+    {
+        if (!sUserPwd.empty())
+        {
+            m_sUserPwd = sUserPwd;
+        }
+        m_TaskStore.Clear();
+        m_bScanFailed = false;
+        m_bWorkerFailed = false;
+
+        {
+            /* SubmitUploadFile() reads the mode and pushes under it */
+            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+            m_eCurOptMode = eCurOptMode;
+            m_TaskQueue.Reset(m_eSchedulePolicy);
+            m_FtpParam.bCancel = false;
+            m_FtpParam.iReadRemain = -1;
+            m_FtpParam.iCurSize = 0;
+            m_FtpParam.iTotalSize = 0;
+        }
+
+        return true;
+    }
+    return false;
+}
+
+void FtpClient::run()
+{
+    try
+    {
+        m_bOptResult = false;
+        /* the modes that stay on the server of m_sRemotePath keep one
+           session for the routine; the others check out per server */
+        if (m_eCurOptMode == TailUpload || m_eCurOptMode == RemoteCopy)
+        {
+            m_pSession = SessionPool::Instance().Checkout(m_sRemotePath,
+                m_sUserPwd);
+        }
+
+        switch (m_eCurOptMode)
+        {
+        case Upload:
+            m_bOptResult = UploadTasksImpl(3);
+            break;
+        case Download:
+        {
+            BandwidthCalendar::Slot slot(m_bBackfill, _IsStopped,
+                &m_FtpParam);
+            m_bOptResult = slot.IsHeld() &&
+                DownloadFileImpl(m_sRemotePath, m_sLocalPath, 3);
+            break;
+        }
+        case DownloadMatched:
+        {
+            BandwidthCalendar::Slot slot(m_bBackfill, _IsStopped,
+                &m_FtpParam);
+            m_bOptResult = slot.IsHeld() && DownloadMatchedFilesImpl(
+                m_sRemotePath, m_sLocalPath, 3);
+            break;
+        }
+        case WatchUpload:
+            m_bOptResult = WatchUploadImpl(m_sRemotePath, m_sLocalPath);
+            break;
+        case TailUpload:
+            m_bOptResult = TailUploadImpl(m_sRemotePath, m_sLocalPath, 3);
+            break;
+        case FanOutUpload:
+        {
+            BandwidthCalendar::Slot slot(m_bBackfill, _IsStopped,
+                &m_FtpParam);
+            m_bOptResult = slot.IsHeld() &&
+                UploadFanOutImpl(m_sLocalPath, 3);
+            break;
+        }
+        case RemoteCopy:
+            m_bOptResult = RemoteCopyImpl(3);
+            break;
+        default:
+            m_bOptResult = false;
+            break;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        m_bOptResult = false;
+    }
+    catch (...)
+    {
+        m_bOptResult = false;
+    }
+
+    if (m_pSession != NULL)
+    {
+        SessionPool::Instance().Checkin(m_pSession, m_sRemotePath,
+            m_sUserPwd);
+        m_pSession = NULL;
+    }
+
+    /* stop a scan that is still feeding the queue */
+    m_TaskQueue.Abort();
+    m_ScanThread.join();
+    if (m_bScanFailed)
+    {
+        m_bOptResult = false;
+    }
+
+    m_bRoutineStart.Store(false);
+}
+
+void FtpClient::ScanDirectory()
+{
+    QueueScanHandler handler(m_TaskStore, m_TaskQueue, m_FtpParam);
+    DirScanner scanner(m_Filter, handler);
+    if (!scanner.Scan(m_sLocalPath, m_bRecursive, m_bRecursive ? 4 : 1))
+    {
+        m_bScanFailed = true;
+    }
+    m_TaskQueue.Finish();
+}
+
+bool FtpClient::UploadTasksImpl(int iTimeout)
+{
+    if (m_iMaxConcurrency <= 1)
+    {
+        return UploadTaskLoop(m_FtpParam, iTimeout);
+    }
+
+    /* this thread takes part as one of the sessions */
+    std::vector<Poco::Thread *> vectThreads;
+    for (int i = 1; i < m_iMaxConcurrency; ++i)
+    {
+        vectThreads.push_back(new Poco::Thread());
+        vectThreads.back()->start(m_WorkerRunnable);
+    }
+    bool bResult = UploadTaskLoop(m_FtpParam, iTimeout);
+    for (size_t i = 0; i < vectThreads.size(); ++i)
+    {
+        vectThreads[i]->join();
+        delete vectThreads[i];
+    }
+    return bResult && !m_bWorkerFailed;
+}
+
+void FtpClient::UploadWorker()
+{
+    FtpParam ftpParam;
+    ftpParam.pTotal = &m_FtpParam;
+    bool bResult = false;
+    try
+    {
+        bResult = UploadTaskLoop(ftpParam, 3);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        m_TaskQueue.Abort();
+    }
+    if (!bResult)
+    {
+        m_bWorkerFailed = true;
+    }
+}
+
+bool FtpClient::UploadTaskLoop(
+    FtpParam &ftpParam,
+    int iTimeout)
+{
+    TaskSession session(m_sUserPwd);
+    TaskStore::TaskId iTask = 0;
+    std::string sRemotePath;
+    std::string sLocalPath;
+    while (m_TaskQueue.Pop(iTask))
+    {
+        m_TaskStore.GetPaths(iTask, m_sRemotePath, m_sLocalPath,
+            sRemotePath, sLocalPath);
+        std::string sHost = UrlUtil::GetHost(sRemotePath);
+        CURL *pCurl = session.Get(sRemotePath);
+        if (NULL == pCurl)
+        {
+            fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+            m_TaskQueue.Release(iTask);
+            m_TaskQueue.Abort();
+            return false;
+        }
+
+        /* the sessions the server takes and the calendar may hold the
+           task back, it keeps its place here; a calendar slot is only
+           taken once the server has room, not held while waiting */
+        ConcurrencyController::Slot hostSlot(
+            m_bAdaptive ? sHost : std::string(), _IsStopped, &ftpParam);
+        BandwidthCalendar::Slot slot(
+            m_bBackfill || m_TaskStore.GetPriority(iTask) < 0,
+            _IsStopped, &ftpParam);
+        if (!slot.IsHeld() || !hostSlot.IsHeld() ||
+            !PortManager::Instance().WaitForPort(m_TaskStore.GetSize(iTask),
+            _IsStopped, &ftpParam))
+        {
+            m_TaskQueue.Release(iTask);
+            m_TaskQueue.Abort();
+            return false;
+        }
+        Poco::Int64 iOffset = m_TaskStore.GetOffset(iTask);
+        m_TaskStore.SetState(iTask, TaskStore::Running);
+
+        Poco::Int64 iStartSize = 0;
+        {
+            Poco::FastMutex::ScopedLock l(m_RunningMutex);
+            ftpParam.iPriority = m_TaskStore.GetPriority(iTask);
+            ftpParam.iTaskHost = m_TaskStore.GetHost(iTask);
+            ftpParam.bYield = false;
+            m_RunningParams.push_back(&ftpParam);
+        }
+        {
+            Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+            iStartSize = ftpParam.iCurSize;
+        }
+        CURLcode eError = CURLE_OK;
+        bool bHostDown = false;
+        bool bResult = UploadFileImpl(pCurl, ftpParam, sRemotePath,
+            sLocalPath, iTimeout, iOffset, iOffset > 0 ?
+            m_TaskStore.GetSize(iTask) - iOffset : -1, &eError, &bHostDown);
+        bool bYield = false;
+        {
+            Poco::FastMutex::ScopedLock l(m_RunningMutex);
+            m_RunningParams.erase(std::find(m_RunningParams.begin(),
+                m_RunningParams.end(), &ftpParam));
+            bYield = ftpParam.bYield;
+            ftpParam.bYield = false;
+        }
+        m_TaskQueue.Release(iTask);
+
+        bool bCancel = ftpParam.bCancel ||
+            (ftpParam.pTotal != NULL && ftpParam.pTotal->bCancel);
+        /* the first failure already counts, before the breaker opens;
+           GetHostLimit() holds the task back once it has */
+        bool bParked = !bResult && !bYield && !bCancel &&
+            m_bParkOnOutage && bHostDown;
+        bool bRetry = false;
+        if (!bResult && !bYield && !bCancel && !bParked && m_bAdaptive)
+        {
+            long iResponse = 0;
+            curl_easy_getinfo(pCurl, CURLINFO_RESPONSE_CODE, &iResponse);
+            bRetry = ConcurrencyController::Instance().ReportError(sHost,
+                iResponse, eError == CURLE_COULDNT_CONNECT ||
+                eError == CURLE_OPERATION_TIMEDOUT);
+        }
+        if (!bResult && (bYield || bRetry || bParked) && !bCancel)
+        {
+            /* paused for something more urgent, refused by a busy
+               server or parked until it is back, continue later from
+               what the server kept; without SIZE start over */
+            Poco::Int64 iSent = 0;
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                iSent = ftpParam.iCurSize - iStartSize;
+            }
+            Poco::Int64 iKept = 0;
+            if (bParked)
+            {
+                /* no SIZE from a server that is down, what it had still
+                   holds unless this attempt got some of it out */
+                iKept = (iSent == 0) ? iOffset : 0;
+            }
+            else if (!GetRemoteSizeImpl(pCurl, sRemotePath, iKept) ||
+                iKept < iOffset)
+            {
+                iKept = 0;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                ftpParam.iCurSize -= iSent - (iKept - iOffset);
+            }
+            if (ftpParam.pTotal != NULL)
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+                ftpParam.pTotal->iCurSize -= iSent - (iKept - iOffset);
+            }
+            m_TaskStore.SetOffset(iTask, iKept);
+            m_TaskStore.SetState(iTask, TaskStore::Pending);
+            if (m_TaskQueue.Requeue(iTask)) continue;
+        }
+
+        if (!bResult && !bCancel && m_eCurOptMode == WatchUpload)
+        {
+            /* the watch goes on, the file is queued again after a
+               pause and leaves the progress until then */
+            Poco::Int64 iSent = 0;
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+                iSent = ftpParam.iCurSize - iStartSize;
+                ftpParam.iCurSize -= iSent;
+            }
+            if (ftpParam.pTotal != NULL)
+            {
+                Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+                ftpParam.pTotal->iCurSize -= iSent;
+                ftpParam.pTotal->iTotalSize -= m_TaskStore.GetSize(iTask);
+            }
+            m_TaskStore.SetState(iTask, TaskStore::Failed);
+            {
+                Poco::FastMutex::ScopedLock l(m_PendingMutex);
+                PendingFile &pending = m_PendingFiles[sLocalPath];
+                pending.tChanged.update();
+                pending.tChanged += 5 * Poco::Timespan::SECONDS;
+            }
+            continue;
+        }
+
+        if (!bResult)
+        {
+            /* the batch stops at the first failure, the other
+               transfers finish the file they are on */
+            m_TaskStore.SetState(iTask, TaskStore::Failed);
+            m_TaskQueue.Abort();
+            return false;
+        }
+        m_TaskStore.SetState(iTask, TaskStore::Done);
+    }
+    return true;
+}
+
+int FtpClient::GetHostLimit(TaskStore::HostId iHost)
+{
+    std::string sHost = m_TaskStore.GetHostName(iHost);
+    int iLimit = 0;
+    {
+        Poco::FastMutex::ScopedLock l(m_HostCapMutex);
+        std::map<std::string, int>::const_iterator it =
+            m_HostCaps.find(sHost);
+        if (it != m_HostCaps.end())
+        {
+            iLimit = it->second;
+        }
+    }
+    if (m_bAdaptive)
+    {
+        int iLearned = ConcurrencyController::Instance().GetLimit(sHost);
+        iLimit = iLimit > 0 ? std::min(iLimit, iLearned) : iLearned;
+    }
+    /* while the circuit is open nothing starts, or everything fails at
+       once; then a single task goes as the probe */
+    HostHealth::State eHealth = HostHealth::Instance().GetState(sHost);
+    if (eHealth == HostHealth::Open && m_bParkOnOutage)
+    {
+        return -1;
+    }
+    if (eHealth == HostHealth::HalfOpen)
+    {
+        return 1;
+    }
+    /* short of local ports, every server makes do with fewer sessions */
+    int iPorts = PortManager::Instance().GetSessionLimit(m_iMaxConcurrency);
+    if (iPorts < m_iMaxConcurrency)
+    {
+        iLimit = iLimit > 0 ? std::min(iLimit, iPorts) : iPorts;
+    }
+    return iLimit;
+}
+
+void FtpClient::PreemptFor(int iPriority, TaskStore::HostId iHost)
+{
+    /* what may run now, short of ports or with a learned or set cap
+       for the server; a parked server gains nothing from a yield */
+    int iLimit = PortManager::Instance().GetSessionLimit(m_iMaxConcurrency);
+    int iHostLimit = GetHostLimit(iHost);
+    if (iHostLimit < 0)
+    {
+        return;
+    }
+
+    Poco::FastMutex::ScopedLock l(m_RunningMutex);
+    int iHostRunning = 0;
+    for (size_t i = 0; i < m_RunningParams.size(); ++i)
+    {
+        if (m_RunningParams[i]->iTaskHost == iHost) ++iHostRunning;
+    }
+    /* a session between files picks the new task up by itself; with
+       the server full only one of its own transfers makes room */
+    bool bHostFull = iHostLimit > 0 && iHostRunning >= iHostLimit;
+    if ((int)m_RunningParams.size() < iLimit && !bHostFull)
+    {
+        return;
+    }
+    FtpParam *pVictim = NULL;
+    for (size_t i = 0; i < m_RunningParams.size(); ++i)
+    {
+        FtpParam *pParam = m_RunningParams[i];
+        if (bHostFull && pParam->iTaskHost != iHost) continue;
+        if (!pParam->bYield && pParam->iPriority < iPriority &&
+            (pVictim == NULL || pParam->iPriority < pVictim->iPriority))
+        {
+            pVictim = pParam;
+        }
+    }
+    if (pVictim != NULL)
+    {
+        pVictim->bYield = true;
+    }
+}
+
+bool FtpClient::UploadFileImpl(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iTimeout,
+    Poco::Int64 iOffset/* = 0*/,
+    Poco::Int64 iLength/* = -1*/)
+{
+    return UploadFileImpl(m_pSession, m_FtpParam, sRemotePath, sLocalPath,
+        iTimeout, iOffset, iLength);
+}
+
+bool FtpClient::UploadFileImpl(
+    CURL *pCurl,
+    FtpParam &ftpParam,
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iTimeout,
+    Poco::Int64 iOffset/* = 0*/,
+    Poco::Int64 iLength/* = -1*/,
+    CURLcode *pError/* = NULL*/,
+    bool *pHostDown/* = NULL*/)
+{
+    bool bResult = false;
+    /* what went wrong, for the caller to tell load or an outage from
+       other causes */
+    if (pError != NULL)
+    {
+        *pError = CURLE_READ_ERROR;
+    }
+    if (pHostDown != NULL)
+    {
+        *pHostDown = false;
+    }
+
+    FILE *pFileHandle = fopen(sLocalPath.c_str(), "rb");
+    if (pFileHandle == NULL)
+    {
+        perror(NULL);
+        return bResult;
+    }
+    if (iOffset > 0 && _SeekFile(pFileHandle, iOffset) != 0)
+    {
+        perror(NULL);
+        fclose(pFileHandle);
+        return bResult;
+    }
+
+    {
+        Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+        ftpParam.sFileName = Poco::Path(sLocalPath).getFileName();
+        ftpParam.iReadRemain = iLength;
+        ftpParam.pFileHandle = pFileHandle;
+        ftpParam.pClient = this;
+        ftpParam.pFunc = &FtpClient::OnUpload;
+        ftpParam.sHost = UrlUtil::GetHost(sRemotePath);
+        ftpParam.iRateJob = m_iRateJob;
+        ftpParam.bAdaptive = m_bAdaptive;
+    }
+    if (ftpParam.pTotal != NULL)
+    {
+        Poco::FastMutex::ScopedLock l(ftpParam.pTotal->theMutex);
+        ftpParam.pTotal->sFileName = ftpParam.sFileName;
+    }
+
+    if (NULL == pCurl)
+    {
+        fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+        fclose(pFileHandle);
+        return bResult;
+    }
+    /* reset drops the options but keeps the open control connection */
+    curl_easy_reset(pCurl);
+    curl_easy_setopt(pCurl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_URL, sRemotePath.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+
+    if (iTimeout)
+    {
+        curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT, iTimeout);
+    }
+    // ӳʱ()
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+    // ʹٶȳʱķʽϿµ߳̿
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10);
+
+    curl_easy_setopt(pCurl, CURLOPT_READFUNCTION, _ReadData);
+    curl_easy_setopt(pCurl, CURLOPT_READDATA, &ftpParam);
+//     curl_easy_setopt(pCurl, CURLOPT_INFILESIZE_LARGE,
+//         (curl_off_t)ftpParam.iTotalSize);
+
+    curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
+    curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &ftpParam);
+
+    curl_easy_setopt(pCurl, CURLOPT_FTP_CREATE_MISSING_DIRS, 1L);
+    if (iOffset > 0)
+    {
+        curl_easy_setopt(pCurl, CURLOPT_APPEND, 1L);
+    }
+    if (iLength >= 0)
+    {
+        curl_easy_setopt(pCurl, CURLOPT_INFILESIZE_LARGE,
+            (curl_off_t)iLength);
+    }
+
+    //curl_easy_setopt(pCurl, CURLOPT_VERBOSE, 1L);
+
+    Poco::Int64 iStartSize = 0;
+    {
+        Poco::FastMutex::ScopedLock l(ftpParam.theMutex);
+        iStartSize = ftpParam.iCurSize;
+    }
+    _UploadRewind rewind = {&ftpParam, iOffset, iLength, iStartSize};
+    CURLcode ret = _PerformTransfer(pCurl, ftpParam.sHost, &ftpParam,
+        _RewindUpload, &rewind, pHostDown);
+
+    long iConnects = 0;
+    curl_easy_getinfo(pCurl, CURLINFO_NUM_CONNECTS, &iConnects);
+    bool bCancel = ftpParam.bCancel ||
+        (ftpParam.pTotal != NULL && ftpParam.pTotal->bCancel);
+    if (iConnects == 0 && !bCancel &&
+        (ret == CURLE_SEND_ERROR || ret == CURLE_RECV_ERROR ||
+         ret == CURLE_GOT_NOTHING || ret == CURLE_FTP_WEIRD_SERVER_REPLY))
+    {
+        /* the server dropped the idle session, send again on a new one */
+        _RewindUpload(&rewind);
+        curl_easy_setopt(pCurl, CURLOPT_FRESH_CONNECT, 1L);
+        ret = _PerformTransfer(pCurl, ftpParam.sHost, &ftpParam,
+            _RewindUpload, &rewind, pHostDown);
+    }
+
+    fclose(pFileHandle);
+    _InvalidateListCache(m_sUserPwd, sRemotePath);
+    if (pError != NULL)
+    {
+        *pError = ret;
+    }
+
+    if (ret == CURLE_OK)
+    {
+        bResult = true;
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+        bResult = false;
+    }
+    return bResult;
+}
+
+bool FtpClient::TailUploadImpl(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iTimeout)
+{
+    Poco::Int64 iSent = 0;
+    bool bSynced = true;
+    Poco::Timestamp tGrown;
+    while (!m_FtpParam.bCancel)
+    {
+        Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+        if (!bSynced)
+        {
+            /* the last append broke off, continue from what arrived */
+            Poco::Int64 iRemoteSize = 0;
+            if (GetRemoteSizeImpl(m_pSession, sRemotePath, iRemoteSize))
+            {
+                iSent = (iRemoteSize <= iSize) ? iRemoteSize : 0;
+                bSynced = true;
+            }
+        }
+        else if (iSize < iSent)
+        {
+            /* truncated or replaced, start over */
+            iSent = 0;
+        }
+
+        if (bSynced && iSize > iSent)
+        {
+            {
+                Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+                m_FtpParam.iCurSize = (Poco::Int64)iSent;
+                m_FtpParam.iTotalSize = (Poco::Int64)iSize;
+            }
+            if (UploadFileImpl(sRemotePath, sLocalPath, iTimeout,
+                iSent, iSize - iSent))
+            {
+                iSent = iSize;
+            }
+            else
+            {
+                bSynced = false;
+            }
+            tGrown.update();
+        }
+        else if (bSynced &&
+            tGrown.isElapsed((Poco::Timestamp::TimeDiff)m_iIdleMs * 1000))
+        {
+            break;
+        }
+        m_WakeEvent.tryWait(m_iIntervalMs);
+    }
+    if (m_FtpParam.bCancel)
+    {
+        return false;
+    }
+
+    /* the writer closed the file, the remote copy must match it */
+    Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+    for (int i = 0; !m_FtpParam.bCancel; ++i)
+    {
+        /* checked again after every resend, at most two of them */
+        Poco::Int64 iRemoteSize = 0;
+        if (!GetRemoteSizeImpl(m_pSession, sRemotePath, iRemoteSize))
+        {
+            return false;
+        }
+        if (iRemoteSize == iSize)
+        {
+            return true;
+        }
+        if (i == 2)
+        {
+            break;
+        }
+        iSent = (iRemoteSize < iSize) ? iRemoteSize : 0;
+        fprintf(stderr, "remote size %lld differs from %lld, resending\n",
+            (long long)iRemoteSize, (long long)iSize);
+        if (!UploadFileImpl(sRemotePath, sLocalPath, iTimeout,
+            iSent, iSize - iSent))
+        {
+            return false;
+        }
+    }
     return false;
 }
 
-void FtpClient::run()
+bool FtpClient::GetRemoteSizeImpl(
+    CURL *pCurl,
+    const std::string &sRemotePath,
+    Poco::Int64 &iSize)
 {
-    try
+    if (NULL == pCurl)
     {
-        m_bOptResult = false;
+        return false;
+    }
+    curl_easy_reset(pCurl);
+    curl_easy_setopt(pCurl, CURLOPT_URL, sRemotePath.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_HEADERFUNCTION, _ThrowAway);
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+
+    CURLcode ret = curl_easy_perform(pCurl);
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+        return false;
+    }
+    double fSize = -1.0;
+    curl_easy_getinfo(pCurl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &fSize);
+    if (fSize < 0.0)
+    {
+        return false;
+    }
+    iSize = (Poco::Int64)fSize;
+    return true;
+}
+
+bool FtpClient::DownloadFileImpl(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    int iTimeout)
+{
+    bool bResult = false;
+
+    if (!Poco::File(sLocalPath).exists())
+    {
+        Poco::File(Poco::Path(sLocalPath).parent())
+            .createDirectories();
+    }
+    FILE *pFileHandle = fopen(sLocalPath.c_str(), "wb");
+    if (pFileHandle == NULL)
+    {
+        perror(NULL);
+        return false;
+    }
+    /* the server of the url first, then its replicas. The first one
+       that answers tells what the file is */
+    std::vector<std::string> vectSources(1, sRemotePath);
+    std::vector<std::string> vectReplicas;
+    ConnectRacer::Instance().GetReplicas(UrlUtil::GetHost(sRemotePath),
+        vectReplicas);
+    for (size_t i = 0; i < vectReplicas.size(); ++i)
+    {
+        vectSources.push_back(
+            UrlUtil::ReplaceHost(sRemotePath, vectReplicas[i]));
+    }
+    size_t iSource = 0;
+    double fileTotalSize = 0.0;
+    long iFileTime = -1;
+    while (iSource < vectSources.size() &&
+        !_GetUrlFileSize(fileTotalSize, vectSources[iSource], m_sUserPwd,
+        &iFileTime))
+    {
+        ++iSource;
+    }
+    if (iSource == vectSources.size())
+    {
+        fprintf(stderr, "_GetUrlFileSize failed%d\n", __LINE__);
+        fclose(pFileHandle);
+        return false;
+    }
+
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.sFileName = Poco::Path(sLocalPath).getFileName();
+        m_FtpParam.iTotalSize = (Poco::Int64)fileTotalSize;
+        m_FtpParam.pFileHandle = pFileHandle;
+        m_FtpParam.pClient = this;
+        m_FtpParam.pFunc = &FtpClient::OnDownLoad;
+        m_FtpParam.sHost = UrlUtil::GetHost(vectSources[iSource]);
+        m_FtpParam.iRateJob = m_iRateJob;
+        m_FtpParam.iCurSize = 0;
+    }
+
+    if (m_iDownloadSources > 1)
+    {
+        /* every replica with the same file takes a share */
+        std::vector<std::string> vectMirrors(1, vectSources[iSource]);
+        for (size_t i = iSource + 1; i < vectSources.size() &&
+            (int)vectMirrors.size() < m_iDownloadSources; ++i)
+        {
+            if (_IsSameFile(vectSources[i], m_sUserPwd, fileTotalSize,
+                iFileTime))
+            {
+                vectMirrors.push_back(vectSources[i]);
+            }
+        }
+        if (vectMirrors.size() > 1)
+        {
+            fclose(pFileHandle);
+            return DownloadRangesImpl(vectMirrors, sLocalPath,
+                (Poco::Int64)fileTotalSize);
+        }
+    }
+
+    SessionPool &pool = SessionPool::Instance();
+    const std::string &sUrl = vectSources[iSource];
+    CURL *pCurl = pool.Checkout(sUrl, m_sUserPwd);
+    curl_easy_setopt(pCurl, CURLOPT_URL, sUrl.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
+    //ӳʱ
+    if (iTimeout > 0)
+    {
+        curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, iTimeout);
+    }
+    // ӳʱ()
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+    // ʹٶȳʱķʽϿµ߳̿
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10);
+
+    curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, _WriteData);
+    curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &m_FtpParam);
+
+    curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
+    curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &m_FtpParam);
+
+    //curl_easy_setopt(pCurl, CURLOPT_VERBOSE, 1L);
 
-        switch (m_eCurOptMode)
+    CURLcode ret = _PerformTransfer(pCurl, m_FtpParam.sHost, &m_FtpParam);
+    size_t iFirst = iSource;
+    while (_IsFailover(ret) && !_IsStopped(&m_FtpParam))
+    {
+        /* REST at what has been written on the next replica with the
+           same file, the progress goes on from there */
+        do
         {
-        case Upload:
+            ++iSource;
+        } while (iSource < vectSources.size() &&
+            !_IsSameFile(vectSources[iSource], m_sUserPwd, fileTotalSize,
+            iFileTime));
+        if (iSource == vectSources.size())
         {
-            m_bOptResult = true;
-            while (!m_UploadTasks.empty())
-            {
-                std::pair<std::string, std::string> item =
-                    m_UploadTasks.front();
-                m_UploadTasks.pop_front();
-                if (!UploadFileImpl(item.first, item.second, 3))
-                {
-                    m_bOptResult = false;
-                    break;
-                }
-            }
-            m_UploadTasks.clear();
             break;
         }
-        case Download:
-            m_bOptResult = DownloadFileImpl(m_sRemotePath, m_sLocalPath, 3);
-            break;
-        default:
-            m_bOptResult = false;
-            break;
+        Poco::Int64 iOffset = _TellFile(pFileHandle);
+        std::string sHost = UrlUtil::GetHost(vectSources[iSource]);
+        fprintf(stderr, "%s from %s, going on at %lld from %s\n",
+            curl_easy_strerror(ret), m_FtpParam.sHost.c_str(),
+            (long long)iOffset, sHost.c_str());
+        {
+            Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+            m_FtpParam.sHost = sHost;
         }
+        curl_easy_setopt(pCurl, CURLOPT_URL, vectSources[iSource].c_str());
+        curl_easy_setopt(pCurl, CURLOPT_RESUME_FROM_LARGE,
+            (curl_off_t)iOffset);
+        ret = _PerformTransfer(pCurl, sHost, &m_FtpParam);
     }
-    catch (...)
+    fclose(pFileHandle);
+    if (ret == CURLE_OK)
     {
-        m_bOptResult = false;
+        bResult = true;
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+        bResult = false;
     }
+    /* after a failover the session is on another server than the one it
+       was checked out for */
+    pool.Checkin(pCurl, sUrl, m_sUserPwd, iSource == iFirst);
 
-    m_bRoutineStart.Store(false);
+    return bResult;
 }
 
-bool FtpClient::UploadFileImpl(
-    const std::string &sRemotePath,
+bool FtpClient::UploadFanOutImpl(
     const std::string &sLocalPath,
     int iTimeout)
 {
-    bool bResult = false;
+    FanOutBuffer buffer(sLocalPath, (int)m_vectFanOut.size());
+    if (!buffer.Open())
+    {
+        return false;
+    }
+    Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.sFileName = Poco::Path(sLocalPath).getFileName();
+        m_FtpParam.iTotalSize = (Poco::Int64)(iSize * m_vectFanOut.size());
+        m_FtpParam.pClient = this;
+        m_FtpParam.pFunc = &FtpClient::OnUpload;
+        m_FtpParam.iRateJob = m_iRateJob;
+    }
 
-    FILE *pFileHandle = fopen(sLocalPath.c_str(), "rb");
-    if (pFileHandle == NULL)
+    std::vector<FanOutWorker *> vectWorkers;
+    std::vector<Poco::Thread *> vectThreads;
+    for (size_t i = 0; i < m_vectFanOut.size(); ++i)
     {
-        perror(NULL);
-        return bResult;
+        vectWorkers.push_back(new FanOutWorker(buffer, (int)i,
+            m_vectFanOut[i], m_sUserPwd, iSize, iTimeout, m_FtpParam));
+        vectThreads.push_back(new Poco::Thread());
+        vectThreads.back()->start(*vectWorkers.back());
+    }
+    bool bResult = true;
+    for (size_t i = 0; i < vectThreads.size(); ++i)
+    {
+        vectThreads[i]->join();
+        bResult = bResult && m_vectFanOut[i].bResult;
+        delete vectThreads[i];
+        delete vectWorkers[i];
+    }
+    return bResult;
+}
+
+bool FtpClient::DownloadRangesImpl(
+    const std::vector<std::string> &vectSources,
+    const std::string &sLocalPath,
+    Poco::Int64 iSize)
+{
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.pFileHandle = NULL;
+    }
+    RangeScheduler scheduler(iSize, (int)vectSources.size());
+    std::vector<RangeWorker *> vectWorkers;
+    std::vector<Poco::Thread *> vectThreads;
+    for (size_t i = 0; i < vectSources.size(); ++i)
+    {
+        vectWorkers.push_back(new RangeWorker(scheduler, (int)i,
+            vectSources[i], m_sUserPwd, sLocalPath, m_FtpParam));
+        vectThreads.push_back(new Poco::Thread());
+        vectThreads.back()->start(*vectWorkers.back());
+    }
+    bool bWriteFailed = false;
+    for (size_t i = 0; i < vectThreads.size(); ++i)
+    {
+        vectThreads[i]->join();
+        bWriteFailed = bWriteFailed || vectWorkers[i]->IsWriteFailed();
+        delete vectThreads[i];
+        delete vectWorkers[i];
     }
+    bool bResult = scheduler.IsComplete() && !bWriteFailed;
+    if (!bResult)
+    {
+        fprintf(stderr, "%s incomplete\n", sLocalPath.c_str());
+    }
+    return bResult;
+}
 
+bool FtpClient::RemoteCopyImpl(int iTimeout)
+{
     {
         Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-        m_FtpParam.sFileName = Poco::Path(sLocalPath).getFileName();
-        m_FtpParam.pFileHandle = pFileHandle;
+        m_FtpParam.sFileName = Poco::Path(_GetUrlPath(m_sTargetPath),
+            Poco::Path::PATH_UNIX).getFileName();
+        m_FtpParam.pFileHandle = NULL;
         m_FtpParam.pClient = this;
         m_FtpParam.pFunc = &FtpClient::OnUpload;
+        m_FtpParam.sHost = UrlUtil::GetHost(m_sTargetPath);
+        m_FtpParam.iRateJob = m_iRateJob;
+    }
+    Poco::Int64 iSize = -1;
+    bool bRelay = false;
+    bool bResult = FxpCopyImpl(iSize, bRelay, iTimeout);
+    if (!bResult && bRelay && !_IsStopped(&m_FtpParam))
+    {
+        fprintf(stderr, "no FXP from %s to %s, relaying the file\n",
+            UrlUtil::GetHost(m_sRemotePath).c_str(),
+            UrlUtil::GetHost(m_sTargetPath).c_str());
+        m_bCopyRelayed = true;
+        /* unlike FXP the relay uses the bandwidth of this client */
+        BandwidthCalendar::Slot slot(m_bBackfill, _IsStopped, &m_FtpParam);
+        bResult = slot.IsHeld() && RelayCopyImpl(iSize, iTimeout);
     }
+    _InvalidateListCache(m_sTargetUserPwd, m_sTargetPath);
+    return bResult;
+}
 
-    CURL *pCurl = curl_easy_init();
-    if (NULL == pCurl)
+bool FtpClient::FxpCopyImpl(
+    Poco::Int64 &iSize,
+    bool &bRelay,
+    int iTimeout)
+{
+    iSize = -1;
+    bRelay = false;
+    const long iTimeoutMs = iTimeout * 1000L;
+    const long FXP_POLL_MS = 100;
+    /* slower than this between the servers counts as hung */
+    const Poco::Int64 FXP_MIN_RATE = 16 * 1024;
+    /* what a file of unknown size may take */
+    const Poco::Int64 FXP_UNSIZED_MS = 3600 * 1000;
+    ControlChannel source;
+    ControlChannel target;
+    if (!_OpenChannel(source, m_sRemotePath, m_sUserPwd, iTimeout) ||
+        !_OpenChannel(target, m_sTargetPath, m_sTargetUserPwd, iTimeout))
+    {
+        return false;
+    }
+    std::string sSourcePath = _GetUrlPath(m_sRemotePath);
+    std::string sTargetPath = _GetUrlPath(m_sTargetPath);
+    std::string sReply;
+    iSize = _GetChannelSize(source, sSourcePath, iTimeoutMs);
+    if (iSize >= 0)
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.iTotalSize = (Poco::Int64)iSize;
+    }
+    /* the missing directories, as CURLOPT_FTP_CREATE_MISSING_DIRS does
+       for uploads; one that exists already is refused */
+    for (std::string::size_type i = sTargetPath.find('/', 1);
+        i != std::string::npos; i = sTargetPath.find('/', i + 1))
+    {
+        target.Command("MKD " + sTargetPath.substr(0, i), sReply,
+            iTimeoutMs);
+    }
+
+    /* from here on a failure means the servers would not connect to
+       each other, the target has got nothing yet */
+    bRelay = true;
+    bool bExtended = false;
+    std::string sPort;
+    if (source.Command("TYPE I", sReply, iTimeoutMs) != 200 ||
+        target.Command("TYPE I", sReply, iTimeoutMs) != 200 ||
+        (sPort = _GetFxpPort(source, iTimeoutMs, bExtended)).empty() ||
+        target.Command((bExtended ? "EPRT " : "PORT ") + sPort, sReply,
+        iTimeoutMs) != 200)
+    {
+        fprintf(stderr, "FXP refused: %s\n", sReply.c_str());
+        return false;
+    }
+    /* the target connects at STOR, the source sends at RETR */
+    int iCode = target.Command("STOR " + sTargetPath, sReply, iTimeoutMs);
+    if (iCode != 150 && iCode != 125)
+    {
+        fprintf(stderr, "FXP refused: %s\n", sReply.c_str());
+        /* 550 and 553, the file itself is not allowed there */
+        bRelay = iCode != 550 && iCode != 553;
+        return false;
+    }
+    iCode = source.Command("RETR " + sSourcePath, sReply, iTimeoutMs);
+    if (iCode != 150 && iCode != 125)
+    {
+        fprintf(stderr, "FXP refused: %s\n", sReply.c_str());
+        target.Command("ABOR", sReply, FXP_POLL_MS);
+        bRelay = iCode != 550;
+        return false;
+    }
+
+    /* both end the transfer with a reply, no data passes here to time
+       a stall by. The copy gets the time it takes at FXP_MIN_RATE, the
+       side still busy after the other replied gets iTimeout more, and
+       Cancel() stops it */
+    Poco::Int64 iTransferMs = iSize >= 0 ?
+        iTimeoutMs + iSize * 1000 / FXP_MIN_RATE : FXP_UNSIZED_MS;
+    Poco::Timestamp tStart;
+    Poco::Timestamp tFirstReply;
+    bool bExpired = false;
+    int iSourceCode = 0;
+    int iTargetCode = 0;
+    std::string sSourceReply;
+    std::string sTargetReply;
+    while ((iSourceCode == 0 || iTargetCode == 0) &&
+        iSourceCode < 400 && iTargetCode < 400 &&
+        !source.IsBroken() && !target.IsBroken() &&
+        !_IsStopped(&m_FtpParam))
+    {
+        bool bReplied = iSourceCode != 0 || iTargetCode != 0;
+        if (tStart.elapsed() / 1000 > iTransferMs ||
+            (bReplied && tFirstReply.elapsed() / 1000 > iTimeoutMs))
+        {
+            bExpired = true;
+            break;
+        }
+        if (iSourceCode == 0)
+        {
+            iSourceCode = source.ReadReply(sSourceReply, 0);
+        }
+        if (iTargetCode == 0)
+        {
+            iTargetCode = target.ReadReply(sTargetReply, FXP_POLL_MS);
+        }
+        else if (iSourceCode == 0)
+        {
+            iSourceCode = source.ReadReply(sSourceReply, FXP_POLL_MS);
+        }
+        if (!bReplied && (iSourceCode != 0 || iTargetCode != 0))
+        {
+            tFirstReply.update();
+        }
+    }
+    if (bExpired || iSourceCode / 100 != 2 || iTargetCode / 100 != 2)
+    {
+        /* the side still busy is stopped, both once the time is up; the
+           reply does not matter as the connection is closed next */
+        if (bExpired || iSourceCode == 0)
+        {
+            source.Command("ABOR", sReply, FXP_POLL_MS);
+        }
+        if (bExpired || iTargetCode == 0)
+        {
+            target.Command("ABOR", sReply, FXP_POLL_MS);
+        }
+        if (bExpired)
+        {
+            fprintf(stderr, "FXP of %s did not end in time\n",
+                m_sRemotePath.c_str());
+        }
+        else if (!_IsStopped(&m_FtpParam))
+        {
+            fprintf(stderr, "FXP failed: %s / %s\n", sSourceReply.c_str(),
+                sTargetReply.c_str());
+        }
+        /* 425, one server could not open the data connection */
+        bRelay = iSourceCode == 425 || iTargetCode == 425;
+        return false;
+    }
+    bRelay = false;
+
+    Poco::Int64 iCopied = _GetChannelSize(target, sTargetPath, iTimeoutMs);
+    if (iSize >= 0 && iCopied >= 0 && iCopied != iSize)
+    {
+        fprintf(stderr, "%s has %lld of %lld bytes\n",
+            m_sTargetPath.c_str(), (long long)iCopied, (long long)iSize);
+        return false;
+    }
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.iCurSize = m_FtpParam.iTotalSize;
+    }
+    OnUpload(&m_FtpParam);
+    return true;
+}
+
+bool FtpClient::RelayCopyImpl(
+    Poco::Int64 iSize,
+    int iTimeout)
+{
+    if (NULL == m_pSession)
     {
         fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
-        return bResult;
+        return false;
     }
-    curl_easy_setopt(pCurl, CURLOPT_UPLOAD, 1L);
-    curl_easy_setopt(pCurl, CURLOPT_URL, sRemotePath.c_str());
+    {
+        Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+        m_FtpParam.iCurSize = 0;
+    }
+    RelayBuffer buffer;
+    RelayUploader uploader(buffer, m_sTargetPath, m_sTargetUserPwd, iSize,
+        iTimeout, m_FtpParam);
+    Poco::Thread uploadThread;
+    uploadThread.start(uploader);
+
+    /* the download is charged to the source, the upload to the target */
+    FtpParam sourceParam;
+    sourceParam.pTotal = &m_FtpParam;
+    sourceParam.sHost = UrlUtil::GetHost(m_sRemotePath);
+    sourceParam.iRateJob = m_iRateJob;
+    _RelayWrite relay = {&buffer, &sourceParam};
+
+    CURL *pCurl = m_pSession;
+    curl_easy_reset(pCurl);
+    curl_easy_setopt(pCurl, CURLOPT_URL, m_sRemotePath.c_str());
     curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
-
     if (iTimeout)
     {
         curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT, iTimeout);
     }
-    // ӳʱ()
-    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
-    // ʹٶȳʱķʽϿµ߳̿
-    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1);
-    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10);
-
-    curl_easy_setopt(pCurl, CURLOPT_READFUNCTION, _ReadData);
-    curl_easy_setopt(pCurl, CURLOPT_READDATA, &m_FtpParam);
-//     curl_easy_setopt(pCurl, CURLOPT_INFILESIZE_LARGE,
-//         (curl_off_t)m_FtpParam.iTotalSize);
-
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10L);
+    curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, _WriteRelay);
+    curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &relay);
     curl_easy_setopt(pCurl, CURLOPT_NOPROGRESS, 0L);
     curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
-    curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &m_FtpParam);
-
-    curl_easy_setopt(pCurl, CURLOPT_FTPPORT, "-"); /* disable passive mode */
-    curl_easy_setopt(pCurl, CURLOPT_FTP_CREATE_MISSING_DIRS, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &sourceParam);
 
-    //curl_easy_setopt(pCurl, CURLOPT_VERBOSE, 1L);
+    CURLcode ret = _PerformTransfer(pCurl, sourceParam.sHost, &sourceParam);
+    buffer.Finish(ret == CURLE_OK);
+    uploadThread.join();
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "%s: %s\n", m_sRemotePath.c_str(),
+            curl_easy_strerror(ret));
+    }
+    return ret == CURLE_OK && uploader.GetResult();
+}
 
-    CURLcode ret = curl_easy_perform(pCurl);
+bool FtpClient::WatchUploadImpl(
+    const std::string &sRemoteDirectory,
+    const std::string &sLocalDirectory)
+{
+    Poco::DirectoryWatcher watcher(sLocalDirectory,
+        Poco::DirectoryWatcher::DW_ITEM_ADDED |
+        Poco::DirectoryWatcher::DW_ITEM_MODIFIED |
+        Poco::DirectoryWatcher::DW_ITEM_MOVED_TO, 1);
+    watcher.itemAdded += Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+    watcher.itemModified +=
+        Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+    watcher.itemMovedTo +=
+        Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+
+    /* what is there already goes the same way once it is stable, the
+       watcher only reports what changes from now on */
+    std::vector<std::string> vectExisting;
+    PathScanHandler handler(sLocalDirectory, vectExisting);
+    DirScanner(m_Filter, handler, false).Scan(sLocalDirectory);
+    {
+        Poco::FastMutex::ScopedLock l(m_PendingMutex);
+        for (size_t i = 0; i < vectExisting.size(); ++i)
+        {
+            m_PendingFiles[vectExisting[i]];
+        }
+    }
 
-    fclose(pFileHandle);
+    /* the sessions take the stable files from the queue, so the limits
+       and priorities of a batch apply; this thread only watches */
+    std::vector<Poco::Thread *> vectThreads;
+    for (int i = 0; i < std::max(m_iMaxConcurrency, 1); ++i)
+    {
+        vectThreads.push_back(new Poco::Thread());
+        vectThreads.back()->start(m_WorkerRunnable);
+    }
 
-    if (ret == CURLE_OK)
+    /* wake up often enough to notice a quiet file within iStableMs */
+    long iPollMs = std::max(m_iStableMs / 4, 10);
+    while (!m_FtpParam.bCancel)
     {
-        bResult = true;
+        m_WakeEvent.tryWait(iPollMs);
+
+        std::vector<std::string> vectReady;
+        GetStableFiles(vectReady);
+        for (size_t i = 0; i < vectReady.size() && !m_FtpParam.bCancel; ++i)
+        {
+            const std::string &sLocalPath = vectReady[i];
+            Poco::Int64 iSize = -1;
+            try
+            {
+                iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+            }
+            catch (...)
+            {
+                /* gone again since it was found stable */
+                continue;
+            }
+            {
+                Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
+                m_FtpParam.iTotalSize += iSize;
+            }
+            m_TaskQueue.Push(m_TaskStore.AddFile(sRemoteDirectory +
+                Poco::Path(sLocalPath).getFileName(), sLocalPath, iSize));
+        }
     }
-    else
+
+    m_TaskQueue.Abort();
+    for (size_t i = 0; i < vectThreads.size(); ++i)
     {
-        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
-        bResult = false;
+        vectThreads[i]->join();
+        delete vectThreads[i];
     }
-    curl_easy_cleanup(pCurl);
-    return bResult;
+
+    watcher.itemAdded -= Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+    watcher.itemModified -=
+        Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+    watcher.itemMovedTo -=
+        Poco::delegate(this, &FtpClient::OnDirectoryChanged);
+    return true;
 }
 
-bool FtpClient::DownloadFileImpl(
-    const std::string &sRemotePath,
-    const std::string &sLocalPath,
-    int iTimeout)
+void FtpClient::GetStableFiles(std::vector<std::string> &vectReady)
 {
-    bool bResult = false;
+    Poco::Timestamp now;
+    Poco::Timestamp::TimeDiff iStable =
+        (Poco::Timestamp::TimeDiff)m_iStableMs * 1000;
 
-    if (!Poco::File(sLocalPath).exists())
+    Poco::FastMutex::ScopedLock l(m_PendingMutex);
+    std::map<std::string, PendingFile>::iterator it = m_PendingFiles.begin();
+    while (it != m_PendingFiles.end())
     {
-        Poco::File(Poco::Path(sLocalPath).parent())
-            .createDirectories();
+        Poco::Int64 iSize = -1;
+        Poco::Timestamp tModify(0);
+        try
+        {
+            Poco::File file(it->first);
+            if (file.isFile())
+            {
+                iSize = (Poco::Int64)file.getSize();
+                tModify = file.getLastModified();
+            }
+        }
+        catch (...)
+        {
+        }
+
+        if (iSize < 0)
+        {
+            m_PendingFiles.erase(it++);
+        }
+        else if (iSize != it->second.iSize ||
+            tModify != it->second.tModify)
+        {
+            it->second.iSize = iSize;
+            it->second.tModify = tModify;
+            if (it->second.tChanged < now)
+            {
+                it->second.tChanged = now;
+            }
+            ++it;
+        }
+        else if (now - it->second.tChanged >= iStable)
+        {
+            if (m_Filter.MatchAttributes(iSize, tModify.epochMicroseconds()))
+            {
+                vectReady.push_back(it->first);
+            }
+            m_PendingFiles.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
     }
-    FILE *pFileHandle = fopen(sLocalPath.c_str(), "wb");
-    if (pFileHandle == NULL)
+}
+
+void FtpClient::OnDirectoryChanged(
+    const void *pSender,
+    const Poco::DirectoryWatcher::DirectoryEvent &event)
+{
+    (void)pSender;
+    const std::string &sPath = event.item.path();
+    if (!m_Filter.MatchName(Poco::Path(sPath).getFileName()))
     {
-        perror(NULL);
-        return false;
+        return;
     }
-    double fileTotalSize;
-    if (!_GetUrlFileSize(fileTotalSize, sRemotePath, m_sUserPwd))
     {
-        fprintf(stderr, "_GetUrlFileSize failed%d\n", __LINE__);
-        return false;
+        Poco::FastMutex::ScopedLock l(m_PendingMutex);
+        m_PendingFiles[sPath].tChanged.update();
     }
+    m_WakeEvent.set();
+}
+
+bool FtpClient::DownloadMatchedFilesImpl(
+    const std::string &sRemotePattern,
+    const std::string &sLocalDirectory,
+    int iTimeout)
+{
+    Poco::File(sLocalDirectory).createDirectories();
+
+    WildcardParam wildcard;
+    wildcard.pFtpParam = &m_FtpParam;
+    wildcard.sLocalDirectory = sLocalDirectory;
+    wildcard.pFilter = &m_Filter;
+    wildcard.bFailed = false;
 
     {
         Poco::FastMutex::ScopedLock l(m_FtpParam.theMutex);
-        m_FtpParam.sFileName = Poco::Path(sLocalPath).getFileName();
-        m_FtpParam.iTotalSize = (long)fileTotalSize;
-        m_FtpParam.pFileHandle = pFileHandle;
+        m_FtpParam.pFileHandle = NULL;
         m_FtpParam.pClient = this;
         m_FtpParam.pFunc = &FtpClient::OnDownLoad;
+        m_FtpParam.sHost = UrlUtil::GetHost(sRemotePattern);
+        m_FtpParam.iRateJob = m_iRateJob;
     }
 
-    CURL *pCurl = curl_easy_init();
-    curl_easy_setopt(pCurl, CURLOPT_URL, sRemotePath.c_str());
+    SessionPool &pool = SessionPool::Instance();
+    CURL *pCurl = pool.Checkout(sRemotePattern, m_sUserPwd);
+    if (NULL == pCurl)
+    {
+        fprintf(stderr, "curl_easy_init failed!%d\n", __LINE__);
+        return false;
+    }
+    curl_easy_setopt(pCurl, CURLOPT_URL, sRemotePattern.c_str());
     curl_easy_setopt(pCurl, CURLOPT_USERPWD, m_sUserPwd.c_str());
-    //ӳʱ
     if (iTimeout > 0)
     {
-        curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, iTimeout);
+        curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT, iTimeout);
     }
-    // ӳʱ()
     curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
-    // ʹٶȳʱķʽϿµ߳̿
     curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_LIMIT, 1);
     curl_easy_setopt(pCurl, CURLOPT_LOW_SPEED_TIME, 10);
 
+    /* curl lists the directory and fetches each match on this session */
+    curl_easy_setopt(pCurl, CURLOPT_WILDCARDMATCH, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_CHUNK_BGN_FUNCTION, _BeginChunk);
+    curl_easy_setopt(pCurl, CURLOPT_CHUNK_END_FUNCTION, _EndChunk);
+    curl_easy_setopt(pCurl, CURLOPT_CHUNK_DATA, &wildcard);
+
     curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, _WriteData);
     curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &m_FtpParam);
 
@@ -615,22 +3385,43 @@ bool FtpClient::DownloadFileImpl(
     curl_easy_setopt(pCurl, CURLOPT_PROGRESSFUNCTION, _Progress);
     curl_easy_setopt(pCurl, CURLOPT_PROGRESSDATA, &m_FtpParam);
 
-    //curl_easy_setopt(pCurl, CURLOPT_VERBOSE, 1L);
+    CURLcode ret = _PerformTransfer(pCurl, m_FtpParam.sHost, &m_FtpParam);
+    /* an aborted transfer skips the end callback */
+    _EndChunk(&wildcard);
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "%s\n", curl_easy_strerror(ret));
+    }
+    pool.Checkin(pCurl, sRemotePattern, m_sUserPwd);
 
-    CURLcode ret = curl_easy_perform(pCurl);
-    fclose(pFileHandle);
-    if (ret == CURLE_OK)
+    return ret == CURLE_OK && !wildcard.bFailed;
+}
+
+bool FtpClient::ListDirectoryImpl(
+    const std::string &sUrlDirectory,
+    const std::string &sUserPwd,
+    FtpListHandler &handler)
+{
+    std::string sHost = UrlUtil::GetHost(sUrlDirectory);
+    bool bMlsd = !ListOnlyHosts::Instance().Contains(sHost);
+    CURLcode ret = _GetListing(handler, sUrlDirectory, sUserPwd, bMlsd);
+    if (bMlsd && ret == CURLE_FTP_COULDNT_RETR_FILE)
     {
-        bResult = true;
+        /* server rejected MLSD, retry with a plain LIST; what the MLSD
+           delivered before it failed is dropped */
+        handler.OnListRestart();
+        ret = _GetListing(handler, sUrlDirectory, sUserPwd, false);
+        if (ret == CURLE_OK)
+        {
+            ListOnlyHosts::Instance().Add(sHost);
+        }
     }
-    else
+    if (ret != CURLE_OK)
     {
         fprintf(stderr, "%s\n", curl_easy_strerror(ret));
-        bResult = false;
+        return false;
     }
-    curl_easy_cleanup(pCurl);
-
-    return bResult;
+    return true;
 }
 
 void FtpClient::OnUpload(const void *pParam)
@@ -640,7 +3431,7 @@ void FtpClient::OnUpload(const void *pParam)
         if (NULL == pParam || m_Observers.empty()) return;
     }
     std::string sFileName;
-    long iCurSize, iTotalSize;
+    Poco::Int64 iCurSize, iTotalSize;
     _GetProcessInfoWithLock(
         (FtpParam*)pParam, sFileName, iCurSize, iTotalSize);
     Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
@@ -664,7 +3455,7 @@ void FtpClient::OnDownLoad(const void *pParam)
         if (NULL == pParam || m_Observers.empty()) return;
     }
     std::string sFileName;
-    long iCurSize, iTotalSize;
+    Poco::Int64 iCurSize, iTotalSize;
     _GetProcessInfoWithLock(
         (FtpParam*)pParam, sFileName, iCurSize, iTotalSize);
     Poco::FastMutex::ScopedLock lock(m_CallbackMutex);
@@ -683,8 +3474,8 @@ void FtpClient::OnDownLoad(const void *pParam)
 
 bool FtpClient::GetCurProcess(
     std::string &sFileName,
-    long &iCurSize,
-    long &iTotalSize)
+    Poco::Int64 &iCurSize,
+    Poco::Int64 &iTotalSize)
 {
     if (m_bRoutineStart.Load())
     {
@@ -3,13 +3,24 @@
 
 #include <string>
 #include <vector>
-#include <deque>
+#include <map>
 #include <curl/curl.h>
 #include <Poco/Mutex.h>
 #include <Poco/Thread.h>
 #include <Poco/Runnable.h>
+#include <Poco/RunnableAdapter.h>
+#include <Poco/Event.h>
+#include <Poco/Timestamp.h>
+#include <Poco/DirectoryWatcher.h>
 
 #include "AtomicBool.h"
+#include "FileFilter.h"
+#include "TaskStore.h"
+#include "UploadTaskQueue.h"
+#include "FtpListParser.h"
+#include "RateLimiter.h"
+#include "BandwidthCalendar.h"
+#include "ConcurrencyController.h"
 
 class ProgressObserver
 {
@@ -18,37 +29,104 @@ public:
 
     virtual void OnUploadProgress(
         const std::string &sFileName,
-        long iCurSize,
-        long iTotalSize) = 0;
+        Poco::Int64 iCurSize,
+        Poco::Int64 iTotalSize) = 0;
 
     virtual void OnDownloadProgress(
         const std::string &sFileName,
-        long iCurSize,
-        long iTotalSize) = 0;
+        Poco::Int64 iCurSize,
+        Poco::Int64 iTotalSize) = 0;
 };
 
 class FtpClient;
 struct FtpParam
 {
+    FtpParam()
+    : pFileHandle(NULL)
+    , sFileName()
+    , iCurSize(0)
+    , iTotalSize(0)
+    , iReadRemain(-1)
+    , pClient(NULL)
+    , pFunc(NULL)
+    , bCancel(false)
+    , pTotal(NULL)
+    , iPriority(0)
+    , iTaskHost(TaskStore::RootHost)
+    , bYield(false)
+    , sHost()
+    , iRateJob(0)
+    , bAdaptive(false){}
+
     FILE *pFileHandle;
     std::string sFileName;
-    long iCurSize;
-    long iTotalSize;
+    Poco::Int64 iCurSize;
+    Poco::Int64 iTotalSize;
+    Poco::Int64 iReadRemain;
     FtpClient *pClient;
     void (FtpClient::*pFunc)(const void*);
     volatile bool bCancel;
+    /* batch counters and cancel flag shared by parallel transfers */
+    FtpParam *pTotal;
+    /* priority and server of the running task, bYield asks it to step
+       aside */
+    int iPriority;
+    TaskStore::HostId iTaskHost;
+    volatile bool bYield;
+    /* what the transferred bytes are charged to in RateLimiter */
+    std::string sHost;
+    int iRateJob;
+    /* feed ConcurrencyController with goodput samples */
+    bool bAdaptive;
     Poco::FastMutex theMutex;
 };
 
+/* how the upload of one file to one of several servers went */
+struct FanOutResult
+{
+    FanOutResult()
+    : sRemotePath()
+    , bResult(false)
+    , sError()
+    , iSent(0)
+    , bDetached(false){}
+
+    std::string sRemotePath;
+    bool bResult;
+    /* curl's message when it failed */
+    std::string sError;
+    Poco::Int64 iSent;
+    /* fell too far behind the others and read the file by itself */
+    bool bDetached;
+};
+
 class FtpClient
 : public Poco::Runnable
 , private Poco::Thread
+, private UploadTaskQueue::HostLimits
 {
     enum OptMode
     {
         Unknown,
         Upload,
         Download,
+        DownloadMatched,
+        WatchUpload,
+        TailUpload,
+        FanOutUpload,
+        RemoteCopy,
+    };
+
+    struct PendingFile
+    {
+        PendingFile()
+        : iSize(-1)
+        , tModify(0)
+        , tChanged(){}
+
+        Poco::Int64 iSize;
+        Poco::Timestamp tModify;
+        Poco::Timestamp tChanged;
     };
 
 public:
@@ -66,8 +144,8 @@ public:
 
     bool GetCurProcess(
         std::string &sFileName,
-        long &iCurSize,
-        long &iTotalSize);
+        Poco::Int64 &iCurSize,
+        Poco::Int64 &iTotalSize);
 
     bool UploadFileSync(
         const std::string &sRemotePath,
@@ -79,6 +157,16 @@ public:
         const std::string &sLocalPath,
         const std::string &sUserPwd = "");
 
+    /* queue one file with a priority: if an upload is running it joins
+       that batch ahead of everything less urgent, and when all sessions
+       are busy the least urgent transfer is paused and resumed later
+       from what the server already has */
+    bool SubmitUploadFile(
+        const std::string &sRemotePath,
+        const std::string &sLocalPath,
+        int iPriority,
+        const std::string &sUserPwd = "");
+
     bool UploadDirAllFilesAsync(
         const std::string &sRemoteDirectory,
         const std::string &sLocalDirectory,
@@ -91,6 +179,84 @@ public:
         bool bMatch = true,
         const std::string &sUserPwd = "");
 
+    bool UploadDirFilteredFilesAsync(
+        const std::string &sRemoteDirectory,
+        const std::string &sLocalDirectory,
+        const FileFilter &filter,
+        const std::string &sUserPwd = "");
+
+    /* upload sLocalDirectory with all subdirectories, missing remote
+       directories are created; the tree is scanned by several threads */
+    bool UploadDirTreeAsync(
+        const std::string &sRemoteDirectory,
+        const std::string &sLocalDirectory,
+        const FileFilter &filter = FileFilter(),
+        const std::string &sUserPwd = "");
+
+    /* keep uploading the files of sLocalDirectory, those already there
+       and those that appear, until Cancel(); a file is queued once its
+       size and modification time have been unchanged for iStableMs, and
+       sent over up to SetMaxConcurrency() sessions */
+    bool WatchDirUploadAsync(
+        const std::string &sRemoteDirectory,
+        const std::string &sLocalDirectory,
+        const std::vector<std::string> &vectMatch =
+            std::vector<std::string>(),
+        bool bMatch = true,
+        int iStableMs = 500,
+        const std::string &sUserPwd = "");
+
+    /* upload a file that is still being written: new tail bytes are
+       appended (APPE) every iIntervalMs, the file counts as closed
+       after iIdleMs without growth and is then checked by size */
+    bool UploadGrowingFileAsync(
+        const std::string &sRemotePath,
+        const std::string &sLocalPath,
+        int iIntervalMs = 1000,
+        int iIdleMs = 10000,
+        const std::string &sUserPwd = "");
+
+    /* one local file to several servers at once, read from disk only
+       once. True if every upload succeeded, GetFanOutResults tells how
+       each one went */
+    bool UploadFanOutSync(
+        const std::vector<std::string> &vectRemotePaths,
+        const std::string &sLocalPath,
+        const std::string &sUserPwd = "");
+
+    bool UploadFanOutAsync(
+        const std::vector<std::string> &vectRemotePaths,
+        const std::string &sLocalPath,
+        const std::string &sUserPwd = "");
+
+    /* one per server of the last fan-out upload, once it ended */
+    void GetFanOutResults(std::vector<FanOutResult> &vectResults);
+
+    /* copy a file from one server to another. The servers send it to
+       each other (FXP, PASV on the source and PORT on the target) and
+       only the commands go through this client. If a server does not
+       allow that, the file is relayed through memory instead, RETR on
+       one session fed into STOR on the other without touching the
+       disk. sTargetUserPwd empty logs in to the target as to the
+       source */
+    bool CopyRemoteFileSync(
+        const std::string &sSourcePath,
+        const std::string &sTargetPath,
+        const std::string &sUserPwd = "",
+        const std::string &sTargetUserPwd = "");
+
+    bool CopyRemoteFileAsync(
+        const std::string &sSourcePath,
+        const std::string &sTargetPath,
+        const std::string &sUserPwd = "",
+        const std::string &sTargetUserPwd = "");
+
+    /* the last copy went through this client, not server to server */
+    bool IsCopyRelayed() const;
+
+    /* if the server stalls or drops the connection, the download goes
+       on from the same offset on a replica set with
+       ConnectRacer::SetReplicas that has the same size and time */
     bool DownloadFileSync(
         const std::string &sRemotePath,
         const std::string &sLocalPath,
@@ -101,6 +267,81 @@ public:
         const std::string &sLocalPath,
         const std::string &sUserPwd = "");
 
+    /* download every file matching the wildcard in the last part of
+       sRemotePattern (e.g. "*.h264") over one session; an empty
+       vectMatch takes all matched files, otherwise filter by extension */
+    bool DownloadMatchedFilesAsync(
+        const std::string &sRemotePattern,
+        const std::string &sLocalDirectory,
+        const std::vector<std::string> &vectMatch =
+            std::vector<std::string>(),
+        bool bMatch = true,
+        const std::string &sUserPwd = "");
+
+    /* list remote directory, MLSD with LIST fallback, cached per dir */
+    bool ListDirectory(
+        const std::string &sRemoteDirectory,
+        std::vector<FtpFileInfo> &vectEntries,
+        bool bUseCache = true,
+        const std::string &sUserPwd = "");
+
+    /* stream entries to handler while parsing, bypasses the cache */
+    bool ListDirectory(
+        const std::string &sRemoteDirectory,
+        FtpListHandler &handler,
+        const std::string &sUserPwd = "");
+
+    /* look up a single entry through the cached parent listing */
+    bool GetRemoteFileInfo(
+        const std::string &sRemotePath,
+        FtpFileInfo &fileInfo,
+        const std::string &sUserPwd = "");
+
+    bool DeleteRemoteFile(
+        const std::string &sRemotePath,
+        const std::string &sUserPwd = "");
+
+    static void ClearListCache();
+
+    /* parallel sessions for directory uploads, applies from the next
+       routine on */
+    void SetMaxConcurrency(int iMaxConcurrency);
+
+    /* order in which the files of a directory upload are sent */
+    void SetSchedulePolicy(UploadTaskQueue::Policy ePolicy);
+
+    /* share of the RateLimiter total this client gets next to the
+       others that are transferring, 1 by default */
+    void SetRateWeight(int iWeight);
+
+    /* transfers of this client only run in BandwidthCalendar windows
+       that allow backfill, as do upload tasks of negative priority */
+    void SetBackfill(bool bBackfill);
+
+    /* let ConcurrencyController pick how many of the SetMaxConcurrency
+       sessions run against each server, failed transfers are retried
+       as long as that lowers the limit */
+    void SetAdaptiveConcurrency(bool bAdaptive);
+
+    /* sessions a batch may run against one server ("host[:port]" as in
+       the URL), 0 for no cap. With several servers in a batch they take
+       turns by bytes sent, a busy one does not hold the others up */
+    void SetHostMaxConcurrency(const std::string &sHost, int iMax);
+
+    /* a task that failed because its server is down goes back to the
+       queue, and while HostHealth holds the circuit open the server's
+       tasks wait there until it is back, instead of failing the batch */
+    void SetParkOnOutage(bool bPark);
+
+    /* downloads are split among up to iSources servers at once, the one
+       of the URL and its replicas with the same file, each one's share
+       following its throughput. 1 by default */
+    void SetDownloadSources(int iSources);
+
+    /* queue depth, running transfers and limit of each server of the
+       running batch; running / limit is the utilization */
+    void GetHostLoads(std::vector<UploadTaskQueue::HostLoad> &vectLoads);
+
     bool AwaitResult();
 
     bool Cancel();
@@ -112,16 +353,114 @@ private:
     bool SetStartState(const std::string &sUserPwd,
         OptMode eCurOptMode);
 
+    bool StartDirUpload(
+        const std::string &sRemoteDirectory,
+        const std::string &sLocalDirectory,
+        const FileFilter &filter,
+        bool bRecursive,
+        const std::string &sUserPwd);
+
+    /* producer side of m_TaskQueue, runs on m_ScanThread */
+    void ScanDirectory();
+
+    /* drain m_TaskQueue over m_iMaxConcurrency sessions */
+    bool UploadTasksImpl(int iTimeout);
+
+    /* entry of the extra transfer threads */
+    void UploadWorker();
+
+    /* takes tasks until the queue is done, on a pooled session to the
+       server of the task at hand */
+    bool UploadTaskLoop(FtpParam &ftpParam, int iTimeout);
+
+    /* ask the least urgent running transfer below iPriority to yield
+       when no session may take a new task for iHost */
+    void PreemptFor(int iPriority, TaskStore::HostId iHost);
+
+    /* the cap set for the server, lowered to what ConcurrencyController
+       allows when adaptive */
+    int GetHostLimit(TaskStore::HostId iHost);
+
+    /* iOffset > 0 appends the range to the remote file */
+    bool UploadFileImpl(
+        const std::string &sRemotePath,
+        const std::string &sLocalPath,
+        int iTimeout,
+        Poco::Int64 iOffset = 0,
+        Poco::Int64 iLength = -1);
+
     bool UploadFileImpl(
+        CURL *pCurl,
+        FtpParam &ftpParam,
+        const std::string &sRemotePath,
+        const std::string &sLocalPath,
+        int iTimeout,
+        Poco::Int64 iOffset = 0,
+        Poco::Int64 iLength = -1,
+        CURLcode *pError = NULL,
+        bool *pHostDown = NULL);
+
+    bool TailUploadImpl(
         const std::string &sRemotePath,
         const std::string &sLocalPath,
         int iTimeout);
 
+    /* one FanOutWorker thread per entry of m_vectFanOut */
+    bool UploadFanOutImpl(
+        const std::string &sLocalPath,
+        int iTimeout);
+
+    /* FXP first, the relay if the servers would not do it */
+    bool RemoteCopyImpl(int iTimeout);
+
+    /* iSize is the size of the source, -1 if it did not tell. bRelay is
+       set when the copy failed before the target got any data */
+    bool FxpCopyImpl(
+        Poco::Int64 &iSize,
+        bool &bRelay,
+        int iTimeout);
+
+    /* RETR on m_pSession, STOR on a RelayUploader thread */
+    bool RelayCopyImpl(
+        Poco::Int64 iSize,
+        int iTimeout);
+
+    bool GetRemoteSizeImpl(
+        CURL *pCurl,
+        const std::string &sRemotePath,
+        Poco::Int64 &iSize);
+
     bool DownloadFileImpl(
         const std::string &sRemotePath,
         const std::string &sLocalPath,
         int iTimeout);
 
+    /* one RangeWorker thread per source, all writing into sLocalPath */
+    bool DownloadRangesImpl(
+        const std::vector<std::string> &vectSources,
+        const std::string &sLocalPath,
+        Poco::Int64 iSize);
+
+    bool WatchUploadImpl(
+        const std::string &sRemoteDirectory,
+        const std::string &sLocalDirectory);
+
+    void GetStableFiles(std::vector<std::string> &vectReady);
+
+    void OnDirectoryChanged(
+        const void *pSender,
+        const Poco::DirectoryWatcher::DirectoryEvent &event);
+
+    bool DownloadMatchedFilesImpl(
+        const std::string &sRemotePattern,
+        const std::string &sLocalDirectory,
+        int iTimeout);
+
+    bool ListDirectoryImpl(
+        const std::string &sUrlDirectory,
+        const std::string &sUserPwd,
+        FtpListHandler &handler);
+
     void OnUpload(const void *pParam);
 
     void OnDownLoad(const void *pParam);
@@ -132,15 +471,46 @@ private:
 
 private:
     std::vector<ProgressObserver *> m_Observers;
-    std::deque<std::pair<std::string, std::string> > m_UploadTasks;
+    TaskStore m_TaskStore;
+    UploadTaskQueue m_TaskQueue;
+    std::map<std::string, PendingFile> m_PendingFiles;
+    std::vector<FtpParam *> m_RunningParams;
 
     Poco::FastMutex m_CallbackMutex;
+    Poco::FastMutex m_PendingMutex;
+    Poco::FastMutex m_RunningMutex;
+    Poco::Event m_WakeEvent;
 
     std::string m_sLocalPath;
     std::string m_sRemotePath;
+    /* where a remote copy goes, and the login there */
+    std::string m_sTargetPath;
     std::string m_sUserPwd;
+    std::string m_sTargetUserPwd;
+    FileFilter m_Filter;
+    int m_iStableMs;
+    int m_iIntervalMs;
+    int m_iIdleMs;
     OptMode m_eCurOptMode;
     bool m_bOptResult;
+    bool m_bRecursive;
+    bool m_bScanFailed;
+    volatile bool m_bWorkerFailed;
+    int m_iMaxConcurrency;
+    UploadTaskQueue::Policy m_eSchedulePolicy;
+    int m_iRateJob;
+    bool m_bBackfill;
+    bool m_bAdaptive;
+    bool m_bParkOnOutage;
+    int m_iDownloadSources;
+    std::vector<FanOutResult> m_vectFanOut;
+    bool m_bCopyRelayed;
+    std::map<std::string, int> m_HostCaps;
+    Poco::FastMutex m_HostCapMutex;
+    CURL *m_pSession;
+    Poco::RunnableAdapter<FtpClient> m_ScanRunnable;
+    Poco::RunnableAdapter<FtpClient> m_WorkerRunnable;
+    Poco::Thread m_ScanThread;
 
     FtpParam m_FtpParam;
     AtomicBool m_bRoutineStart;
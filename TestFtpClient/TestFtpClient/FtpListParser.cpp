@@ -0,0 +1,445 @@
+#include <string.h>
+#include <Poco/DateTime.h>
+
+#include "FtpListParser.h"
+
+namespace // anonymous namespace begin
+{
+    const Poco::Timestamp::TimeVal SECOND = 1000000;
+    const int MAX_FIELDS = 12;
+
+    struct Field
+    {
+        const char *pBegin;
+        const char *pEnd;
+    };
+
+    inline bool _IsDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool _IsBlank(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    inline char _ToLower(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+    }
+
+    bool _ParseNumber(
+        const char *pBegin,
+        const char *pEnd,
+        Poco::Int64 &iValue)
+    {
+        if (pBegin == pEnd) return false;
+        iValue = 0;
+        for (; pBegin != pEnd; ++pBegin)
+        {
+            if (!_IsDigit(*pBegin)) return false;
+            iValue = iValue * 10 + (*pBegin - '0');
+        }
+        return true;
+    }
+
+    /* caller guarantees iCount digits */
+    int _ParseDigits(const char *p, int iCount)
+    {
+        int iValue = 0;
+        for (int i = 0; i < iCount; ++i)
+        {
+            iValue = iValue * 10 + (p[i] - '0');
+        }
+        return iValue;
+    }
+
+    bool _AllDigits(const char *p, int iCount)
+    {
+        for (int i = 0; i < iCount; ++i)
+        {
+            if (!_IsDigit(p[i])) return false;
+        }
+        return true;
+    }
+
+    bool _EqualsNoCase(
+        const char *pBegin,
+        const char *pEnd,
+        const char *szValue)
+    {
+        for (; pBegin != pEnd; ++pBegin, ++szValue)
+        {
+            if (*szValue == '\0' || _ToLower(*pBegin) != *szValue)
+            {
+                return false;
+            }
+        }
+        return *szValue == '\0';
+    }
+
+    bool _ContainsNoCase(
+        const char *pBegin,
+        const char *pEnd,
+        const char *szValue)
+    {
+        size_t iLen = strlen(szValue);
+        for (; pBegin + iLen <= pEnd; ++pBegin)
+        {
+            if (_EqualsNoCase(pBegin, pBegin + iLen, szValue)) return true;
+        }
+        return false;
+    }
+
+    int _ParseMonth(const char *pBegin, const char *pEnd)
+    {
+        static const char *szMonths[] = {"jan", "feb", "mar", "apr",
+            "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"};
+        if (pEnd - pBegin != 3) return 0;
+        for (int i = 0; i < 12; ++i)
+        {
+            if (_EqualsNoCase(pBegin, pEnd, szMonths[i])) return i + 1;
+        }
+        return 0;
+    }
+
+    /* days since 1970-01-01 in the proleptic Gregorian calendar */
+    Poco::Int64 _DaysFromCivil(int iYear, int iMonth, int iDay)
+    {
+        iYear -= iMonth <= 2;
+        int iEra = (iYear >= 0 ? iYear : iYear - 399) / 400;
+        int iYearOfEra = iYear - iEra * 400;
+        int iDayOfYear = (153 * (iMonth + (iMonth > 2 ? -3 : 9)) + 2) / 5
+            + iDay - 1;
+        int iDayOfEra = iYearOfEra * 365 + iYearOfEra / 4
+            - iYearOfEra / 100 + iDayOfYear;
+        return (Poco::Int64)iEra * 146097 + iDayOfEra - 719468;
+    }
+
+    /* UTC time in microseconds, 0 for out of range fields */
+    Poco::Timestamp::TimeVal _MakeTime(
+        int iYear, int iMonth, int iDay,
+        int iHour, int iMinute, int iSecond)
+    {
+        if (iMonth < 1 || iMonth > 12 || iDay < 1 || iDay > 31 ||
+            iHour < 0 || iHour > 23 || iMinute < 0 || iMinute > 59 ||
+            iSecond < 0 || iSecond > 60)
+        {
+            return 0;
+        }
+        return (_DaysFromCivil(iYear, iMonth, iDay) * 86400 +
+            iHour * 3600 + iMinute * 60 + iSecond) * SECOND;
+    }
+
+    int _SplitFields(
+        const char *pBegin,
+        const char *pEnd,
+        Field *pFields,
+        int iMaxFields)
+    {
+        int iCount = 0;
+        while (iCount < iMaxFields)
+        {
+            while (pBegin != pEnd && _IsBlank(*pBegin)) ++pBegin;
+            if (pBegin == pEnd) break;
+            pFields[iCount].pBegin = pBegin;
+            while (pBegin != pEnd && !_IsBlank(*pBegin)) ++pBegin;
+            pFields[iCount].pEnd = pBegin;
+            ++iCount;
+        }
+        return iCount;
+    }
+} // anonymous namespace end
+
+FtpListParser::FtpListParser(FtpListHandler &handler, bool bMlsd)
+: m_Handler(handler)
+, m_bMlsd(bMlsd)
+, m_iEntryCount(0)
+, m_sPending()
+, m_iCurYear(Poco::DateTime().year())
+, m_tLatest(Poco::Timestamp().epochMicroseconds() + 86400 * SECOND)
+{
+}
+
+void FtpListParser::Feed(const char *pData, size_t iSize)
+{
+    const char *pEnd = pData + iSize;
+    if (!m_sPending.empty())
+    {
+        const char *pNewline = (const char *)memchr(pData, '\n', iSize);
+        if (pNewline == NULL)
+        {
+            m_sPending.append(pData, iSize);
+            return;
+        }
+        m_sPending.append(pData, pNewline);
+        ParseLine(m_sPending.data(), m_sPending.data() + m_sPending.size());
+        m_sPending.clear();
+        pData = pNewline + 1;
+    }
+
+    /* complete lines are parsed in place, only a split tail is copied */
+    while (pData < pEnd)
+    {
+        const char *pNewline =
+            (const char *)memchr(pData, '\n', pEnd - pData);
+        if (pNewline == NULL)
+        {
+            m_sPending.assign(pData, pEnd);
+            return;
+        }
+        ParseLine(pData, pNewline);
+        pData = pNewline + 1;
+    }
+}
+
+void FtpListParser::Finish()
+{
+    if (!m_sPending.empty())
+    {
+        ParseLine(m_sPending.data(), m_sPending.data() + m_sPending.size());
+        m_sPending.clear();
+    }
+}
+
+size_t FtpListParser::GetEntryCount() const
+{
+    return m_iEntryCount;
+}
+
+void FtpListParser::ParseLine(const char *pBegin, const char *pEnd)
+{
+    if (pBegin != pEnd && pEnd[-1] == '\r') --pEnd;
+    if (pBegin == pEnd) return;
+
+    FtpListEntry entry;
+    entry.pName = NULL;
+    entry.iNameLen = 0;
+    entry.eType = FtpFileInfo::Unknown;
+    entry.iSize = 0;
+    entry.tModify = 0;
+
+    bool bParsed = false;
+    if (m_bMlsd)
+    {
+        bParsed = ParseMlsdLine(pBegin, pEnd, entry);
+    }
+    else if (_IsDigit(*pBegin))
+    {
+        bParsed = ParseDosLine(pBegin, pEnd, entry);
+    }
+    else
+    {
+        bParsed = ParseUnixLine(pBegin, pEnd, entry);
+    }
+
+    if (bParsed)
+    {
+        ++m_iEntryCount;
+        m_Handler.OnListEntry(entry);
+    }
+}
+
+/* type=file;size=1024;modify=20170101120000; name */
+bool FtpListParser::ParseMlsdLine(
+    const char *pBegin,
+    const char *pEnd,
+    FtpListEntry &entry)
+{
+    const char *pSpace = (const char *)memchr(pBegin, ' ', pEnd - pBegin);
+    if (pSpace == NULL || pSpace + 1 >= pEnd) return false;
+    entry.pName = pSpace + 1;
+    entry.iNameLen = pEnd - entry.pName;
+
+    const char *pFact = pBegin;
+    while (pFact < pSpace)
+    {
+        const char *pFactEnd = pFact;
+        while (pFactEnd != pSpace && *pFactEnd != ';') ++pFactEnd;
+        const char *pEqual = pFact;
+        while (pEqual != pFactEnd && *pEqual != '=') ++pEqual;
+
+        if (pEqual != pFactEnd)
+        {
+            const char *pValue = pEqual + 1;
+            if (_EqualsNoCase(pFact, pEqual, "type"))
+            {
+                if (_EqualsNoCase(pValue, pFactEnd, "file"))
+                {
+                    entry.eType = FtpFileInfo::File;
+                }
+                else if (_EqualsNoCase(pValue, pFactEnd, "dir"))
+                {
+                    entry.eType = FtpFileInfo::Directory;
+                }
+                else if (_EqualsNoCase(pValue, pFactEnd, "cdir") ||
+                    _EqualsNoCase(pValue, pFactEnd, "pdir"))
+                {
+                    return false;
+                }
+                else if (_ContainsNoCase(pValue, pFactEnd, "link"))
+                {
+                    entry.eType = FtpFileInfo::Link;
+                }
+            }
+            else if (_EqualsNoCase(pFact, pEqual, "size"))
+            {
+                _ParseNumber(pValue, pFactEnd, entry.iSize);
+            }
+            else if (_EqualsNoCase(pFact, pEqual, "modify") &&
+                pFactEnd - pValue >= 14 && _AllDigits(pValue, 14))
+            {
+                entry.tModify = _MakeTime(
+                    _ParseDigits(pValue, 4),
+                    _ParseDigits(pValue + 4, 2),
+                    _ParseDigits(pValue + 6, 2),
+                    _ParseDigits(pValue + 8, 2),
+                    _ParseDigits(pValue + 10, 2),
+                    _ParseDigits(pValue + 12, 2));
+            }
+        }
+        pFact = pFactEnd + 1;
+    }
+    return true;
+}
+
+/* 01-31-17  10:30AM       <DIR>          name */
+bool FtpListParser::ParseDosLine(
+    const char *pBegin,
+    const char *pEnd,
+    FtpListEntry &entry)
+{
+    Field fields[4];
+    if (_SplitFields(pBegin, pEnd, fields, 4) < 4) return false;
+
+    const Field &date = fields[0];
+    const Field &time = fields[1];
+    if (date.pEnd - date.pBegin < 8 || time.pEnd - time.pBegin < 5 ||
+        !_AllDigits(date.pBegin, 2) || !_AllDigits(date.pBegin + 3, 2) ||
+        !_AllDigits(date.pBegin + 6, 2) ||
+        !_AllDigits(time.pBegin, 2) || !_AllDigits(time.pBegin + 3, 2))
+    {
+        return false;
+    }
+
+    int iYear = 0;
+    if (date.pEnd - date.pBegin >= 10 && _AllDigits(date.pBegin + 6, 4))
+    {
+        iYear = _ParseDigits(date.pBegin + 6, 4);
+    }
+    else
+    {
+        iYear = _ParseDigits(date.pBegin + 6, 2);
+        iYear += (iYear < 70) ? 2000 : 1900;
+    }
+    int iHour = _ParseDigits(time.pBegin, 2);
+    if (time.pEnd - time.pBegin >= 7)
+    {
+        iHour %= 12;
+        if (_ToLower(time.pBegin[5]) == 'p') iHour += 12;
+    }
+    entry.tModify = _MakeTime(iYear,
+        _ParseDigits(date.pBegin, 2), _ParseDigits(date.pBegin + 3, 2),
+        iHour, _ParseDigits(time.pBegin + 3, 2), 0);
+
+    if (_EqualsNoCase(fields[2].pBegin, fields[2].pEnd, "<dir>"))
+    {
+        entry.eType = FtpFileInfo::Directory;
+    }
+    else if (_ParseNumber(fields[2].pBegin, fields[2].pEnd, entry.iSize))
+    {
+        entry.eType = FtpFileInfo::File;
+    }
+    else
+    {
+        return false;
+    }
+
+    entry.pName = fields[3].pBegin;
+    entry.iNameLen = pEnd - entry.pName;
+    return true;
+}
+
+/* -rw-r--r--   1 owner group   1024 Jan 31 10:30 name */
+bool FtpListParser::ParseUnixLine(
+    const char *pBegin,
+    const char *pEnd,
+    FtpListEntry &entry)
+{
+    Field fields[MAX_FIELDS];
+    int iCount = _SplitFields(pBegin, pEnd, fields, MAX_FIELDS);
+
+    /* the group column is optional, so anchor on the month */
+    int iMonth = 0;
+    int iMon = 0;
+    Poco::Int64 iDay = 0;
+    for (int i = 2; i + 3 < iCount; ++i)
+    {
+        iMon = _ParseMonth(fields[i].pBegin, fields[i].pEnd);
+        if (iMon &&
+            _ParseNumber(fields[i + 1].pBegin, fields[i + 1].pEnd, iDay) &&
+            _ParseNumber(fields[i - 1].pBegin, fields[i - 1].pEnd,
+                entry.iSize))
+        {
+            iMonth = i;
+            break;
+        }
+    }
+    if (iMonth == 0) return false;
+
+    switch (*pBegin)
+    {
+    case '-': entry.eType = FtpFileInfo::File; break;
+    case 'd': entry.eType = FtpFileInfo::Directory; break;
+    case 'l': entry.eType = FtpFileInfo::Link; break;
+    default: entry.eType = FtpFileInfo::Unknown; break;
+    }
+
+    const Field &yearOrTime = fields[iMonth + 2];
+    const char *pColon = (const char *)memchr(yearOrTime.pBegin, ':',
+        yearOrTime.pEnd - yearOrTime.pBegin);
+    if (pColon == NULL)
+    {
+        Poco::Int64 iYear = 0;
+        _ParseNumber(yearOrTime.pBegin, yearOrTime.pEnd, iYear);
+        entry.tModify = _MakeTime((int)iYear, iMon, (int)iDay, 0, 0, 0);
+    }
+    else
+    {
+        /* no year means within the last six months */
+        Poco::Int64 iHour = 0;
+        Poco::Int64 iMinute = 0;
+        _ParseNumber(yearOrTime.pBegin, pColon, iHour);
+        _ParseNumber(pColon + 1, yearOrTime.pEnd, iMinute);
+        entry.tModify = _MakeTime(m_iCurYear, iMon, (int)iDay,
+            (int)iHour, (int)iMinute, 0);
+        if (entry.tModify > m_tLatest)
+        {
+            entry.tModify = _MakeTime(m_iCurYear - 1, iMon, (int)iDay,
+                (int)iHour, (int)iMinute, 0);
+        }
+    }
+
+    entry.pName = fields[iMonth + 3].pBegin;
+    entry.iNameLen = pEnd - entry.pName;
+    if (entry.eType == FtpFileInfo::Link)
+    {
+        for (const char *p = entry.pName; p + 4 <= pEnd; ++p)
+        {
+            if (p[0] == ' ' && p[1] == '-' && p[2] == '>' && p[3] == ' ')
+            {
+                entry.iNameLen = p - entry.pName;
+                break;
+            }
+        }
+    }
+
+    if ((entry.iNameLen == 1 && entry.pName[0] == '.') ||
+        (entry.iNameLen == 2 && entry.pName[0] == '.' &&
+            entry.pName[1] == '.'))
+    {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _FtpListParser_H_
+#define _FtpListParser_H_
+
+#include <string>
+#include <Poco/Timestamp.h>
+
+struct FtpFileInfo
+{
+    enum FileType
+    {
+        Unknown,
+        File,
+        Directory,
+        Link,
+    };
+
+    FtpFileInfo()
+    : sName()
+    , eType(Unknown)
+    , iSize(0)
+    , tModify(0){}
+
+    std::string sName;
+    FileType eType;
+    Poco::Int64 iSize;
+    Poco::Timestamp tModify;
+};
+
+/* one parsed line, pName points into the parser's input */
+struct FtpListEntry
+{
+    const char *pName;
+    size_t iNameLen;
+    FtpFileInfo::FileType eType;
+    Poco::Int64 iSize;
+    Poco::Timestamp::TimeVal tModify;
+};
+
+class FtpListHandler
+{
+public:
+    virtual ~FtpListHandler(){}
+
+    virtual void OnListEntry(const FtpListEntry &entry) = 0;
+
+    /* the listing starts over, e.g. with LIST after MLSD failed part
+       way; the entries passed so far do not count */
+    virtual void OnListRestart(){}
+};
+
+/* incremental MLSD / LIST (Unix, DOS) parser, fed as data arrives */
+class FtpListParser
+{
+public:
+    FtpListParser(FtpListHandler &handler, bool bMlsd);
+
+    void Feed(const char *pData, size_t iSize);
+
+    /* parse a trailing line without newline */
+    void Finish();
+
+    size_t GetEntryCount() const;
+
+private:
+    void ParseLine(const char *pBegin, const char *pEnd);
+
+    bool ParseMlsdLine(const char *pBegin, const char *pEnd,
+        FtpListEntry &entry);
+
+    bool ParseDosLine(const char *pBegin, const char *pEnd,
+        FtpListEntry &entry);
+
+    bool ParseUnixLine(const char *pBegin, const char *pEnd,
+        FtpListEntry &entry);
+
+    FtpListParser(const FtpListParser &rhs);
+
+    FtpListParser & operator=(const FtpListParser &rhs);
+
+private:
+    FtpListHandler &m_Handler;
+    bool m_bMlsd;
+    size_t m_iEntryCount;
+    std::string m_sPending;
+    int m_iCurYear;
+    Poco::Timestamp::TimeVal m_tLatest;
+};
+
+#endif // _FtpListParser_H_
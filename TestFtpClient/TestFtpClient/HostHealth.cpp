@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <algorithm>
+#include <Poco/SingletonHolder.h>
+
+#include "HostHealth.h"
+
+namespace // anonymous namespace begin
+{
+    /* the longest a failed probe leaves the circuit open */
+    const Poco::Timestamp::TimeDiff MAX_OPEN_US =
+        (Poco::Timestamp::TimeDiff)5 * 60 * 1000 * 1000;
+
+    /* a probe that did not report by then does not hold the others back,
+       a long transfer may be the probe or its thread may be gone */
+    const Poco::Timestamp::TimeDiff PROBE_TIMEOUT_US = 30 * 1000 * 1000;
+} // anonymous namespace end
+
+HostHealth &HostHealth::Instance()
+{
+    static Poco::SingletonHolder<HostHealth> sh;
+    return *sh.get();
+}
+
+const char *HostHealth::GetName(State eState)
+{
+    switch (eState)
+    {
+    case HalfOpen:
+        return "half-open";
+    case Open:
+        return "open";
+    default:
+        return "closed";
+    }
+}
+
+HostHealth::HostHealth()
+: m_Hosts()
+, m_iThreshold(3)
+, m_iOpenUs(10 * 1000 * 1000)
+{
+}
+
+void HostHealth::SetThreshold(int iFailures)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iThreshold = std::max(iFailures, 1);
+}
+
+void HostHealth::SetOpenTime(long iMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iOpenUs = (Poco::Timestamp::TimeDiff)std::max(iMs, 1L) * 1000;
+}
+
+bool HostHealth::Allow(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::iterator it = m_Hosts.find(sHost);
+    if (it == m_Hosts.end())
+    {
+        return true;
+    }
+    Host &host = it->second;
+    Poco::Timestamp now;
+    switch (GetStateLocked(host, now))
+    {
+    case Closed:
+        return true;
+    case HalfOpen:
+        host.bProbing = true;
+        host.tProbe = now;
+        return true;
+    default:
+        ++host.iRejected;
+        return false;
+    }
+}
+
+void HostHealth::ReportSuccess(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::iterator it = m_Hosts.find(sHost);
+    if (it == m_Hosts.end())
+    {
+        return;
+    }
+    Host &host = it->second;
+    if (host.eState == Open)
+    {
+        fprintf(stderr, "%s is back, circuit closed\n", sHost.c_str());
+    }
+    host.eState = Closed;
+    host.iFailures = 0;
+    host.iOpenUs = 0;
+    host.bProbing = false;
+}
+
+void HostHealth::ReportFailure(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    Poco::Timestamp now;
+    ++host.iFailures;
+    if (host.eState == Open)
+    {
+        /* a failed probe, or an attempt that started before the trip */
+        if (host.bProbing)
+        {
+            host.bProbing = false;
+            host.iOpenUs = std::min(host.iOpenUs * 2, MAX_OPEN_US);
+            host.tRetry = now + host.iOpenUs;
+        }
+        return;
+    }
+    if (host.iFailures >= m_iThreshold)
+    {
+        Trip(host, now);
+        fprintf(stderr, "%s failed %d times in a row, circuit open for "
+            "%ld ms\n", sHost.c_str(), host.iFailures,
+            (long)(host.iOpenUs / 1000));
+    }
+}
+
+void HostHealth::ReportAborted(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::iterator it = m_Hosts.find(sHost);
+    if (it != m_Hosts.end())
+    {
+        it->second.bProbing = false;
+    }
+}
+
+HostHealth::State HostHealth::GetState(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    return it != m_Hosts.end() ?
+        GetStateLocked(it->second, Poco::Timestamp()) : Closed;
+}
+
+HostHealth::Status HostHealth::GetStatus(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Status status;
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    if (it == m_Hosts.end())
+    {
+        return status;
+    }
+    const Host &host = it->second;
+    Poco::Timestamp now;
+    status.eState = GetStateLocked(host, now);
+    status.iFailures = host.iFailures;
+    status.iTrips = host.iTrips;
+    status.iRejected = host.iRejected;
+    if (host.eState == Open && host.tRetry > now)
+    {
+        status.iRetryMs = (long)((host.tRetry - now) / 1000);
+    }
+    return status;
+}
+
+void HostHealth::Clear()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Hosts.clear();
+}
+
+HostHealth::State HostHealth::GetStateLocked(
+    const Host &host,
+    const Poco::Timestamp &now) const
+{
+    if (host.eState == Closed)
+    {
+        return Closed;
+    }
+    if (now < host.tRetry ||
+        (host.bProbing && now - host.tProbe < PROBE_TIMEOUT_US))
+    {
+        return Open;
+    }
+    return HalfOpen;
+}
+
+void HostHealth::Trip(Host &host, const Poco::Timestamp &now)
+{
+    host.eState = Open;
+    host.iOpenUs = m_iOpenUs;
+    host.tRetry = now + host.iOpenUs;
+    host.bProbing = false;
+    ++host.iTrips;
+}
@@ -0,0 +1,125 @@
+#ifndef _HostHealth_H_
+#define _HostHealth_H_
+
+#include <string>
+#include <map>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
+
+/* whether each server is up, shared by every FtpClient of the process.
+   A circuit breaker per host: after a number of connect or login
+   failures in a row the circuit opens and transfers to the host are
+   refused at once instead of each one waiting out the timeouts. When
+   the open time is over a single attempt is let through as a probe; if
+   the server answers the circuit closes again, if not it stays open
+   for twice as long, up to a few minutes */
+class HostHealth
+{
+public:
+    enum State
+    {
+        /* transfers go through */
+        Closed,
+        /* one attempt may go through to see whether the host is back */
+        HalfOpen,
+        /* refused until the open time is over or the probe answered */
+        Open,
+    };
+
+    struct Status
+    {
+        Status()
+        : eState(Closed)
+        , iFailures(0)
+        , iTrips(0)
+        , iRejected(0)
+        , iRetryMs(0){}
+
+        State eState;
+        /* connect or login failures in a row */
+        int iFailures;
+        /* times the circuit opened */
+        Poco::UInt64 iTrips;
+        /* attempts refused while it was open */
+        Poco::UInt64 iRejected;
+        /* until the next probe, 0 unless open */
+        long iRetryMs;
+    };
+
+    static HostHealth &Instance();
+
+    static const char *GetName(State eState);
+
+    /* failures in a row that open the circuit, 3 by default */
+    void SetThreshold(int iFailures);
+
+    /* how long the circuit stays open before the first probe, 10 s by
+       default */
+    void SetOpenTime(long iMs);
+
+    /* sHost as in the URL, with the port if it has one. False if the
+       circuit is open; true for a probe, which then has to report */
+    bool Allow(const std::string &sHost);
+
+    /* the server answered, even if the transfer failed otherwise */
+    void ReportSuccess(const std::string &sHost);
+
+    /* it could not be reached or refused the login */
+    void ReportFailure(const std::string &sHost);
+
+    /* an attempt ended before the server said anything, e.g. cancelled;
+       if it was the probe another one may go */
+    void ReportAborted(const std::string &sHost);
+
+    /* HalfOpen when an attempt would be let through as the probe */
+    State GetState(const std::string &sHost);
+
+    Status GetStatus(const std::string &sHost);
+
+    /* close every circuit and forget the counts */
+    void Clear();
+
+    HostHealth();
+
+private:
+    struct Host
+    {
+        Host()
+        : eState(Closed)
+        , iFailures(0)
+        , iOpenUs(0)
+        , tRetry(0)
+        , bProbing(false)
+        , tProbe(0)
+        , iTrips(0)
+        , iRejected(0){}
+
+        /* Closed or Open, HalfOpen is only reported */
+        State eState;
+        int iFailures;
+        /* the open time of the last trip, doubled on a failed probe */
+        Poco::Timestamp::TimeDiff iOpenUs;
+        Poco::Timestamp tRetry;
+        bool bProbing;
+        Poco::Timestamp tProbe;
+        Poco::UInt64 iTrips;
+        Poco::UInt64 iRejected;
+    };
+
+    State GetStateLocked(const Host &host, const Poco::Timestamp &now) const;
+
+    void Trip(Host &host, const Poco::Timestamp &now);
+
+    HostHealth(const HostHealth &rhs);
+
+    HostHealth & operator=(const HostHealth &rhs);
+
+private:
+    std::map<std::string, Host> m_Hosts;
+    int m_iThreshold;
+    Poco::Timestamp::TimeDiff m_iOpenUs;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _HostHealth_H_
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <algorithm>
+#include <Poco/Thread.h>
+#include <Poco/SingletonHolder.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#include "PortManager.h"
+
+namespace // anonymous namespace begin
+{
+    /* from here on sessions are taken away, at the end only one is left
+       and small files wait */
+    const double HIGH_PRESSURE = 0.6;
+    const double FULL_PRESSURE = 0.9;
+
+    /* files below this wait for ports, larger ones do not */
+    const Poco::Int64 SMALL_FILE = 1024 * 1024;
+
+    /* how often a waiting file looks again */
+    const long PORT_POLL_MS = 200;
+
+    const Poco::Timestamp::TimeVal SECOND_US = 1000 * 1000;
+
+    /* the range Windows hands out since Vista, 49152 to 65535 */
+    const int DEFAULT_EPHEMERAL_PORTS = 16384;
+
+    int _GetEphemeralPorts()
+    {
+#if defined(__linux__)
+        FILE *pFile = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+        if (pFile != NULL)
+        {
+            int iFirst = 0;
+            int iLast = 0;
+            int iCount = fscanf(pFile, "%d %d", &iFirst, &iLast);
+            fclose(pFile);
+            if (iCount == 2 && iLast >= iFirst)
+            {
+                return iLast - iFirst + 1;
+            }
+        }
+#endif
+        return DEFAULT_EPHEMERAL_PORTS;
+    }
+} // anonymous namespace end
+
+PortManager &PortManager::Instance()
+{
+    static Poco::SingletonHolder<PortManager> sh;
+    return *sh.get();
+}
+
+PortManager::PortManager()
+: m_iListenFirst(0)
+, m_iListenLast(0)
+, m_iEphemeralPorts(_GetEphemeralPorts())
+#if defined(_WIN32)
+, m_iTimeWait(120 * SECOND_US)
+#else
+, m_iTimeWait(60 * SECOND_US)
+#endif
+, m_bReuseAddress(true)
+, m_Listen()
+, m_Connect()
+, m_iWaits(0)
+{
+}
+
+void PortManager::SetListenRange(unsigned short iFirst, unsigned short iLast)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iListenFirst = std::min(iFirst, iLast);
+    m_iListenLast = std::max(iFirst, iLast);
+}
+
+std::string PortManager::GetPortSpec()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    if (m_iListenFirst == 0)
+    {
+        return "-";
+    }
+    /* no address in front, curl takes the one of the control connection */
+    char szSpec[32];
+    sprintf(szSpec, ":%u-%u", (unsigned)m_iListenFirst,
+        (unsigned)m_iListenLast);
+    return szSpec;
+}
+
+void PortManager::SetEphemeralPorts(int iCount)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iEphemeralPorts = std::max(iCount, 1);
+}
+
+void PortManager::SetTimeWait(long iMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iTimeWait = (Poco::Timestamp::TimeDiff)std::max(iMs, 1000L) * 1000;
+}
+
+void PortManager::SetReuseAddress(bool bReuse)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bReuseAddress = bReuse;
+}
+
+void PortManager::PrepareDataSocket(curl_socket_t iSocket)
+{
+#if defined(_WIN32)
+    (void)iSocket;
+#else
+    bool bReuse = false;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        bReuse = m_bReuseAddress;
+    }
+    int iOn = 1;
+    if (bReuse && setsockopt(iSocket, SOL_SOCKET, SO_REUSEADDR,
+        &iOn, sizeof(iOn)) != 0)
+    {
+        perror("SO_REUSEADDR");
+    }
+#endif
+}
+
+void PortManager::AddConnection(bool bListen)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Add(bListen ? m_Listen : m_Connect, Poco::Timestamp());
+}
+
+double PortManager::GetPressure()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return GetPressureLocked(Poco::Timestamp());
+}
+
+int PortManager::GetSessionLimit(int iMax)
+{
+    double fPressure = GetPressure();
+    if (fPressure <= HIGH_PRESSURE || iMax <= 1)
+    {
+        return iMax;
+    }
+    /* straight down to a single session at FULL_PRESSURE */
+    double fShare = (FULL_PRESSURE - fPressure) /
+        (FULL_PRESSURE - HIGH_PRESSURE);
+    return std::max(1, 1 + (int)((iMax - 1) * std::max(fShare, 0.0)));
+}
+
+bool PortManager::WaitForPort(
+    Poco::Int64 iFileSize,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    if (iFileSize >= SMALL_FILE)
+    {
+        return true;
+    }
+    bool bCounted = false;
+    while (GetPressure() >= FULL_PRESSURE)
+    {
+        if (pStop != NULL && pStop(pStopParam))
+        {
+            return false;
+        }
+        if (!bCounted)
+        {
+            Poco::FastMutex::ScopedLock l(m_Mutex);
+            ++m_iWaits;
+            bCounted = true;
+        }
+        Poco::Thread::sleep(PORT_POLL_MS);
+    }
+    return true;
+}
+
+PortManager::Stats PortManager::GetStats()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Stats stats;
+    stats.fPressure = GetPressureLocked(Poco::Timestamp());
+    stats.iListenPorts = GetListenPortsLocked();
+    stats.iListenRecent = m_Listen.iTotal;
+    stats.iConnectPorts = m_iEphemeralPorts;
+    stats.iConnectRecent = m_Connect.iTotal;
+    stats.iWaits = m_iWaits;
+    return stats;
+}
+
+void PortManager::Add(Window &window, const Poco::Timestamp &now)
+{
+    Poco::Timestamp::TimeVal iSecond = now.epochMicroseconds() / SECOND_US;
+    if (window.Seconds.empty() || window.Seconds.back().first != iSecond)
+    {
+        window.Seconds.push_back(std::make_pair(iSecond, 0));
+    }
+    ++window.Seconds.back().second;
+    ++window.iTotal;
+}
+
+void PortManager::Expire(Window &window, const Poco::Timestamp &now)
+{
+    Poco::Timestamp::TimeVal iOldest =
+        (now.epochMicroseconds() - m_iTimeWait) / SECOND_US;
+    while (!window.Seconds.empty() && window.Seconds.front().first < iOldest)
+    {
+        window.iTotal -= window.Seconds.front().second;
+        window.Seconds.pop_front();
+    }
+}
+
+double PortManager::GetPressureLocked(const Poco::Timestamp &now)
+{
+    Expire(m_Listen, now);
+    Expire(m_Connect, now);
+    if (m_iListenFirst == 0)
+    {
+        /* listeners take their ports from the ephemeral range too */
+        return (double)(m_Listen.iTotal + m_Connect.iTotal) /
+            m_iEphemeralPorts;
+    }
+    return std::max((double)m_Listen.iTotal / GetListenPortsLocked(),
+        (double)m_Connect.iTotal / m_iEphemeralPorts);
+}
+
+int PortManager::GetListenPortsLocked() const
+{
+    return m_iListenFirst == 0 ? m_iEphemeralPorts :
+        m_iListenLast - m_iListenFirst + 1;
+}
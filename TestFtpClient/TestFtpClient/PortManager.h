@@ -0,0 +1,121 @@
+#ifndef _PortManager_H_
+#define _PortManager_H_
+
+#include <string>
+#include <deque>
+#include <curl/curl.h>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
+
+#include "RateLimiter.h"
+
+/* local ports taken by data connections, for every FtpClient of the
+   process. Each file opens a data connection, and the port stays taken
+   for the TIME_WAIT period after it closed, so what matters is how many
+   were opened within that time against how many ports there are: the
+   listener range of active mode, the system's ephemeral ports for the
+   rest. As that pressure rises, fewer sessions are allowed per server,
+   and near the end small files wait for ports to come back instead of
+   failing to bind or connect; large ones are not held up, they need one
+   port for a lot of data */
+class PortManager
+{
+public:
+    struct Stats
+    {
+        Stats()
+        : iListenPorts(0)
+        , iListenRecent(0)
+        , iConnectPorts(0)
+        , iConnectRecent(0)
+        , fPressure(0.0)
+        , iWaits(0){}
+
+        int iListenPorts;
+        /* listeners opened within the TIME_WAIT period */
+        int iListenRecent;
+        int iConnectPorts;
+        int iConnectRecent;
+        double fPressure;
+        /* files that had to wait for a port */
+        Poco::UInt64 iWaits;
+    };
+
+    static PortManager &Instance();
+
+    /* ports for PORT/EPRT listeners, 0 0 lets the system pick them */
+    void SetListenRange(unsigned short iFirst, unsigned short iLast);
+
+    /* CURLOPT_FTPPORT for active mode */
+    std::string GetPortSpec();
+
+    /* local ports for outgoing connections, read from the system */
+    void SetEphemeralPorts(int iCount);
+
+    /* how long a closed connection keeps its port */
+    void SetTimeWait(long iMs);
+
+    /* SO_REUSEADDR on data sockets, so a listener port can be bound
+       again while connections on it are in TIME_WAIT. On by default,
+       Windows does not need it there and it means something else */
+    void SetReuseAddress(bool bReuse);
+
+    void PrepareDataSocket(curl_socket_t iSocket);
+
+    /* a data connection was made, by a listener or by connecting */
+    void AddConnection(bool bListen);
+
+    /* share of the ports taken, above 1 when connections are opened
+       faster than the ports come back */
+    double GetPressure();
+
+    /* the sessions of iMax still allowed per server */
+    int GetSessionLimit(int iMax);
+
+    /* holds a small file back while nearly all ports are taken, false
+       if pStop asked to give up */
+    bool WaitForPort(Poco::Int64 iFileSize,
+        RateLimiter::StopCheck pStop = NULL, const void *pStopParam = NULL);
+
+    Stats GetStats();
+
+    PortManager();
+
+private:
+    /* connections per second over the TIME_WAIT period */
+    struct Window
+    {
+        Window()
+        : Seconds()
+        , iTotal(0){}
+
+        std::deque<std::pair<Poco::Timestamp::TimeVal, int> > Seconds;
+        int iTotal;
+    };
+
+    void Add(Window &window, const Poco::Timestamp &now);
+
+    void Expire(Window &window, const Poco::Timestamp &now);
+
+    double GetPressureLocked(const Poco::Timestamp &now);
+
+    int GetListenPortsLocked() const;
+
+    PortManager(const PortManager &rhs);
+
+    PortManager & operator=(const PortManager &rhs);
+
+private:
+    unsigned short m_iListenFirst;
+    unsigned short m_iListenLast;
+    int m_iEphemeralPorts;
+    Poco::Timestamp::TimeDiff m_iTimeWait;
+    bool m_bReuseAddress;
+    Window m_Listen;
+    Window m_Connect;
+    Poco::UInt64 m_iWaits;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _PortManager_H_
@@ -0,0 +1,260 @@
+#include <algorithm>
+
+#include "RangeScheduler.h"
+
+namespace // anonymous namespace begin
+{
+    /* smaller ranges cost more in REST and RETR than they bring */
+    const Poco::Int64 MIN_CHUNK = 256 * 1024;
+
+    /* before a source has a rate */
+    const Poco::Int64 FIRST_CHUNK = 1024 * 1024;
+
+    /* a range lasts about this long at the rate of its source */
+    const double CHUNK_SECONDS = 2.0;
+
+    /* a tail is only taken over if the range ends this much sooner */
+    const double STEAL_GAIN_SECONDS = 0.5;
+    const Poco::Int64 MIN_STEAL = 64 * 1024;
+
+    const Poco::Timestamp::TimeDiff SAMPLE_US = 500 * 1000;
+    const double RATE_WEIGHT = 0.3;
+
+    /* no data for this long after the first byte of a range, and the
+       rest of it is taken away */
+    const Poco::Timestamp::TimeDiff STALL_US = 3 * 1000 * 1000;
+
+    /* how often a waiting source looks for a stalled one or a cancel */
+    const long NEXT_POLL_MS = 100;
+} // anonymous namespace end
+
+RangeScheduler::RangeScheduler(Poco::Int64 iSize, int iSources)
+: m_iSize(iSize)
+, m_vectFree()
+, m_vectSources(std::max(iSources, 1))
+, m_iClaimed(0)
+{
+    if (iSize > 0)
+    {
+        m_vectFree.push_back(std::make_pair((Poco::Int64)0, iSize));
+    }
+}
+
+bool RangeScheduler::Next(
+    int iSource,
+    Poco::Int64 &iBegin,
+    Poco::Int64 &iEnd,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Source &source = m_vectSources[iSource];
+    if (source.iPos < source.iEnd)
+    {
+        m_vectFree.push_back(std::make_pair(source.iPos, source.iEnd));
+        source.iEnd = source.iPos;
+    }
+    while (!source.bFailed)
+    {
+        if (AssignLocked(iSource, iBegin, iEnd) ||
+            StealLocked(iSource, iBegin, iEnd))
+        {
+            source.iPos = iBegin;
+            source.iEnd = iEnd;
+            source.bStarted = false;
+            source.bStalled = false;
+            return true;
+        }
+        bool bBusy = false;
+        for (size_t i = 0; i < m_vectSources.size(); ++i)
+        {
+            bBusy = bBusy || m_vectSources[i].iPos < m_vectSources[i].iEnd;
+        }
+        if (!bBusy || (pStop != NULL && pStop(pStopParam)))
+        {
+            return false;
+        }
+        m_Changed.tryWait(m_Mutex, NEXT_POLL_MS);
+    }
+    return false;
+}
+
+size_t RangeScheduler::Claim(int iSource, size_t iCount)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Source &source = m_vectSources[iSource];
+    Poco::Int64 iLeft = std::max(source.iEnd - source.iPos, (Poco::Int64)0);
+    size_t iKeep = (Poco::Int64)iCount > iLeft ? (size_t)iLeft : iCount;
+    source.iPos += iKeep;
+    m_iClaimed += iKeep;
+
+    Poco::Timestamp now;
+    if (!source.bStarted)
+    {
+        /* checkout, login and the wait for the data connection count
+           neither for the rate nor as a stall */
+        source.bStarted = true;
+        source.iSampleBytes = 0;
+        source.tSample = now;
+    }
+    source.iSampleBytes += iKeep;
+    source.tLast = now;
+    Poco::Timestamp::TimeDiff iElapsed = now - source.tSample;
+    if (iElapsed >= SAMPLE_US)
+    {
+        double fRate = source.iSampleBytes * 1000000.0 / iElapsed;
+        source.fRate = source.fRate > 0.0 ?
+            source.fRate * (1.0 - RATE_WEIGHT) + fRate * RATE_WEIGHT : fRate;
+        source.iSampleBytes = 0;
+        source.tSample = now;
+    }
+    if (source.iPos >= source.iEnd)
+    {
+        m_Changed.broadcast();
+    }
+    return iKeep;
+}
+
+void RangeScheduler::Fail(int iSource)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Source &source = m_vectSources[iSource];
+    source.bFailed = true;
+    if (source.iPos < source.iEnd)
+    {
+        m_vectFree.push_back(std::make_pair(source.iPos, source.iEnd));
+        source.iEnd = source.iPos;
+    }
+    m_Changed.broadcast();
+}
+
+bool RangeScheduler::IsFailed(int iSource)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectSources[iSource].bFailed;
+}
+
+bool RangeScheduler::IsStalled(int iSource)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectSources[iSource].bStalled;
+}
+
+bool RangeScheduler::IsComplete()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_iClaimed >= m_iSize;
+}
+
+double RangeScheduler::GetRate(int iSource)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectSources[iSource].fRate;
+}
+
+bool RangeScheduler::AssignLocked(
+    int iSource,
+    Poco::Int64 &iBegin,
+    Poco::Int64 &iEnd)
+{
+    if (m_vectFree.empty())
+    {
+        return false;
+    }
+    const Source &source = m_vectSources[iSource];
+    Poco::Int64 iChunk = std::min(FIRST_CHUNK,
+        m_iSize / (2 * (Poco::Int64)m_vectSources.size()));
+    if (source.fRate > 0.0)
+    {
+        /* no more than its share of what is left by rate */
+        Poco::Int64 iFree = 0;
+        for (size_t i = 0; i < m_vectFree.size(); ++i)
+        {
+            iFree += m_vectFree[i].second - m_vectFree[i].first;
+        }
+        double fRates = 0.0;
+        for (size_t i = 0; i < m_vectSources.size(); ++i)
+        {
+            if (!m_vectSources[i].bFailed)
+            {
+                fRates += m_vectSources[i].fRate;
+            }
+        }
+        iChunk = (Poco::Int64)std::min(source.fRate * CHUNK_SECONDS,
+            iFree * source.fRate / fRates);
+    }
+    iChunk = std::max(iChunk, MIN_CHUNK);
+
+    std::pair<Poco::Int64, Poco::Int64> &range = m_vectFree.front();
+    iBegin = range.first;
+    iEnd = std::min(range.second, iBegin + iChunk);
+    /* no stub left behind that is too small for a request of its own */
+    if (range.second - iEnd < MIN_CHUNK)
+    {
+        iEnd = range.second;
+    }
+    if (iEnd == range.second)
+    {
+        m_vectFree.erase(m_vectFree.begin());
+    }
+    else
+    {
+        range.first = iEnd;
+    }
+    return true;
+}
+
+bool RangeScheduler::StealLocked(
+    int iSource,
+    Poco::Int64 &iBegin,
+    Poco::Int64 &iEnd)
+{
+    Poco::Timestamp now;
+    int iVictim = -1;
+    Poco::Int64 iSplit = 0;
+    double fBestGain = STEAL_GAIN_SECONDS;
+    for (size_t i = 0; i < m_vectSources.size(); ++i)
+    {
+        const Source &other = m_vectSources[i];
+        Poco::Int64 iLeft = other.iEnd - other.iPos;
+        if ((int)i == iSource || iLeft <= 0)
+        {
+            continue;
+        }
+        if (other.bStarted && now - other.tLast > STALL_US)
+        {
+            /* all of it, the stalled source stops and asks anew */
+            m_vectSources[i].bStalled = true;
+            iVictim = (int)i;
+            iSplit = other.iPos;
+            break;
+        }
+        if (iLeft < 2 * MIN_STEAL)
+        {
+            continue;
+        }
+        /* a rate not known yet is taken as the other's, or both alike */
+        double fOther = other.fRate;
+        double fSelf = m_vectSources[iSource].fRate;
+        fOther = fOther > 0.0 ? fOther : (fSelf > 0.0 ? fSelf : 1.0);
+        fSelf = fSelf > 0.0 ? fSelf : fOther;
+
+        double fGain = iLeft / fOther - iLeft / (fOther + fSelf);
+        Poco::Int64 iKeep = (Poco::Int64)(iLeft * fOther / (fOther + fSelf));
+        if (fGain > fBestGain && iLeft - iKeep >= MIN_STEAL)
+        {
+            fBestGain = fGain;
+            iVictim = (int)i;
+            iSplit = other.iPos + iKeep;
+        }
+    }
+    if (iVictim < 0)
+    {
+        return false;
+    }
+    Source &victim = m_vectSources[iVictim];
+    iBegin = iSplit;
+    iEnd = victim.iEnd;
+    victim.iEnd = iSplit;
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef _RangeScheduler_H_
+#define _RangeScheduler_H_
+
+#include <vector>
+#include <utility>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Timestamp.h>
+
+#include "RateLimiter.h"
+
+/* splits one download among several servers with the same file. Each
+   source asks for its next range when the last one is done, sized to a
+   couple of seconds at the rate it got so far, so a faster server takes
+   a larger share. When nothing is left to hand out, an idle source
+   takes over the tail of the range that would finish last, split so
+   that both end about the same time. A source that stalled after the
+   first byte of its range loses all it has left, and takes a new range
+   once it stopped that transfer. Whatever a failed source did not get
+   goes back for the others */
+class RangeScheduler
+{
+public:
+    RangeScheduler(Poco::Int64 iSize, int iSources);
+
+    /* the next range [iBegin, iEnd) for iSource. Waits while the others
+       still have work that is not worth taking over, false once the
+       file is complete, iSource failed or pStop asked to give up */
+    bool Next(int iSource, Poco::Int64 &iBegin, Poco::Int64 &iEnd,
+        RateLimiter::StopCheck pStop = NULL, const void *pStopParam = NULL);
+
+    /* iCount bytes arrived for the current range of iSource; how many of
+       them are still its to write, fewer once another source took over
+       the rest of the range */
+    size_t Claim(int iSource, size_t iCount);
+
+    /* iSource gets nothing more, the rest of its range goes back */
+    void Fail(int iSource);
+
+    /* it failed and gets nothing more */
+    bool IsFailed(int iSource);
+
+    /* it stalled and another source took over its current range */
+    bool IsStalled(int iSource);
+
+    /* every byte was claimed */
+    bool IsComplete();
+
+    /* bytes per second iSource got, 0 while unknown */
+    double GetRate(int iSource);
+
+private:
+    struct Source
+    {
+        Source()
+        : iPos(0)
+        , iEnd(0)
+        , fRate(0.0)
+        , iSampleBytes(0)
+        , tSample()
+        , tLast()
+        , bStarted(false)
+        , bStalled(false)
+        , bFailed(false){}
+
+        /* the current range, done when iPos reaches iEnd */
+        Poco::Int64 iPos;
+        Poco::Int64 iEnd;
+        /* averaged over samples of half a second or more */
+        double fRate;
+        Poco::Int64 iSampleBytes;
+        Poco::Timestamp tSample;
+        /* when the last bytes of the current range arrived, if any */
+        Poco::Timestamp tLast;
+        bool bStarted;
+        bool bStalled;
+        bool bFailed;
+    };
+
+    /* a piece of the free ranges */
+    bool AssignLocked(int iSource, Poco::Int64 &iBegin, Poco::Int64 &iEnd);
+
+    /* the tail of the range that gains most by being split */
+    bool StealLocked(int iSource, Poco::Int64 &iBegin, Poco::Int64 &iEnd);
+
+    RangeScheduler(const RangeScheduler &rhs);
+
+    RangeScheduler & operator=(const RangeScheduler &rhs);
+
+private:
+    Poco::Int64 m_iSize;
+    /* what no source has been given yet, or one gave back */
+    std::vector<std::pair<Poco::Int64, Poco::Int64> > m_vectFree;
+    std::vector<Source> m_vectSources;
+    Poco::Int64 m_iClaimed;
+    Poco::FastMutex m_Mutex;
+    Poco::Condition m_Changed;
+};
+
+#endif // _RangeScheduler_H_
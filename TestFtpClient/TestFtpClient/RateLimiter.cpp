@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <Poco/Thread.h>
+#include <Poco/SingletonHolder.h>
+
+#include "RateLimiter.h"
+
+namespace // anonymous namespace begin
+{
+    /* a job that has not asked for this long gives its share away */
+    const Poco::Timestamp::TimeDiff JOB_IDLE = 500 * 1000;
+
+    /* what an idle bucket may save up: 50 ms of traffic, at least one
+       full curl buffer */
+    const double BURST_SECONDS = 0.05;
+    const double BURST_MIN = 16 * 1024;
+
+    /* waits are cut into slices so rate changes and cancels are seen */
+    const Poco::Timestamp::TimeDiff WAIT_SLICE = 50 * 1000;
+} // anonymous namespace end
+
+RateLimiter &RateLimiter::Instance()
+{
+    static Poco::SingletonHolder<RateLimiter> sh;
+    return *sh.get();
+}
+
+RateLimiter::RateLimiter()
+: m_Total()
+, m_iTotalRate(0)
+, m_iScheduleRate(0)
+, m_Hosts()
+, m_Jobs()
+, m_iNextJob(1)
+{
+}
+
+void RateLimiter::SetTotalRate(Poco::Int64 iBytesPerSec)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iTotalRate = std::max<Poco::Int64>(iBytesPerSec, 0);
+    ApplyTotal(Poco::Timestamp());
+}
+
+void RateLimiter::SetScheduleRate(Poco::Int64 iBytesPerSec)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iScheduleRate = std::max<Poco::Int64>(iBytesPerSec, 0);
+    ApplyTotal(Poco::Timestamp());
+}
+
+void RateLimiter::ApplyTotal(const Poco::Timestamp &now)
+{
+    Poco::Int64 iRate = m_iTotalRate;
+    if (m_iScheduleRate > 0 && (iRate == 0 || m_iScheduleRate < iRate))
+    {
+        iRate = m_iScheduleRate;
+    }
+    SetRate(m_Total, (double)iRate, now);
+    ShareTotal(now);
+}
+
+void RateLimiter::SetDirectionRate(
+    Direction eDirection,
+    Poco::Int64 iBytesPerSec)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    SetRate(m_Directions[eDirection],
+        (double)std::max<Poco::Int64>(iBytesPerSec, 0), Poco::Timestamp());
+}
+
+void RateLimiter::SetHostRate(
+    const std::string &sHost,
+    Poco::Int64 iBytesPerSec)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    /* kept when lifted, a transfer may still be waiting on it */
+    SetRate(m_Hosts[sHost],
+        (double)std::max<Poco::Int64>(iBytesPerSec, 0), Poco::Timestamp());
+}
+
+int RateLimiter::RegisterJob(int iWeight/* = 1*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    int iJob = m_iNextJob++;
+    m_Jobs[iJob].iWeight = std::max(iWeight, 1);
+    return iJob;
+}
+
+void RateLimiter::SetJobWeight(int iJob, int iWeight)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<int, Job>::iterator it = m_Jobs.find(iJob);
+    if (it != m_Jobs.end())
+    {
+        it->second.iWeight = std::max(iWeight, 1);
+        ShareTotal(Poco::Timestamp());
+    }
+}
+
+void RateLimiter::UnregisterJob(int iJob)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Jobs.erase(iJob);
+    ShareTotal(Poco::Timestamp());
+}
+
+bool RateLimiter::Acquire(
+    int iJob,
+    const std::string &sHost,
+    Direction eDirection,
+    size_t iBytes,
+    StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    if (iBytes == 0)
+    {
+        return true;
+    }
+
+    /* where each bucket's credit has to reach, -1 if not charged */
+    double fTargets[4] = {-1.0, -1.0, -1.0, -1.0};
+    bool bCharged = false;
+    for (;;)
+    {
+        Poco::Timestamp::TimeDiff iWait = 0;
+        {
+            Poco::FastMutex::ScopedLock l(m_Mutex);
+            Poco::Timestamp now;
+            if (!bCharged)
+            {
+                std::map<int, Job>::iterator it = m_Jobs.find(iJob);
+                if (it != m_Jobs.end())
+                {
+                    it->second.tActive = now;
+                }
+                ShareTotal(now);
+            }
+
+            /* looked up again every round, limits may have been lifted */
+            Bucket *buckets[4];
+            GetBuckets(iJob, sHost, eDirection, buckets);
+            for (int i = 0; i < 4; ++i)
+            {
+                if (buckets[i] == NULL) continue;
+                Refill(*buckets[i], now);
+                if (!bCharged)
+                {
+                    buckets[i]->fGranted += (double)iBytes;
+                    fTargets[i] = buckets[i]->fGranted;
+                }
+                if (fTargets[i] >= 0.0)
+                {
+                    iWait = std::max(iWait, WaitFor(*buckets[i], fTargets[i]));
+                }
+            }
+            bCharged = true;
+        }
+
+        if (iWait <= 0)
+        {
+            return true;
+        }
+        if (pStop != NULL && pStop(pStopParam))
+        {
+            return false;
+        }
+        Poco::Thread::sleep((long)std::max<Poco::Timestamp::TimeDiff>(
+            std::min(iWait, WAIT_SLICE) / 1000, 1));
+    }
+}
+
+void RateLimiter::SetRate(
+    Bucket &bucket,
+    double fRate,
+    const Poco::Timestamp &now)
+{
+    if (fRate == bucket.fRate)
+    {
+        return;
+    }
+    if (bucket.fRate > 0.0)
+    {
+        /* what was earned so far is kept at the old rate */
+        Refill(bucket, now);
+    }
+    else
+    {
+        /* from unlimited: nothing saved up, everything granted is paid */
+        bucket.fCredit = bucket.fGranted;
+        bucket.tLast = now;
+    }
+    bucket.fRate = fRate;
+}
+
+void RateLimiter::Refill(Bucket &bucket, const Poco::Timestamp &now)
+{
+    if (bucket.fRate > 0.0)
+    {
+        double fBurst = std::max(bucket.fRate * BURST_SECONDS, BURST_MIN);
+        bucket.fCredit = std::min(
+            bucket.fCredit + bucket.fRate * (double)(now - bucket.tLast) / 1e6,
+            bucket.fGranted + fBurst);
+    }
+    bucket.tLast = now;
+}
+
+Poco::Timestamp::TimeDiff RateLimiter::WaitFor(
+    const Bucket &bucket,
+    double fTarget)
+{
+    if (bucket.fCredit >= fTarget)
+    {
+        return 0;
+    }
+    return (Poco::Timestamp::TimeDiff)
+        ((fTarget - bucket.fCredit) * 1e6 / bucket.fRate) + 1;
+}
+
+void RateLimiter::ShareTotal(const Poco::Timestamp &now)
+{
+    Poco::Int64 iWeights = 0;
+    std::map<int, Job>::iterator it = m_Jobs.begin();
+    for (; it != m_Jobs.end(); ++it)
+    {
+        if (now - it->second.tActive < JOB_IDLE)
+        {
+            iWeights += it->second.iWeight;
+        }
+    }
+    for (it = m_Jobs.begin(); it != m_Jobs.end(); ++it)
+    {
+        double fRate = 0.0;
+        if (m_Total.fRate > 0.0 && now - it->second.tActive < JOB_IDLE)
+        {
+            fRate = m_Total.fRate * it->second.iWeight / (double)iWeights;
+        }
+        else if (m_Total.fRate > 0.0)
+        {
+            /* an idle job keeps its last share until it shows up again,
+               then it is recomputed before it is charged */
+            continue;
+        }
+        SetRate(it->second.bucket, fRate, now);
+    }
+}
+
+void RateLimiter::GetBuckets(
+    int iJob,
+    const std::string &sHost,
+    Direction eDirection,
+    Bucket *buckets[4])
+{
+    buckets[0] = m_Total.fRate > 0.0 ? &m_Total : NULL;
+    buckets[1] = m_Directions[eDirection].fRate > 0.0 ?
+        &m_Directions[eDirection] : NULL;
+
+    buckets[2] = NULL;
+    if (!m_Hosts.empty())
+    {
+        std::map<std::string, Bucket>::iterator it = m_Hosts.find(sHost);
+        if (it != m_Hosts.end() && it->second.fRate > 0.0)
+        {
+            buckets[2] = &it->second;
+        }
+    }
+
+    buckets[3] = NULL;
+    if (m_Total.fRate > 0.0)
+    {
+        std::map<int, Job>::iterator it = m_Jobs.find(iJob);
+        if (it != m_Jobs.end() && it->second.bucket.fRate > 0.0)
+        {
+            buckets[3] = &it->second.bucket;
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef _RateLimiter_H_
+#define _RateLimiter_H_
+
+#include <string>
+#include <map>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
+
+/* process wide bandwidth shaping shared by every FtpClient. A transfer
+   passes each block through Acquire(), which charges it to the total,
+   direction, host and job buckets and sleeps until all of them have
+   earned it. Every bucket serves in arrival order: a request waits until
+   the credit the bucket has accrued covers all bytes granted up to and
+   including its own, so the long-run rate is exact whatever the block
+   size. While a total limit is set, the jobs seen in the last half
+   second split it by weight. Rates are bytes per second, 0 means no
+   limit, and changes apply to transfers already running */
+class RateLimiter
+{
+public:
+    enum Direction
+    {
+        Upload,
+        Download,
+    };
+
+    /* polled while waiting, true aborts the wait */
+    typedef bool (*StopCheck)(const void *pParam);
+
+    static RateLimiter &Instance();
+
+    void SetTotalRate(Poco::Int64 iBytesPerSec);
+
+    /* the cap of the BandwidthCalendar window in force, the lower of it
+       and SetTotalRate() applies */
+    void SetScheduleRate(Poco::Int64 iBytesPerSec);
+
+    void SetDirectionRate(Direction eDirection, Poco::Int64 iBytesPerSec);
+
+    /* sHost as in the URL, with the port if it has one */
+    void SetHostRate(const std::string &sHost, Poco::Int64 iBytesPerSec);
+
+    int RegisterJob(int iWeight = 1);
+
+    void SetJobWeight(int iJob, int iWeight);
+
+    void UnregisterJob(int iJob);
+
+    /* false if pStop asked to give up before the bytes were earned */
+    bool Acquire(
+        int iJob,
+        const std::string &sHost,
+        Direction eDirection,
+        size_t iBytes,
+        StopCheck pStop = NULL,
+        const void *pStopParam = NULL);
+
+    RateLimiter();
+
+private:
+    struct Bucket
+    {
+        Bucket()
+        : fRate(0.0)
+        , fCredit(0.0)
+        , fGranted(0.0)
+        , tLast(){}
+
+        double fRate;
+        /* bytes earned and bytes handed out since the bucket started */
+        double fCredit;
+        double fGranted;
+        Poco::Timestamp tLast;
+    };
+
+    struct Job
+    {
+        Job()
+        : iWeight(1)
+        , tActive(0)
+        , bucket(){}
+
+        int iWeight;
+        Poco::Timestamp tActive;
+        Bucket bucket;
+    };
+
+    static void SetRate(
+        Bucket &bucket,
+        double fRate,
+        const Poco::Timestamp &now);
+
+    static void Refill(Bucket &bucket, const Poco::Timestamp &now);
+
+    /* microseconds until the bucket has earned fTarget */
+    static Poco::Timestamp::TimeDiff WaitFor(
+        const Bucket &bucket,
+        double fTarget);
+
+    /* the total bucket follows the lower of both caps */
+    void ApplyTotal(const Poco::Timestamp &now);
+
+    /* split the total among the jobs active lately, by weight */
+    void ShareTotal(const Poco::Timestamp &now);
+
+    /* the buckets a request is charged to, NULL where there is no limit */
+    void GetBuckets(
+        int iJob,
+        const std::string &sHost,
+        Direction eDirection,
+        Bucket *buckets[4]);
+
+    RateLimiter(const RateLimiter &rhs);
+
+    RateLimiter & operator=(const RateLimiter &rhs);
+
+private:
+    Bucket m_Total;
+    Poco::Int64 m_iTotalRate;
+    Poco::Int64 m_iScheduleRate;
+    Bucket m_Directions[2];
+    std::map<std::string, Bucket> m_Hosts;
+    std::map<int, Job> m_Jobs;
+    int m_iNextJob;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _RateLimiter_H_
@@ -0,0 +1,107 @@
+#include <string.h>
+#include <algorithm>
+
+#include "RelayBuffer.h"
+
+namespace // anonymous namespace begin
+{
+    /* how often a waiting side looks at its stop check */
+    const long WAIT_POLL_MS = 100;
+} // anonymous namespace end
+
+RelayBuffer::RelayBuffer(size_t iMaxBytes/* = 4 * 1024 * 1024*/)
+: m_vectData(std::max(iMaxBytes, (size_t)1))
+, m_iHead(0)
+, m_iSize(0)
+, m_iRead(0)
+, m_bFinished(false)
+, m_bComplete(false)
+, m_bAborted(false)
+{
+}
+
+bool RelayBuffer::Write(
+    const void *pData,
+    size_t iSize,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    const char *pBytes = (const char *)pData;
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    while (iSize > 0)
+    {
+        if (m_bAborted || (pStop != NULL && pStop(pStopParam)))
+        {
+            return false;
+        }
+        if (m_iSize == m_vectData.size())
+        {
+            m_Changed.tryWait(m_Mutex, WAIT_POLL_MS);
+            continue;
+        }
+        /* up to the end of the free space or of the ring */
+        size_t iTail = (m_iHead + m_iSize) % m_vectData.size();
+        size_t iCopy = std::min(iSize, m_vectData.size() - m_iSize);
+        iCopy = std::min(iCopy, m_vectData.size() - iTail);
+        memcpy(&m_vectData[iTail], pBytes, iCopy);
+        m_iSize += iCopy;
+        pBytes += iCopy;
+        iSize -= iCopy;
+        m_Changed.broadcast();
+    }
+    return true;
+}
+
+size_t RelayBuffer::Read(
+    void *pData,
+    size_t iSize,
+    RateLimiter::StopCheck pStop/* = NULL*/,
+    const void *pStopParam/* = NULL*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    for (;;)
+    {
+        if (m_bAborted || (pStop != NULL && pStop(pStopParam)))
+        {
+            return (size_t)-1;
+        }
+        if (m_iSize > 0)
+        {
+            break;
+        }
+        if (m_bFinished)
+        {
+            return m_bComplete ? 0 : (size_t)-1;
+        }
+        m_Changed.tryWait(m_Mutex, WAIT_POLL_MS);
+    }
+    size_t iCopy = std::min(iSize, m_iSize);
+    iCopy = std::min(iCopy, m_vectData.size() - m_iHead);
+    memcpy(pData, &m_vectData[m_iHead], iCopy);
+    m_iHead = (m_iHead + iCopy) % m_vectData.size();
+    m_iSize -= iCopy;
+    m_iRead += iCopy;
+    m_Changed.broadcast();
+    return iCopy;
+}
+
+void RelayBuffer::Finish(bool bComplete)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bFinished = true;
+    m_bComplete = bComplete;
+    m_Changed.broadcast();
+}
+
+void RelayBuffer::Abort()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bAborted = true;
+    m_Changed.broadcast();
+}
+
+Poco::Int64 RelayBuffer::GetRead()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_iRead;
+}
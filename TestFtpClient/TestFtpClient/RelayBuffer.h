@@ -0,0 +1,56 @@
+#ifndef _RelayBuffer_H_
+#define _RelayBuffer_H_
+
+#include <vector>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+
+#include "RateLimiter.h"
+
+/* passes what one transfer downloads to another one that uploads it,
+   through memory only. The writer waits while iMaxBytes are not sent on
+   yet, the reader while there is nothing; when one side gives up the
+   other one stops at its next call */
+class RelayBuffer
+{
+public:
+    explicit RelayBuffer(size_t iMaxBytes = 4 * 1024 * 1024);
+
+    /* false once the reader gave up or pStop asked to */
+    bool Write(const void *pData, size_t iSize,
+        RateLimiter::StopCheck pStop = NULL, const void *pStopParam = NULL);
+
+    /* up to iSize bytes, 0 once everything was read, (size_t)-1 if the
+       writer failed, the reader aborted or pStop asked to give up */
+    size_t Read(void *pData, size_t iSize,
+        RateLimiter::StopCheck pStop = NULL, const void *pStopParam = NULL);
+
+    /* nothing more to write, bComplete false if the download failed */
+    void Finish(bool bComplete);
+
+    /* the reader gives up, Write and Read fail from now on */
+    void Abort();
+
+    /* bytes handed to the reader so far */
+    Poco::Int64 GetRead();
+
+private:
+    RelayBuffer(const RelayBuffer &rhs);
+
+    RelayBuffer & operator=(const RelayBuffer &rhs);
+
+private:
+    /* a ring, m_iSize bytes from m_iHead on */
+    std::vector<char> m_vectData;
+    size_t m_iHead;
+    size_t m_iSize;
+    Poco::Int64 m_iRead;
+    bool m_bFinished;
+    bool m_bComplete;
+    bool m_bAborted;
+    Poco::FastMutex m_Mutex;
+    Poco::Condition m_Changed;
+};
+
+#endif // _RelayBuffer_H_
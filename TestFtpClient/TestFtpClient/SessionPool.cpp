@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <algorithm>
+#include <Poco/SingletonHolder.h>
+
+#include "SessionPool.h"
+#include "SocketTuner.h"
+#include "UrlUtil.h"
+
+namespace // anonymous namespace begin
+{
+    /* how often the keepalive thread looks at the pool */
+    const long TICK_MS = 1000;
+
+    /* idle sessions kept per server and login beyond the warm ones */
+    const size_t MAX_IDLE = 16;
+
+    /* pause before a server that could not be warmed up is tried again */
+    const Poco::Timestamp::TimeDiff WARM_RETRY_US = 30 * 1000 * 1000;
+
+    /* "scheme://host[:port]/" of an url and the "host[:port]" in it */
+    void _SplitUrl(
+        const std::string &sUrl,
+        std::string &sRootUrl,
+        std::string &sHost)
+    {
+        sHost = UrlUtil::GetHost(sUrl);
+        sRootUrl = UrlUtil::GetRootUrl(sUrl);
+    }
+} // anonymous namespace end
+
+SessionPool &SessionPool::Instance()
+{
+    static Poco::SingletonHolder<SessionPool> sh;
+    return *sh.get();
+}
+
+SessionPool::SessionPool()
+: m_Hosts()
+, m_WarmCounts()
+, m_iIntervalMs(30 * 1000)
+, m_iMaxIdleMs(5 * 60 * 1000)
+, m_Stats()
+, m_StopEvent(false)
+, m_KeepAliveRunnable(*this, &SessionPool::KeepAliveRoutine)
+, m_KeepAliveThread()
+{
+}
+
+SessionPool::~SessionPool()
+{
+    Stop();
+    Clear();
+}
+
+CURL *SessionPool::Checkout(
+    const std::string &sUrl,
+    const std::string &sUserPwd)
+{
+    CURL *pCurl = NULL;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = GetHost(sUrl, sUserPwd);
+        if (!host.vectIdle.empty())
+        {
+            pCurl = host.vectIdle.back().pCurl;
+            host.vectIdle.pop_back();
+        }
+        ++host.iBusy;
+    }
+    if (pCurl != NULL)
+    {
+        curl_easy_reset(pCurl);
+        return pCurl;
+    }
+    pCurl = curl_easy_init();
+    if (pCurl == NULL)
+    {
+        /* nothing is handed out, nothing comes back */
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        --GetHost(sUrl, sUserPwd).iBusy;
+    }
+    return pCurl;
+}
+
+void SessionPool::Checkin(
+    CURL *pCurl,
+    const std::string &sUrl,
+    const std::string &sUserPwd,
+    bool bReusable/* = true*/)
+{
+    bool bClose = !bReusable;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = GetHost(sUrl, sUserPwd);
+        if (host.iBusy > 0)
+        {
+            --host.iBusy;
+        }
+        size_t iMaxIdle = std::max(MAX_IDLE,
+            (size_t)GetWarmLocked(host.sHost));
+        if (pCurl != NULL && !bClose && host.vectIdle.size() < iMaxIdle)
+        {
+            Session session;
+            session.pCurl = pCurl;
+            host.vectIdle.push_back(session);
+        }
+        else
+        {
+            bClose = true;
+        }
+        if (!m_KeepAliveThread.isRunning())
+        {
+            m_StopEvent.reset();
+            m_KeepAliveThread.start(m_KeepAliveRunnable);
+        }
+    }
+    if (bClose && pCurl != NULL)
+    {
+        curl_easy_cleanup(pCurl);
+    }
+}
+
+void SessionPool::SetKeepAliveInterval(long iIntervalMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iIntervalMs = std::max(iIntervalMs, 0L);
+}
+
+void SessionPool::SetMaxIdleTime(long iMaxIdleMs)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_iMaxIdleMs = std::max(iMaxIdleMs, 0L);
+}
+
+void SessionPool::SetWarmSessions(const std::string &sHost, int iCount)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_WarmCounts[sHost] = std::max(iCount, 0);
+}
+
+SessionPool::Stats SessionPool::GetStats()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Stats stats = m_Stats;
+    std::map<std::string, Host>::const_iterator it = m_Hosts.begin();
+    for (; it != m_Hosts.end(); ++it)
+    {
+        stats.iIdle += (int)it->second.vectIdle.size();
+        stats.iBusy += it->second.iBusy;
+    }
+    return stats;
+}
+
+void SessionPool::Clear()
+{
+    std::vector<CURL *> vectClose;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        std::map<std::string, Host>::iterator it = m_Hosts.begin();
+        for (; it != m_Hosts.end(); ++it)
+        {
+            for (size_t i = 0; i < it->second.vectIdle.size(); ++i)
+            {
+                vectClose.push_back(it->second.vectIdle[i].pCurl);
+            }
+            it->second.vectIdle.clear();
+        }
+    }
+    for (size_t i = 0; i < vectClose.size(); ++i)
+    {
+        curl_easy_cleanup(vectClose[i]);
+    }
+}
+
+SessionPool::Host &SessionPool::GetHost(
+    const std::string &sUrl,
+    const std::string &sUserPwd)
+{
+    std::string sRootUrl;
+    std::string sHost;
+    _SplitUrl(sUrl, sRootUrl, sHost);
+    std::string sKey = sUserPwd + "@" + sRootUrl;
+    std::map<std::string, Host>::iterator it = m_Hosts.find(sKey);
+    if (it == m_Hosts.end())
+    {
+        it = m_Hosts.insert(std::make_pair(sKey, Host())).first;
+        it->second.sRootUrl = sRootUrl;
+        it->second.sUserPwd = sUserPwd;
+        it->second.sHost = sHost;
+    }
+    return it->second;
+}
+
+int SessionPool::GetWarmLocked(const std::string &sHost) const
+{
+    std::map<std::string, int>::const_iterator it = m_WarmCounts.find(sHost);
+    return it != m_WarmCounts.end() ? it->second : 0;
+}
+
+bool SessionPool::SendNoop(
+    CURL *pCurl,
+    const std::string &sRootUrl,
+    const std::string &sUserPwd)
+{
+    struct curl_slist *pCommands = curl_slist_append(NULL, "NOOP");
+    std::string sRoot;
+    std::string sHost;
+    _SplitUrl(sRootUrl, sRoot, sHost);
+    /* a warm up connects like a transfer, raced among the addresses */
+    SocketTuner::Context socketContext(sHost);
+    curl_easy_reset(pCurl);
+    SocketTuner::Instance().Prepare(pCurl, socketContext);
+    curl_easy_setopt(pCurl, CURLOPT_URL, sRootUrl.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_USERPWD, sUserPwd.c_str());
+    curl_easy_setopt(pCurl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(pCurl, CURLOPT_QUOTE, pCommands);
+    curl_easy_setopt(pCurl, CURLOPT_CONNECTTIMEOUT, 5);
+    /* a connection a firewall forgot answers nothing at all */
+    curl_easy_setopt(pCurl, CURLOPT_FTP_RESPONSE_TIMEOUT, 5);
+
+    CURLcode ret = curl_easy_perform(pCurl);
+    curl_slist_free_all(pCommands);
+    if (ret != CURLE_OK)
+    {
+        fprintf(stderr, "NOOP to %s: %s\n", sRootUrl.c_str(),
+            curl_easy_strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+void SessionPool::Maintain()
+{
+    std::vector<Pending> vectDue;
+    std::vector<Pending> vectWarm;
+    std::vector<CURL *> vectClose;
+    {
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Poco::Timestamp now;
+        Poco::Timestamp::TimeDiff iInterval =
+            (Poco::Timestamp::TimeDiff)m_iIntervalMs * 1000;
+        Poco::Timestamp::TimeDiff iMaxIdle =
+            (Poco::Timestamp::TimeDiff)m_iMaxIdleMs * 1000;
+        std::map<std::string, Host>::iterator it = m_Hosts.begin();
+        for (; it != m_Hosts.end(); ++it)
+        {
+            Host &host = it->second;
+            size_t iWarm = (size_t)GetWarmLocked(host.sHost);
+            Pending pending;
+            pending.sKey = it->first;
+            pending.sRootUrl = host.sRootUrl;
+            pending.sUserPwd = host.sUserPwd;
+
+            /* oldest first, so the extra ones go before the warm ones */
+            size_t iKept = host.vectIdle.size();
+            std::vector<Session>::iterator itSession = host.vectIdle.begin();
+            while (itSession != host.vectIdle.end())
+            {
+                Poco::Timestamp::TimeDiff iIdle = now - itSession->tUsed;
+                if (iMaxIdle > 0 && iIdle >= iMaxIdle && iKept > iWarm)
+                {
+                    vectClose.push_back(itSession->pCurl);
+                    itSession = host.vectIdle.erase(itSession);
+                    --iKept;
+                }
+                else if (iInterval > 0 && iIdle >= iInterval)
+                {
+                    pending.pCurl = itSession->pCurl;
+                    vectDue.push_back(pending);
+                    itSession = host.vectIdle.erase(itSession);
+                    ++host.iBusy;
+                }
+                else
+                {
+                    ++itSession;
+                }
+            }
+
+            if (iKept < iWarm && now >= host.tWarmRetry)
+            {
+                pending.pCurl = NULL;
+                vectWarm.insert(vectWarm.end(), iWarm - iKept, pending);
+                host.iBusy += (int)(iWarm - iKept);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < vectClose.size(); ++i)
+    {
+        curl_easy_cleanup(vectClose[i]);
+    }
+    for (size_t i = 0; i < vectDue.size(); ++i)
+    {
+        Pending &pending = vectDue[i];
+        bool bAlive = SendNoop(pending.pCurl, pending.sRootUrl,
+            pending.sUserPwd);
+        long iConnects = 0;
+        curl_easy_getinfo(pending.pCurl, CURLINFO_NUM_CONNECTS, &iConnects);
+
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = m_Hosts[pending.sKey];
+        --host.iBusy;
+        ++m_Stats.iNoops;
+        /* curl replaces a connection it finds closed on its own */
+        if (!bAlive || iConnects > 0)
+        {
+            ++m_Stats.iEvicted;
+        }
+        if (bAlive)
+        {
+            Session session;
+            session.pCurl = pending.pCurl;
+            host.vectIdle.push_back(session);
+            pending.pCurl = NULL;
+        }
+    }
+    for (size_t i = 0; i < vectWarm.size(); ++i)
+    {
+        Pending &pending = vectWarm[i];
+        pending.pCurl = curl_easy_init();
+        bool bAlive = pending.pCurl != NULL &&
+            SendNoop(pending.pCurl, pending.sRootUrl, pending.sUserPwd);
+
+        Poco::FastMutex::ScopedLock l(m_Mutex);
+        Host &host = m_Hosts[pending.sKey];
+        --host.iBusy;
+        if (bAlive)
+        {
+            Session session;
+            session.pCurl = pending.pCurl;
+            host.vectIdle.push_back(session);
+            pending.pCurl = NULL;
+            ++m_Stats.iOpened;
+        }
+        else
+        {
+            host.tWarmRetry.update();
+            host.tWarmRetry += WARM_RETRY_US;
+        }
+    }
+
+    /* the ones that failed */
+    for (size_t i = 0; i < vectDue.size(); ++i)
+    {
+        if (vectDue[i].pCurl != NULL) curl_easy_cleanup(vectDue[i].pCurl);
+    }
+    for (size_t i = 0; i < vectWarm.size(); ++i)
+    {
+        if (vectWarm[i].pCurl != NULL) curl_easy_cleanup(vectWarm[i].pCurl);
+    }
+}
+
+void SessionPool::KeepAliveRoutine()
+{
+    while (!m_StopEvent.tryWait(TICK_MS))
+    {
+        Maintain();
+    }
+}
+
+void SessionPool::Stop()
+{
+    if (m_KeepAliveThread.isRunning())
+    {
+        m_StopEvent.set();
+        m_KeepAliveThread.join();
+    }
+}
@@ -0,0 +1,145 @@
+#ifndef _SessionPool_H_
+#define _SessionPool_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <curl/curl.h>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Thread.h>
+#include <Poco/RunnableAdapter.h>
+#include <Poco/Timestamp.h>
+
+/* curl handles with their logged in control connections, kept between
+   transfers and routines for every FtpClient of the process. Sessions
+   are looked up by server and login, the one used last goes out first.
+   A thread sends NOOP on sessions that sat idle for the keepalive
+   interval so servers and firewalls do not drop them; one that does not
+   answer is closed instead of failing the next transfer. It also opens
+   sessions ahead of time to keep a number of them warm per server, and
+   closes the ones above that number that stayed unused too long */
+class SessionPool
+{
+public:
+    struct Stats
+    {
+        Stats()
+        : iIdle(0)
+        , iBusy(0)
+        , iNoops(0)
+        , iEvicted(0)
+        , iOpened(0){}
+
+        int iIdle;
+        int iBusy;
+        Poco::UInt64 iNoops;
+        /* sessions found dead by a NOOP */
+        Poco::UInt64 iEvicted;
+        /* sessions opened ahead of time to keep them warm */
+        Poco::UInt64 iOpened;
+    };
+
+    static SessionPool &Instance();
+
+    /* an idle session to the server of sUrl, a new handle if there is
+       none. Its options are reset either way */
+    CURL *Checkout(const std::string &sUrl, const std::string &sUserPwd);
+
+    /* hand it back after use, bReusable false closes it */
+    void Checkin(CURL *pCurl, const std::string &sUrl,
+        const std::string &sUserPwd, bool bReusable = true);
+
+    /* idle time before a NOOP is sent, 0 for no keepalive. 30 s by
+       default, below the one or two minutes servers usually allow */
+    void SetKeepAliveInterval(long iIntervalMs);
+
+    /* sessions beyond the warm ones are closed after this long unused,
+       0 keeps them */
+    void SetMaxIdleTime(long iMaxIdleMs);
+
+    /* idle sessions kept open for sHost ("host[:port]" as in the URL),
+       for each login that was used with it */
+    void SetWarmSessions(const std::string &sHost, int iCount);
+
+    Stats GetStats();
+
+    /* close every idle session */
+    void Clear();
+
+    SessionPool();
+
+    ~SessionPool();
+
+private:
+    struct Session
+    {
+        CURL *pCurl;
+        Poco::Timestamp tUsed;
+    };
+
+    struct Host
+    {
+        Host()
+        : sRootUrl()
+        , sUserPwd()
+        , sHost()
+        , vectIdle()
+        , iBusy(0)
+        , tWarmRetry(0){}
+
+        /* what NOOP and warm up connect to */
+        std::string sRootUrl;
+        std::string sUserPwd;
+        std::string sHost;
+        /* least recently used first */
+        std::vector<Session> vectIdle;
+        /* checked out, or being kept alive right now */
+        int iBusy;
+        /* no warm up before this after one failed */
+        Poco::Timestamp tWarmRetry;
+    };
+
+    /* a session taken out of the pool for a NOOP, or one being opened
+       to keep the server warm */
+    struct Pending
+    {
+        std::string sKey;
+        std::string sRootUrl;
+        std::string sUserPwd;
+        CURL *pCurl;
+    };
+
+    Host &GetHost(const std::string &sUrl, const std::string &sUserPwd);
+
+    int GetWarmLocked(const std::string &sHost) const;
+
+    /* connects if needed, false if the server did not answer */
+    static bool SendNoop(CURL *pCurl, const std::string &sRootUrl,
+        const std::string &sUserPwd);
+
+    void Maintain();
+
+    void KeepAliveRoutine();
+
+    void Stop();
+
+    SessionPool(const SessionPool &rhs);
+
+    SessionPool & operator=(const SessionPool &rhs);
+
+private:
+    std::map<std::string, Host> m_Hosts;
+    std::map<std::string, int> m_WarmCounts;
+    long m_iIntervalMs;
+    long m_iMaxIdleMs;
+    Stats m_Stats;
+    Poco::FastMutex m_Mutex;
+
+    Poco::Event m_StopEvent;
+    Poco::RunnableAdapter<SessionPool> m_KeepAliveRunnable;
+    Poco::Thread m_KeepAliveThread;
+};
+
+#endif // _SessionPool_H_
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <Poco/SingletonHolder.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "SocketTuner.h"
+#include "PortManager.h"
+#include "ConnectRacer.h"
+
+namespace // anonymous namespace begin
+{
+    /* the round trip assumed until a handshake was seen */
+    const double DEFAULT_RTT = 0.1;
+
+    const int MIN_BUFFER = 64 * 1024;
+    const int MAX_BUFFER = 64 * 1024 * 1024;
+
+    bool _SetOption(
+        curl_socket_t iSocket,
+        int iLevel,
+        int iName,
+        const void *pValue,
+        int iLength,
+        const char *szName)
+    {
+        if (setsockopt(iSocket, iLevel, iName, (const char *)pValue,
+            iLength) == 0)
+        {
+            return true;
+        }
+#if defined(_WIN32)
+        fprintf(stderr, "%s failed: %d\n", szName, WSAGetLastError());
+#else
+        fprintf(stderr, "%s failed: %s\n", szName, strerror(errno));
+#endif
+        return false;
+    }
+
+    unsigned short _GetPort(const struct sockaddr *pAddr)
+    {
+        if (pAddr->sa_family == AF_INET)
+        {
+            return ntohs(((const struct sockaddr_in *)pAddr)->sin_port);
+        }
+        if (pAddr->sa_family == AF_INET6)
+        {
+            return ntohs(((const struct sockaddr_in6 *)pAddr)->sin6_port);
+        }
+        return 0;
+    }
+} // anonymous namespace end
+
+SocketTuner::Context::Context(const std::string &sHost)
+: sHost(sHost)
+, iControlPort(21)
+, iRaced(CURL_SOCKET_BAD)
+, bRaceFailed(false)
+, bRaced(false)
+, pStop(NULL)
+, pStopParam(NULL)
+{
+    /* "[v6]:port" or "host:port" */
+    std::string::size_type iColon = sHost.rfind(':');
+    std::string::size_type iBracket = sHost.rfind(']');
+    if (iColon != std::string::npos &&
+        (iBracket == std::string::npos ? sHost.find(':') == iColon :
+        iColon > iBracket))
+    {
+        iControlPort = (unsigned short)atoi(sHost.c_str() + iColon + 1);
+    }
+}
+
+SocketTuner &SocketTuner::Instance()
+{
+    static Poco::SingletonHolder<SocketTuner> sh;
+    return *sh.get();
+}
+
+SocketTuner::SocketTuner()
+: m_Hosts()
+, m_Default()
+{
+}
+
+void SocketTuner::SetPolicy(const std::string &sHost, const Policy &policy)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    host.bPolicy = true;
+    host.policy = policy;
+}
+
+void SocketTuner::SetDefaultPolicy(const Policy &policy)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_Default = policy;
+}
+
+SocketTuner::Policy SocketTuner::GetPolicy(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return GetPolicyLocked(sHost);
+}
+
+void SocketTuner::Prepare(CURL *pCurl, Context &context)
+{
+    Policy policy = GetPolicy(context.sHost);
+    curl_easy_setopt(pCurl, CURLOPT_OPENSOCKETFUNCTION, OpenSocket);
+    curl_easy_setopt(pCurl, CURLOPT_OPENSOCKETDATA, &context);
+    curl_easy_setopt(pCurl, CURLOPT_SOCKOPTFUNCTION, SetSocketOptions);
+    curl_easy_setopt(pCurl, CURLOPT_SOCKOPTDATA, &context);
+    context.bRaced = ConnectRacer::Instance().IsRaced(context.sHost,
+        context.iControlPort);
+    if (policy.iKeepIdle > 0)
+    {
+        /* curl knows how to set them on each system */
+        curl_easy_setopt(pCurl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(pCurl, CURLOPT_TCP_KEEPIDLE,
+            (long)policy.iKeepIdle);
+        curl_easy_setopt(pCurl, CURLOPT_TCP_KEEPINTVL, (long)(
+            policy.iKeepInterval > 0 ? policy.iKeepInterval :
+            policy.iKeepIdle));
+    }
+}
+
+void SocketTuner::ReportConnect(CURL *pCurl, const std::string &sHost)
+{
+    long iConnects = 0;
+    double fLookup = 0.0;
+    double fConnect = 0.0;
+    curl_easy_getinfo(pCurl, CURLINFO_NUM_CONNECTS, &iConnects);
+    curl_easy_getinfo(pCurl, CURLINFO_NAMELOOKUP_TIME, &fLookup);
+    curl_easy_getinfo(pCurl, CURLINFO_CONNECT_TIME, &fConnect);
+    if (iConnects == 0 || fConnect <= fLookup)
+    {
+        return;
+    }
+
+    /* queueing only ever adds to it, the smallest is the path */
+    double fRtt = fConnect - fLookup;
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Host &host = m_Hosts[sHost];
+    if (host.fRtt == 0.0 || fRtt < host.fRtt)
+    {
+        host.fRtt = fRtt;
+    }
+}
+
+double SocketTuner::GetRtt(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    return it != m_Hosts.end() ? it->second.fRtt : 0.0;
+}
+
+int SocketTuner::GetBufferSize(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    const Policy &policy = GetPolicyLocked(sHost);
+    if (policy.iBufferSize > 0)
+    {
+        return policy.iBufferSize;
+    }
+    if (policy.iBytesPerSec <= 0)
+    {
+        return 0;
+    }
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    double fRtt = (it != m_Hosts.end() && it->second.fRtt > 0.0) ?
+        it->second.fRtt : DEFAULT_RTT;
+    double fBytes = policy.iBytesPerSec * fRtt;
+    return (int)std::max((double)MIN_BUFFER,
+        std::min(fBytes, (double)MAX_BUFFER));
+}
+
+bool SocketTuner::Apply(
+    curl_socket_t iSocket,
+    const std::string &sHost,
+    bool bControl)
+{
+    Policy policy = GetPolicy(sHost);
+    bool bResult = true;
+    if (bControl)
+    {
+        if (policy.bNoDelay)
+        {
+            int iOn = 1;
+            bResult &= _SetOption(iSocket, IPPROTO_TCP, TCP_NODELAY,
+                &iOn, sizeof(iOn), "TCP_NODELAY");
+        }
+        return bResult;
+    }
+
+    /* before the handshake, the window scale is agreed on there */
+    int iBuffer = GetBufferSize(sHost);
+    if (iBuffer > 0)
+    {
+        bResult &= _SetOption(iSocket, SOL_SOCKET, SO_SNDBUF,
+            &iBuffer, sizeof(iBuffer), "SO_SNDBUF");
+        bResult &= _SetOption(iSocket, SOL_SOCKET, SO_RCVBUF,
+            &iBuffer, sizeof(iBuffer), "SO_RCVBUF");
+    }
+#if defined(TCP_CONGESTION)
+    if (!policy.sCongestion.empty())
+    {
+        bResult &= _SetOption(iSocket, IPPROTO_TCP, TCP_CONGESTION,
+            policy.sCongestion.c_str(), (int)policy.sCongestion.size(),
+            "TCP_CONGESTION");
+    }
+#endif
+    return bResult;
+}
+
+curl_socket_t SocketTuner::OpenSocket(
+    void *pParam,
+    curlsocktype purpose,
+    struct curl_sockaddr *pAddress)
+{
+    /* the address is only known here; the listening socket of active
+       mode also comes through and passes its options on to accept() */
+    Context *pContext = (Context *)pParam;
+    bool bControl = purpose == CURLSOCKTYPE_IPCXN &&
+        _GetPort(&pAddress->addr) == pContext->iControlPort;
+    if (bControl)
+    {
+        if (pContext->bRaceFailed)
+        {
+            return CURL_SOCKET_BAD;
+        }
+        /* whatever address curl picked, the one that greeted first */
+        bool bRaced = false;
+        curl_socket_t iSocket = ConnectRacer::Instance().Connect(
+            pContext->sHost, pContext->iControlPort, bRaced,
+            pContext->pStop, pContext->pStopParam);
+        if (bRaced)
+        {
+            pContext->bRaceFailed = iSocket == CURL_SOCKET_BAD;
+            pContext->iRaced = iSocket;
+            if (iSocket != CURL_SOCKET_BAD)
+            {
+                Instance().Apply(iSocket, pContext->sHost, true);
+            }
+            return iSocket;
+        }
+    }
+
+    curl_socket_t iSocket = socket(pAddress->family, pAddress->socktype,
+        pAddress->protocol);
+    if (iSocket == CURL_SOCKET_BAD)
+    {
+        return iSocket;
+    }
+    Instance().Apply(iSocket, pContext->sHost, bControl);
+    if (!bControl)
+    {
+        PortManager::Instance().PrepareDataSocket(iSocket);
+    }
+    return iSocket;
+}
+
+int SocketTuner::SetSocketOptions(
+    void *pParam,
+    curl_socket_t iSocket,
+    curlsocktype purpose)
+{
+    /* connecting sockets were set up in OpenSocket() */
+    Context *pContext = (Context *)pParam;
+    if (purpose == CURLSOCKTYPE_ACCEPT)
+    {
+        Instance().Apply(iSocket, pContext->sHost, false);
+    }
+    else if (iSocket == pContext->iRaced)
+    {
+        /* only once, the number may come back for another socket */
+        pContext->iRaced = CURL_SOCKET_BAD;
+        return CURL_SOCKOPT_ALREADY_CONNECTED;
+    }
+    /* a transfer is never failed over a refused option */
+    return CURL_SOCKOPT_OK;
+}
+
+const SocketTuner::Policy &SocketTuner::GetPolicyLocked(
+    const std::string &sHost) const
+{
+    std::map<std::string, Host>::const_iterator it = m_Hosts.find(sHost);
+    if (it != m_Hosts.end() && it->second.bPolicy)
+    {
+        return it->second.policy;
+    }
+    return m_Default;
+}
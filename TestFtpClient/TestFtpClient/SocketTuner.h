@@ -0,0 +1,129 @@
+#ifndef _SocketTuner_H_
+#define _SocketTuner_H_
+
+#include <string>
+#include <map>
+#include <curl/curl.h>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+
+#include "RateLimiter.h"
+
+/* socket options for the connections curl opens, per server and shared
+   by every FtpClient of the process. Data sockets get their buffers
+   sized to the bandwidth-delay product of the link, with the round trip
+   taken from the TCP handshakes seen so far, and may use another
+   congestion control. The control connection can turn Nagle off so
+   commands are not held back, and both can send keepalives. A policy
+   left at its defaults changes nothing */
+class SocketTuner
+{
+public:
+    struct Policy
+    {
+        Policy()
+        : iBytesPerSec(0)
+        , iBufferSize(0)
+        , sCongestion()
+        , bNoDelay(false)
+        , iKeepIdle(0)
+        , iKeepInterval(0){}
+
+        /* speed of the link, sizes the data socket buffers with the
+           measured round trip; 0 leaves them to the system */
+        Poco::Int64 iBytesPerSec;
+        /* SO_SNDBUF and SO_RCVBUF of data sockets instead of the sizing */
+        int iBufferSize;
+        /* TCP_CONGESTION of data sockets, e.g. "bbr". Only where the
+           system has it, otherwise its default stays */
+        std::string sCongestion;
+        /* TCP_NODELAY on the control connection */
+        bool bNoDelay;
+        /* seconds idle before keepalive probes and between them, 0 for
+           none; without an interval the idle time is used */
+        int iKeepIdle;
+        int iKeepInterval;
+    };
+
+    /* what the callbacks of one transfer need, it has to outlive it */
+    struct Context
+    {
+        /* sHost as in the URL, with the port if it has one */
+        explicit Context(const std::string &sHost);
+
+        std::string sHost;
+        /* connections to this port are the control connection */
+        unsigned short iControlPort;
+        /* the socket ConnectRacer connected, until curl took it */
+        curl_socket_t iRaced;
+        /* no address answered, curl is not to try them one by one */
+        bool bRaceFailed;
+        /* set by Prepare(): the control connection may end up at
+           another address than curl resolved */
+        bool bRaced;
+        /* polled while the addresses are raced */
+        RateLimiter::StopCheck pStop;
+        const void *pStopParam;
+    };
+
+    static SocketTuner &Instance();
+
+    void SetPolicy(const std::string &sHost, const Policy &policy);
+
+    /* for hosts without a policy of their own */
+    void SetDefaultPolicy(const Policy &policy);
+
+    Policy GetPolicy(const std::string &sHost);
+
+    /* installs the callbacks and keepalive options on the handle, again
+       before every perform as curl_easy_reset drops them */
+    void Prepare(CURL *pCurl, Context &context);
+
+    /* after a perform, takes the handshake time of a new connection */
+    void ReportConnect(CURL *pCurl, const std::string &sHost);
+
+    /* smallest handshake time in seconds, 0 while unknown */
+    double GetRtt(const std::string &sHost);
+
+    /* SO_SNDBUF and SO_RCVBUF for data sockets, 0 to leave them */
+    int GetBufferSize(const std::string &sHost);
+
+    /* sets the options of the host's policy on a socket that is not yet
+       connected, false if the system refused one of them */
+    bool Apply(curl_socket_t iSocket, const std::string &sHost,
+        bool bControl);
+
+    SocketTuner();
+
+private:
+    struct Host
+    {
+        Host()
+        : bPolicy(false)
+        , policy()
+        , fRtt(0.0){}
+
+        bool bPolicy;
+        Policy policy;
+        double fRtt;
+    };
+
+    static curl_socket_t OpenSocket(void *pParam, curlsocktype purpose,
+        struct curl_sockaddr *pAddress);
+
+    static int SetSocketOptions(void *pParam, curl_socket_t iSocket,
+        curlsocktype purpose);
+
+    const Policy &GetPolicyLocked(const std::string &sHost) const;
+
+    SocketTuner(const SocketTuner &rhs);
+
+    SocketTuner & operator=(const SocketTuner &rhs);
+
+private:
+    std::map<std::string, Host> m_Hosts;
+    Policy m_Default;
+    Poco::FastMutex m_Mutex;
+};
+
+#endif // _SocketTuner_H_
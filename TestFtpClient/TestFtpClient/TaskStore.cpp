@@ -0,0 +1,312 @@
+#include <string.h>
+#include <algorithm>
+
+#include "TaskStore.h"
+
+namespace // anonymous namespace begin
+{
+    const size_t BLOCK_SIZE = 64 * 1024;
+
+    template <class T>
+    size_t _Capacity(const std::vector<T> &vect)
+    {
+        return vect.capacity() * sizeof(T);
+    }
+} // anonymous namespace end
+
+TaskStore::TaskStore()
+: m_vectDirs()
+, m_DirIndex()
+, m_sLastRelDir()
+, m_iLastDir(RootDir)
+, m_vectDir()
+, m_vectName()
+, m_vectNameLen()
+, m_vectSize()
+, m_vectState()
+, m_vectPriority()
+, m_vectOffset()
+, m_vectHost()
+, m_vectHostNames()
+, m_FilePaths()
+, m_vectBlocks()
+, m_iBlockUsed(BLOCK_SIZE)
+, m_iNameBytes(0)
+{
+    Clear();
+}
+
+TaskStore::~TaskStore()
+{
+    Clear();
+}
+
+void TaskStore::Clear()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    for (size_t i = 0; i < m_vectBlocks.size(); ++i)
+    {
+        delete [] m_vectBlocks[i];
+    }
+    /* swap so the capacity is released as well */
+    std::vector<char *>().swap(m_vectBlocks);
+    std::vector<DirId>().swap(m_vectDir);
+    std::vector<const char *>().swap(m_vectName);
+    std::vector<Poco::UInt16>().swap(m_vectNameLen);
+    std::vector<Poco::Int64>().swap(m_vectSize);
+    std::vector<Poco::UInt8>().swap(m_vectState);
+    std::vector<Poco::Int8>().swap(m_vectPriority);
+    std::vector<Poco::Int64>().swap(m_vectOffset);
+    std::vector<HostId>().swap(m_vectHost);
+    m_vectHostNames.clear();
+    m_FilePaths.clear();
+    m_DirIndex.clear();
+    m_iBlockUsed = BLOCK_SIZE;
+    m_iNameBytes = 0;
+
+    DirNode root;
+    root.iParent = RootDir;
+    root.pName = "";
+    root.iNameLen = 0;
+    m_vectDirs.assign(1, root);
+    m_sLastRelDir.clear();
+    m_iLastDir = RootDir;
+}
+
+TaskStore::TaskId TaskStore::Add(
+    const std::string &sRelDir,
+    const char *pName,
+    size_t iNameLen,
+    Poco::Int64 iSize)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    if (sRelDir != m_sLastRelDir)
+    {
+        m_iLastDir = InternDir(sRelDir);
+        m_sLastRelDir = sRelDir;
+    }
+
+    return AddLocked(m_iLastDir, pName, iNameLen, iSize, RootHost);
+}
+
+TaskStore::TaskId TaskStore::AddFile(
+    const std::string &sRemotePath,
+    const std::string &sLocalPath,
+    Poco::Int64 iSize,
+    HostId iHost/* = RootHost*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    TaskId iTask = AddLocked(RootDir, "", 0, iSize, iHost);
+    m_FilePaths[iTask] = std::make_pair(sRemotePath, sLocalPath);
+    return iTask;
+}
+
+TaskStore::HostId TaskStore::InternHost(const std::string &sHost)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    /* a batch goes to a handful of servers, a scan is enough */
+    std::vector<std::string>::iterator it =
+        std::find(m_vectHostNames.begin(), m_vectHostNames.end(), sHost);
+    if (it != m_vectHostNames.end())
+    {
+        return (HostId)(it - m_vectHostNames.begin());
+    }
+    m_vectHostNames.push_back(sHost);
+    return (HostId)(m_vectHostNames.size() - 1);
+}
+
+std::string TaskStore::GetHostName(HostId iHost) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return iHost < m_vectHostNames.size() ?
+        m_vectHostNames[iHost] : std::string();
+}
+
+TaskStore::HostId TaskStore::GetHost(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectHost[iTask];
+}
+
+size_t TaskStore::GetCount() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectDir.size();
+}
+
+Poco::Int64 TaskStore::GetSize(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectSize[iTask];
+}
+
+TaskStore::TaskState TaskStore::GetState(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return (TaskState)m_vectState[iTask];
+}
+
+void TaskStore::SetState(TaskId iTask, TaskState eState)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_vectState[iTask] = (Poco::UInt8)eState;
+}
+
+TaskStore::DirId TaskStore::GetDir(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectDir[iTask];
+}
+
+int TaskStore::GetPriority(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectPriority[iTask];
+}
+
+void TaskStore::SetPriority(TaskId iTask, int iPriority)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_vectPriority[iTask] = (Poco::Int8)
+        std::max(-128, std::min(iPriority, 127));
+}
+
+Poco::Int64 TaskStore::GetOffset(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_vectOffset[iTask];
+}
+
+void TaskStore::SetOffset(TaskId iTask, Poco::Int64 iOffset)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_vectOffset[iTask] = iOffset;
+}
+
+void TaskStore::GetPaths(
+    TaskId iTask,
+    const std::string &sRemoteRoot,
+    const std::string &sLocalRoot,
+    std::string &sRemotePath,
+    std::string &sLocalPath) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<TaskId, std::pair<std::string, std::string> >::const_iterator
+        it = m_FilePaths.find(iTask);
+    if (it != m_FilePaths.end())
+    {
+        sRemotePath = it->second.first;
+        sLocalPath = it->second.second;
+        return;
+    }
+    std::string sRelPath;
+    AppendDirPath(m_vectDir[iTask], sRelPath);
+    sRelPath.append(m_vectName[iTask], m_vectNameLen[iTask]);
+    sRemotePath = sRemoteRoot + sRelPath;
+    sLocalPath = sLocalRoot + sRelPath;
+}
+
+std::string TaskStore::GetRelativePath(TaskId iTask) const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::string sPath;
+    AppendDirPath(m_vectDir[iTask], sPath);
+    sPath.append(m_vectName[iTask], m_vectNameLen[iTask]);
+    return sPath;
+}
+
+size_t TaskStore::GetMemoryUsage() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    size_t iBytes = _Capacity(m_vectDir) + _Capacity(m_vectName) +
+        _Capacity(m_vectNameLen) + _Capacity(m_vectSize) +
+        _Capacity(m_vectState) + _Capacity(m_vectPriority) +
+        _Capacity(m_vectOffset) + _Capacity(m_vectHost) +
+        _Capacity(m_vectBlocks) +
+        _Capacity(m_vectDirs) + m_vectBlocks.size() * BLOCK_SIZE;
+    /* a map node is about four pointers plus the key */
+    iBytes += m_DirIndex.size() *
+        (4 * sizeof(void *) + sizeof(std::pair<DirId, std::string>) +
+        sizeof(DirId));
+    return iBytes;
+}
+
+size_t TaskStore::GetNameBytes() const
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    return m_iNameBytes;
+}
+
+TaskStore::TaskId TaskStore::AddLocked(
+    DirId iDir,
+    const char *pName,
+    size_t iNameLen,
+    Poco::Int64 iSize,
+    HostId iHost)
+{
+    TaskId iTask = (TaskId)m_vectDir.size();
+    m_vectDir.push_back(iDir);
+    m_vectName.push_back(CopyName(pName, iNameLen));
+    m_vectNameLen.push_back((Poco::UInt16)iNameLen);
+    m_vectSize.push_back(iSize);
+    m_vectState.push_back((Poco::UInt8)Pending);
+    m_vectPriority.push_back(0);
+    m_vectOffset.push_back(0);
+    m_vectHost.push_back(iHost);
+    return iTask;
+}
+
+TaskStore::DirId TaskStore::InternDir(const std::string &sRelDir)
+{
+    DirId iDir = RootDir;
+    std::string::size_type iBegin = 0;
+    while (iBegin < sRelDir.size())
+    {
+        std::string::size_type iEnd = sRelDir.find('/', iBegin);
+        if (iEnd == std::string::npos) iEnd = sRelDir.size();
+
+        std::pair<DirId, std::string> key(iDir,
+            sRelDir.substr(iBegin, iEnd - iBegin));
+        std::map<std::pair<DirId, std::string>, DirId>::iterator it =
+            m_DirIndex.find(key);
+        if (it != m_DirIndex.end())
+        {
+            iDir = it->second;
+        }
+        else
+        {
+            DirNode node;
+            node.iParent = iDir;
+            node.pName = CopyName(key.second.data(), key.second.size());
+            node.iNameLen = (Poco::UInt16)key.second.size();
+            iDir = (DirId)m_vectDirs.size();
+            m_vectDirs.push_back(node);
+            m_DirIndex.insert(std::make_pair(key, iDir));
+        }
+        iBegin = iEnd + 1;
+    }
+    return iDir;
+}
+
+const char * TaskStore::CopyName(const char *pName, size_t iNameLen)
+{
+    if (iNameLen == 0) return "";
+    if (m_iBlockUsed + iNameLen > BLOCK_SIZE)
+    {
+        m_vectBlocks.push_back(new char[BLOCK_SIZE]);
+        m_iBlockUsed = 0;
+    }
+    char *pCopy = m_vectBlocks.back() + m_iBlockUsed;
+    memcpy(pCopy, pName, iNameLen);
+    m_iBlockUsed += iNameLen;
+    m_iNameBytes += iNameLen;
+    return pCopy;
+}
+
+void TaskStore::AppendDirPath(DirId iDir, std::string &sPath) const
+{
+    if (iDir == RootDir) return;
+    AppendDirPath(m_vectDirs[iDir].iParent, sPath);
+    sPath.append(m_vectDirs[iDir].pName, m_vectDirs[iDir].iNameLen);
+    sPath += '/';
+}
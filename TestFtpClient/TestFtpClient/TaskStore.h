@@ -0,0 +1,150 @@
+#ifndef _TaskStore_H_
+#define _TaskStore_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <Poco/Types.h>
+#include <Poco/Mutex.h>
+
+/* all files of one transfer batch, kept compact: every directory is
+   interned once as a node (parent + own name), a file is the node id
+   plus a name slice in an arena, and the per-file fields are stored as
+   parallel arrays. A task's path is root + directory path + name, a
+   file added on its own keeps its full paths aside. Every task also
+   names the server it goes to, interned like the directories.
+   Every method locks, the scan threads add while the transfer reads */
+class TaskStore
+{
+public:
+    typedef Poco::UInt32 TaskId;
+    typedef Poco::UInt32 DirId;
+    typedef Poco::UInt16 HostId;
+
+    enum TaskState
+    {
+        Pending,
+        Running,
+        Done,
+        Failed,
+    };
+
+    enum
+    {
+        RootDir = 0,
+        /* the server of the scanned roots, intern it first */
+        RootHost = 0,
+    };
+
+    TaskStore();
+
+    ~TaskStore();
+
+    /* drop every task and give the arena back */
+    void Clear();
+
+    /* sRelDir as handed out by DirScanner: "a/b/", "" for the root,
+       the task goes to RootHost */
+    TaskId Add(
+        const std::string &sRelDir,
+        const char *pName,
+        size_t iNameLen,
+        Poco::Int64 iSize);
+
+    /* a file outside the scanned roots */
+    TaskId AddFile(
+        const std::string &sRemotePath,
+        const std::string &sLocalPath,
+        Poco::Int64 iSize,
+        HostId iHost = RootHost);
+
+    /* "host[:port]" to its id, added if new */
+    HostId InternHost(const std::string &sHost);
+
+    std::string GetHostName(HostId iHost) const;
+
+    HostId GetHost(TaskId iTask) const;
+
+    size_t GetCount() const;
+
+    Poco::Int64 GetSize(TaskId iTask) const;
+
+    TaskState GetState(TaskId iTask) const;
+
+    void SetState(TaskId iTask, TaskState eState);
+
+    DirId GetDir(TaskId iTask) const;
+
+    /* higher runs first, 0 by default */
+    int GetPriority(TaskId iTask) const;
+
+    void SetPriority(TaskId iTask, int iPriority);
+
+    /* bytes already on the server, the rest is appended */
+    Poco::Int64 GetOffset(TaskId iTask) const;
+
+    void SetOffset(TaskId iTask, Poco::Int64 iOffset);
+
+    void GetPaths(
+        TaskId iTask,
+        const std::string &sRemoteRoot,
+        const std::string &sLocalRoot,
+        std::string &sRemotePath,
+        std::string &sLocalPath) const;
+
+    /* directory path plus name, relative to the roots */
+    std::string GetRelativePath(TaskId iTask) const;
+
+    /* bytes held for the tasks, names included */
+    size_t GetMemoryUsage() const;
+
+    size_t GetNameBytes() const;
+
+private:
+    struct DirNode
+    {
+        DirId iParent;
+        const char *pName;
+        Poco::UInt16 iNameLen;
+    };
+
+    DirId InternDir(const std::string &sRelDir);
+
+    const char * CopyName(const char *pName, size_t iNameLen);
+
+    void AppendDirPath(DirId iDir, std::string &sPath) const;
+
+    TaskId AddLocked(DirId iDir, const char *pName, size_t iNameLen,
+        Poco::Int64 iSize, HostId iHost);
+
+    TaskStore(const TaskStore &rhs);
+
+    TaskStore & operator=(const TaskStore &rhs);
+
+private:
+    std::vector<DirNode> m_vectDirs;
+    std::map<std::pair<DirId, std::string>, DirId> m_DirIndex;
+    /* the directory the previous Add() went to, files arrive grouped */
+    std::string m_sLastRelDir;
+    DirId m_iLastDir;
+
+    std::vector<DirId> m_vectDir;
+    std::vector<const char *> m_vectName;
+    std::vector<Poco::UInt16> m_vectNameLen;
+    std::vector<Poco::Int64> m_vectSize;
+    std::vector<Poco::UInt8> m_vectState;
+    std::vector<Poco::Int8> m_vectPriority;
+    std::vector<Poco::Int64> m_vectOffset;
+    std::vector<HostId> m_vectHost;
+    std::vector<std::string> m_vectHostNames;
+    std::map<TaskId, std::pair<std::string, std::string> > m_FilePaths;
+
+    /* names live in big blocks that are never moved */
+    std::vector<char *> m_vectBlocks;
+    size_t m_iBlockUsed;
+    size_t m_iNameBytes;
+
+    mutable Poco::FastMutex m_Mutex;
+};
+
+#endif // _TaskStore_H_
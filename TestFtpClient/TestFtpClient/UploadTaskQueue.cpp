@@ -0,0 +1,359 @@
+#include <algorithm>
+
+#include "UploadTaskQueue.h"
+
+namespace // anonymous namespace begin
+{
+    /* bytes a server is credited per round */
+    const Poco::Int64 QUANTUM = 4 * 1024 * 1024;
+
+    /* what a file costs at least, STOR and the data connection */
+    const Poco::Int64 MIN_COST = 64 * 1024;
+
+    /* how often a Pop() waiting for busy servers asks for their limits
+       again, they may go up without anything being released */
+    const long HOST_POLL_MS = 200;
+} // anonymous namespace end
+
+UploadTaskQueue::UploadTaskQueue(
+    const TaskStore &taskStore,
+    size_t iCapacity/* = 65536*/)
+: m_TaskStore(taskStore)
+, m_ePolicy(Fifo)
+, m_iCount(0)
+, m_iSeq(0)
+, m_Levels()
+, m_HostStates()
+, m_iRunning(0)
+, m_pLimits(NULL)
+, m_iCapacity(iCapacity)
+, m_bFinished(false)
+, m_bDrained(false)
+, m_bAborted(false)
+{
+}
+
+void UploadTaskQueue::SetHostLimits(HostLimits *pLimits)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_pLimits = pLimits;
+}
+
+void UploadTaskQueue::Reset(Policy ePolicy/* = Fifo*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    Clear();
+    m_HostStates.clear();
+    m_iRunning = 0;
+    m_ePolicy = ePolicy;
+    m_iSeq = 0;
+    m_bFinished = false;
+    m_bDrained = false;
+    m_bAborted = false;
+}
+
+bool UploadTaskQueue::Push(
+    TaskStore::TaskId iTask,
+    bool bWaitForRoom/* = true*/)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    while (bWaitForRoom && !m_bAborted && m_iCount >= m_iCapacity)
+    {
+        m_NotFull.wait(m_Mutex);
+    }
+    if (m_bAborted || m_bDrained)
+    {
+        return false;
+    }
+    Add(iTask);
+    m_NotEmpty.signal();
+    return true;
+}
+
+bool UploadTaskQueue::Pop(TaskStore::TaskId &iTask)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    for (;;)
+    {
+        if (m_bAborted)
+        {
+            return false;
+        }
+        if (m_iCount > 0 && Take(iTask))
+        {
+            break;
+        }
+        /* a running task may still be requeued, and urgent work may
+           still join while the others are busy */
+        if (m_iCount == 0 && m_bFinished && m_iRunning == 0)
+        {
+            m_bDrained = true;
+            return false;
+        }
+        if (m_iCount == 0)
+        {
+            m_NotEmpty.wait(m_Mutex);
+        }
+        else
+        {
+            m_NotEmpty.tryWait(m_Mutex, HOST_POLL_MS);
+        }
+    }
+    m_NotFull.signal();
+    return true;
+}
+
+void UploadTaskQueue::Release(TaskStore::TaskId iTask)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    std::map<TaskStore::HostId, HostState>::iterator it =
+        m_HostStates.find(m_TaskStore.GetHost(iTask));
+    if (it != m_HostStates.end() && it->second.iRunning > 0)
+    {
+        --it->second.iRunning;
+    }
+    if (m_iRunning > 0)
+    {
+        --m_iRunning;
+    }
+    /* a Pop() may be waiting for exactly this server, or for the last
+       task to end */
+    m_NotEmpty.broadcast();
+}
+
+bool UploadTaskQueue::Requeue(TaskStore::TaskId iTask)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    if (m_bAborted)
+    {
+        return false;
+    }
+    /* the caller pops it again itself, the capacity is not checked */
+    m_bDrained = false;
+    Add(iTask);
+    m_NotEmpty.signal();
+    return true;
+}
+
+void UploadTaskQueue::Finish()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bFinished = true;
+    m_NotEmpty.broadcast();
+}
+
+void UploadTaskQueue::Abort()
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    m_bAborted = true;
+    Clear();
+    m_NotEmpty.broadcast();
+    m_NotFull.broadcast();
+}
+
+void UploadTaskQueue::GetHostLoads(std::vector<HostLoad> &vectLoads)
+{
+    Poco::FastMutex::ScopedLock l(m_Mutex);
+    vectLoads.clear();
+    std::map<TaskStore::HostId, HostState>::iterator it =
+        m_HostStates.begin();
+    for (; it != m_HostStates.end(); ++it)
+    {
+        if (it->second.iQueued == 0 && it->second.iRunning == 0) continue;
+        HostLoad load;
+        load.sHost = m_TaskStore.GetHostName(it->first);
+        load.iQueued = it->second.iQueued;
+        load.iRunning = it->second.iRunning;
+        load.iLimit = it->second.iLimit;
+        vectLoads.push_back(load);
+    }
+}
+
+/* heap comparators, ties keep the scan order */
+bool UploadTaskQueue::LargerFirst(const Entry &lhs, const Entry &rhs)
+{
+    if (lhs.iSize != rhs.iSize) return lhs.iSize < rhs.iSize;
+    return lhs.iSeq > rhs.iSeq;
+}
+
+bool UploadTaskQueue::SmallerFirst(const Entry &lhs, const Entry &rhs)
+{
+    if (lhs.iSize != rhs.iSize) return lhs.iSize > rhs.iSize;
+    return lhs.iSeq > rhs.iSeq;
+}
+
+void UploadTaskQueue::Add(TaskStore::TaskId iTask)
+{
+    Level &level = m_Levels[m_TaskStore.GetPriority(iTask)];
+    TaskStore::HostId iHost = m_TaskStore.GetHost(iTask);
+    std::map<TaskStore::HostId, HostQueue>::iterator it =
+        level.Hosts.find(iHost);
+    if (it == level.Hosts.end())
+    {
+        /* a server new to this priority waits for its turn */
+        it = level.Hosts.insert(std::make_pair(iHost, HostQueue())).first;
+        level.Round.push_back(iHost);
+    }
+    AddToHost(it->second, iTask);
+    ++level.iCount;
+    ++m_HostStates[iHost].iQueued;
+    ++m_iCount;
+}
+
+void UploadTaskQueue::AddToHost(HostQueue &queue, TaskStore::TaskId iTask)
+{
+    switch (m_ePolicy)
+    {
+    case ShortestFirst:
+    case LongestFirst:
+    {
+        Entry entry;
+        entry.iTask = iTask;
+        entry.iSize = m_TaskStore.GetSize(iTask);
+        entry.iSeq = m_iSeq++;
+        queue.Heap.push_back(entry);
+        std::push_heap(queue.Heap.begin(), queue.Heap.end(),
+            m_ePolicy == ShortestFirst ? SmallerFirst : LargerFirst);
+        break;
+    }
+    case ByDirectory:
+    {
+        TaskStore::DirId iDir = m_TaskStore.GetDir(iTask);
+        std::deque<TaskStore::TaskId> &tasks = queue.DirTasks[iDir];
+        if (tasks.empty() && (queue.iCount == 0 || iDir != queue.iCurDir))
+        {
+            queue.DirOrder.push_back(iDir);
+        }
+        tasks.push_back(iTask);
+        break;
+    }
+    default:
+        queue.Tasks.push_back(iTask);
+        break;
+    }
+    ++queue.iCount;
+}
+
+bool UploadTaskQueue::Take(TaskStore::TaskId &iTask)
+{
+    /* the most urgent level that has a task for a server with room,
+       empty ones are dropped */
+    LevelMap::iterator itLevel = m_Levels.begin();
+    while (itLevel != m_Levels.end())
+    {
+        if (itLevel->second.iCount == 0)
+        {
+            m_Levels.erase(itLevel++);
+            continue;
+        }
+        if (TakeFromLevel(itLevel->second, iTask))
+        {
+            --itLevel->second.iCount;
+            --m_iCount;
+            ++m_iRunning;
+            return true;
+        }
+        ++itLevel;
+    }
+    return false;
+}
+
+bool UploadTaskQueue::TakeFromLevel(Level &level, TaskStore::TaskId &iTask)
+{
+    /* the server in front sends while it has credit and pays the file
+       size, one in debt gets a quantum and goes to the back. Busy ones
+       are passed over; once all of them were in a row, give up */
+    size_t iBusy = 0;
+    while (iBusy < level.Round.size())
+    {
+        TaskStore::HostId iHost = level.Round.front();
+        level.Round.pop_front();
+        std::map<TaskStore::HostId, HostQueue>::iterator it =
+            level.Hosts.find(iHost);
+        if (it->second.iCount == 0)
+        {
+            level.Hosts.erase(it);
+            continue;
+        }
+        if (IsHostBusy(iHost))
+        {
+            level.Round.push_back(iHost);
+            ++iBusy;
+            continue;
+        }
+        if (it->second.iDeficit <= 0)
+        {
+            it->second.iDeficit += QUANTUM;
+            level.Round.push_back(iHost);
+            iBusy = 0;
+            continue;
+        }
+
+        level.Round.push_front(iHost);
+        iTask = TakeFromHost(it->second);
+        it->second.iDeficit -= std::max(m_TaskStore.GetSize(iTask), MIN_COST);
+        HostState &state = m_HostStates[iHost];
+        --state.iQueued;
+        ++state.iRunning;
+        return true;
+    }
+    return false;
+}
+
+TaskStore::TaskId UploadTaskQueue::TakeFromHost(HostQueue &queue)
+{
+    TaskStore::TaskId iTask = 0;
+    switch (m_ePolicy)
+    {
+    case ShortestFirst:
+    case LongestFirst:
+        std::pop_heap(queue.Heap.begin(), queue.Heap.end(),
+            m_ePolicy == ShortestFirst ? SmallerFirst : LargerFirst);
+        iTask = queue.Heap.back().iTask;
+        queue.Heap.pop_back();
+        break;
+    case ByDirectory:
+    {
+        std::map<TaskStore::DirId, std::deque<TaskStore::TaskId> >::iterator
+            it = queue.DirTasks.find(queue.iCurDir);
+        /* move on only when the current directory has nothing left */
+        while (it == queue.DirTasks.end() || it->second.empty())
+        {
+            if (it != queue.DirTasks.end()) queue.DirTasks.erase(it);
+            queue.iCurDir = queue.DirOrder.front();
+            queue.DirOrder.pop_front();
+            it = queue.DirTasks.find(queue.iCurDir);
+        }
+        iTask = it->second.front();
+        it->second.pop_front();
+        break;
+    }
+    default:
+        iTask = queue.Tasks.front();
+        queue.Tasks.pop_front();
+        break;
+    }
+    --queue.iCount;
+    return iTask;
+}
+
+bool UploadTaskQueue::IsHostBusy(TaskStore::HostId iHost)
+{
+    HostState &state = m_HostStates[iHost];
+    state.iLimit = m_pLimits != NULL ? m_pLimits->GetHostLimit(iHost) : 0;
+    return state.iLimit < 0 ||
+        (state.iLimit > 0 && state.iRunning >= state.iLimit);
+}
+
+void UploadTaskQueue::Clear()
+{
+    m_Levels.clear();
+    m_iCount = 0;
+    /* what is running still gets released */
+    std::map<TaskStore::HostId, HostState>::iterator it =
+        m_HostStates.begin();
+    for (; it != m_HostStates.end(); ++it)
+    {
+        it->second.iQueued = 0;
+    }
+}
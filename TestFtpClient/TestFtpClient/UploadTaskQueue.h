@@ -0,0 +1,196 @@
+#ifndef _UploadTaskQueue_H_
+#define _UploadTaskQueue_H_
+
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+
+#include "TaskStore.h"
+
+/* bounded queue of TaskStore ids between the directory scan and the
+   transfer loop, the scan blocks while it is full. A task of higher
+   priority always leaves first; within one priority the order depends
+   on the policy, applied to whatever has been scanned so far, so a
+   large capacity lets it see most of the batch. Between the servers of
+   one priority the queue deals by deficit round robin on bytes, and a
+   server that already runs as many tasks as it may is passed over */
+class UploadTaskQueue
+{
+public:
+    /* tells how many tasks a server may run at once, asked at every
+       Pop() with the queue locked */
+    class HostLimits
+    {
+    public:
+        virtual ~HostLimits(){}
+
+        /* 0 for no limit, -1 while no task may start at all */
+        virtual int GetHostLimit(TaskStore::HostId iHost) = 0;
+    };
+
+    struct HostLoad
+    {
+        std::string sHost;
+        size_t iQueued;
+        int iRunning;
+        /* as HostLimits said the last time, 0 for none, -1 parked */
+        int iLimit;
+    };
+
+    enum Policy
+    {
+        /* scan order */
+        Fifo,
+        /* small files are not kept waiting behind huge ones */
+        ShortestFirst,
+        /* longest processing time first, the shortest batch time with
+           several parallel transfers */
+        LongestFirst,
+        /* finish a directory before the next one, fewer CWD commands */
+        ByDirectory,
+    };
+
+    UploadTaskQueue(const TaskStore &taskStore, size_t iCapacity = 65536);
+
+    /* NULL for no limits, must outlive the queue */
+    void SetHostLimits(HostLimits *pLimits);
+
+    /* empty the queue and accept producers again */
+    void Reset(Policy ePolicy = Fifo);
+
+    /* blocks while full unless bWaitForRoom is false, false once the
+       queue was aborted */
+    bool Push(TaskStore::TaskId iTask, bool bWaitForRoom = true);
+
+    /* blocks while empty and not finished, while every task left is
+       for a busy server or while tasks still run and may bring more,
+       false when nothing is left; after that Push() is refused as no
+       transfer will come back */
+    bool Pop(TaskStore::TaskId &iTask);
+
+    /* a popped task stopped running, its server gets the slot back */
+    void Release(TaskStore::TaskId iTask);
+
+    /* put back a task that was paused and released, taken even after
+       Finish() */
+    bool Requeue(TaskStore::TaskId iTask);
+
+    /* the producer has pushed everything */
+    void Finish();
+
+    /* drop all tasks and wake up both sides */
+    void Abort();
+
+    /* every server that has tasks queued or running */
+    void GetHostLoads(std::vector<HostLoad> &vectLoads);
+
+private:
+    struct Entry
+    {
+        TaskStore::TaskId iTask;
+        Poco::Int64 iSize;
+        Poco::UInt64 iSeq;
+    };
+
+    static bool LargerFirst(const Entry &lhs, const Entry &rhs);
+
+    static bool SmallerFirst(const Entry &lhs, const Entry &rhs);
+
+    /* the tasks of one priority for one server */
+    struct HostQueue
+    {
+        HostQueue()
+        : iCount(0)
+        , iDeficit(0)
+        , Tasks()
+        , Heap()
+        , DirTasks()
+        , DirOrder()
+        , iCurDir(TaskStore::RootDir){}
+
+        size_t iCount;
+        /* bytes the server may still send in this round */
+        Poco::Int64 iDeficit;
+        /* Fifo */
+        std::deque<TaskStore::TaskId> Tasks;
+        /* ShortestFirst / LongestFirst, a binary heap */
+        std::vector<Entry> Heap;
+        /* ByDirectory, the current directory is drained before the
+           others are taken in the order they were first seen */
+        std::map<TaskStore::DirId, std::deque<TaskStore::TaskId> > DirTasks;
+        std::deque<TaskStore::DirId> DirOrder;
+        TaskStore::DirId iCurDir;
+    };
+
+    /* the tasks of one priority */
+    struct Level
+    {
+        Level()
+        : iCount(0)
+        , Hosts()
+        , Round(){}
+
+        size_t iCount;
+        std::map<TaskStore::HostId, HostQueue> Hosts;
+        /* servers with tasks in the order they take turns */
+        std::deque<TaskStore::HostId> Round;
+    };
+
+    typedef std::map<int, Level, std::greater<int> > LevelMap;
+
+    struct HostState
+    {
+        HostState()
+        : iQueued(0)
+        , iRunning(0)
+        , iLimit(0){}
+
+        size_t iQueued;
+        int iRunning;
+        int iLimit;
+    };
+
+    void Add(TaskStore::TaskId iTask);
+
+    void AddToHost(HostQueue &queue, TaskStore::TaskId iTask);
+
+    /* false if every task left is for a busy server */
+    bool Take(TaskStore::TaskId &iTask);
+
+    bool TakeFromLevel(Level &level, TaskStore::TaskId &iTask);
+
+    TaskStore::TaskId TakeFromHost(HostQueue &queue);
+
+    bool IsHostBusy(TaskStore::HostId iHost);
+
+    void Clear();
+
+    UploadTaskQueue(const UploadTaskQueue &rhs);
+
+    UploadTaskQueue & operator=(const UploadTaskQueue &rhs);
+
+private:
+    const TaskStore &m_TaskStore;
+    Policy m_ePolicy;
+    size_t m_iCount;
+    Poco::UInt64 m_iSeq;
+    LevelMap m_Levels;
+    std::map<TaskStore::HostId, HostState> m_HostStates;
+    /* popped and not yet released, over all servers */
+    int m_iRunning;
+    HostLimits *m_pLimits;
+
+    size_t m_iCapacity;
+    bool m_bFinished;
+    bool m_bDrained;
+    bool m_bAborted;
+    Poco::FastMutex m_Mutex;
+    Poco::Condition m_NotEmpty;
+    Poco::Condition m_NotFull;
+};
+
+#endif // _UploadTaskQueue_H_
@@ -0,0 +1,38 @@
+#include "UrlUtil.h"
+
+std::string UrlUtil::GetHost(const std::string &sUrl)
+{
+    std::string::size_type iBegin, iEnd;
+    FindHost(sUrl, iBegin, iEnd);
+    return sUrl.substr(iBegin, iEnd - iBegin);
+}
+
+std::string UrlUtil::ReplaceHost(
+    const std::string &sUrl,
+    const std::string &sHost)
+{
+    std::string::size_type iBegin, iEnd;
+    FindHost(sUrl, iBegin, iEnd);
+    return sUrl.substr(0, iBegin) + sHost + sUrl.substr(iEnd);
+}
+
+std::string UrlUtil::GetRootUrl(const std::string &sUrl)
+{
+    std::string::size_type iScheme = sUrl.find("://");
+    std::string sScheme = (iScheme == std::string::npos) ?
+        std::string("ftp://") : sUrl.substr(0, iScheme + 3);
+    return sScheme + GetHost(sUrl) + "/";
+}
+
+void UrlUtil::FindHost(
+    const std::string &sUrl,
+    std::string::size_type &iBegin,
+    std::string::size_type &iEnd)
+{
+    iBegin = sUrl.find("://");
+    iBegin = (iBegin == std::string::npos) ? 0 : iBegin + 3;
+    iEnd = sUrl.find('/', iBegin);
+    if (iEnd == std::string::npos) iEnd = sUrl.size();
+    std::string::size_type iAt = sUrl.rfind('@', iEnd);
+    if (iAt != std::string::npos && iAt >= iBegin) iBegin = iAt + 1;
+}
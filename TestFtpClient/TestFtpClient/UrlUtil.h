@@ -0,0 +1,32 @@
+#ifndef _UrlUtil_H_
+#define _UrlUtil_H_
+
+#include <string>
+
+/* the parts of an ftp url the modules key their state by. The host is
+   what follows the scheme and a "user:pwd@", up to the path */
+class UrlUtil
+{
+public:
+    /* "host[:port]", the key of the host limits */
+    static std::string GetHost(const std::string &sUrl);
+
+    /* the same url on another "host[:port]" */
+    static std::string ReplaceHost(
+        const std::string &sUrl,
+        const std::string &sHost);
+
+    /* "scheme://host[:port]/", ftp:// if the url has no scheme */
+    static std::string GetRootUrl(const std::string &sUrl);
+
+private:
+    /* where the host starts and ends in sUrl */
+    static void FindHost(
+        const std::string &sUrl,
+        std::string::size_type &iBegin,
+        std::string::size_type &iEnd);
+
+    UrlUtil();
+};
+
+#endif // _UrlUtil_H_
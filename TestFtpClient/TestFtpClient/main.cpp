@@ -1,30 +1,49 @@
+#include <algorithm>
+#include <Poco/Stopwatch.h>
+#include <Poco/Path.h>
+#include <Poco/File.h>
+#include <Poco/DirectoryIterator.h>
+#include <deque>
+
 #include "FtpClient.h"
+#include "DirScanner.h"
+#include "TaskStore.h"
+#include "UploadTaskQueue.h"
+#include "RateLimiter.h"
+#include "BandwidthCalendar.h"
+#include "ConcurrencyController.h"
+#include "DataModeCache.h"
+#include "SocketTuner.h"
+#include "SessionPool.h"
+#include "PortManager.h"
+#include "HostHealth.h"
+#include "ConnectRacer.h"
 
 class ProgressMonitor : public ProgressObserver
 {
 public:
     void OnUploadProgress(
         const std::string &sName,
-        long iCurSize,
-        long iTotalSize)
+        Poco::Int64 iCurSize,
+        Poco::Int64 iTotalSize)
     {
         if (iTotalSize == 0) return;
-        long long iProgress = (long long)iCurSize * 100;
+        Poco::Int64 iProgress = iCurSize * 100;
         iProgress /= iTotalSize;
         printf("FileName: %s, upload progress: %d%\n",
-            sName.c_str(), iProgress);
+            sName.c_str(), (int)iProgress);
     }
 
     void OnDownloadProgress(
         const std::string &sName,
-        long iCurSize,
-        long iTotalSize)
+        Poco::Int64 iCurSize,
+        Poco::Int64 iTotalSize)
     {
         if (iTotalSize == 0) return;
-        long long iProgress = (long long)iCurSize * 100;
+        Poco::Int64 iProgress = iCurSize * 100;
         iProgress /= iTotalSize;
         printf("FileName: %s, download progress: %d%\n",
-            sName.c_str(), iProgress);
+            sName.c_str(), (int)iProgress);
     }
 };
 
@@ -68,6 +87,18 @@ void TestAsync()
         printf("UploadDirMatchedFilesAsync success!\n");
     }
 
+    FileFilter filter;
+    filter.AddGlob("~*", false);
+    filter.AddExtensions(vectMatch);
+    filter.SetSizeRange(1);
+    client.UploadDirFilteredFilesAsync("ftp://192.168.1.170/test/",
+        "D:\\testFTP\\", filter);
+    bResult = client.AwaitResult();
+    if (bResult)
+    {
+        printf("UploadDirFilteredFilesAsync success!\n");
+    }
+
     client.UploadDirAllFilesAsync("ftp://192.168.1.170/test/",
         "D:\\testFTP\\");
     bResult = client.AwaitResult();
@@ -95,11 +126,904 @@ void TestAsync()
     {
         printf("DownloadFileAsync success!\n");
     }
+
+    client.DownloadMatchedFilesAsync("ftp://192.168.1.170/test/*.h264",
+        "D:\\testFTP2\\");
+
+    bResult = client.AwaitResult();
+    if (bResult)
+    {
+        printf("DownloadMatchedFilesAsync success!\n");
+    }
+}
+
+void TestWatch()
+{
+    ProgressMonitor monitor;
+    FtpClient client;
+    client.RegisterObserver(&monitor);
+    std::vector<std::string> vectMatch;
+    vectMatch.push_back("h264");
+    client.WatchDirUploadAsync("ftp://192.168.1.170/test/",
+        "D:\\testFTP\\record\\", vectMatch);
+
+    Sleep(60000);
+    client.Cancel();
+    client.AwaitResult();
+}
+
+void TestGrowingFile()
+{
+    ProgressMonitor monitor;
+    FtpClient client;
+    client.RegisterObserver(&monitor);
+    bool bResult = client.UploadGrowingFileAsync(
+        "ftp://192.168.1.170/test/live.h264",
+        "D:\\testFTP\\record\\live.h264");
+    if (bResult && client.AwaitResult())
+    {
+        printf("UploadGrowingFileAsync success!\n");
+    }
+}
+
+void TestList()
+{
+    FtpClient client;
+    std::vector<FtpFileInfo> vectEntries;
+    if (client.ListDirectory("ftp://192.168.1.170/test/", vectEntries))
+    {
+        for (size_t i = 0; i < vectEntries.size(); ++i)
+        {
+            printf("%s %lld\n", vectEntries[i].sName.c_str(),
+                (long long)vectEntries[i].iSize);
+        }
+    }
+
+    FtpFileInfo fileInfo;
+    if (client.GetRemoteFileInfo("ftp://192.168.1.170/test/upload.h264",
+        fileInfo))
+    {
+        printf("upload.h264 size: %lld\n", (long long)fileInfo.iSize);
+    }
+}
+
+void TestPriority()
+{
+    FtpClient client;
+    client.SetMaxConcurrency(2);
+    client.UploadDirAllFilesAsync("ftp://192.168.1.170/backfill/",
+        "D:\\testFTP\\backfill\\");
+
+    /* the alarm clip pauses one of the two backfill transfers */
+    Sleep(3000);
+    client.SubmitUploadFile("ftp://192.168.1.170/alarm/alarm.h264",
+        "D:\\testFTP\\alarm.h264", 10);
+
+    bool bResult = client.AwaitResult();
+    if (bResult)
+    {
+        printf("backfill with urgent clip success!\n");
+    }
+}
+
+/* business hours on weekdays: 2 MB/s and two transfers, no backfill;
+   the rest of the week is open */
+void TestCalendar()
+{
+    BandwidthCalendar &calendar = BandwidthCalendar::Instance();
+    BandwidthCalendar::Window peak;
+    peak.iDays = BandwidthCalendar::Weekdays;
+    peak.iBeginMinute = 8 * 60;
+    peak.iEndMinute = 19 * 60;
+    peak.iBytesPerSec = 2 * 1024 * 1024;
+    peak.iMaxTransfers = 2;
+    peak.bBackfill = false;
+    calendar.AddWindow(peak);
+    calendar.Start();
+
+    FtpClient live;
+    FtpClient backfill;
+    backfill.SetBackfill(true);
+    backfill.SetMaxConcurrency(4);
+    backfill.UploadDirAllFilesAsync("ftp://192.168.1.170/backfill/",
+        "D:\\testFTP\\backfill\\");
+    live.UploadFileAsync("ftp://192.168.1.170/alarm/alarm.h264",
+        "D:\\testFTP\\alarm.h264");
+
+    if (live.AwaitResult())
+    {
+        printf("live upload success!\n");
+    }
+    if (backfill.AwaitResult())
+    {
+        printf("backfill upload success!\n");
+    }
+    calendar.Stop();
+}
+
+/* up to 16 sessions, the controller finds how many the server likes
+   and remembers it for the next run */
+void TestAdaptive()
+{
+    ConcurrencyController::Instance().SetStateFile("concurrency.txt");
+
+    FtpClient client;
+    client.SetMaxConcurrency(16);
+    client.SetAdaptiveConcurrency(true);
+    client.UploadDirTreeAsync("ftp://192.168.1.170/backfill/",
+        "D:\\testFTP\\backfill\\");
+
+    bool bResult = client.AwaitResult();
+    printf("adaptive upload %s, %d sessions\n",
+        bResult ? "success" : "failed",
+        ConcurrencyController::Instance().GetLimit("192.168.1.170"));
+}
+
+/* one batch for two servers, the slow one may only use two of the six
+   sessions; the queues are printed while it runs */
+void TestMultiHost()
+{
+    FtpClient client;
+    client.SetMaxConcurrency(6);
+    client.SetHostMaxConcurrency("192.168.1.171", 2);
+    client.UploadDirAllFilesAsync("ftp://192.168.1.170/backfill/",
+        "D:\\testFTP\\backfill\\");
+    client.SubmitUploadFile("ftp://192.168.1.171/mirror/alarm.h264",
+        "D:\\testFTP\\alarm.h264", 0);
+
+    std::vector<UploadTaskQueue::HostLoad> vectLoads;
+    for (int i = 0; i < 10; ++i)
+    {
+        Sleep(1000);
+        client.GetHostLoads(vectLoads);
+        for (size_t j = 0; j < vectLoads.size(); ++j)
+        {
+            printf("%s: %u queued, %d running, limit %d\n",
+                vectLoads[j].sHost.c_str(), (unsigned)vectLoads[j].iQueued,
+                vectLoads[j].iRunning, vectLoads[j].iLimit);
+        }
+    }
+    if (client.AwaitResult())
+    {
+        printf("multi-host upload success!\n");
+    }
+}
+
+/* two downloads three minutes apart, longer than the server keeps an
+   idle login; the second one finds its session still open */
+void TestSessionPool()
+{
+    SessionPool &pool = SessionPool::Instance();
+    pool.SetKeepAliveInterval(20 * 1000);
+    pool.SetWarmSessions("192.168.1.170", 2);
+
+    FtpClient client;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (i > 0)
+        {
+            Sleep(3 * 60 * 1000);
+        }
+        bool bResult = client.DownloadFileSync(
+            "ftp://192.168.1.170/test/upload.h264",
+            "D:\\testFTP\\download_pool.h264");
+        SessionPool::Stats stats = pool.GetStats();
+        printf("download %d %s: %d idle, %d busy, %llu NOOP, "
+            "%llu evicted, %llu opened\n", i, bResult ? "ok" : "failed",
+            stats.iIdle, stats.iBusy, (unsigned long long)stats.iNoops,
+            (unsigned long long)stats.iEvicted,
+            (unsigned long long)stats.iOpened);
+    }
+}
+
+/* thousands of small files over active mode with a narrow listener
+   range; as the ports fill up the batch slows down to fewer sessions
+   instead of failing */
+void TestPortPressure()
+{
+    PortManager &ports = PortManager::Instance();
+    ports.SetListenRange(40000, 40999);
+    DataModeCache::Instance().SetMode("192.168.1.170", DataModeCache::Port);
+
+    FtpClient client;
+    client.SetMaxConcurrency(8);
+    client.UploadDirAllFilesAsync("ftp://192.168.1.170/small/",
+        "D:\\testFTP\\small\\");
+    for (int i = 0; i < 30; ++i)
+    {
+        Sleep(1000);
+        PortManager::Stats stats = ports.GetStats();
+        std::vector<UploadTaskQueue::HostLoad> vectLoads;
+        client.GetHostLoads(vectLoads);
+        printf("pressure %.2f, %d/%d listener ports, %d/%d connect ports, "
+            "%llu waits, %d running\n", stats.fPressure,
+            stats.iListenRecent, stats.iListenPorts, stats.iConnectRecent,
+            stats.iConnectPorts, (unsigned long long)stats.iWaits,
+            vectLoads.empty() ? 0 : vectLoads[0].iRunning);
+    }
+    if (client.AwaitResult())
+    {
+        printf("small files upload success!\n");
+    }
+}
+
+/* two servers in one batch while the second one is switched off: its
+   tasks are parked once the circuit opens, the first server goes on,
+   and they are sent when a probe finds the second one back */
+void TestCircuitBreaker()
+{
+    HostHealth &health = HostHealth::Instance();
+    health.SetThreshold(3);
+    health.SetOpenTime(5000);
+
+    FtpClient client;
+    client.SetMaxConcurrency(4);
+    client.SetParkOnOutage(true);
+    client.UploadDirAllFilesAsync("ftp://192.168.1.170/backfill/",
+        "D:\\testFTP\\backfill\\");
+    for (int i = 0; i < 10; ++i)
+    {
+        client.SubmitUploadFile("ftp://192.168.1.171/mirror/alarm.h264",
+            "D:\\testFTP\\alarm.h264", 0);
+    }
+    for (int i = 0; i < 60; ++i)
+    {
+        Sleep(1000);
+        HostHealth::Status status = health.GetStatus("192.168.1.171");
+        printf("192.168.1.171 %s: %d failures, %llu trips, %llu refused, "
+            "probe in %ld ms\n", HostHealth::GetName(status.eState),
+            status.iFailures, (unsigned long long)status.iTrips,
+            (unsigned long long)status.iRejected, status.iRetryMs);
+    }
+    if (client.AwaitResult())
+    {
+        printf("upload across the outage success!\n");
+    }
+}
+
+/* a server with a standby replica: uploads connect to whichever
+   greets first, later ones start with the faster address */
+void TestConnectRace()
+{
+    ConnectRacer &racer = ConnectRacer::Instance();
+    std::vector<std::string> vectReplicas;
+    vectReplicas.push_back("192.168.1.171");
+    racer.SetReplicas("192.168.1.170", vectReplicas);
+    racer.SetStaggerDelay(200);
+
+    FtpClient client;
+    for (int i = 0; i < 3; ++i)
+    {
+        Poco::Stopwatch watch;
+        watch.start();
+        bool bResult = client.UploadFileSync(
+            "ftp://192.168.1.170/test/race.h264", "D:\\testFTP\\race.h264");
+        printf("upload %d %s in %lld ms\n", i, bResult ? "ok" : "failed",
+            (long long)watch.elapsed() / 1000);
+        /* a new login each time, not the pooled one */
+        SessionPool::Instance().Clear();
+    }
+    std::vector<ConnectRacer::Address> vectAddresses;
+    racer.GetAddresses("192.168.1.170", vectAddresses);
+    for (size_t i = 0; i < vectAddresses.size(); ++i)
+    {
+        printf("%s: %.1f ms, %llu wins, %llu failures\n",
+            vectAddresses[i].sAddress.c_str(), vectAddresses[i].fConnectMs,
+            (unsigned long long)vectAddresses[i].iWins,
+            (unsigned long long)vectAddresses[i].iFailures);
+    }
+}
+
+/* a file mirrored on two servers: when the first one goes away in the
+   middle, the download goes on from there on the other */
+void TestDownloadFailover()
+{
+    std::vector<std::string> vectReplicas;
+    vectReplicas.push_back("192.168.1.171");
+    ConnectRacer::Instance().SetReplicas("192.168.1.170", vectReplicas);
+
+    FtpClient client;
+    Poco::Stopwatch watch;
+    watch.start();
+    bool bResult = client.DownloadFileSync(
+        "ftp://192.168.1.170/test/upload.h264", "D:\\testFTP\\mirror.h264");
+    printf("download %s in %lld ms\n", bResult ? "ok" : "failed",
+        (long long)watch.elapsed() / 1000);
+}
+
+/* one file from three mirrors at once, the faster ones get more of it */
+void TestMultiSourceDownload()
+{
+    std::vector<std::string> vectReplicas;
+    vectReplicas.push_back("192.168.1.171");
+    vectReplicas.push_back("192.168.1.172");
+    ConnectRacer::Instance().SetReplicas("192.168.1.170", vectReplicas);
+
+    FtpClient client;
+    client.SetDownloadSources(3);
+    Poco::Stopwatch watch;
+    watch.start();
+    bool bResult = client.DownloadFileSync(
+        "ftp://192.168.1.170/test/upload.h264", "D:\\testFTP\\multi.h264");
+    printf("download %s in %lld ms\n", bResult ? "ok" : "failed",
+        (long long)watch.elapsed() / 1000);
+}
+
+/* the same recording to three servers, read from disk once */
+void TestFanOutUpload()
+{
+    std::vector<std::string> vectRemotePaths;
+    vectRemotePaths.push_back("ftp://192.168.1.170/test/fanout.h264");
+    vectRemotePaths.push_back("ftp://192.168.1.171/test/fanout.h264");
+    vectRemotePaths.push_back("ftp://192.168.1.172/test/fanout.h264");
+
+    FtpClient client;
+    bool bResult = client.UploadFanOutSync(vectRemotePaths,
+        "D:\\testFTP\\fanout.h264");
+    printf("fan-out upload %s\n", bResult ? "ok" : "failed");
+    std::vector<FanOutResult> vectResults;
+    client.GetFanOutResults(vectResults);
+    for (size_t i = 0; i < vectResults.size(); ++i)
+    {
+        printf("%s: %s, %lld bytes%s\n", vectResults[i].sRemotePath.c_str(),
+            vectResults[i].bResult ? "ok" : vectResults[i].sError.c_str(),
+            (long long)vectResults[i].iSent,
+            vectResults[i].bDetached ? ", read by itself" : "");
+    }
+}
+
+/* an archive from one server to another, the data does not come here */
+void TestRemoteCopy()
+{
+    FtpClient client;
+    bool bResult = client.CopyRemoteFileSync(
+        "ftp://192.168.1.170/archive/2017/record.h264",
+        "ftp://192.168.1.171/archive/2017/record.h264",
+        "admin:123456", "backup:654321");
+    printf("remote copy %s, %s\n", bResult ? "ok" : "failed",
+        client.IsCopyRelayed() ? "relayed" : "server to server");
+}
+
+/* the first upload probes the data connection modes of the server,
+   the ones after it start with the mode that worked */
+void TestDataMode()
+{
+    const std::string sHost = "192.168.1.170";
+    DataModeCache &cache = DataModeCache::Instance();
+    FtpClient client;
+    for (int i = 0; i < 3; ++i)
+    {
+        client.UploadFileSync("ftp://192.168.1.170/test/upload.h264",
+            "D:\\testFTP\\upload.h264");
+        bool bFixed = false;
+        printf("upload %d, %s kept\n", i,
+            DataModeCache::GetName(cache.GetMode(sHost, bFixed)));
+    }
+    for (int i = DataModeCache::Epsv; i < DataModeCache::ModeCount; ++i)
+    {
+        DataModeCache::Mode eMode = (DataModeCache::Mode)i;
+        DataModeCache::Stats stats = cache.GetStats(sHost, eMode);
+        printf("%s: %d ok, %d failed", DataModeCache::GetName(eMode),
+            stats.iSuccesses, stats.iFailures);
+        if (stats.iSuccesses > 0)
+        {
+            printf(", first byte %.1f / %.1f / %.1f ms (min/avg/max)",
+                stats.fMinMs, stats.fTotalMs / stats.iSuccesses,
+                stats.fMaxMs);
+        }
+        printf("\n");
+    }
+}
+
+class CountingHandler : public FtpListHandler
+{
+public:
+    CountingHandler()
+    : iTotalSize(0){}
+
+    void OnListEntry(const FtpListEntry &entry)
+    {
+        iTotalSize += entry.iSize;
+    }
+
+    Poco::Int64 iTotalSize;
+};
+
+void BenchListFormat(const char *szFormat, const std::string &sListing,
+    bool bMlsd)
+{
+    /* feed in the chunk size curl hands to the write callback */
+    const size_t iChunk = CURL_MAX_WRITE_SIZE;
+    CountingHandler handler;
+    FtpListParser parser(handler, bMlsd);
+    Poco::Stopwatch watch;
+    watch.start();
+    for (size_t i = 0; i < sListing.size(); i += iChunk)
+    {
+        parser.Feed(sListing.data() + i,
+            std::min(iChunk, sListing.size() - i));
+    }
+    parser.Finish();
+    watch.stop();
+
+    double fSeconds = (double)watch.elapsed() / 1000000.0;
+    printf("%s: %u entries, %.1f MB in %.3f s, %.0f entries/sec\n",
+        szFormat, (unsigned)parser.GetEntryCount(),
+        sListing.size() / 1048576.0, fSeconds,
+        parser.GetEntryCount() / fSeconds);
+}
+
+void BenchListParser()
+{
+    const int iLines = 1000000;
+    std::string sUnix, sDos, sMlsd;
+    char szLine[256];
+    for (int i = 0; i < iLines; ++i)
+    {
+        sprintf(szLine, "-rw-r--r--   1 ftp      ftp      %10d "
+            "Jan %2d 10:%02d record_%07d.h264\r\n",
+            i * 37, i % 28 + 1, i % 60, i);
+        sUnix += szLine;
+        sprintf(szLine, "01-%02d-17  10:%02dAM %14d record_%07d.h264\r\n",
+            i % 28 + 1, i % 60, i * 37, i);
+        sDos += szLine;
+        sprintf(szLine, "type=file;size=%d;modify=201701%02d10%02d00; "
+            "record_%07d.h264\r\n", i * 37, i % 28 + 1, i % 60, i);
+        sMlsd += szLine;
+    }
+
+    BenchListFormat("LIST unix", sUnix, false);
+    BenchListFormat("LIST dos", sDos, false);
+    BenchListFormat("MLSD", sMlsd, true);
+}
+
+class NullScanHandler : public DirScanHandler
+{
+public:
+    bool OnDirEntry(
+        const std::string &/*sRelDir*/,
+        const char * /*pName*/,
+        size_t /*iNameLen*/,
+        Poco::Int64 /*iSize*/,
+        Poco::Timestamp::TimeVal /*tModify*/)
+    {
+        return true;
+    }
+};
+
+/* the enumeration FtpClient did before DirScanner, made recursive */
+Poco::UInt64 WalkWithPoco(const std::string &sDirectory,
+    const FileFilter &filter, Poco::Int64 &iTotalSize)
+{
+    Poco::UInt64 iFiles = 0;
+    Poco::DirectoryIterator it(sDirectory), end;
+    for (; it != end; ++it)
+    {
+        if (it->isDirectory())
+        {
+            iFiles += WalkWithPoco(it->path(), filter, iTotalSize);
+        }
+        else if (it->isFile() &&
+            filter.MatchName(Poco::Path(it->path()).getFileName()))
+        {
+            iTotalSize += it->getSize();
+            ++iFiles;
+        }
+    }
+    return iFiles;
+}
+
+void BenchDirScanner(const char *szName, const std::string &sRoot,
+    const FileFilter &filter, bool bNeedStat, int iThreads)
+{
+    NullScanHandler handler;
+    DirScanner scanner(filter, handler, bNeedStat);
+    Poco::Stopwatch watch;
+    watch.start();
+    scanner.Scan(sRoot, true, iThreads);
+    watch.stop();
+
+    double fSeconds = (double)watch.elapsed() / 1000000.0;
+    printf("%s: %llu files in %llu dirs, %.3f s\n", szName,
+        (unsigned long long)scanner.GetFileCount(),
+        (unsigned long long)scanner.GetDirCount(), fSeconds);
+}
+
+/* 1000 directories of 1000 files, half of them match the filter;
+   run it twice, the first pass mostly measures a cold cache */
+void BenchDirScan()
+{
+    const std::string sRoot = "bench_tree/";
+    const int iDirs = 1000;
+    const int iFilesPerDir = 1000;
+    char szName[64];
+    if (!Poco::File(sRoot).exists())
+    {
+        for (int i = 0; i < iDirs; ++i)
+        {
+            sprintf(szName, "dir_%04d/", i);
+            std::string sDirectory = sRoot + szName;
+            Poco::File(sDirectory).createDirectories();
+            for (int j = 0; j < iFilesPerDir; ++j)
+            {
+                sprintf(szName, "record_%04d.%s", j,
+                    (j % 2) ? "h264" : "idx");
+                FILE *pFile = fopen((sDirectory + szName).c_str(), "wb");
+                if (pFile != NULL) fclose(pFile);
+            }
+        }
+    }
+
+    FileFilter filter;
+    filter.AddGlob("*.h264");
+
+    Poco::Stopwatch watch;
+    watch.start();
+    Poco::Int64 iTotalSize = 0;
+    Poco::UInt64 iFiles = WalkWithPoco(sRoot, filter, iTotalSize);
+    watch.stop();
+    printf("Poco::DirectoryIterator: %llu files, %.3f s\n",
+        (unsigned long long)iFiles, (double)watch.elapsed() / 1000000.0);
+
+    BenchDirScanner("DirScanner no stat", sRoot, filter, false, 1);
+    BenchDirScanner("DirScanner stat", sRoot, filter, true, 1);
+    BenchDirScanner("DirScanner stat x4", sRoot, filter, true, 4);
+    BenchDirScanner("DirScanner stat x8", sRoot, filter, true, 8);
+}
+
+/* 1M files in 1000 directories three levels deep, the same batch as
+   the old deque of full remote / local path pairs */
+void BenchTaskStore()
+{
+    const int iFiles = 1000000;
+    const std::string sRemoteRoot = "ftp://127.0.0.1/upload/";
+    const std::string sLocalRoot = "D:/record/";
+    char szDir[64];
+    char szName[64];
+
+    TaskStore taskStore;
+    Poco::Stopwatch watch;
+    watch.start();
+    for (int i = 0; i < iFiles; ++i)
+    {
+        int iDir = i / 1000;
+        sprintf(szDir, "camera_%02d/%02d/%02d/",
+            iDir / 100, iDir / 10 % 10, iDir % 10);
+        int iNameLen = sprintf(szName, "record_%07d.h264", i);
+        taskStore.Add(szDir, szName, iNameLen, i * 37);
+    }
+    watch.stop();
+
+    size_t iBytes = taskStore.GetMemoryUsage();
+    size_t iNameBytes = taskStore.GetNameBytes();
+    printf("TaskStore: %u files in %.3f s, %.1f MB, "
+        "%.1f bytes per file + %.1f name bytes\n",
+        (unsigned)taskStore.GetCount(),
+        (double)watch.elapsed() / 1000000.0, iBytes / 1048576.0,
+        (double)(iBytes - iNameBytes) / iFiles,
+        (double)iNameBytes / iFiles);
+
+    /* the heap size of a string is a guess, capacity + header rounded
+       up to 16 the way most allocators do */
+    std::deque<std::pair<std::string, std::string> > tasks;
+    size_t iHeapBytes = 0;
+    for (int i = 0; i < iFiles; ++i)
+    {
+        int iDir = i / 1000;
+        sprintf(szDir, "camera_%02d/%02d/%02d/",
+            iDir / 100, iDir / 10 % 10, iDir % 10);
+        sprintf(szName, "record_%07d.h264", i);
+        std::string sRelPath = std::string(szDir) + szName;
+        tasks.push_back(std::make_pair(sRemoteRoot + sRelPath,
+            sLocalRoot + sRelPath));
+        iHeapBytes += (tasks.back().first.capacity() + 1 + 16 + 15) / 16 * 16;
+        iHeapBytes += (tasks.back().second.capacity() + 1 + 16 + 15) / 16 * 16;
+    }
+    iHeapBytes += tasks.size() * sizeof(tasks.back());
+    printf("deque of path pairs: about %.1f MB, %.1f bytes per file\n",
+        iHeapBytes / 1048576.0, (double)iHeapBytes / iFiles);
+}
+
+/* discrete simulation of one batch over iStreams parallel transfers:
+   the stream that gets free first takes the next task. Per file there
+   is a fixed STOR overhead, a CWD when the directory changes, then the
+   data at a fixed rate per stream */
+void SimulateSchedule(const char *szName, UploadTaskQueue::Policy ePolicy,
+    const TaskStore &taskStore, int iStreams)
+{
+    const double fSetup = 0.05;
+    const double fCwd = 0.02;
+    const double fBytesPerSec = 10.0 * 1048576.0;
+
+    UploadTaskQueue queue(taskStore, taskStore.GetCount());
+    queue.Reset(ePolicy);
+    for (TaskStore::TaskId i = 0; i < taskStore.GetCount(); ++i)
+    {
+        queue.Push(i);
+    }
+    queue.Finish();
+
+    std::vector<double> vectFree(iStreams, 0.0);
+    std::vector<TaskStore::DirId> vectDir(iStreams, (TaskStore::DirId)-1);
+    double fMakespan = 0.0;
+    double fDoneSum = 0.0;
+    double fSmallDoneSum = 0.0;
+    int iSmall = 0;
+    int iCwds = 0;
+    TaskStore::TaskId iTask = 0;
+    while (queue.Pop(iTask))
+    {
+        int iStream = (int)(std::min_element(vectFree.begin(),
+            vectFree.end()) - vectFree.begin());
+        double fTime = vectFree[iStream] + fSetup;
+        if (vectDir[iStream] != taskStore.GetDir(iTask))
+        {
+            vectDir[iStream] = taskStore.GetDir(iTask);
+            fTime += fCwd;
+            ++iCwds;
+        }
+        Poco::Int64 iSize = taskStore.GetSize(iTask);
+        fTime += iSize / fBytesPerSec;
+        vectFree[iStream] = fTime;
+
+        fMakespan = std::max(fMakespan, fTime);
+        fDoneSum += fTime;
+        if (iSize < 1048576)
+        {
+            fSmallDoneSum += fTime;
+            ++iSmall;
+        }
+    }
+
+    printf("%-14s streams %d: batch %7.1f s, mean done %7.1f s, "
+        "small files mean done %7.1f s, %d CWD\n", szName, iStreams,
+        fMakespan, fDoneSum / taskStore.GetCount(),
+        iSmall ? fSmallDoneSum / iSmall : 0.0, iCwds);
+}
+
+/* 2000 files in 20 directories as a multi-threaded scan hands them
+   out: mostly small, one in ten between 50 and 500 MB */
+void BenchSchedule()
+{
+    TaskStore taskStore;
+    unsigned int iSeed = 12345;
+    char szDir[32];
+    char szName[32];
+    for (int i = 0; i < 2000; ++i)
+    {
+        iSeed = iSeed * 1103515245 + 12345;
+        unsigned int iRand = (iSeed >> 8) & 0xFFFFFF;
+        Poco::Int64 iSize = (iRand % 10 == 0) ?
+            (50 + iRand % 451) * (Poco::Int64)1048576 :
+            64 * 1024 + (Poco::Int64)(iRand % (2 * 1048576));
+        sprintf(szDir, "dir_%02d/", (i / 7 + iRand % 3) % 20);
+        int iNameLen = sprintf(szName, "file_%05d.dat", i);
+        taskStore.Add(szDir, szName, iNameLen, iSize);
+    }
+
+    const int arrStreams[] = { 1, 4 };
+    for (int i = 0; i < 2; ++i)
+    {
+        SimulateSchedule("FIFO", UploadTaskQueue::Fifo,
+            taskStore, arrStreams[i]);
+        SimulateSchedule("shortest", UploadTaskQueue::ShortestFirst,
+            taskStore, arrStreams[i]);
+        SimulateSchedule("longest (LPT)", UploadTaskQueue::LongestFirst,
+            taskStore, arrStreams[i]);
+        SimulateSchedule("by directory", UploadTaskQueue::ByDirectory,
+            taskStore, arrStreams[i]);
+    }
+}
+
+/* ConcurrencyController against a simulated server, in real time as it
+   samples on the clock: every session runs one endless file, 1 MB/s
+   each up to iPeak sessions, then the total falls by a tenth per extra
+   one; above iRefuse sessions (0 for never) a new one gets a 421. The
+   limit is printed at every sample */
+void SimulateConcurrency(const char *szName, int iPeak, int iRefuse,
+    int iSeconds)
+{
+    const long iStepMs = 100;
+    ConcurrencyController &controller = ConcurrencyController::Instance();
+    std::string sHost = std::string("sim-") + szName;
+    controller.SetBounds(2, 16);
+
+    int iRunning = 0;
+    printf("%s, peak at %d sessions:", szName, iPeak);
+    for (int iStep = 0; iStep < iSeconds * 1000 / iStepMs; ++iStep)
+    {
+        int iLimit = controller.GetLimit(sHost);
+        /* above the limit, sessions finish their file and stop */
+        for (; iRunning > iLimit; --iRunning)
+        {
+            controller.ReleaseSlot(sHost);
+        }
+        while (iRunning < iLimit)
+        {
+            controller.AcquireSlot(sHost);
+            if (iRefuse > 0 && iRunning + 1 > iRefuse)
+            {
+                controller.ReportError(sHost, 421, false);
+                controller.ReleaseSlot(sHost);
+                break;
+            }
+            ++iRunning;
+        }
+
+        double fMBytes = iRunning <= iPeak ? iRunning :
+            iPeak * std::max(1.0 - 0.1 * (iRunning - iPeak), 0.1);
+        controller.AddBytes(sHost,
+            (size_t)(fMBytes * 1048576.0 * iStepMs / 1000));
+        Poco::Thread::sleep(iStepMs);
+
+        if (iStep % (3000 / iStepMs) == 0)
+        {
+            printf(" %d", controller.GetLimit(sHost));
+        }
+    }
+    printf("\n");
+    for (; iRunning > 0; --iRunning)
+    {
+        controller.ReleaseSlot(sHost);
+    }
+}
+
+void BenchConcurrency()
+{
+    SimulateConcurrency("peak6", 6, 0, 60);
+    SimulateConcurrency("refuse4", 8, 4, 30);
+}
+
+/* pushes 16 KB blocks through the limiter until told to stop, the way
+   a transfer's read callback does */
+class RateSender
+: public Poco::Runnable
+{
+public:
+    RateSender(int iJob)
+    : m_iJob(iJob)
+    , m_iBytes(0)
+    , m_bStop(false){}
+
+    void run()
+    {
+        while (!m_bStop)
+        {
+            RateLimiter::Instance().Acquire(m_iJob, "127.0.0.1",
+                RateLimiter::Upload, 16 * 1024);
+            m_iBytes += 16 * 1024;
+        }
+    }
+
+    int m_iJob;
+    Poco::Int64 m_iBytes;
+    volatile bool m_bStop;
+};
+
+/* iThreads senders, one job each, the first with three times the
+   weight of the others, against a total limit in bits per second */
+void BenchRateLimit(double fBitsPerSec, int iThreads, int iSeconds)
+{
+    RateLimiter &limiter = RateLimiter::Instance();
+    limiter.SetTotalRate((Poco::Int64)(fBitsPerSec / 8));
+
+    std::vector<RateSender *> vectSenders;
+    std::vector<Poco::Thread *> vectThreads;
+    for (int i = 0; i < iThreads; ++i)
+    {
+        vectSenders.push_back(new RateSender(
+            limiter.RegisterJob(i == 0 ? 3 : 1)));
+        vectThreads.push_back(new Poco::Thread);
+    }
+    Poco::Stopwatch watch;
+    watch.start();
+    for (int i = 0; i < iThreads; ++i)
+    {
+        vectThreads[i]->start(*vectSenders[i]);
+    }
+    Poco::Thread::sleep(iSeconds * 1000);
+    for (int i = 0; i < iThreads; ++i)
+    {
+        vectSenders[i]->m_bStop = true;
+    }
+    Poco::Int64 iBytes = 0;
+    for (int i = 0; i < iThreads; ++i)
+    {
+        vectThreads[i]->join();
+        iBytes += vectSenders[i]->m_iBytes;
+    }
+    watch.stop();
+
+    double fRate = iBytes * 8 / ((double)watch.elapsed() / 1000000.0);
+    printf("limit %.0f Mbit/s, %d jobs: got %.2f Mbit/s (%+.2f%%), "
+        "weight 3 job %.1f%% of the bytes (expected %.1f%%)\n",
+        fBitsPerSec / 1e6, iThreads, fRate / 1e6,
+        (fRate / fBitsPerSec - 1.0) * 100.0,
+        100.0 * vectSenders[0]->m_iBytes / (double)iBytes,
+        100.0 * 3 / (iThreads + 2));
+
+    for (int i = 0; i < iThreads; ++i)
+    {
+        limiter.UnregisterJob(vectSenders[i]->m_iJob);
+        delete vectThreads[i];
+        delete vectSenders[i];
+    }
+    limiter.SetTotalRate(0);
+}
+
+void BenchRateLimiter()
+{
+    BenchRateLimit(1e6, 2, 10);
+    BenchRateLimit(1e10, 4, 5);
+}
+
+/* one stream up and down a long fat link, first with the system socket
+   defaults, then with buffers sized for 1 Gbit/s and bbr; the first
+   upload also measures the round trip the sizing uses */
+void BenchSocketTuning()
+{
+    const std::string sHost = "192.168.1.170";
+    const std::string sRemotePath = "ftp://192.168.1.170/test/bench.dat";
+    const std::string sLocalPath = "D:\\testFTP\\bench.dat";
+    SocketTuner &tuner = SocketTuner::Instance();
+    Poco::Int64 iSize = (Poco::Int64)Poco::File(sLocalPath).getSize();
+
+    for (int i = 0; i < 2; ++i)
+    {
+        SocketTuner::Policy policy;
+        if (i == 1)
+        {
+            policy.iBytesPerSec = 1000000000 / 8;
+            policy.sCongestion = "bbr";
+            policy.bNoDelay = true;
+            policy.iKeepIdle = 60;
+        }
+        tuner.SetPolicy(sHost, policy);
+
+        FtpClient client;
+        Poco::Stopwatch watch;
+        watch.start();
+        bool bUpload = client.UploadFileSync(sRemotePath, sLocalPath);
+        double fUpload = (double)watch.elapsed() / 1000000.0;
+        watch.restart();
+        bool bDownload = client.DownloadFileSync(sRemotePath,
+            sLocalPath + ".back");
+        double fDownload = (double)watch.elapsed() / 1000000.0;
+
+        printf("%s: rtt %.1f ms, buffer %d KB, upload %s %.1f MB/s, "
+            "download %s %.1f MB/s\n", i ? "tuned" : "system defaults",
+            tuner.GetRtt(sHost) * 1000.0, tuner.GetBufferSize(sHost) / 1024,
+            bUpload ? "ok" : "failed", iSize / fUpload / 1048576.0,
+            bDownload ? "ok" : "failed", iSize / fDownload / 1048576.0);
+    }
 }
 
 int main()
 {
     //TestSync();
+    //TestWatch();
+    //TestGrowingFile();
+    //TestList();
+    //TestPriority();
+    //TestCalendar();
+    //TestAdaptive();
+    //TestMultiHost();
+    //TestDataMode();
+    //TestSessionPool();
+    //TestPortPressure();
+    //TestCircuitBreaker();
+    //TestConnectRace();
+    //TestDownloadFailover();
+    //TestMultiSourceDownload();
+    //TestFanOutUpload();
+    //TestRemoteCopy();
+    //BenchListParser();
+    //BenchDirScan();
+    //BenchTaskStore();
+    //BenchSchedule();
+    //BenchConcurrency();
+    //BenchRateLimiter();
+    //BenchSocketTuning();
     TestAsync();
 
     system("pause");